@@ -0,0 +1,274 @@
+"""
+Benchmarks mdb against a synthetic target process (target.c), and writes
+the results as JSON so runs from different builds can be compared.
+
+    python bench.py [--heap MB] [--regions N] [--threads N]
+                    [-o results.json]
+    python bench.py --compare old.json new.json
+
+Needs OS X and the usual task_for_pid privileges.
+"""
+
+import json
+import os
+import platform
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+from argparse import ArgumentParser
+
+from mdb.task import BasicTask
+from mdb.kern import KernelError
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+CHUNKS = [4096, 64 * 1024, 1 << 20, 16 << 20]
+READ_LIMIT = 64 << 20       # bytes of heap re-read by the chunk benchmarks
+MIN_TIME = 0.5              # seconds each measurement repeats for
+REGRESSION = 0.10           # --compare flags changes worse than this
+
+
+def build(workdir):
+    exe = os.path.join(workdir, "target")
+    cc = os.environ.get("CC", "cc")
+    subprocess.check_call([cc, "-O2", "-pthread", "-o", exe,
+                           os.path.join(HERE, "target.c")])
+    return exe
+
+
+def spawn(exe, args, cwd):
+    proc = subprocess.Popen([exe] + args, stdin=subprocess.PIPE,
+                            stdout=subprocess.PIPE, cwd=cwd)
+    return proc, json.loads(proc.stdout.readline())
+
+
+def repeat(fn):
+    """Call fn until MIN_TIME has passed; returns (calls, seconds)."""
+    calls = 0
+    start = time.time()
+    while True:
+        fn()
+        calls += 1
+        elapsed = time.time() - start
+        if elapsed >= MIN_TIME:
+            return calls, elapsed
+
+
+def latencies(samples):
+    samples = sorted(samples)
+    if not samples:
+        return None
+
+    return {"samples": len(samples),
+            "median_us": samples[len(samples) // 2] * 1e6,
+            "p99_us": samples[min(len(samples) - 1,
+                                  int(len(samples) * 0.99))] * 1e6}
+
+
+def readable(t):
+    for r in t.iterRegions():
+        if r['protection'] & 1:
+            yield r
+
+
+def benchRead(t):
+    # The largest writable regions are the target's heap
+    heap = sorted((r for r in readable(t) if r['protection'] & 2),
+                  key=lambda r: -r['size'])
+    spans, total = [], 0
+    for r in heap:
+        if total >= READ_LIMIT:
+            break
+        size = min(r['size'], READ_LIMIT - total)
+        spans.append((r['address'], size))
+        total += size
+
+    results = {}
+    for chunk in CHUNKS:
+        def once():
+            for address, size in spans:
+                for offset in xrange(0, size - chunk + 1, chunk):
+                    t.vm.read(address + offset, chunk)
+
+        calls, elapsed = repeat(once)
+        moved = sum(size - size % chunk for _, size in spans) * calls
+        results[str(chunk)] = {"mb_s": moved / elapsed / (1 << 20)}
+
+    return results
+
+
+def benchRegions(t):
+    count = [0]
+
+    def once():
+        count[0] = sum(1 for _ in t.iterRegions())
+
+    calls, elapsed = repeat(once)
+    return {"count": count[0], "per_s": count[0] * calls / elapsed}
+
+
+def benchThreadState(t):
+    threads = t.getThreads()
+    samples = []
+
+    def once():
+        for thread in threads:
+            start = time.time()
+            thread.getState()
+            samples.append(time.time() - start)
+
+    repeat(once)
+    result = latencies(samples)
+    result["threads"] = len(threads)
+    return result
+
+
+def benchEvents(t, hot, count=2000):
+    """Breakpoint hit, poll and resume round trips on a hot function."""
+    t.setBreakpoint(hot)
+    samples = []
+    resumed = None
+
+    try:
+        while len(samples) < count:
+            event = t.poll()
+            if event is None:
+                continue
+
+            if event['breakpoint'] != hot:
+                raise KernelError("unexpected %s" % event['type'])
+
+            if resumed is not None:
+                samples.append(time.time() - resumed)
+
+            resumed = time.time()
+            event['thread'].resume()
+    finally:
+        t.clearBreakpoint(hot)
+
+    result = latencies(samples)
+    result["per_s"] = len(samples) / sum(samples)
+    return result
+
+
+def benchSearch(t, needle):
+    found = [0]
+    scanned = [0]
+
+    def once():
+        found[0] = scanned[0] = 0
+        for r in readable(t):
+            try:
+                data = t.vm.read(r['address'], r['size'])
+            except KernelError:
+                continue
+
+            scanned[0] += len(data)
+            i = data.find(needle)
+            while i != -1:
+                found[0] += 1
+                i = data.find(needle, i + 1)
+
+    calls, elapsed = repeat(once)
+    return {"gb_s": scanned[0] * calls / elapsed / (1 << 30),
+            "bytes": scanned[0], "found": found[0]}
+
+
+def run(options):
+    workdir = tempfile.mkdtemp(prefix="mdb-bench-")
+    args = ["-heap", str(options.heap), "-regions", str(options.regions),
+            "-threads", str(options.threads)]
+
+    try:
+        exe = build(workdir)
+        proc, target = spawn(exe, args + ["-hot"], workdir)
+
+        t = BasicTask(target['pid'])
+        t.attach()
+
+        results = {
+            "read": benchRead(t),
+            "regions": benchRegions(t),
+            "thread_state": benchThreadState(t),
+            "events": benchEvents(t, target['hot']),
+            "search": benchSearch(t, str(target['needle'])),
+        }
+
+        if results["search"]["found"] < target['needles']:
+            sys.exit("search found %d of %d needles" % (
+                results["search"]["found"], target['needles']))
+
+        proc.stdin.close()
+        proc.wait()
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    return {"version": 1,
+            "time": time.strftime("%Y-%m-%dT%H:%M:%S"),
+            "host": platform.node(),
+            "platform": platform.platform(),
+            "config": {"heap_mb": options.heap, "regions": options.regions,
+                       "threads": options.threads},
+            "results": results}
+
+
+def metrics(results, prefix=""):
+    """Flatten to {name: value} for the rate and latency leaves."""
+    flat = {}
+    for key, value in (results or {}).items():
+        name = prefix + key
+        if isinstance(value, dict):
+            flat.update(metrics(value, name + "."))
+        elif key.endswith("_s") or key.endswith("_us"):
+            flat[name] = value
+    return flat
+
+
+def compare(old, new):
+    old, new = metrics(old["results"]), metrics(new["results"])
+    regressed = False
+
+    print "%-28s %14s %14s %8s" % ("metric", "old", "new", "change")
+    for name in sorted(set(old) & set(new)):
+        if not old[name]:
+            continue
+
+        change = new[name] / old[name] - 1
+        # Latencies regress upwards, rates downwards
+        worse = change if name.endswith("_us") else -change
+        flag = ""
+        if worse > REGRESSION:
+            flag = "  REGRESSION"
+            regressed = True
+
+        print "%-28s %14.2f %14.2f %+7.1f%%%s" % (name, old[name], new[name],
+                                                  change * 100, flag)
+
+    return regressed
+
+
+if __name__ == "__main__":
+    parser = ArgumentParser(description="mdb benchmarks")
+    parser.add_argument("--heap", type=int, default=256,
+                        help="target heap size in MB")
+    parser.add_argument("--regions", type=int, default=1024,
+                        help="extra mappings in the target")
+    parser.add_argument("--threads", type=int, default=8,
+                        help="target thread count")
+    parser.add_argument("-o", "--output", help="write results here")
+    parser.add_argument("--compare", nargs=2, metavar=("OLD", "NEW"),
+                        help="compare two results files")
+    options = parser.parse_args()
+
+    if options.compare:
+        old, new = [json.load(open(path)) for path in options.compare]
+        sys.exit(1 if compare(old, new) else 0)
+
+    results = json.dumps(run(options), indent=2, sort_keys=True)
+    if options.output:
+        with open(options.output, "w") as f:
+            f.write(results + "\n")
+    else:
+        print results
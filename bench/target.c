@@ -0,0 +1,140 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Synthetic target process for bench.py
+ *
+ *   target [-heap MB] [-regions N] [-threads N] [-hot]
+ *
+ * Prints a JSON line describing itself, then runs until stdin is closed.
+ * With -hot every thread but main calls bench_hot() in a loop, for the
+ * breakpoint benchmarks.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define BLOCK  (1 << 20)
+#define REGION (64 * 1024)
+
+static const char needle[] = "MDB-BENCH-NEEDLE";
+
+volatile unsigned long bench_counter;
+
+__attribute__((noinline)) void
+bench_hot (void)
+{
+    bench_counter++;
+    __asm__ volatile ("" ::: "memory");
+}
+
+static void *
+bench_worker (void *arg)
+{
+    int hot = *(int *) arg;
+
+    for (;;) {
+        if (hot)
+            bench_hot();
+        else
+            usleep(1000);
+    }
+
+    return NULL;
+}
+
+int
+main (int argc, char **argv)
+{
+    int heap = 64, regions = 256, threads = 4, hot = 0;
+    int i, found = 0;
+    unsigned long seed = 1, k;
+    unsigned long *block;
+    pthread_t thread;
+    char *region, c;
+
+    for (i = 1; i < argc; ++i) {
+        if (! strcmp(argv[i], "-heap") && i + 1 < argc)
+            heap = atoi(argv[++i]);
+        else if (! strcmp(argv[i], "-regions") && i + 1 < argc)
+            regions = atoi(argv[++i]);
+        else if (! strcmp(argv[i], "-threads") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (! strcmp(argv[i], "-hot"))
+            hot = 1;
+        else {
+            fprintf(stderr, "usage: %s [-heap MB] [-regions N] "
+                    "[-threads N] [-hot]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    /* Incompressible heap with a needle somewhere in each megabyte */
+    for (i = 0; i < heap; ++i) {
+        block = malloc(BLOCK);
+        if (block == NULL)
+            return 1;
+
+        for (k = 0; k < BLOCK / sizeof(unsigned long); ++k) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            block[k] = seed;
+        }
+
+        memcpy((char *) block + (seed >> 33) % (BLOCK - sizeof(needle)),
+               needle, sizeof(needle) - 1);
+        found++;
+    }
+
+    /* Alternate protections so neighbouring mappings don't merge */
+    for (i = 0; i < regions; ++i) {
+        region = mmap(NULL, REGION, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (region == MAP_FAILED)
+            return 1;
+
+        memset(region, i, REGION);
+        if (i & 1)
+            mprotect(region, REGION, PROT_READ);
+    }
+
+    for (i = 1; i < threads; ++i)
+        pthread_create(&thread, NULL, bench_worker, &hot);
+
+    printf("{\"pid\": %d, \"hot\": %lu, \"needle\": \"%s\", "
+           "\"needles\": %d}\n", (int) getpid(),
+           (unsigned long) bench_hot, needle, found);
+    fflush(stdout);
+
+    /* Exit when the harness closes our stdin */
+    while (read(0, &c, 1) > 0)
+        ;
+
+    return 0;
+}
@@ -0,0 +1,39 @@
+from time import time
+
+from mdb.task import BasicTask, AGENT_PATH
+
+
+def timed(label, f, *args, **kwds):
+    start = time()
+    result = f(*args, **kwds)
+    print "%s: %.2fms" % (label, (time() - start) * 1e3)
+    return result
+
+
+if __name__ == "__main__":
+    from sys import argv
+
+    # e.g. agent.py <pid> <address> <size> [needle]
+    t = BasicTask(int(argv[1]))
+    address = int(argv[2], 0)
+    size = int(argv[3], 0)
+
+    t.attach()
+    before = timed("read, mach_vm_read", t.vm.read, address, size)
+    timed("loadAgent", t.loadAgent, AGENT_PATH)
+    after = timed("read, agent", t.vm.read, address, size)
+    assert before == after
+
+    # Treat the start of the range as a list whose first word is next
+    nodes = timed("walkList", t.walkList, address, 0, size=16, limit=1000)
+    print "  %d nodes" % len(nodes)
+
+    addresses = [node[0] for node in nodes]
+    timed("gather", t.gather, addresses, 16)
+
+    if len(argv) > 4:
+        hits = timed("search", t.vm.search, argv[4])
+        for hit in hits[:10]:
+            print "  0x%0.2X" % hit
+
+    t.unloadAgent()
@@ -0,0 +1,33 @@
+from mdb.task import BasicTask
+
+if __name__ == "__main__":
+    from sys import argv
+
+    # Count hits on breakpoints at the given (hex) addresses until ^C
+    t = BasicTask(int(argv[1]))
+    t.attach()
+
+    hits = {}
+    for address in argv[2:]:
+        address = int(address, 16)
+        t.setBreakpoint(address)
+        hits[address] = 0
+
+    try:
+        while True:
+            event = t.poll()
+            if event is None:
+                continue
+
+            if event['breakpoint'] is None:
+                print "%s in thread %s" % (event['type'], event['thread'])
+                break
+
+            hits[event['breakpoint']] += 1
+            event['thread'].resume()
+    except KeyboardInterrupt:
+        pass
+
+    for address in sorted(hits):
+        t.clearBreakpoint(address)
+        print "0x%0.2X: %d hits" % (address, hits[address])
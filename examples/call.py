@@ -0,0 +1,33 @@
+import ctypes
+from time import time
+
+from mdb.task import BasicTask
+
+
+# System libraries are mapped at the same address in every process
+libc = ctypes.CDLL(None)
+
+def function(name):
+    return ctypes.cast(getattr(libc, name), ctypes.c_void_p).value
+
+
+if __name__ == "__main__":
+    from sys import argv
+
+    t = BasicTask(int(argv[1]))
+    t.attach()
+
+    print "getpid() = %d" % t.call(function("getpid"), ret='i')
+
+    # Memory for our own use, then a string to measure in it
+    buf = t.call(function("malloc"), [64])
+    t.vm.write("hello from the debugger\0", buf)
+    print "strlen() = %d" % t.call(function("strlen"), [buf])
+    print "sqrt(2.0) = %f" % t.call(function("sqrt"), [2.0], ret='d')
+    t.call(function("free"), [buf], ret=None)
+
+    n = 1000
+    start = time()
+    for i in xrange(n):
+        t.call(function("getpid"), ret='i')
+    print "%.1fus per call" % ((time() - start) * 1e6 / n)
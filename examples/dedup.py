@@ -0,0 +1,71 @@
+from collections import defaultdict
+
+from mdb.task import BasicTask, BasicCoreTask
+from mdb import kern
+
+# How much of a group of tasks' memory is byte-identical: zero pages, and
+# pages whose contents appear more than once (within one task or across
+# tasks), i.e. what same-page merging or forking from a warm parent could
+# share. Pages are compared by their 64-bit hashes.
+
+def regionOf(regions, address):
+    lo, hi = 0, len(regions)
+    while lo < hi:
+        mid = (lo + hi) // 2
+        if regions[mid]['address'] + regions[mid]['size'] <= address:
+            lo = mid + 1
+        else:
+            hi = mid
+    return regions[lo]
+
+def mb(pages):
+    return "%.1fM" % (pages * kern.pageSize / float(1 << 20))
+
+
+if __name__ == "__main__":
+    from sys import argv
+
+    tasks = []
+    for arg in argv[1:]:
+        # Either live pids or the paths of ELF core files
+        t = BasicTask(int(arg)) if arg.isdigit() else BasicCoreTask(arg)
+        t.attach()
+        addresses, hashes = t.pageHashes(resident=True)
+        tasks.append((arg, list(t.iterRegions()), addresses, hashes))
+        if isinstance(t, BasicCoreTask):
+            t.close()
+
+    zero = kern.hash("\0" * kern.pageSize)
+    copies = defaultdict(int)
+    for _, _, _, hashes in tasks:
+        for h in hashes:
+            copies[h] += 1
+
+    total = sum(len(hashes) for _, _, _, hashes in tasks)
+    zeros = sum(n for h, n in copies.iteritems() if h == zero)
+    unique = sum(1 for h in copies if h != zero)
+
+    for name, regions, addresses, hashes in tasks:
+        print "%s: %s resident" % (name, mb(len(hashes)))
+
+        stats = defaultdict(lambda: [0, 0, 0])
+        for address, h in zip(addresses, hashes):
+            s = stats[regionOf(regions, address)['address']]
+            s[0] += 1
+            if h == zero:
+                s[1] += 1
+            elif copies[h] > 1:
+                s[2] += 1
+
+        print "  %-18s %8s %8s %8s  %s" % ("region", "pages", "zero",
+                                          "dup", "path")
+        for r in regions:
+            if r['address'] in stats:
+                pages, z, d = stats[r['address']]
+                print "  0x%016x %8d %8d %8d  %s" % (r['address'], pages, z,
+                                                    d, r['path'] or "")
+
+    print
+    print "%d tasks, %s resident: %s zero, %s in %d distinct pages" % (
+        len(tasks), mb(total), mb(zeros), mb(total - zeros), unique)
+    print "merging identical pages would save %s" % mb(total - unique)
@@ -0,0 +1,24 @@
+from mdb.task import BasicTask
+from mdb.rsp import RSPServer
+
+if __name__ == "__main__":
+    from sys import argv
+
+    # Serve the task to gdb ("target extended-remote :<port>") or lldb
+    # ("gdb-remote <port>"); a non-numeric second argument is taken as a
+    # Unix socket path
+    t = BasicTask(int(argv[1]))
+    t.attach()
+
+    address = argv[2] if len(argv) > 2 else "1234"
+    if address.isdigit():
+        address = ("127.0.0.1", int(address))
+
+    server = RSPServer(t, address)
+    print "listening on %s" % (server.listen(),)
+    try:
+        server.serve()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.close()
@@ -0,0 +1,28 @@
+from mdb.task import BasicTask, BasicCoreTask
+
+if __name__ == "__main__":
+    from sys import argv
+
+    # Either a live pid or the path of an ELF core file
+    if argv[1].isdigit():
+        t = BasicTask(int(argv[1]))
+    else:
+        t = BasicCoreTask(argv[1])
+
+    t.attach()
+    heap = t.walkHeap()
+
+    for i, arena in enumerate(heap['arenas']):
+        print "Arena #%d @ 0x%0.2X, top 0x%0.2X (%d bytes free), system_mem %d" % (
+            i, arena['address'], arena['top'], arena['top_size'],
+            arena['system_mem'])
+
+    inuse = sum(heap['inuse'])
+    print "%d chunks, %d in use, %d free" % (
+        len(heap['address']), inuse, len(heap['address']) - inuse)
+
+    print "%10s %10s %14s %10s %14s" % ("size <=", "in use", "bytes",
+                                        "free", "bytes")
+    for bound, icount, ibytes, fcount, fbytes in heap['histogram']:
+        print "%10d %10d %14d %10d %14d" % (bound, icount, ibytes,
+                                            fcount, fbytes)
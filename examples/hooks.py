@@ -0,0 +1,44 @@
+from time import sleep, time
+
+from mdb.task import BasicTask
+
+if __name__ == "__main__":
+    from sys import argv
+
+    # Log calls to the functions at the given (hex) addresses until ^C,
+    # printing the call rate and the first argument of the latest call
+    t = BasicTask(int(argv[1]))
+    t.attach()
+
+    calls = {}
+    for address in argv[2:]:
+        address = int(address, 16)
+        t.hook(address)
+        calls[address] = 0
+
+    lost = 0
+    try:
+        while True:
+            start = time()
+            sleep(1)
+            records, dropped = t.drainHooks()
+            lost += dropped
+
+            latest = {}
+            for address, thread, tsc, caller, sp, args in records:
+                calls[address] += 1
+                latest[address] = (caller, args[0])
+
+            print "%d calls/s, %d dropped" % (len(records) / (time() - start),
+                                              dropped)
+            for address in sorted(latest):
+                caller, arg = latest[address]
+                print "  0x%0.2X from 0x%0.2X, rdi 0x%0.2X" % (address, caller,
+                                                               arg)
+    except KeyboardInterrupt:
+        pass
+
+    for address in sorted(calls):
+        t.unhook(address)
+        print "0x%0.2X: %d calls" % (address, calls[address])
+    print "%d calls lost to a full ring" % lost
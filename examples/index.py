@@ -0,0 +1,33 @@
+from time import time
+
+from mdb.task import BasicTask, BasicCoreTask
+
+if __name__ == "__main__":
+    from sys import argv
+
+    # e.g. index.py <pid|core> 'password' '[A-Za-z0-9+/]{40,}={0,2}' ...
+    # Patterns with a '/' prefix are regular expressions, the rest literals.
+    if argv[1].isdigit():
+        t = BasicTask(int(argv[1]))
+    else:
+        t = BasicCoreTask(argv[1])
+
+    t.attach()
+    start = time()
+    index = t.buildIndex()
+    stats = index.stats()
+    print "indexed %d pages, %d grams in %.2fs (%d bytes)" % (
+        stats['pages'], stats['grams'], time() - start, stats['bytes'])
+
+    for query in argv[2:]:
+        start = time()
+        if query.startswith("/"):
+            addresses, lengths = index.regexSearch(query[1:])
+        else:
+            addresses = index.search(query)
+            lengths = [len(query)] * len(addresses)
+        print "%r: %d hits in %.2fms" % (query, len(addresses),
+                                         (time() - start) * 1e3)
+
+        for address, length in zip(addresses, lengths)[:10]:
+            print "  0x%0.2X %r" % (address, t.vm.read(address, min(length, 80)))
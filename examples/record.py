@@ -0,0 +1,48 @@
+from collections import Counter
+from time import time
+
+from mdb.task import BasicTask, BasicReplayTask
+
+if __name__ == "__main__":
+    from sys import argv
+
+    # Record a task's exceptions and breakpoint hits for a while:
+    #   python record.py 1234 events.log [seconds] [breakpoint address...]
+    # then summarise the recording offline:
+    #   python record.py events.log
+    if argv[1].isdigit():
+        t = BasicTask(int(argv[1]))
+        t.attach()
+        for address in argv[4:]:
+            t.setBreakpoint(int(address, 16))
+
+        t.record(argv[2], memory=64)
+        end = time() + (float(argv[3]) if len(argv) > 3 else 10)
+        while time() < end:
+            event = t.poll()
+            if event is not None:
+                event['thread'].resume()
+
+        print "%(events)d events, %(dropped)d dropped, %(bytes)d bytes" % (
+            t.stopRecording())
+    else:
+        t = BasicReplayTask(argv[1])
+        t.attach()
+
+        kinds = Counter()
+        pcs = Counter()
+        last = 0
+        while True:
+            event = t.poll()
+            if event is None:
+                break
+            kinds[event['type']] += 1
+            state = event['thread'].getState()
+            pcs[state.get('rip', state.get('eip'))] += 1
+            last = event['time']
+
+        print "%d events over %.3fs" % (sum(kinds.values()), last / 1e9)
+        for kind, n in kinds.most_common():
+            print "  %s: %d" % (kind, n)
+        for pc, n in pcs.most_common(10):
+            print "  0x%0.2X: %d" % (pc, n)
@@ -0,0 +1,16 @@
+from mdb.task import BasicTask, BasicCoreTask
+
+if __name__ == "__main__":
+    from sys import argv
+
+    # e.g. regex.py <pid|core> '\d{13,16}' or '[A-Za-z0-9+/]{40,}={0,2}'
+    if argv[1].isdigit():
+        t = BasicTask(int(argv[1]))
+    else:
+        t = BasicCoreTask(argv[1])
+
+    t.attach()
+    addresses, lengths = t.regexSearch(argv[2])
+
+    for address, length in zip(addresses, lengths):
+        print "0x%0.2X %r" % (address, t.vm.read(address, min(length, 80)))
@@ -0,0 +1,27 @@
+from mdb.task import BasicTask
+from mdb.kern import Sampler
+from mdb.sampler import loadSamples
+
+if __name__ == "__main__":
+    from sys import argv
+    from time import sleep
+
+    # Sample a few 64-bit counters at 10kHz for a second, e.g.
+    #   sampler.py <pid> out.samp 0x100001000 0x100001008
+    t = BasicTask(int(argv[1]))
+    t.attach()
+
+    watches = [(int(a, 0), 'q') for a in argv[3:]]
+    s = Sampler(t, watches, rate=10000, path=argv[2])
+    s.start()
+    sleep(1)
+    s.stop()
+
+    samples = s.read()
+    print "%d samples in memory" % len(samples['time']), s.stats()
+
+    recorded = loadSamples(argv[2])
+    print "%d records on disk" % len(recorded['time'])
+    for address, column in zip(recorded['addresses'], recorded['values']):
+        print "%#x min %d max %d last %d" % (address, min(column),
+                                             max(column), column[-1])
@@ -1,5 +1,5 @@
-from mdb.task import BasicTask
-from mdb.kern import KernelError
+from mdb.task import BasicTask, BasicCoreTask, BasicRemoteTask
+from mdb.kern import printable
 
 def findAll(string, sub):
     end = len(string)
@@ -14,34 +14,30 @@ def findAll(string, sub):
         start = index + 1
 
 
-def clean(string):
-    s = ""
-    for c in string:
-        if 31 < ord(c) < 127:
-            s += c
-        else:
-            s += '.'
-
-    return s
-
 if __name__ == "__main__":
     from sys import argv
 
-    pid = int(argv[1])
     term = argv[2]
 
-    t = BasicTask(pid)
+    # A live pid, a gdbserver or QEMU gdbstub's host:port, or the path of an
+    # ELF core file
+    if argv[1].isdigit():
+        t = BasicTask(int(argv[1]))
+    elif ":" in argv[1]:
+        t = BasicRemoteTask(argv[1])
+    else:
+        t = BasicCoreTask(argv[1])
+
     t.attach()
     print t.basicInfo()
     for pos, r in enumerate(t.iterRegions()):
         print "Scanning region #%d @ 0x%0.2X of size %d..." % (
             pos, r['address'], r['size'])
 
-        try:
-            data = t.vm.read(r['address'], r['size'])
-        except KernelError:
-            continue
+        # Only resident pages are read, so nothing is faulted in; the rest,
+        # and unreadable pages (e.g. guard pages), come back zeroed
+        data, valid = t.vm.readResident(r['address'], r['size'])
 
-        for i in findAll(data, term):
-            string = clean(data[(i-50):(i+50)])
+        hits = list(findAll(data, term))
+        for i, string in zip(hits, printable(data, hits, 50, 50)):
             print " 0x%0.2X %s" % (r['address']+i, string)
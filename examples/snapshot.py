@@ -0,0 +1,22 @@
+from mdb.task import BasicTask, BasicCoreTask
+
+if __name__ == "__main__":
+    from sys import argv
+
+    # Save a live pid (or re-save a core) as an ELF core; the task is only
+    # stopped while its memory is copied-on-write and its registers read
+    if argv[1].isdigit():
+        t = BasicTask(int(argv[1]))
+    else:
+        t = BasicCoreTask(argv[1])
+
+    t.attach()
+    s = t.snapshot(argv[2], live=len(argv) < 4 or argv[3] != "stopped")
+    print "%d segments, %d threads, %d bytes" % (
+        s['segments'], s['threads'], s['bytes'])
+    print "stopped in %.3fms, paused for %.3fms" % (
+        s['window'] / 1e6, s['pause'] / 1e6)
+
+    c = BasicCoreTask(argv[2])
+    c.attach()
+    print c.basicInfo()
@@ -0,0 +1,37 @@
+from mdb.task import BasicTask, BasicCoreTask, BasicStoreTask
+from mdb import kern
+
+# Snapshot tasks into a deduplicated page store, e.g. the same process every
+# few seconds or a pool of forked workers, then reopen one:
+#
+#   python store.py /tmp/snaps 1234 1234 1235 core.1236
+
+def mb(n):
+    return "%.1fM" % (n / float(1 << 20))
+
+
+if __name__ == "__main__":
+    from sys import argv
+
+    store = kern.Store(argv[1])
+
+    for i, arg in enumerate(argv[2:]):
+        # Either live pids or the paths of ELF core files
+        t = BasicTask(int(arg)) if arg.isdigit() else BasicCoreTask(arg)
+        t.attach()
+
+        name = "%s.%d" % (arg.replace("/", "_"), i)
+        r = store.add(t, name)
+        print "%s: %s, %d zero pages, %d new, %s written, stopped %.2fms" % (
+            name, mb(r['pages'] * kern.pageSize), r['zero'], r['new'],
+            mb(r['bytes']), r['pause'] / 1e6)
+
+    stats = store.stats()
+    print "%d snapshots in %d unique pages, %s on disk" % (
+        len(store.snapshots()), stats['pages'], mb(stats['bytes']))
+
+    last = BasicStoreTask(store, store.snapshots()[-1])
+    last.attach()
+    for region in last.iterRegions():
+        print "0x%016x %8d %s" % (region['address'], region['size'],
+                                 region['path'] or "")
@@ -0,0 +1,23 @@
+from mdb.task import BasicTask, BasicCoreTask
+from mdb.kern import KernelError, Memory
+
+if __name__ == "__main__":
+    from sys import argv
+
+    # Like strings(1) -a -t x over the whole address space, plus UTF-16LE
+    if argv[1].isdigit():
+        t = BasicTask(int(argv[1]))
+    else:
+        t = BasicCoreTask(argv[1])
+
+    t.attach()
+    for r in t.iterRegions():
+        try:
+            s = Memory(t, r['address'], r['size']).strings(views=True)
+        except KernelError:
+            continue
+
+        for offset, wide, view in zip(s['offset'], s['wide'], s['views']):
+            text = str(view).decode('utf-16le') if wide else str(view)
+            print "%x %s%s" % (r['address'] + offset, "w " if wide else "",
+                               text.encode('ascii', 'replace'))
@@ -0,0 +1,47 @@
+import os
+from array import array
+
+from mdb import kern
+from mdb.task import BasicTask, BasicCoreTask
+
+if __name__ == "__main__":
+    from sys import argv
+
+    # Either a live pid or the path of an ELF core file
+    if argv[1].isdigit():
+        t = BasicTask(int(argv[1]))
+    else:
+        t = BasicCoreTask(argv[1])
+
+    t.attach()
+
+    cache = os.path.expanduser("~/.mdb/symbols")
+    if not os.path.isdir(cache):
+        os.makedirs(cache)
+
+    symbols = kern.Symbols(t, cache)
+    print "%d symbols" % symbols.load()
+
+    for thread in t.getThreads():
+        state = thread.getState()
+        pc = state.get('rip', state.get('eip'))
+        sp = state.get('rsp', state.get('esp'))
+
+        print "Thread %s" % thread
+        found = symbols.lookup(pc)
+        if found:
+            print "  pc  0x%0.2X %s+%d (%s)" % ((pc,) + found)
+        else:
+            print "  pc  0x%0.2X" % pc
+
+        # Return addresses are somewhere in the words above sp
+        try:
+            words = array('L', t.vm.read(sp, 8192))
+        except kern.Error:
+            continue
+
+        ids, offsets = symbols.lookupMany(words)
+        for addr, index, offset in zip(words, ids, offsets):
+            if index >= 0 and offset > 0:
+                name, path = symbols.name(index)
+                print "  ret 0x%0.2X %s+%d (%s)" % (addr, name, offset, path)
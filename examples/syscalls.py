@@ -0,0 +1,54 @@
+from collections import defaultdict
+from errno import errorcode
+from time import sleep
+
+from mdb.task import BasicTask
+
+if __name__ == "__main__":
+    from sys import argv
+
+    # Trace some syscalls by their libsystem_kernel stub names until ^C,
+    # e.g. python syscalls.py 1234 read write __open, or only those on one
+    # file descriptor: python syscalls.py 1234 read write fd=5. Other
+    # syscalls aren't slowed down
+    t = BasicTask(int(argv[1]))
+    t.attach()
+
+    names = [a for a in argv[2:] if not a.startswith("fd=")]
+    fds = [int(a[3:]) for a in argv[2:] if a.startswith("fd=")]
+    filters = {0: fds[0]} if fds else None
+
+    stubs = {}
+    for name in names:
+        stubs[t.traceSyscall(name, args=filters)] = name
+
+    lost = 0
+    try:
+        while True:
+            sleep(1)
+            records, dropped = t.drainSyscalls()
+            lost += dropped
+
+            calls = defaultdict(int)
+            ticks = defaultdict(int)
+            errors = defaultdict(int)
+            for (address, number, thread, start, end, caller, args, result,
+                 error) in records:
+                name = stubs[address]
+                calls[name] += 1
+                ticks[name] += end - start
+                if error:
+                    errors[name, errorcode.get(error, error)] += 1
+
+            print "%d syscalls, %d dropped" % (len(records), dropped)
+            for name in sorted(calls):
+                print "  %s: %d, %d ticks each" % (name, calls[name],
+                                                   ticks[name] / calls[name])
+            for (name, error), n in sorted(errors.items()):
+                print "  %s failed with %s: %d" % (name, error, n)
+    except KeyboardInterrupt:
+        pass
+
+    for address in stubs:
+        t.untraceSyscall(address)
+    print "%d syscalls lost to a full ring" % lost
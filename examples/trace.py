@@ -0,0 +1,34 @@
+from mdb.task import BasicTask, BasicCoreTask
+from mdb.kern import KernelError
+
+if __name__ == "__main__":
+    from sys import argv
+
+    # Record the debugger operations behind a full memory scan and write
+    # them out for chrome://tracing or https://ui.perfetto.dev
+    if argv[1].isdigit():
+        t = BasicTask(int(argv[1]))
+    else:
+        t = BasicCoreTask(argv[1])
+
+    t.startTrace(capacity=1 << 20)
+    t.attach()
+
+    for thread in t.getThreads():
+        thread.getState()
+
+    for r in t.iterRegions():
+        try:
+            t.vm.read(r['address'], r['size'])
+        except KernelError:
+            continue
+
+    t.stopTrace()
+
+    with open(argv[2], "w") as f:
+        f.write(t.exportTrace())
+
+    for op, s in sorted(t.stats().items()):
+        if s['calls']:
+            print "%-10s %8d calls %12d bytes %10.3f ms" % (
+                op, s['calls'], s['bytes'], s['ns'] / 1e6)
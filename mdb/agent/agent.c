@@ -0,0 +1,449 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The agent: loaded into the task by Task.loadAgent(), it serves memory
+ * requests from the debugger over the shared ring in shared.h, so reads and
+ * pointer chasing run in the task's own address space with no system calls
+ * on either side while it's busy.
+ *
+ * Faults are caught rather than crashing the task: the serving thread's
+ * EXC_BAD_ACCESS goes to a thread-level exception port, ahead of any task or
+ * host handler, and the handler thread points the faulting thread at
+ * kern_agent_recover, which longjmps out of the request.
+ */
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <string.h>
+#include <time.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+#include <mach/mach_vm.h>
+#include <mach/mig_errors.h>
+#include <mach/thread_status.h>
+
+#include "shared.h"
+
+/* Idle polls before sleeping on the wake port */
+#define AGENT_SPIN  20000
+
+/* exception_raise, as sent for EXCEPTION_DEFAULT */
+typedef struct {
+    mach_msg_header_t head;
+    mach_msg_body_t body;
+    mach_msg_port_descriptor_t thread;
+    mach_msg_port_descriptor_t task;
+    NDR_record_t ndr;
+    exception_type_t exception;
+    mach_msg_type_number_t code_count;
+    integer_t code[2];
+    char trailer[128];
+} kern_agent_exc;
+
+static kern_agent_shared *kern_agent;
+static mach_port_t kern_agent_thread;
+static mach_port_t kern_agent_exc_port;
+static jmp_buf kern_agent_jmp;
+static volatile int kern_agent_guarded;
+
+static void
+kern_agent_recover (void)
+{
+    _longjmp(kern_agent_jmp, 1);
+}
+
+/*
+ * Resume a fault in a guarded section at kern_agent_recover, on a fresh
+ * aligned frame below the red zone. Anything else is refused, so it goes on
+ * to the task's handlers as it would have without the agent
+ */
+static kern_return_t
+kern_agent_fault (mach_port_t thread)
+{
+    kern_return_t kr;
+    x86_thread_state64_t state;
+    mach_msg_type_number_t count = x86_THREAD_STATE64_COUNT;
+
+    if (thread != kern_agent_thread || ! kern_agent_guarded)
+        return KERN_FAILURE;
+
+    kr = thread_get_state(thread, x86_THREAD_STATE64,
+                          (thread_state_t) &state, &count);
+    if (kr != KERN_SUCCESS)
+        return kr;
+
+    state.__rip = (uint64_t) (uintptr_t) kern_agent_recover;
+    state.__rsp = ((state.__rsp - 128) & ~(uint64_t) 15) - 8;
+    kern_agent_guarded = 0;
+
+    return thread_set_state(thread, x86_THREAD_STATE64,
+                            (thread_state_t) &state, count);
+}
+
+/* Exception server; exits once the port is destroyed */
+static void *
+kern_agent_handler (void *arg)
+{
+    kern_agent_exc request;
+    mig_reply_error_t reply;
+    mach_msg_return_t mr;
+
+    (void) arg;
+
+    for (;;) {
+        mr = mach_msg(&request.head, MACH_RCV_MSG, 0, sizeof(request),
+                      kern_agent_exc_port, MACH_MSG_TIMEOUT_NONE,
+                      MACH_PORT_NULL);
+        if (mr != MACH_MSG_SUCCESS)
+            break;
+
+        memset(&reply, 0, sizeof(reply));
+        reply.Head.msgh_bits =
+            MACH_MSGH_BITS(MACH_MSGH_BITS_REMOTE(request.head.msgh_bits), 0);
+        reply.Head.msgh_size = sizeof(reply);
+        reply.Head.msgh_remote_port = request.head.msgh_remote_port;
+        reply.Head.msgh_local_port = MACH_PORT_NULL;
+        reply.Head.msgh_id = request.head.msgh_id + 100;
+        reply.NDR = NDR_record;
+        reply.RetCode = request.exception == EXC_BAD_ACCESS ?
+                        kern_agent_fault(request.thread.name) : KERN_FAILURE;
+
+        mach_port_deallocate(mach_task_self(), request.thread.name);
+        mach_port_deallocate(mach_task_self(), request.task.name);
+
+        mach_msg(&reply.Head, MACH_SEND_MSG, reply.Head.msgh_size, 0,
+                 MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+    }
+
+    return NULL;
+}
+
+/*
+ * Copy size bytes from src, which may be unmapped
+ *
+ * Returns: 0 on success, -1 if it faulted
+ */
+static int
+kern_agent_copy (void *dst, const void *src, size_t size)
+{
+    if (_setjmp(kern_agent_jmp))
+        return -1;
+
+    kern_agent_guarded = 1;
+    memcpy(dst, src, size);
+    kern_agent_guarded = 0;
+
+    return 0;
+}
+
+static void
+kern_agent_read (kern_agent_request *req, uint8_t *window)
+{
+    req->count = 0;
+    req->next = 0;
+
+    if (req->size > KERN_AGENT_WINDOW) {
+        req->status = KERN_INVALID_ARGUMENT;
+        return;
+    }
+
+    if (kern_agent_copy(window, (const void *) (uintptr_t) req->address,
+                        (size_t) req->size) < 0) {
+        req->status = KERN_INVALID_ADDRESS;
+        return;
+    }
+
+    req->out_size = req->size;
+    req->status = KERN_SUCCESS;
+}
+
+/*
+ * Follow next pointers at arg[0] from address, copying size bytes of each
+ * node after its address, until a NULL, the list's head (the 8 bytes of
+ * input) again or arg[1] nodes. When the window fills up, next is where to
+ * carry on from
+ */
+static void
+kern_agent_walk (kern_agent_request *req, uint8_t *window)
+{
+    size_t stride = 8 + (size_t) KERN_AGENT_OUT(req->size);
+    uint8_t *out = window + KERN_AGENT_OUT(req->in_size),
+            *end = window + KERN_AGENT_WINDOW;
+    uint64_t node = req->address, limit = req->arg[1], count = 0, head;
+
+    memcpy(&head, window, 8);
+    req->status = KERN_SUCCESS;
+    req->next = 0;
+
+    while (node != 0 && count < limit) {
+        if (out + stride > end) {
+            req->next = node;
+            break;
+        }
+
+        memcpy(out, &node, 8);
+        if (kern_agent_copy(out + 8, (const void *) (uintptr_t) node,
+                            (size_t) req->size) < 0 ||
+            kern_agent_copy(&node, (const void *) (uintptr_t)
+                            (node + req->arg[0]), 8) < 0) {
+            req->status = KERN_INVALID_ADDRESS;
+            break;
+        }
+
+        out += stride;
+        count++;
+
+        if (node == head)
+            break;
+    }
+
+    req->count = count;
+    req->out_size = count * stride;
+}
+
+/*
+ * Copy size bytes at each of the in_size / 8 addresses of the input. Each
+ * result is followed by a byte, 1 if it was read; faulting ones are zeroed
+ */
+static void
+kern_agent_gather (kern_agent_request *req, uint8_t *window)
+{
+    size_t stride = (size_t) req->size + 1;
+    uint64_t i, n = req->in_size / 8, address;
+    uint8_t *out = window + KERN_AGENT_OUT(req->in_size);
+
+    req->next = 0;
+    if (KERN_AGENT_OUT(req->in_size) + n * stride > KERN_AGENT_WINDOW) {
+        req->status = KERN_INVALID_ARGUMENT;
+        return;
+    }
+
+    for (i = 0; i < n; ++i, out += stride) {
+        memcpy(&address, window + i * 8, 8);
+        out[req->size] = kern_agent_copy(out, (const void *) (uintptr_t)
+                                         address, (size_t) req->size) == 0;
+        if (! out[req->size])
+            memset(out, 0, (size_t) req->size);
+    }
+
+    req->count = n;
+    req->out_size = n * stride;
+    req->status = KERN_SUCCESS;
+}
+
+/*
+ * Find the input in the readable regions of [address, address+size), other
+ * than the shared area, up to arg[0] hits or as many as fit. Matches don't
+ * span regions. When the hits fill the window, next is where to carry on
+ */
+static void
+kern_agent_search (kern_agent_request *req, uint8_t *window)
+{
+    const uint8_t *needle = window;
+    size_t len = (size_t) req->in_size;
+    uint64_t *hits = (uint64_t *) (window + KERN_AGENT_OUT(req->in_size));
+    uint64_t max = (KERN_AGENT_WINDOW - KERN_AGENT_OUT(req->in_size)) / 8,
+             end = req->address + req->size, lo;
+    uint64_t shared_lo = (uint64_t) (uintptr_t) kern_agent,
+             shared_hi = shared_lo + kern_agent->size;
+    volatile uint64_t count = 0;
+    mach_vm_address_t address = req->address;
+    mach_vm_size_t size;
+    vm_region_basic_info_data_64_t info;
+    mach_msg_type_number_t info_count;
+    mach_port_t object;
+    const uint8_t *p, *hi;
+
+    if (req->arg[0] != 0 && req->arg[0] < max)
+        max = req->arg[0];
+
+    req->status = KERN_SUCCESS;
+    req->next = 0;
+
+    while (len > 0 && address < end && count < max) {
+        info_count = VM_REGION_BASIC_INFO_COUNT_64;
+        if (mach_vm_region(mach_task_self(), &address, &size,
+                           VM_REGION_BASIC_INFO_64, (vm_region_info_t) &info,
+                           &info_count, &object) != KERN_SUCCESS ||
+            address >= end)
+            break;
+
+        lo = address > req->address ? address : req->address;
+        hi = (const uint8_t *) (uintptr_t)
+             (address + size < end ? address + size : end);
+        address += size;
+
+        if (! (info.protection & VM_PROT_READ) ||
+            (lo < shared_hi && (uint64_t) (uintptr_t) hi > shared_lo))
+            continue;
+
+        /* A region unmapped under us is skipped from the fault on */
+        if (_setjmp(kern_agent_jmp))
+            continue;
+        kern_agent_guarded = 1;
+
+        for (p = (const uint8_t *) (uintptr_t) lo;
+             (size_t) (hi - p) >= len; ++p) {
+            p = memmem(p, (size_t) (hi - p), needle, len);
+            if (p == NULL)
+                break;
+
+            hits[count++] = (uint64_t) (uintptr_t) p;
+            if (count == max) {
+                req->next = (uint64_t) (uintptr_t) p + 1;
+                break;
+            }
+        }
+
+        kern_agent_guarded = 0;
+    }
+
+    req->count = count;
+    req->out_size = count * 8;
+}
+
+/* Sleep on the wake port once head is seen not to have moved */
+static void
+kern_agent_sleep (uint64_t tail)
+{
+    struct {
+        mach_msg_header_t head;
+        char trailer[64];
+    } msg;
+
+    kern_agent->sleeping = 1;
+    __sync_synchronize();
+
+    if (kern_agent->head == tail)
+        mach_msg(&msg.head, MACH_RCV_MSG, 0, sizeof(msg),
+                 kern_agent->wake, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+
+    kern_agent->sleeping = 0;
+}
+
+/*
+ * The agent's thread: set up fault handling and the wake port, then serve
+ * requests until told to stop
+ *
+ * Arguments: shared - the area the debugger mapped for the ring
+ */
+void
+kern_agent_main (kern_agent_shared *shared)
+{
+    kern_agent_request *req;
+    pthread_t handler;
+    mach_port_t self = mach_task_self(), wake;
+    uint64_t tail;
+    unsigned int idle = 0;
+    int stop = 0;
+
+    kern_agent = shared;
+    kern_agent_thread = mach_thread_self();
+    pthread_threadid_np(NULL, &shared->tid);
+
+    if (mach_port_allocate(self, MACH_PORT_RIGHT_RECEIVE,
+                           &kern_agent_exc_port) != KERN_SUCCESS)
+        goto out;
+    if (mach_port_insert_right(self, kern_agent_exc_port, kern_agent_exc_port,
+                               MACH_MSG_TYPE_MAKE_SEND) != KERN_SUCCESS ||
+        thread_set_exception_ports(kern_agent_thread, EXC_MASK_BAD_ACCESS,
+                                   kern_agent_exc_port, EXCEPTION_DEFAULT,
+                                   THREAD_STATE_NONE) != KERN_SUCCESS ||
+        pthread_create(&handler, NULL, kern_agent_handler, NULL) != 0)
+        goto out_exc;
+    pthread_detach(handler);
+
+    if (mach_port_allocate(self, MACH_PORT_RIGHT_RECEIVE, &wake) !=
+        KERN_SUCCESS)
+        goto out_exc;
+    shared->wake = wake;
+
+    __sync_synchronize();
+    shared->state = _KERN_AGENT_READY;
+
+    while (! stop) {
+        tail = shared->tail;
+        if (shared->head == tail) {
+            if (++idle < AGENT_SPIN) {
+                __asm__ __volatile__ ("pause");
+                continue;
+            }
+            kern_agent_sleep(tail);
+            idle = 0;
+            continue;
+        }
+        idle = 0;
+        __sync_synchronize();
+
+        req = &shared->ring[tail % KERN_AGENT_SLOTS];
+        switch (req->op) {
+        case _KERN_AGENT_READ:
+            kern_agent_read(req, KERN_AGENT_WINDOW_AT(shared, tail %
+                                                      KERN_AGENT_SLOTS));
+            break;
+        case _KERN_AGENT_WALK:
+            kern_agent_walk(req, KERN_AGENT_WINDOW_AT(shared, tail %
+                                                      KERN_AGENT_SLOTS));
+            break;
+        case _KERN_AGENT_GATHER:
+            kern_agent_gather(req, KERN_AGENT_WINDOW_AT(shared, tail %
+                                                        KERN_AGENT_SLOTS));
+            break;
+        case _KERN_AGENT_SEARCH:
+            kern_agent_search(req, KERN_AGENT_WINDOW_AT(shared, tail %
+                                                        KERN_AGENT_SLOTS));
+            break;
+        case _KERN_AGENT_STOP:
+            req->status = KERN_SUCCESS;
+            stop = 1;
+            break;
+        default:
+            req->status = KERN_INVALID_ARGUMENT;
+            break;
+        }
+
+        __sync_synchronize();
+        shared->tail = tail + 1;
+    }
+
+    mach_port_mod_refs(self, wake, MACH_PORT_RIGHT_RECEIVE, -1);
+
+ out_exc:
+    /* Destroying the port ends the handler thread */
+    thread_set_exception_ports(kern_agent_thread, EXC_MASK_BAD_ACCESS,
+                               MACH_PORT_NULL, EXCEPTION_DEFAULT,
+                               THREAD_STATE_NONE);
+    mach_port_mod_refs(self, kern_agent_exc_port, MACH_PORT_RIGHT_RECEIVE, -1);
+    mach_port_deallocate(self, kern_agent_exc_port);
+ out:
+    mach_port_deallocate(self, kern_agent_thread);
+
+    /* Last touch of the shared area: the debugger may unmap it after this */
+    __sync_synchronize();
+    shared->state = _KERN_AGENT_STOPPED;
+}
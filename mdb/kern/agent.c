@@ -0,0 +1,1081 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <dlfcn.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include <mach/mach.h>
+#include <mach/mach_error.h>
+#include <mach/mach_types.h>
+#include <mach/mach_vm.h>
+
+#include "util.h"
+#include "kern.h"
+#include "memory.h"
+#include "regex.h"
+#include "scratch.h"
+#include "task.h"
+#include "agent.h"
+
+/*
+ * The debugger's half of the agent (mdb/agent/agent.c). Loading it takes a
+ * raw Mach thread, which can't call into libdyld itself, so the bootstrap
+ * code below only creates a proper pthread, whose start routine (the
+ * loader) dlopens the agent and calls into it:
+ *
+ * bootstrap (rdi = &shared->boot):
+ *   mov rbx, rdi
+ *   lea rdi, [rbx + pthread]
+ *   xor esi, esi
+ *   mov rdx, [rbx + start]
+ *   mov rcx, rbx
+ *   call [rbx + create]
+ *   mov [rbx + status], eax
+ * 1: pause                             ; until the debugger terminates it
+ *   jmp 1b
+ *
+ * loader (rdi = &shared->boot):
+ *   push rbx
+ *   mov rbx, rdi
+ *   lea rdi, [rbx + path]
+ *   mov esi, RTLD_NOW
+ *   call [rbx + dlopen]
+ *   test rax, rax
+ *   jz 2f
+ *   mov rdi, rax
+ *   lea rsi, [rbx + symbol]
+ *   call [rbx + dlsym]
+ *   test rax, rax
+ *   jz 2f
+ *   mov rdi, [rbx + shared]
+ *   call rax                           ; serves until stopped
+ *   jmp 3f
+ * 2: call [rbx + dlerror]
+ *   mov [rbx + error], rax
+ * 3: xor eax, eax
+ *   pop rbx
+ *   ret
+ *
+ * The library functions are looked up in the debugger: they live in the
+ * shared cache, which every 64-bit process maps at the same address until
+ * the next boot. That's checked against the task before anything is run.
+ */
+
+static const uint8_t kern_agent_code[] = {
+    0x48, 0x89, 0xfb, 0x48, 0x8d, 0x7b, 0x30, 0x31, 0xf6, 0x48, 0x8b, 0x53,
+    0x08, 0x48, 0x89, 0xd9, 0xff, 0x13, 0x89, 0x43, 0x40, 0xf3, 0x90, 0xeb,
+    0xfc,
+    /* loader */
+    0x53, 0x48, 0x89, 0xfb, 0x48, 0x8d, 0x7b, 0x60, 0xbe, 0x02, 0x00, 0x00,
+    0x00, 0xff, 0x53, 0x10, 0x48, 0x85, 0xc0, 0x74, 0x17, 0x48, 0x89, 0xc7,
+    0x48, 0x8d, 0x73, 0x48, 0xff, 0x53, 0x18, 0x48, 0x85, 0xc0, 0x74, 0x08,
+    0x48, 0x8b, 0x7b, 0x28, 0xff, 0xd0, 0xeb, 0x07, 0xff, 0x53, 0x20, 0x48,
+    0x89, 0x43, 0x38, 0x31, 0xc0, 0x5b, 0xc3,
+};
+
+#define AGENT_LOADER    25
+#define AGENT_STACK     (64 * 1024)
+#define AGENT_SPIN      1000
+#define AGENT_TIMEOUT   500000000ULL    /* ns before a request is given up */
+#define AGENT_STOP_WAIT 1000000         /* us for the agent to stop */
+#define SEARCH_CHUNK    (1024 * 1024)
+
+#define VOLATILE(x) (*(volatile __typeof__(x) *) &(x))
+
+/* Windows are found from our own layout: the task can write shared->data */
+#define AGENT_WINDOW_AT(agent, slot) \
+    ((uint8_t *) (agent)->shared + KERN_AGENT_DATA + \
+     (uint64_t) (slot) * KERN_AGENT_WINDOW)
+
+/*
+ * The task's agent, locked for one producer and held against
+ * kern_agent_free until kern_agent_release
+ *
+ * Returns: the agent, or NULL if none is loaded
+ */
+static struct kern_agent *
+kern_agent_acquire (kern_TaskObj *task)
+{
+    pthread_rwlock_rdlock(&task->agent_lock);
+    if (task->agent == NULL) {
+        pthread_rwlock_unlock(&task->agent_lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&task->agent->lock);
+    return task->agent;
+}
+
+static void
+kern_agent_release (kern_TaskObj *task, struct kern_agent *agent)
+{
+    pthread_mutex_unlock(&agent->lock);
+    pthread_rwlock_unlock(&task->agent_lock);
+}
+
+/*
+ * Whether requests can go to the agent: not while the task is frozen, as
+ * its thread is too, nor after a timeout until it has caught up
+ */
+static int
+kern_agent_usable (kern_TaskObj *task, struct kern_agent *agent)
+{
+    if (task->frozen)
+        return 0;
+
+    if (agent->stalled) {
+        if (agent->shared->tail != agent->posted)
+            return 0;
+        agent->stalled = 0;
+    }
+
+    return 1;
+}
+
+/* The next free slot, which kern_agent_post publishes */
+static kern_agent_request *
+kern_agent_slot (struct kern_agent *agent, uint8_t **window)
+{
+    size_t slot = (size_t) (agent->posted % KERN_AGENT_SLOTS);
+
+    if (window != NULL)
+        *window = AGENT_WINDOW_AT(agent, slot);
+
+    return &agent->shared->ring[slot];
+}
+
+static void
+kern_agent_post (struct kern_agent *agent)
+{
+    mach_msg_header_t msg;
+
+    __sync_synchronize();
+    agent->shared->head = ++agent->posted;
+    __sync_synchronize();
+
+    /* A sleeping agent checks head after setting sleeping, so one of us
+       sees the other */
+    if (agent->shared->sleeping) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0);
+        msg.msgh_size = sizeof(msg);
+        msg.msgh_remote_port = agent->wake;
+        mach_msg(&msg, MACH_SEND_MSG | MACH_SEND_TIMEOUT, sizeof(msg), 0,
+                 MACH_PORT_NULL, 0, MACH_PORT_NULL);
+    }
+}
+
+/* Wait for request number seq to be done; spins, then yields */
+static kern_return_t
+kern_agent_wait (struct kern_agent *agent, uint64_t seq)
+{
+    uint64_t start = 0, now;
+    unsigned int spins = 0;
+
+    while (agent->shared->tail <= seq) {
+        if (++spins < AGENT_SPIN) {
+            __asm__ __volatile__ ("pause");
+            continue;
+        }
+
+        now = kern_stats_now();
+        if (start == 0) {
+            start = now;
+        } else if (now - start > AGENT_TIMEOUT) {
+            agent->stalled = 1;
+            return KERN_OPERATION_TIMED_OUT;
+        }
+        sched_yield();
+    }
+
+    __sync_synchronize();
+    return KERN_SUCCESS;
+}
+
+/* Post the request filled into the current slot and wait for it */
+static kern_return_t
+kern_agent_call (struct kern_agent *agent, kern_agent_request *req)
+{
+    uint64_t seq = agent->posted;
+    kern_return_t kr;
+
+    kern_agent_post(agent);
+    kr = kern_agent_wait(agent, seq);
+
+    return kr != KERN_SUCCESS ? kr : req->status;
+}
+
+/*
+ * Read through the agent, a window per request, keeping the ring full so
+ * the agent copies one chunk while the debugger copies out the last. Any
+ * failure is left to the Mach read the caller falls back on, so errors are
+ * reported as they would be without the agent
+ *
+ * Returns: KERN_SUCCESS, or an error if the caller should read itself
+ */
+kern_return_t
+kern_agent_read (kern_TaskObj *task, mach_vm_address_t address,
+                 mach_vm_size_t size, void *buf, mach_vm_size_t *out_size)
+{
+    struct kern_agent *agent;
+    kern_agent_request *req;
+    kern_return_t kr = KERN_SUCCESS;
+    uint64_t seq, offset = 0, done = 0, chunk;
+
+    agent = kern_agent_acquire(task);
+    if (agent == NULL)
+        return KERN_NOT_SUPPORTED;
+
+    if (! kern_agent_usable(task, agent)) {
+        kern_agent_release(task, agent);
+        return KERN_NOT_SUPPORTED;
+    }
+
+    for (seq = agent->posted; done < size; ++seq) {
+        while (offset < size && agent->posted - seq < KERN_AGENT_SLOTS) {
+            chunk = MIN(size - offset, KERN_AGENT_WINDOW);
+            req = kern_agent_slot(agent, NULL);
+            req->op = _KERN_AGENT_READ;
+            req->address = address + offset;
+            req->size = chunk;
+            req->in_size = 0;
+            kern_agent_post(agent);
+            offset += chunk;
+        }
+
+        kr = kern_agent_wait(agent, seq);
+        if (kr != KERN_SUCCESS)
+            break;
+
+        req = &agent->shared->ring[seq % KERN_AGENT_SLOTS];
+        if (req->status != KERN_SUCCESS) {
+            kr = req->status;
+            break;
+        }
+
+        /* The length posted, not req->size, which the task can rewrite */
+        chunk = MIN(size - done, KERN_AGENT_WINDOW);
+        memcpy((uint8_t *) buf + done,
+               AGENT_WINDOW_AT(agent, seq % KERN_AGENT_SLOTS), (size_t) chunk);
+        done += chunk;
+    }
+
+    /* Let the rest finish, so the ring is empty between calls */
+    if (kr != KERN_SUCCESS && ! agent->stalled && agent->posted > 0)
+        kern_agent_wait(agent, agent->posted - 1);
+
+    kern_agent_release(task, agent);
+
+    *out_size = done;
+    return kr;
+}
+
+/*
+ * Stop the agent, if it can be reached, and let go of it. If it can't be
+ * stopped its shared area is left in the task, where it may still write.
+ * Readers without the GIL may be using it, so it's taken from the task
+ * once they've let go
+ */
+void
+kern_agent_free (kern_TaskObj *task)
+{
+    struct kern_agent *agent;
+    kern_agent_request *req;
+    int stopped = 0, waited;
+
+    pthread_rwlock_wrlock(&task->agent_lock);
+    agent = task->agent;
+    task->agent = NULL;
+    pthread_rwlock_unlock(&task->agent_lock);
+
+    if (agent == NULL)
+        return;
+
+    pthread_mutex_lock(&agent->lock);
+    if (kern_agent_usable(task, agent)) {
+        req = kern_agent_slot(agent, NULL);
+        req->op = _KERN_AGENT_STOP;
+        kern_agent_post(agent);
+
+        for (waited = 0; waited < AGENT_STOP_WAIT; waited += 1000) {
+            if (VOLATILE(agent->shared->state) == _KERN_AGENT_STOPPED) {
+                stopped = 1;
+                break;
+            }
+            usleep(1000);
+        }
+    }
+    pthread_mutex_unlock(&agent->lock);
+
+    mach_vm_deallocate(mach_task_self(), (mach_vm_address_t) agent->shared,
+                       KERN_AGENT_SIZE);
+    if (stopped)
+        mach_vm_deallocate(task->port, agent->remote, KERN_AGENT_SIZE);
+    if (agent->wake != MACH_PORT_NULL)
+        mach_port_deallocate(mach_task_self(), agent->wake);
+
+    pthread_mutex_destroy(&agent->lock);
+    free(agent);
+}
+
+/* Check the task maps a function where we do */
+static int
+kern_agent_same (kern_TaskObj *task, void *function)
+{
+    uint8_t code[16];
+    mach_vm_size_t out_size;
+
+    return kern_task_read(task, (mach_vm_address_t) (uintptr_t) function,
+                          sizeof(code), code, &out_size) == KERN_SUCCESS &&
+           out_size == sizeof(code) &&
+           memcmp(code, function, sizeof(code)) == 0;
+}
+
+/*
+ * Start the agent's thread and wait for it to come up
+ *
+ * Returns: 0 if it's ready, otherwise -1 with a message in error. *keep is
+ *          set if the agent may yet start, so its area has to stay
+ */
+static int
+kern_agent_start (kern_TaskObj *task, struct kern_agent *agent,
+                  double timeout, char *error, size_t error_size,
+                  int *keep)
+{
+    kern_return_t kr;
+    kern_agent_shared *shared = agent->shared;
+    x86_thread_state64_t state;
+    thread_act_t thread = MACH_PORT_NULL;
+    mach_vm_address_t code, stack = 0;
+    mach_msg_type_name_t type;
+    uint64_t deadline;
+    uint8_t valid[2];
+    char message[256];
+    int r = -1;
+
+    *keep = 0;
+
+    kr = kern_scratch_alloc(task, 0, sizeof(kern_agent_code), &code);
+    if (kr == KERN_SUCCESS)
+        kr = kern_scratch_write(task, code, kern_agent_code,
+                                sizeof(kern_agent_code));
+    if (kr == KERN_SUCCESS)
+        kr = mach_vm_allocate(task->port, &stack, AGENT_STACK,
+                              VM_FLAGS_ANYWHERE);
+    if (kr != KERN_SUCCESS) {
+        snprintf(error, error_size, "couldn't set up the agent's loader: %s",
+                 mach_error_string(kr));
+        return -1;
+    }
+
+    shared->boot.start = code + AGENT_LOADER;
+
+    memset(&state, 0, sizeof(state));
+    state.__rip = code;
+    state.__rdi = agent->remote + offsetof(kern_agent_shared, boot);
+    state.__rsp = stack + AGENT_STACK - 16;
+
+    kr = thread_create_running(task->port, x86_THREAD_STATE64,
+                               (thread_state_t) &state,
+                               x86_THREAD_STATE64_COUNT, &thread);
+    if (kr != KERN_SUCCESS) {
+        snprintf(error, error_size, "couldn't create a thread: %s",
+                 mach_error_string(kr));
+        goto out;
+    }
+
+    deadline = kern_stats_now() + (uint64_t) (timeout * 1e9);
+
+    /* The bootstrap thread spins once it has made the pthread */
+    while (VOLATILE(shared->boot.status) == -1 &&
+           kern_stats_now() < deadline)
+        usleep(1000);
+
+    thread_terminate(thread);
+    mach_port_deallocate(mach_task_self(), thread);
+
+    if (VOLATILE(shared->boot.status) == -1) {
+        snprintf(error, error_size, "the agent's thread didn't start");
+        goto out;
+    }
+    if (shared->boot.status != 0) {
+        snprintf(error, error_size, "couldn't create the agent's thread: %s",
+                 strerror(shared->boot.status));
+        goto out;
+    }
+
+    /* From here the loader may still be running, so the area stays */
+    *keep = 1;
+
+    while (VOLATILE(shared->state) == _KERN_AGENT_LOADING &&
+           VOLATILE(shared->boot.error) == 0 && kern_stats_now() < deadline)
+        usleep(1000);
+
+    if (VOLATILE(shared->boot.error) != 0) {
+        memset(message, 0, sizeof(message));
+        kern_memory_read_partial(task, shared->boot.error,
+                                 sizeof(message) - 1, message, valid);
+        snprintf(error, error_size, "couldn't load the agent: %s", message);
+        *keep = 0;
+        goto out;
+    }
+
+    if (VOLATILE(shared->state) == _KERN_AGENT_LOADING) {
+        snprintf(error, error_size, "the agent didn't start in time");
+        goto out;
+    }
+
+    if (shared->state != _KERN_AGENT_READY) {
+        snprintf(error, error_size, "the agent failed to start");
+        *keep = 0;
+        goto out;
+    }
+
+    kr = mach_port_extract_right(task->port, shared->wake,
+                                 MACH_MSG_TYPE_MAKE_SEND, &agent->wake,
+                                 &type);
+    if (kr != KERN_SUCCESS) {
+        snprintf(error, error_size, "couldn't get the agent's wake port: %s",
+                 mach_error_string(kr));
+        goto out;
+    }
+
+    r = 0;
+
+ out:
+    mach_vm_deallocate(task->port, stack, AGENT_STACK);
+    return r;
+}
+
+/*
+ * Load the agent into the task. Reads through Memory then go to it while
+ * it's running, and walkList(), gather() and Memory.search() run inside the
+ * task. The agent's thread spins briefly after each request and then
+ * sleeps until woken, at the cost of one message. It can't serve a frozen
+ * task, which is read as usual; a task paused by other means makes
+ * requests time out, and the agent isn't used until it catches up.
+ * 64-bit tasks only; tasks that only load signed libraries refuse it
+ *
+ * Arguments: path - the agent library (mdb.task.AGENT_PATH)
+ *            timeout - seconds to wait for it to start, default = 5
+ * Returns:   None
+ */
+PyObject *
+kern_Task_loadAgent (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_return_t kr;
+    struct kern_agent *agent;
+    kern_agent_shared *shared;
+    mach_vm_address_t local;
+    const char *path;
+    char resolved[PATH_MAX], error[512];
+    double timeout = 5.0;
+    void *create, *load, *sym, *err;
+    int r, keep;
+
+    static char *kwlist[] = {"path", "timeout", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|d", kwlist, &path,
+                                      &timeout))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (self->ops != &kern_task_mach_ops) {
+        PyErr_SetString(kern_Error, "agents run in live tasks only");
+        return NULL;
+    }
+
+    if (self->agent != NULL) {
+        PyErr_SetString(kern_Error, "an agent is already loaded");
+        return NULL;
+    }
+
+    if (self->frozen) {
+        PyErr_SetNone(kern_AlreadyPausedError);
+        return NULL;
+    }
+
+    if (sizeof(void *) != 8 || ! kern_task_is64(self)) {
+        PyErr_SetString(kern_Error, "agents run in 64-bit tasks only");
+        return NULL;
+    }
+
+    /* The task resolves relative paths against its own directory */
+    if (realpath(path, resolved) == NULL)
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char *) path);
+    if (strlen(resolved) >= sizeof(((kern_agent_boot *) 0)->path)) {
+        PyErr_SetString(PyExc_ValueError, "path too long");
+        return NULL;
+    }
+
+    create = dlsym(RTLD_DEFAULT, "pthread_create_from_mach_thread");
+    load = dlsym(RTLD_DEFAULT, "dlopen");
+    sym = dlsym(RTLD_DEFAULT, "dlsym");
+    err = dlsym(RTLD_DEFAULT, "dlerror");
+    if (create == NULL || load == NULL || sym == NULL || err == NULL) {
+        PyErr_SetString(kern_Error, "pthread_create_from_mach_thread or "
+                        "dlopen missing");
+        return NULL;
+    }
+
+    if (! kern_agent_same(self, create) || ! kern_agent_same(self, load) ||
+        ! kern_agent_same(self, sym) || ! kern_agent_same(self, err)) {
+        PyErr_SetString(kern_Error, "the task doesn't share our system "
+                        "libraries");
+        return NULL;
+    }
+
+    agent = calloc(1, sizeof(struct kern_agent));
+    if (agent == NULL)
+        return PyErr_NoMemory();
+
+    kr = kern_shared_alloc(self, KERN_AGENT_SIZE, &local, &agent->remote);
+    if (kr != KERN_SUCCESS) {
+        free(agent);
+        KERN_ERROR(kr);
+    }
+
+    shared = agent->shared = (kern_agent_shared *) (uintptr_t) local;
+    shared->magic = KERN_AGENT_MAGIC;
+    shared->version = KERN_AGENT_VERSION;
+    shared->state = _KERN_AGENT_LOADING;
+    shared->size = KERN_AGENT_SIZE;
+    shared->data = KERN_AGENT_DATA;
+
+    shared->boot.create = (uint64_t) (uintptr_t) create;
+    shared->boot.dlopen = (uint64_t) (uintptr_t) load;
+    shared->boot.dlsym = (uint64_t) (uintptr_t) sym;
+    shared->boot.dlerror = (uint64_t) (uintptr_t) err;
+    shared->boot.shared = agent->remote;
+    shared->boot.status = -1;
+    strcpy(shared->boot.symbol, KERN_AGENT_SYMBOL);
+    strcpy(shared->boot.path, resolved);
+
+    Py_BEGIN_ALLOW_THREADS
+    r = kern_agent_start(self, agent, timeout, error, sizeof(error), &keep);
+    Py_END_ALLOW_THREADS
+
+    if (r < 0) {
+        mach_vm_deallocate(mach_task_self(), local, KERN_AGENT_SIZE);
+        if (! keep)
+            mach_vm_deallocate(self->port, agent->remote, KERN_AGENT_SIZE);
+        free(agent);
+        PyErr_SetString(kern_Error, error);
+        return NULL;
+    }
+
+    pthread_mutex_init(&agent->lock, NULL);
+    pthread_rwlock_wrlock(&self->agent_lock);
+    self->agent = agent;
+    pthread_rwlock_unlock(&self->agent_lock);
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Stop the agent. Its library stays loaded in the task
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+PyObject *
+kern_Task_unloadAgent (kern_TaskObj *self)
+{
+    if (self->agent == NULL) {
+        PyErr_SetString(kern_Error, "no agent loaded");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    kern_agent_free(self);
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+/* Append (address, data) for a node to the list */
+static int
+kern_walk_append (PyObject *list, uint64_t address, const void *data,
+                  size_t size)
+{
+    PyObject *node;
+    int r;
+
+    node = Py_BuildValue("(Ks#)", (unsigned long long) address, data,
+                         (int) size);
+    if (node == NULL)
+        return -1;
+
+    r = PyList_Append(list, node);
+    Py_DECREF(node);
+
+    return r;
+}
+
+/*
+ * Follow a linked list, reading each node. With an agent loaded the whole
+ * walk takes a request per window of nodes rather than two reads a node
+ *
+ * Arguments: address - first node
+ *            nextOffset - offset of the next pointer within a node
+ *            size - bytes of each node to return, default = 0
+ *            limit - most nodes, default = 65536
+ * Returns:   List of (address, data), ending at a NULL next pointer, the
+ *            first node again, the limit or a node that can't be read
+ */
+PyObject *
+kern_Task_walkList (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    struct kern_agent *agent;
+    kern_agent_request *req;
+    PyObject *list;
+    uint64_t node, next_offset, size = 0, limit = 65536, head, i, n, stride;
+    uint8_t *window, *data, next[8];
+    mach_vm_size_t out_size;
+
+    static char *kwlist[] = {"address", "nextOffset", "size", "limit", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "KK|KK", kwlist, &node,
+                                      &next_offset, &size, &limit))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (size > KERN_AGENT_WINDOW / 2) {
+        PyErr_SetString(PyExc_ValueError, "size too large");
+        return NULL;
+    }
+
+    if ((list = PyList_New(0)) == NULL)
+        return NULL;
+
+    head = node;
+
+    if ((agent = kern_agent_acquire(self)) != NULL) {
+        /* Nodes after the head address, as many as the window holds */
+        stride = 8 + KERN_AGENT_OUT(size);
+        while (kern_agent_usable(self, agent) && node != 0 &&
+               (uint64_t) PyList_GET_SIZE(list) < limit) {
+            req = kern_agent_slot(agent, &window);
+            memcpy(window, &head, 8);
+            req->op = _KERN_AGENT_WALK;
+            req->address = node;
+            req->size = size;
+            req->arg[0] = next_offset;
+            req->arg[1] = limit - (uint64_t) PyList_GET_SIZE(list);
+            req->in_size = 8;
+
+            if (kern_agent_call(agent, req) == KERN_OPERATION_TIMED_OUT)
+                break;
+
+            data = window + 8;
+            n = MIN(req->count, (KERN_AGENT_WINDOW - 8) / stride);
+            for (i = 0; i < n; ++i, data += stride) {
+                memcpy(&node, data, 8);
+                if (kern_walk_append(list, node, data + 8,
+                                     (size_t) size) < 0) {
+                    kern_agent_release(self, agent);
+                    Py_DECREF(list);
+                    return NULL;
+                }
+            }
+
+            /* Ended, one way or another, unless the window filled up */
+            node = req->next;
+            if (node == 0) {
+                kern_agent_release(self, agent);
+                return list;
+            }
+        }
+
+        kern_agent_release(self, agent);
+    }
+
+    /* Without the agent, or carrying on from where it left off */
+    data = malloc((size_t) size + 1);
+    if (data == NULL) {
+        Py_DECREF(list);
+        return PyErr_NoMemory();
+    }
+
+    while (node != 0 && (uint64_t) PyList_GET_SIZE(list) < limit) {
+        if ((size > 0 &&
+             (kern_task_read(self, node, size, data, &out_size) !=
+              KERN_SUCCESS || out_size != size)) ||
+            kern_task_read(self, node + next_offset, 8, next, &out_size) !=
+            KERN_SUCCESS || out_size != 8)
+            break;
+
+        if (kern_walk_append(list, node, data, (size_t) size) < 0) {
+            free(data);
+            Py_DECREF(list);
+            return NULL;
+        }
+
+        memcpy(&node, next, 8);
+        if (node == head)
+            break;
+    }
+
+    free(data);
+    return list;
+}
+
+/*
+ * Read size bytes at each of many addresses, e.g. the structs a pointer
+ * array refers to. With an agent loaded, a request covers as many as fit
+ * in its window
+ *
+ * Arguments: addresses - sequence of addresses
+ *            size - bytes to read at each
+ * Returns:   List of byte strings, None for those that couldn't be read
+ */
+PyObject *
+kern_Task_gather (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    struct kern_agent *agent;
+    kern_agent_request *req;
+    PyObject *seq, *list = NULL, *item;
+    uint64_t size, *addresses = NULL, batch, i, j, n;
+    uint8_t *window, *data = NULL, *out;
+    mach_vm_size_t out_size;
+    Py_ssize_t count;
+
+    static char *kwlist[] = {"addresses", "size", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "OK", kwlist, &seq, &size))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (size == 0 || size > KERN_AGENT_WINDOW / 2) {
+        PyErr_SetString(PyExc_ValueError, "size out of range");
+        return NULL;
+    }
+
+    seq = PySequence_Fast(seq, "addresses must be a sequence");
+    if (seq == NULL)
+        return NULL;
+
+    count = PySequence_Fast_GET_SIZE(seq);
+    addresses = malloc((size_t) count * 8 + 1);
+    data = malloc((size_t) size + 1);
+    if (addresses == NULL || data == NULL) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    for (i = 0; i < (uint64_t) count; ++i) {
+        addresses[i] = PyInt_AsUnsignedLongLongMask(
+                           PySequence_Fast_GET_ITEM(seq, (Py_ssize_t) i));
+        if (PyErr_Occurred())
+            goto out;
+    }
+
+    if ((list = PyList_New(count)) == NULL)
+        goto out;
+
+    i = 0;
+    if ((agent = kern_agent_acquire(self)) != NULL) {
+        /* Addresses in, then a result and a valid byte for each */
+        batch = (KERN_AGENT_WINDOW - 8) / (8 + size + 1);
+        while (i < (uint64_t) count && kern_agent_usable(self, agent)) {
+            n = MIN(batch, (uint64_t) count - i);
+            req = kern_agent_slot(agent, &window);
+            memcpy(window, addresses + i, (size_t) n * 8);
+            req->op = _KERN_AGENT_GATHER;
+            req->size = size;
+            req->in_size = n * 8;
+
+            if (kern_agent_call(agent, req) != KERN_SUCCESS)
+                break;
+
+            out = window + KERN_AGENT_OUT(n * 8);
+            for (j = 0; j < n; ++j, out += size + 1) {
+                if (out[size])
+                    item = PyString_FromStringAndSize((const char *) out,
+                                                      (Py_ssize_t) size);
+                else {
+                    Py_INCREF(Py_None);
+                    item = Py_None;
+                }
+                if (item == NULL) {
+                    kern_agent_release(self, agent);
+                    Py_CLEAR(list);
+                    goto out;
+                }
+                PyList_SET_ITEM(list, (Py_ssize_t) (i + j), item);
+            }
+            i += n;
+        }
+
+        kern_agent_release(self, agent);
+    }
+
+    for (; i < (uint64_t) count; ++i) {
+        if (kern_task_read(self, addresses[i], size, data, &out_size) ==
+            KERN_SUCCESS && out_size == size)
+            item = PyString_FromStringAndSize((const char *) data,
+                                              (Py_ssize_t) size);
+        else {
+            Py_INCREF(Py_None);
+            item = Py_None;
+        }
+        if (item == NULL) {
+            Py_CLEAR(list);
+            goto out;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t) i, item);
+    }
+
+ out:
+    free(addresses);
+    free(data);
+    Py_DECREF(seq);
+
+    return list;
+}
+
+/*
+ * Search [lo, hi) a region at a time without the agent, skipping pages
+ * that can't be read and the agent's own area
+ *
+ * Returns: 0, or -1 if out of memory
+ */
+static int
+kern_search_read (kern_TaskObj *task, mach_vm_address_t lo,
+                  mach_vm_address_t hi, const uint8_t *needle, size_t len,
+                  uint64_t limit, kern_regex_hits *hits)
+{
+    kern_region region;
+    mach_vm_address_t start, end, skip_lo = 0, skip_hi = 0, address;
+    mach_vm_size_t size;
+    uint8_t *buf, *valid;
+    const uint8_t *p;
+    size_t first, last, k;
+
+    pthread_rwlock_rdlock(&task->agent_lock);
+    if (task->agent != NULL) {
+        skip_lo = task->agent->remote;
+        skip_hi = skip_lo + KERN_AGENT_SIZE;
+    }
+    pthread_rwlock_unlock(&task->agent_lock);
+
+    buf = malloc(SEARCH_CHUNK + len);
+    valid = malloc(KERN_MEMORY_VALID_SIZE(0, SEARCH_CHUNK + len) + 2);
+    if (buf == NULL || valid == NULL) {
+        free(buf);
+        free(valid);
+        return -1;
+    }
+
+    region.address = lo;
+    while (region.address < hi && kern_task_region(task, &region) ==
+           KERN_SUCCESS && region.address < hi) {
+        start = MAX(region.address, lo);
+        end = region.address + region.size < hi ?
+              region.address + region.size : hi;
+        region.address += region.size;
+
+        if (! (region.info.protection & VM_PROT_READ) ||
+            (start < skip_hi && end > skip_lo))
+            continue;
+
+        /* Chunks overlap by len - 1 so matches across them are found */
+        for (address = start; address + len <= end;
+             address += SEARCH_CHUNK) {
+            size = MIN(end - address, SEARCH_CHUNK + len - 1);
+            kern_memory_read_partial(task, address, size, buf, valid);
+
+            for (p = buf; (size_t) (buf + size - p) >= len; ++p) {
+                p = memmem(p, (size_t) (buf + size - p), needle, len);
+                if (p == NULL || (mach_vm_size_t) (p - buf) >= SEARCH_CHUNK)
+                    break;
+
+                /* Not in zeros standing in for pages that weren't read */
+                first = (size_t) ((KERN_TRUNC_PAGE(address + (p - buf)) -
+                                   KERN_TRUNC_PAGE(address)) / vm_page_size);
+                last = (size_t) ((KERN_TRUNC_PAGE(address + (p - buf) + len -
+                                                  1) -
+                                  KERN_TRUNC_PAGE(address)) / vm_page_size);
+                for (k = first; k <= last; ++k)
+                    if (! (valid[k >> 3] & (1 << (k & 7))))
+                        break;
+                if (k <= last)
+                    continue;
+
+                if (kern_regex_hit(hits, address + (p - buf), len) != 0) {
+                    free(buf);
+                    free(valid);
+                    return -1;
+                }
+                if (limit && hits->count == limit)
+                    goto out;
+            }
+        }
+
+        if (region.address == 0)
+            break;
+    }
+
+ out:
+    free(buf);
+    free(valid);
+    return 0;
+}
+
+/*
+ * Search through the agent, a request per window of hits
+ *
+ * Returns: 1 if done, 0 to carry on without it from *lo (e.g. with no agent
+ *          loaded), -1 if out of memory
+ */
+static int
+kern_search_agent (kern_TaskObj *task, mach_vm_address_t *lo,
+                   mach_vm_address_t hi, const uint8_t *needle, size_t len,
+                   uint64_t limit, kern_regex_hits *hits)
+{
+    struct kern_agent *agent;
+    kern_agent_request *req;
+    uint8_t *window;
+    uint64_t i, n, address;
+    int r = 0;
+
+    if ((agent = kern_agent_acquire(task)) == NULL)
+        return 0;
+
+    while (kern_agent_usable(task, agent)) {
+        req = kern_agent_slot(agent, &window);
+        memcpy(window, needle, len);
+        req->op = _KERN_AGENT_SEARCH;
+        req->address = *lo;
+        req->size = hi - *lo;
+        req->in_size = len;
+        req->arg[0] = limit ? limit - hits->count : 0;
+
+        if (kern_agent_call(agent, req) != KERN_SUCCESS)
+            break;
+
+        n = MIN(req->count, (KERN_AGENT_WINDOW - KERN_AGENT_OUT(len)) / 8);
+        for (i = 0; i < n; ++i) {
+            memcpy(&address, window + KERN_AGENT_OUT(len) + i * 8, 8);
+            if (kern_regex_hit(hits, address, len) != 0) {
+                r = -1;
+                goto out;
+            }
+        }
+
+        if (req->next == 0 || req->next >= hi ||
+            (limit && hits->count >= limit)) {
+            r = 1;
+            break;
+        }
+        *lo = req->next;
+    }
+
+ out:
+    kern_agent_release(task, agent);
+    return r;
+}
+
+/*
+ * Find a byte string in the readable regions of the memory. With an agent
+ * loaded the search runs inside the task, and only the hits are copied
+ * out. Matches don't span regions
+ *
+ * Arguments: needle - byte string
+ *            limit - most hits, 0 for all, default = 0
+ * Returns:   Array of addresses, ascending
+ */
+PyObject *
+kern_Memory_search (kern_MemoryObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_TaskObj *task = (kern_TaskObj *) self->task;
+    kern_regex_hits hits;
+    mach_vm_address_t lo = self->address, hi;
+    unsigned long long limit = 0;
+    const char *needle;
+    PyObject *ret;
+    int len, r = 0;
+
+    static char *kwlist[] = {"needle", "limit", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "s#|K", kwlist, &needle,
+                                      &len, &limit))
+        return NULL;
+
+    if (! task->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (len == 0 || len > KERN_AGENT_WINDOW / 2) {
+        PyErr_SetString(PyExc_ValueError, "needle length out of range");
+        return NULL;
+    }
+
+    hi = self->address + self->size < self->address ? UINT64_MAX :
+         self->address + self->size;
+    memset(&hits, 0, sizeof(hits));
+
+    Py_BEGIN_ALLOW_THREADS
+    r = kern_search_agent(task, &lo, hi, (const uint8_t *) needle,
+                          (size_t) len, limit, &hits);
+    if (r == 0)
+        r = kern_search_read(task, lo, hi, (const uint8_t *) needle,
+                             (size_t) len, limit, &hits);
+    Py_END_ALLOW_THREADS
+
+    if (r < 0 || hits.nomem) {
+        free(hits.address);
+        free(hits.length);
+        return PyErr_NoMemory();
+    }
+
+    ret = kern_array_new("L", hits.address, hits.count * 8);
+
+    free(hits.address);
+    free(hits.length);
+
+    return ret;
+}
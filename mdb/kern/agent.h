@@ -0,0 +1,67 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_AGENT_H
+#define _KERN_AGENT_H
+
+#include <pthread.h>
+
+#include <mach/mach_types.h>
+
+#include "structmember.h"
+
+#include "task.h"
+#include "memory.h"
+#include "shared.h"
+
+/* A loaded agent, as seen from the debugger */
+struct kern_agent {
+    kern_agent_shared *shared;  /* mapped here */
+    mach_vm_address_t remote;   /* and in the task */
+    mach_port_t wake;           /* send right to the agent's wake port */
+    uint64_t posted;            /* head, as the debugger last set it */
+    char stalled;               /* a request timed out; not used until the
+                                   agent catches up */
+    pthread_mutex_t lock;       /* one producer at a time */
+};
+
+kern_return_t kern_agent_read (kern_TaskObj *task, mach_vm_address_t address,
+                               mach_vm_size_t size, void *buf,
+                               mach_vm_size_t *out_size);
+
+void kern_agent_free (kern_TaskObj *task);
+
+PyObject *kern_Task_loadAgent (kern_TaskObj *self, PyObject *args,
+                               PyObject *kwds);
+PyObject *kern_Task_unloadAgent (kern_TaskObj *self);
+PyObject *kern_Task_walkList (kern_TaskObj *self, PyObject *args,
+                              PyObject *kwds);
+PyObject *kern_Task_gather (kern_TaskObj *self, PyObject *args,
+                            PyObject *kwds);
+PyObject *kern_Memory_search (kern_MemoryObj *self, PyObject *args,
+                              PyObject *kwds);
+
+#endif
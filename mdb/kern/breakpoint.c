@@ -0,0 +1,270 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+
+#include "util.h"
+#include "kern.h"
+#include "task.h"
+#include "x86.h"
+#include "scratch.h"
+#include "breakpoint.h"
+#include "hook.h"
+
+/*
+ * int3 breakpoints with displaced stepping.
+ *
+ * When a breakpoint is set, the instruction under it is relocated into a
+ * scratch slot that ends with a jump back to the following instruction. A
+ * thread resumed at a breakpoint is sent through the slot instead, so the
+ * int3 is never lifted: other threads keep running past it safely, and each
+ * hit costs a single stop.
+ */
+
+static size_t
+kern_breakpoint_find (struct kern_breakpoints *bps,
+                      mach_vm_address_t address)
+{
+    size_t lo = 0, hi = bps->count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (bps->items[mid].address < address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Slot to resume a thread stopped at address in, or 0 */
+mach_vm_address_t
+kern_breakpoint_slot (kern_TaskObj *task, mach_vm_address_t address)
+{
+    struct kern_breakpoints *bps = task->breakpoints;
+    size_t i;
+
+    if (bps == NULL || bps->count == 0)
+        return 0;
+
+    i = kern_breakpoint_find(bps, address);
+    if (i < bps->count && bps->items[i].address == address)
+        return bps->items[i].slot;
+
+    return 0;
+}
+
+void
+kern_breakpoints_free (kern_TaskObj *task)
+{
+    if (task->breakpoints == NULL)
+        return;
+
+    free(task->breakpoints->items);
+    free(task->breakpoints);
+    task->breakpoints = NULL;
+}
+
+/*
+ * Set a breakpoint
+ *
+ * Arguments: address - address of the first byte of an instruction
+ * Returns:   Address of the displaced copy of the instruction
+ */
+PyObject *
+kern_Task_setBreakpoint (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_return_t kr;
+    struct kern_breakpoints *bps;
+    kern_breakpoint *items;
+    kern_x86_insn insn;
+    mach_vm_address_t address, slot;
+    mach_vm_size_t out_size;
+    uint8_t code[_KERN_X86_MAX_LENGTH], relocated[_KERN_X86_RELOCATED_MAX];
+    uint8_t int3 = 0xcc;
+    size_t i, capacity;
+    int mode64, n;
+
+    static char *kwlist[] = {"address", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "K", kwlist, &address))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if ((slot = kern_breakpoint_slot(self, address)))
+        return PyLong_FromUnsignedLongLong(slot);
+
+    if (kern_hook_overlaps(self, address, 1)) {
+        PyErr_Format(kern_Error, "0x%llx is hooked",
+                     (unsigned long long) address);
+        return NULL;
+    }
+
+    if (self->breakpoints == NULL) {
+        self->breakpoints = calloc(1, sizeof(struct kern_breakpoints));
+        if (self->breakpoints == NULL)
+            return PyErr_NoMemory();
+    }
+    bps = self->breakpoints;
+
+    /* The instruction may end close to the end of its region */
+    kr = kern_task_read(self, address, sizeof(code), code, &out_size);
+    if (kr != KERN_SUCCESS)
+        kr = kern_task_read(self, address, vm_page_size -
+                            (address & (vm_page_size - 1)), code, &out_size);
+    CHECK_KR(kr);
+
+    mode64 = kern_task_is64(self);
+
+    if (kern_x86_decode(code, (size_t) out_size, mode64, &insn) < 0) {
+        PyErr_Format(kern_Error, "can't decode instruction at 0x%llx",
+                     (unsigned long long) address);
+        return NULL;
+    }
+
+    kr = kern_scratch_alloc(self, mode64 ? address : 0, sizeof(relocated),
+                            &slot);
+    CHECK_KR(kr);
+
+    n = kern_x86_relocate(code, &insn, mode64, address, slot, relocated);
+    if (n < 0) {
+        PyErr_Format(kern_Error, "can't displace instruction at 0x%llx",
+                     (unsigned long long) address);
+        return NULL;
+    }
+
+    if (bps->count == bps->capacity) {
+        capacity = bps->capacity ? bps->capacity * 2 : 16;
+        items = realloc(bps->items, capacity * sizeof(kern_breakpoint));
+        if (items == NULL)
+            return PyErr_NoMemory();
+        bps->items = items;
+        bps->capacity = capacity;
+    }
+
+    /* The slot must be in place before any thread can hit the int3 */
+    kr = kern_scratch_write(self, slot, relocated, (mach_vm_size_t) n);
+    CHECK_KR(kr);
+
+    kr = kern_code_write(self, address, &int3, 1);
+    CHECK_KR(kr);
+
+    i = kern_breakpoint_find(bps, address);
+    memmove(&bps->items[i + 1], &bps->items[i],
+            (bps->count - i) * sizeof(kern_breakpoint));
+    bps->items[i].address = address;
+    bps->items[i].slot = slot;
+    bps->items[i].original = code[0];
+    bps->count++;
+
+    return PyLong_FromUnsignedLongLong(slot);
+}
+
+/*
+ * Remove a breakpoint. Its slot stays valid for threads already in it
+ *
+ * Arguments: address - breakpoint address
+ * Returns:   None
+ */
+PyObject *
+kern_Task_clearBreakpoint (kern_TaskObj *self, PyObject *args,
+                           PyObject *kwds)
+{
+    kern_return_t kr;
+    struct kern_breakpoints *bps = self->breakpoints;
+    mach_vm_address_t address;
+    size_t i;
+
+    static char *kwlist[] = {"address", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "K", kwlist, &address))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (! kern_breakpoint_slot(self, address)) {
+        PyErr_Format(PyExc_KeyError, "no breakpoint at 0x%llx",
+                     (unsigned long long) address);
+        return NULL;
+    }
+
+    i = kern_breakpoint_find(bps, address);
+    kr = kern_code_write(self, address, &bps->items[i].original, 1);
+    CHECK_KR(kr);
+
+    memmove(&bps->items[i], &bps->items[i + 1],
+            (bps->count - i - 1) * sizeof(kern_breakpoint));
+    bps->count--;
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Get the task's breakpoints
+ *
+ * Arguments: None
+ * Returns:   Dictionary of breakpoint address to displaced slot address
+ */
+PyObject *
+kern_Task_getBreakpoints (kern_TaskObj *self)
+{
+    PyObject *result, *key, *value;
+    size_t i;
+
+    result = PyDict_New();
+    if (result == NULL || self->breakpoints == NULL)
+        return result;
+
+    for (i = 0; i < self->breakpoints->count; ++i) {
+        key = PyLong_FromUnsignedLongLong(self->breakpoints->items[i].address);
+        value = PyLong_FromUnsignedLongLong(self->breakpoints->items[i].slot);
+        if (key == NULL || value == NULL ||
+            PyDict_SetItem(result, key, value) < 0) {
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(key);
+        Py_DECREF(value);
+    }
+
+    return result;
+}
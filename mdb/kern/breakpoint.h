@@ -0,0 +1,60 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_BREAKPOINT_H
+#define _KERN_BREAKPOINT_H
+
+#include <mach/mach_types.h>
+
+#include "task.h"
+
+typedef struct {
+    mach_vm_address_t address;
+    mach_vm_address_t slot;    /* displaced copy of the instruction */
+    uint8_t original;          /* byte under the int3 */
+} kern_breakpoint;
+
+/* Sorted by address */
+struct kern_breakpoints {
+    kern_breakpoint *items;
+    size_t count;
+    size_t capacity;
+};
+
+mach_vm_address_t kern_breakpoint_slot (kern_TaskObj *task,
+                                        mach_vm_address_t address);
+
+void kern_breakpoints_free (kern_TaskObj *task);
+
+PyObject *kern_Task_setBreakpoint (kern_TaskObj *self, PyObject *args,
+                                   PyObject *kwds);
+
+PyObject *kern_Task_clearBreakpoint (kern_TaskObj *self, PyObject *args,
+                                     PyObject *kwds);
+
+PyObject *kern_Task_getBreakpoints (kern_TaskObj *self);
+
+#endif
@@ -0,0 +1,433 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <string.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+
+#include "util.h"
+#include "kern.h"
+#include "task.h"
+#include "thread.h"
+#include "exception.h"
+#include "scratch.h"
+#include "call.h"
+
+/*
+ * Calls into the task, System V x86-64 ABI. A stopped thread is borrowed:
+ * its registers are saved, the arguments loaded and it's resumed at a
+ * trampoline kept in scratch memory for the life of the task:
+ *
+ *   call r11                           ; the function
+ *   int3                               ; back to us
+ *
+ * The call pushes its own return address, so unless arguments spill onto
+ * the stack a call writes nothing to the task: it's one resume and one
+ * stop. The stack used starts below the thread's red zone.
+ */
+
+static const uint8_t kern_call_code[] = {0x41, 0xff, 0xd3, 0xcc};
+
+#define CALL_TRAP       3       /* offset of the int3 */
+#define CALL_RED_ZONE   128
+#define CALL_MAX_ARGS   32
+#define CALL_RFLAGS_DF  0x400
+
+static kern_return_t
+kern_call_resume (kern_TaskObj *task, kern_ThreadObj *thread)
+{
+    kern_return_t kr;
+    uint64_t start;
+
+    start = kern_stats_now();
+    kr = thread_resume(thread->port);
+    kern_stats_record(&task->stats, _KERN_STAT_RESUME, thread->port, 0,
+                      start, kr);
+
+    return kr;
+}
+
+/*
+ * Wait for the thread to stop, setting aside other threads' events for
+ * poll()
+ *
+ * Returns: 1 when it stopped, 0 on timeout, -1 with an exception set
+ */
+static int
+kern_call_wait (kern_TaskObj *task, kern_ThreadObj *thread, double timeout,
+                exception_type_t *type)
+{
+    kern_exc_event event;
+    PyObject *other;
+    uint64_t deadline;
+    int ret;
+
+    deadline = kern_stats_now() + (uint64_t) (timeout * 1e9);
+
+    while (1) {
+        ret = kern_task_wait(task, 100, &event);
+        if (ret < 0) {
+            PyErr_SetString(kern_Error, "exception wait failed");
+            return -1;
+        }
+
+        if (ret > 0 && event.thread == thread->port) {
+            /* We hold a right to the thread already */
+            mach_port_deallocate(mach_task_self(), event.thread);
+            *type = event.type;
+            return 1;
+        }
+
+        if (ret > 0) {
+            if (task->pending == NULL &&
+                (task->pending = PyList_New(0)) == NULL)
+                return -1;
+            other = kern_task_event(task, &event);
+            if (other == NULL || PyList_Append(task->pending, other) < 0) {
+                Py_XDECREF(other);
+                return -1;
+            }
+            Py_DECREF(other);
+        }
+
+        if (kern_stats_now() >= deadline)
+            return 0;
+    }
+}
+
+static PyObject *
+kern_call_result (const char *ret, uint64_t rax,
+                  const x86_float_state64_t *fstate)
+{
+    double d;
+    float f;
+
+    if (ret == NULL)
+        Py_RETURN_NONE;
+
+    switch (ret[0]) {
+    case 'l':
+        return PyLong_FromLongLong((long long) rax);
+    case 'L':
+        return PyLong_FromUnsignedLongLong(rax);
+    case 'i':
+        return PyInt_FromLong((long) (int32_t) rax);
+    case 'I':
+        return PyLong_FromUnsignedLong((unsigned long) (uint32_t) rax);
+    case 'd':
+        memcpy(&d, &fstate->__fpu_xmm0, sizeof(d));
+        return PyFloat_FromDouble(d);
+    default:
+        memcpy(&f, &fstate->__fpu_xmm0, sizeof(f));
+        return PyFloat_FromDouble((double) f);
+    }
+}
+
+/*
+ * Call a function in the task on one of its threads, which must be able to
+ * run: not while the task is frozen. The thread is paused for the call if
+ * it isn't already, and left as it was found. Other threads keep running;
+ * their events turn up in poll() afterwards. If the call doesn't return in
+ * time the thread is put back regardless, which may leave locks it took
+ * held. 64-bit tasks only
+ *
+ * Arguments: address - the function
+ *            args - sequence of ints and floats, default = (); floats are
+ *                   passed as doubles
+ *            ret - return type: 'l' or 'L' for a signed or unsigned 64-bit
+ *                  integer, 'i' or 'I' for 32-bit, 'd' or 'f' for double
+ *                  or float, None for none, default = 'L'
+ *            thread - the Thread to borrow, default = the task's first
+ *            timeout - seconds to wait for the call, default = 5
+ * Returns:   The function's result
+ */
+PyObject *
+kern_Task_call (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_return_t kr;
+    kern_ThreadObj *thread = NULL;
+    kern_multi_arch_tstate saved, state;
+    x86_float_state64_t fsaved, fstate;
+    mach_msg_type_number_t count;
+    mach_vm_address_t address, sp;
+    exception_type_t type = 0;
+    PyObject *call_args = NULL, *seq = NULL, *threads, *item, *r;
+    PyObject *result = NULL, *exc_type, *exc_value, *exc_tb;
+    const char *ret = "L";
+    uint64_t ints[6] = {0}, stack[CALL_MAX_ARGS];
+    double floats[8] = {0}, d;
+    Py_ssize_t i, n;
+    int nint = 0, nfloat = 0, nstack = 0, paused, done;
+    double timeout = 5.0;
+
+    static char *kwlist[] = {"address", "args", "ret", "thread", "timeout",
+                             NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "K|OzO!d", kwlist, &address,
+                                      &call_args, &ret, &kern_ThreadType,
+                                      &thread, &timeout))
+        return NULL;
+
+    if (ret != NULL && (strlen(ret) != 1 || ! strchr("lLiIdf", ret[0]))) {
+        PyErr_Format(PyExc_ValueError, "unknown return type '%s'", ret);
+        return NULL;
+    }
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (self->ops != &kern_task_mach_ops) {
+        PyErr_SetString(kern_Error, "calls run in live tasks only");
+        return NULL;
+    }
+
+    if (self->frozen) {
+        PyErr_SetNone(kern_AlreadyPausedError);
+        return NULL;
+    }
+
+    if (! kern_task_is64(self)) {
+        PyErr_SetString(kern_Error, "calls run in 64-bit tasks only");
+        return NULL;
+    }
+
+    /* Integers then floats in registers, in order, the rest on the stack */
+    if (call_args != NULL) {
+        seq = PySequence_Fast(call_args, "args must be a sequence");
+        if (seq == NULL)
+            return NULL;
+
+        n = PySequence_Fast_GET_SIZE(seq);
+        if (n > CALL_MAX_ARGS) {
+            Py_DECREF(seq);
+            PyErr_SetString(PyExc_ValueError, "too many arguments");
+            return NULL;
+        }
+
+        for (i = 0; i < n; ++i) {
+            item = PySequence_Fast_GET_ITEM(seq, i);
+
+            if (PyFloat_Check(item)) {
+                d = PyFloat_AS_DOUBLE(item);
+                if (nfloat < 8)
+                    floats[nfloat++] = d;
+                else
+                    memcpy(&stack[nstack++], &d, 8);
+            } else if (PyInt_Check(item) || PyLong_Check(item)) {
+                if (nint < 6)
+                    ints[nint++] = PyInt_AsUnsignedLongLongMask(item);
+                else
+                    stack[nstack++] = PyInt_AsUnsignedLongLongMask(item);
+            } else {
+                Py_DECREF(seq);
+                PyErr_Format(PyExc_TypeError, "argument %zd isn't an int or "
+                             "float", i);
+                return NULL;
+            }
+        }
+        Py_DECREF(seq);
+    }
+
+    if (self->trampoline == 0) {
+        kr = kern_scratch_alloc(self, 0, sizeof(kern_call_code),
+                                &self->trampoline);
+        if (kr == KERN_SUCCESS)
+            kr = kern_scratch_write(self, self->trampoline, kern_call_code,
+                                    sizeof(kern_call_code));
+        if (kr != KERN_SUCCESS) {
+            self->trampoline = 0;
+            KERN_ERROR(kr);
+        }
+    }
+
+    if (thread == NULL) {
+        threads = PyObject_CallMethod((PyObject *) self, "getThreads", NULL);
+        if (threads == NULL)
+            return NULL;
+        if (PyList_GET_SIZE(threads) == 0) {
+            Py_DECREF(threads);
+            PyErr_SetString(kern_Error, "the task has no threads");
+            return NULL;
+        }
+        thread = (kern_ThreadObj *) PyList_GET_ITEM(threads, 0);
+        Py_INCREF(thread);
+        Py_DECREF(threads);
+    } else {
+        Py_INCREF(thread);
+    }
+
+    paused = thread->paused;
+    if (! paused) {
+        r = PyObject_CallMethod((PyObject *) thread, "pause", NULL);
+        if (r == NULL) {
+            Py_DECREF(thread);
+            return NULL;
+        }
+        Py_DECREF(r);
+    }
+
+    /*
+     * A thread paused in a system call would finish it on top of the new
+     * state; abort it first, so the state saved is the restartable one
+     */
+    kr = thread_abort_safely(thread->port);
+    if (kr != KERN_SUCCESS) {
+        kern_handle_kr(kr);
+        goto out;
+    }
+
+    /* The callee may use any vector register, so those are put back too */
+    kr = kern_thread_state(thread, &saved);
+    count = x86_FLOAT_STATE64_COUNT;
+    if (kr == KERN_SUCCESS)
+        kr = thread_get_state(thread->port, x86_FLOAT_STATE64,
+                              (thread_state_t) &fsaved, &count);
+    if (kr != KERN_SUCCESS) {
+        kern_handle_kr(kr);
+        goto out;
+    }
+
+    if (thread->arch != _KERN_THREAD_ARCH_X86_64) {
+        PyErr_SetString(kern_Error, "not a 64-bit thread");
+        goto out;
+    }
+
+    /* Stack arguments start 16 byte aligned, below the red zone */
+    sp = saved.state64.__rsp - CALL_RED_ZONE - nstack * 8;
+    sp &= ~(mach_vm_address_t) 15;
+    if (nstack > 0) {
+        kr = kern_task_write(self, sp, stack, nstack * 8);
+        if (kr != KERN_SUCCESS) {
+            kern_handle_kr(kr);
+            goto out;
+        }
+    }
+
+    state = saved;
+    state.state64.__rip = self->trampoline;
+    state.state64.__rsp = sp;
+    state.state64.__r11 = address;
+    state.state64.__rdi = ints[0];
+    state.state64.__rsi = ints[1];
+    state.state64.__rdx = ints[2];
+    state.state64.__rcx = ints[3];
+    state.state64.__r8 = ints[4];
+    state.state64.__r9 = ints[5];
+    state.state64.__rax = (uint64_t) nfloat;    /* al, for varargs */
+    state.state64.__rflags &= ~(uint64_t) CALL_RFLAGS_DF;
+
+    fstate = fsaved;
+    memcpy(&fstate.__fpu_xmm0, &floats[0], 8);
+    memcpy(&fstate.__fpu_xmm1, &floats[1], 8);
+    memcpy(&fstate.__fpu_xmm2, &floats[2], 8);
+    memcpy(&fstate.__fpu_xmm3, &floats[3], 8);
+    memcpy(&fstate.__fpu_xmm4, &floats[4], 8);
+    memcpy(&fstate.__fpu_xmm5, &floats[5], 8);
+    memcpy(&fstate.__fpu_xmm6, &floats[6], 8);
+    memcpy(&fstate.__fpu_xmm7, &floats[7], 8);
+
+    kr = kern_thread_set_state(thread, &state);
+    if (kr == KERN_SUCCESS && nfloat > 0)
+        kr = thread_set_state(thread->port, x86_FLOAT_STATE64,
+                              (thread_state_t) &fstate,
+                              x86_FLOAT_STATE64_COUNT);
+    if (kr == KERN_SUCCESS)
+        kr = kern_call_resume(self, thread);
+    if (kr != KERN_SUCCESS) {
+        kern_handle_kr(kr);
+        goto restore;
+    }
+
+    done = kern_call_wait(self, thread, timeout, &type);
+
+    /* Stopped by the exception handler, or still running, maybe blocked */
+    if (done <= 0 && (thread_suspend(thread->port) != KERN_SUCCESS ||
+                      thread_abort_safely(thread->port) != KERN_SUCCESS)) {
+        if (! PyErr_Occurred())
+            PyErr_SetString(kern_Error, "can't stop the thread");
+        goto out;
+    }
+    if (done < 0)
+        goto restore;
+
+    kr = kern_thread_state(thread, &state);
+    count = x86_FLOAT_STATE64_COUNT;
+    if (kr == KERN_SUCCESS)
+        kr = thread_get_state(thread->port, x86_FLOAT_STATE64,
+                              (thread_state_t) &fstate, &count);
+    if (kr != KERN_SUCCESS) {
+        kern_handle_kr(kr);
+        goto restore;
+    }
+
+    if (done == 0)
+        PyErr_Format(kern_Error, "call to 0x%llx timed out at 0x%llx",
+                     (unsigned long long) address,
+                     (unsigned long long) state.state64.__rip);
+    else if (type != EXC_BREAKPOINT ||
+             state.state64.__rip != self->trampoline + CALL_TRAP + 1)
+        PyErr_Format(kern_Error, "call to 0x%llx stopped by %s at 0x%llx",
+                     (unsigned long long) address, kern_exc_string(type),
+                     (unsigned long long) state.state64.__rip);
+    else
+        result = kern_call_result(ret, state.state64.__rax, &fstate);
+
+ restore:
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    kr = kern_thread_set_state(thread, &saved);
+    if (kr == KERN_SUCCESS)
+        kr = thread_set_state(thread->port, x86_FLOAT_STATE64,
+                              (thread_state_t) &fsaved,
+                              x86_FLOAT_STATE64_COUNT);
+    if (exc_type != NULL) {
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+    } else if (kr != KERN_SUCCESS) {
+        Py_CLEAR(result);
+        kern_handle_kr(kr);
+    }
+
+ out:
+    if (! paused) {
+        PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+        r = PyObject_CallMethod((PyObject *) thread, "resume", NULL);
+        Py_XDECREF(r);
+        if (r == NULL && exc_type == NULL) {
+            Py_CLEAR(result);
+        } else {
+            if (r == NULL)
+                PyErr_Clear();
+            PyErr_Restore(exc_type, exc_value, exc_tb);
+        }
+    }
+
+    Py_DECREF(thread);
+    return result;
+}
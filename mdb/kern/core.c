@@ -0,0 +1,931 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+
+#include "util.h"
+#include "kern.h"
+#include "memory.h"
+#include "core.h"
+
+
+/* Index of the first segment ending above address, or nsegments */
+size_t
+kern_core_find (kern_CoreTaskObj *core, uint64_t address)
+{
+    size_t lo = 0, hi = core->nsegments, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (core->segments[mid].vaddr + core->segments[mid].memsz <= address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static kern_return_t
+kern_core_read (kern_TaskObj *task, mach_vm_address_t address,
+                mach_vm_size_t size, void *buf, mach_vm_size_t *out_size)
+{
+    kern_CoreTaskObj *core = (kern_CoreTaskObj *) task;
+    kern_core_segment *seg;
+    unsigned char *out = buf;
+    uint64_t remaining = size, off, n, avail;
+    size_t i;
+
+    i = kern_core_find(core, address);
+
+    while (remaining > 0) {
+        if (i >= core->nsegments || core->segments[i].vaddr > address)
+            return KERN_INVALID_ADDRESS;
+
+        seg = &core->segments[i];
+        off = address - seg->vaddr;
+        n = seg->memsz - off;
+        if (n > remaining)
+            n = remaining;
+
+        /* Bytes past p_filesz weren't dumped and read as zero */
+        avail = off < seg->filesz ? seg->filesz - off : 0;
+        if (avail > n)
+            avail = n;
+
+        memcpy(out, core->map + seg->offset + off, (size_t) avail);
+        memset(out + avail, 0, (size_t) (n - avail));
+
+        out += n;
+        address += n;
+        remaining -= n;
+        i++;
+    }
+
+    *out_size = size;
+
+    return KERN_SUCCESS;
+}
+
+kern_return_t
+kern_core_write (kern_TaskObj *task, mach_vm_address_t address,
+                 const void *data, mach_vm_size_t size)
+{
+    return KERN_PROTECTION_FAILURE;
+}
+
+/* The NT_FILE entry containing address, if any */
+static kern_core_file *
+kern_core_file_of (kern_CoreTaskObj *core, uint64_t address)
+{
+    size_t i;
+
+    for (i = 0; i < core->nfiles; ++i)
+        if (core->files[i].start <= address && address < core->files[i].end)
+            return &core->files[i];
+
+    return NULL;
+}
+
+kern_return_t
+kern_core_region (kern_TaskObj *task, kern_region *region)
+{
+    kern_CoreTaskObj *core = (kern_CoreTaskObj *) task;
+    kern_core_file *file;
+    size_t i;
+
+    i = kern_core_find(core, region->address);
+    if (i >= core->nsegments)
+        return KERN_INVALID_ADDRESS;
+
+    memset(&region->info, 0, sizeof(region->info));
+    region->address = core->segments[i].vaddr;
+    region->size = core->segments[i].memsz;
+    region->info.protection = core->segments[i].protection;
+    region->info.max_protection = core->segments[i].protection;
+
+    file = kern_core_file_of(core, region->address);
+    if (file != NULL)
+        region->info.offset = file->offset + (region->address - file->start);
+
+    return KERN_SUCCESS;
+}
+
+size_t
+kern_core_path (kern_TaskObj *task, mach_vm_address_t address,
+                char *buf, size_t size)
+{
+    kern_core_file *file;
+    size_t len;
+
+    file = kern_core_file_of((kern_CoreTaskObj *) task, address);
+    if (file == NULL)
+        return 0;
+
+    len = strlen(file->path);
+    if (len >= size)
+        return 0;
+
+    memcpy(buf, file->path, len + 1);
+    return len;
+}
+
+static Py_ssize_t
+kern_core_direct (kern_TaskObj *task, mach_vm_address_t address,
+                  mach_vm_size_t size)
+{
+    kern_CoreTaskObj *core = (kern_CoreTaskObj *) task;
+    kern_core_segment *seg;
+    size_t i;
+
+    i = kern_core_find(core, address);
+    if (i >= core->nsegments)
+        return -1;
+
+    seg = &core->segments[i];
+    if (seg->vaddr > address || address + size > seg->vaddr + seg->filesz)
+        return -1;
+
+    return (Py_ssize_t) (seg->offset + (address - seg->vaddr));
+}
+
+/* Only the pages the core holds count as resident, not those past p_filesz */
+kern_return_t
+kern_core_residency (kern_TaskObj *task, mach_vm_address_t address,
+                     mach_vm_size_t size, uint8_t *present, size_t first)
+{
+    kern_CoreTaskObj *core = (kern_CoreTaskObj *) task;
+    kern_core_segment *seg;
+    uint64_t end;
+    size_t i;
+
+    i = kern_core_find(core, address);
+    if (i >= core->nsegments || core->segments[i].vaddr > address)
+        return KERN_INVALID_ADDRESS;
+
+    seg = &core->segments[i];
+    end = seg->vaddr + seg->filesz;
+    for (; size > 0 && address < end; size -= vm_page_size,
+         address += vm_page_size, ++first)
+        present[first >> 3] |= (uint8_t) (1 << (first & 7));
+
+    return KERN_SUCCESS;
+}
+
+static const kern_task_ops kern_core_ops = {
+    kern_core_read,
+    kern_core_write,
+    kern_core_region,
+    kern_core_path,
+    kern_core_direct,
+    kern_core_residency,
+};
+
+int
+kern_core_segment_cmp (const void *a, const void *b)
+{
+    const kern_core_segment *x = a, *y = b;
+
+    return x->vaddr < y->vaddr ? -1 : x->vaddr > y->vaddr;
+}
+
+/* Drop what attach() parsed, so a failed attach can be retried */
+void
+kern_core_reset (kern_CoreTaskObj *core)
+{
+    if (core->map != NULL)
+        munmap(core->map, core->map_size);
+    core->map = NULL;
+    core->map_size = 0;
+
+    free(core->segments);
+    core->segments = NULL;
+    core->nsegments = 0;
+
+    free(core->files);
+    core->files = NULL;
+    core->nfiles = 0;
+
+    PyList_SetSlice(core->threads, 0, PyList_GET_SIZE(core->threads), NULL);
+}
+
+/* Drop the file and the objects holding the task, leaving it detached */
+void
+kern_core_close (kern_CoreTaskObj *core)
+{
+    PyObject *vm = core->task.vm;
+
+    kern_core_reset(core);
+
+    Py_INCREF(Py_None);
+    core->task.vm = Py_None;
+    Py_DECREF(vm);
+
+    core->task.attached = 0;
+    core->task.frozen = 0;
+}
+
+kern_CoreThreadObj *
+kern_core_thread_new (PyObject *task, int tid)
+{
+    kern_CoreThreadObj *thread;
+
+    thread = PyObject_New(kern_CoreThreadObj, &kern_CoreThreadType);
+    if (thread == NULL)
+        return NULL;
+
+    thread->thread.port = MACH_PORT_NULL;
+    thread->thread.arch = _KERN_THREAD_ARCH_X86_64;
+    thread->thread.paused = 1;
+    thread->thread.tid = (uint64_t) tid;
+    memset(&thread->state, 0, sizeof(thread->state));
+    memset(&thread->utime, 0, sizeof(thread->utime));
+    memset(&thread->stime, 0, sizeof(thread->stime));
+
+    Py_INCREF(task);
+    thread->thread.task = task;
+
+    return thread;
+}
+
+int
+kern_core_add_thread (kern_CoreTaskObj *core, kern_elf_prstatus64 *prs)
+{
+    kern_CoreThreadObj *thread;
+    x86_thread_state64_t *s;
+    int ret;
+
+    thread = kern_core_thread_new((PyObject *) core, prs->pr_pid);
+    if (thread == NULL)
+        return -1;
+
+    s = &thread->state.state64;
+#define R(mach, elf) s->__##mach = prs->pr_reg.elf
+    R(rax, rax); R(rbx, rbx); R(rcx, rcx); R(rdx, rdx);
+    R(rdi, rdi); R(rsi, rsi); R(rbp, rbp); R(rsp, rsp);
+    R(r8, r8); R(r9, r9); R(r10, r10); R(r11, r11);
+    R(r12, r12); R(r13, r13); R(r14, r14); R(r15, r15);
+    R(rip, rip); R(rflags, eflags); R(cs, cs); R(fs, fs); R(gs, gs);
+#undef R
+
+    thread->utime = prs->pr_utime;
+    thread->stime = prs->pr_stime;
+
+    if (PyList_GET_SIZE(core->threads) == 0) {
+        core->task.pid = prs->pr_pid;
+        core->utime = prs->pr_utime;
+        core->stime = prs->pr_stime;
+    }
+
+    ret = PyList_Append(core->threads, (PyObject *) thread);
+    Py_DECREF(thread);
+
+    return ret;
+}
+
+/*
+ * NT_FILE: count, page size, count (start, end, page offset) triples, then
+ * count NUL-terminated paths
+ */
+static int
+kern_core_add_files (kern_CoreTaskObj *core, uint64_t offset, uint64_t size)
+{
+    uint64_t *desc = (uint64_t *) (core->map + offset), count, page_size, i;
+    const char *path, *end = (const char *) core->map + offset + size;
+
+    if (size < 16 || core->files != NULL)
+        return 0;
+
+    count = desc[0];
+    page_size = desc[1];
+    if (count > (size - 16) / 24)
+        return 0;
+
+    core->files = calloc((size_t) count + 1, sizeof(kern_core_file));
+    if (core->files == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    path = (const char *) (desc + 2 + count * 3);
+    for (i = 0; i < count && path < end; ++i) {
+        core->files[i].start = desc[2 + i * 3];
+        core->files[i].end = desc[3 + i * 3];
+        core->files[i].offset = desc[4 + i * 3] * page_size;
+        core->files[i].path = path;
+
+        path = memchr(path, '\0', (size_t) (end - path));
+        if (path == NULL)
+            break;
+        path++;
+        core->nfiles++;
+    }
+
+    return 0;
+}
+
+static int
+kern_core_parse_notes (kern_CoreTaskObj *core, uint64_t offset, uint64_t size)
+{
+    Elf64_Nhdr *note;
+    uint64_t end, desc;
+
+    /* A truncated core loses the tail of its notes too */
+    if (size > core->map_size - offset)
+        size = core->map_size - offset;
+    end = offset + size;
+
+    while (offset + sizeof(Elf64_Nhdr) <= end) {
+        note = (Elf64_Nhdr *) (core->map + offset);
+        desc = offset + sizeof(Elf64_Nhdr) + ((note->n_namesz + 3) & ~3);
+
+        if (desc + note->n_descsz > end)
+            break;
+
+        if (note->n_type == NT_PRSTATUS &&
+            note->n_descsz >= sizeof(kern_elf_prstatus64)) {
+            if (kern_core_add_thread(core, (kern_elf_prstatus64 *)
+                                     (core->map + desc)) < 0)
+                return -1;
+        } else if (note->n_type == NT_FILE) {
+            if (kern_core_add_files(core, desc, note->n_descsz) < 0)
+                return -1;
+        }
+
+        offset = desc + ((note->n_descsz + 3) & ~3);
+    }
+
+    return 0;
+}
+
+static int
+kern_core_parse (kern_CoreTaskObj *core)
+{
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *) core->map;
+    Elf64_Phdr *phdr;
+    kern_core_segment *seg;
+    int i;
+
+    if (core->map_size < sizeof(Elf64_Ehdr) ||
+        memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+        ehdr->e_type != ET_CORE || ehdr->e_machine != EM_X86_64 ||
+        ehdr->e_phentsize != sizeof(Elf64_Phdr) ||
+        ehdr->e_phoff + (uint64_t) ehdr->e_phnum * sizeof(Elf64_Phdr)
+            > core->map_size) {
+        PyErr_SetString(kern_Error, "Not an x86-64 ELF core file");
+        return -1;
+    }
+
+    core->segments = calloc(ehdr->e_phnum + 1, sizeof(kern_core_segment));
+    if (core->segments == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    phdr = (Elf64_Phdr *) (core->map + ehdr->e_phoff);
+    for (i = 0; i < ehdr->e_phnum; ++i, ++phdr) {
+
+        if (phdr->p_type == PT_NOTE && phdr->p_offset <= core->map_size) {
+            if (kern_core_parse_notes(core, phdr->p_offset,
+                                      phdr->p_filesz) < 0)
+                return -1;
+
+        } else if (phdr->p_type == PT_LOAD && phdr->p_memsz > 0) {
+            seg = &core->segments[core->nsegments++];
+            seg->vaddr = phdr->p_vaddr;
+            seg->memsz = phdr->p_memsz;
+            seg->offset = phdr->p_offset;
+            seg->filesz = phdr->p_filesz;
+
+            /* A truncated core loses the tail of its segments */
+            if (seg->offset >= core->map_size)
+                seg->filesz = 0;
+            else if (seg->filesz > core->map_size - seg->offset)
+                seg->filesz = core->map_size - seg->offset;
+            if (seg->filesz > seg->memsz)
+                seg->filesz = seg->memsz;
+
+            seg->protection = ((phdr->p_flags & PF_R) ? VM_PROT_READ : 0) |
+                              ((phdr->p_flags & PF_W) ? VM_PROT_WRITE : 0) |
+                              ((phdr->p_flags & PF_X) ? VM_PROT_EXECUTE : 0);
+        }
+    }
+
+    qsort(core->segments, core->nsegments, sizeof(kern_core_segment),
+          kern_core_segment_cmp);
+
+    return 0;
+}
+
+/*
+ * Open and map the core file
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_CoreTask_attach (kern_CoreTaskObj *self)
+{
+    struct stat st;
+    PyObject *vm;
+    void *map;
+    int fd;
+
+    if (self->task.attached) {
+        PyErr_SetNone(kern_AlreadyAttachedError);
+        return NULL;
+    }
+
+    fd = open(PyString_AsString(self->path), O_RDONLY);
+    if (fd < 0)
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError,
+                                                    self->path);
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError,
+                                                    self->path);
+    }
+
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError,
+                                                    self->path);
+
+    self->map = map;
+    self->map_size = (size_t) st.st_size;
+
+    /* Reads are served straight from the page cache, front to back */
+    madvise(map, self->map_size, MADV_WILLNEED);
+
+    if (kern_core_parse(self) < 0) {
+        kern_core_reset(self);
+        return NULL;
+    }
+
+    vm = kern_memory_new((PyObject *) self, 0, UINT64_MAX);
+    if (vm == NULL) {
+        kern_core_reset(self);
+        return NULL;
+    }
+
+    Py_DECREF(self->task.vm);
+    self->task.vm = vm;
+
+    self->task.attached = 1;
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Unmap the core file and drop the task's vm and threads, which hold it.
+ * Closing twice does nothing; not to be called while another thread is
+ * using the task
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_CoreTask_close (kern_CoreTaskObj *self)
+{
+    kern_core_close(self);
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Get the threads saved in the core file
+ *
+ * Arguments: None
+ * Returns:   List of CoreThread objects
+ */
+static PyObject *
+kern_CoreTask_getThreads (kern_CoreTaskObj *self)
+{
+    if (! self->task.attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    return PyList_GetSlice(self->threads, 0, PyList_GET_SIZE(self->threads));
+}
+
+static void
+kern_core_thread_info (kern_CoreThreadObj *thread, kern_thread_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->state = TH_STATE_STOPPED;
+    info->user_time = thread->utime.tv_sec * 1000000 + thread->utime.tv_usec;
+    info->system_time = thread->stime.tv_sec * 1000000 +
+                        thread->stime.tv_usec;
+}
+
+/*
+ * Get the saved threads' CPU times. Saved threads are stopped, without a
+ * name or priority
+ *
+ * Arguments: None
+ * Returns:   List of {thread, tid, name, state, cpu_usage, priority,
+ *            user_time, system_time}
+ */
+static PyObject *
+kern_CoreTask_threadInfo (kern_CoreTaskObj *self)
+{
+    kern_thread_info info;
+    PyObject *list, *dict;
+    Py_ssize_t i, n;
+
+    if (! self->task.attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    n = PyList_GET_SIZE(self->threads);
+    if ((list = PyList_New(n)) == NULL)
+        return NULL;
+
+    for (i = 0; i < n; ++i) {
+        kern_core_thread_info((kern_CoreThreadObj *)
+                              PyList_GET_ITEM(self->threads, i), &info);
+        dict = kern_thread_info_dict((kern_ThreadObj *)
+                                     PyList_GET_ITEM(self->threads, i),
+                                     &info);
+        if (dict == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, dict);
+    }
+
+    return list;
+}
+
+/*
+ * Get basic information about the dumped task
+ *
+ * Arguments: None
+ * Returns:   {suspend_count, virtual_size, resident_size, user_time,
+ *             system_time}
+ */
+static PyObject *
+kern_CoreTask_basicInfo (kern_CoreTaskObj *self)
+{
+    uint64_t virtual_size = 0, resident_size = 0;
+    size_t i;
+
+    if (! self->task.attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    for (i = 0; i < self->nsegments; ++i) {
+        virtual_size += self->segments[i].memsz;
+        resident_size += self->segments[i].filesz;
+    }
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:(K,K),s:(K,K)}",
+                         "suspend_count", (uint64_t) 0,
+                         "virtual_size", virtual_size,
+                         "resident_size", resident_size,
+                         "user_time", self->utime.tv_sec,
+                         self->utime.tv_usec,
+                         "system_time", self->stime.tv_sec,
+                         self->stime.tv_usec);
+}
+
+/*
+ * Core files have no pending events
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_CoreTask_poll (kern_CoreTaskObj *self)
+{
+    Py_RETURN_NONE;
+}
+
+/*
+ * A saved task never runs, so freezing it stops nothing
+ *
+ * Arguments: None
+ * Returns:   0, the stop window in ns
+ */
+static PyObject *
+kern_CoreTask_freeze (kern_CoreTaskObj *self)
+{
+    if (! self->task.attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (self->task.frozen) {
+        PyErr_SetNone(kern_AlreadyPausedError);
+        return NULL;
+    }
+
+    self->task.frozen = 1;
+    self->task.frozen_at = kern_stats_now();
+
+    return PyInt_FromLong(0);
+}
+
+/*
+ * Arguments: None
+ * Returns:   how long the task was frozen, in ns
+ */
+static PyObject *
+kern_CoreTask_thaw (kern_CoreTaskObj *self)
+{
+    if (! self->task.frozen) {
+        PyErr_SetNone(kern_NotPausedError);
+        return NULL;
+    }
+
+    self->task.frozen = 0;
+
+    return PyLong_FromUnsignedLongLong(kern_stats_now() -
+                                       self->task.frozen_at);
+}
+
+static Py_ssize_t
+kern_CoreTask_getreadbuffer (kern_CoreTaskObj *self, Py_ssize_t segment,
+                             void **ptrptr)
+{
+    if (segment != 0) {
+        PyErr_SetString(PyExc_SystemError,
+                        "accessing non-existent buffer segment");
+        return -1;
+    }
+
+    *ptrptr = self->map;
+    return (Py_ssize_t) self->map_size;
+}
+
+static Py_ssize_t
+kern_CoreTask_getsegcount (kern_CoreTaskObj *self, Py_ssize_t *lenp)
+{
+    if (lenp)
+        *lenp = (Py_ssize_t) self->map_size;
+    return 1;
+}
+
+static PyBufferProcs kern_CoreTask_as_buffer = {
+    (readbufferproc) kern_CoreTask_getreadbuffer,
+    0,
+    (segcountproc) kern_CoreTask_getsegcount,
+    (charbufferproc) kern_CoreTask_getreadbuffer,
+};
+
+static void
+kern_CoreTask_dealloc (kern_CoreTaskObj *self)
+{
+    if (self->map != NULL)
+        munmap(self->map, self->map_size);
+    free(self->segments);
+    free(self->files);
+    Py_XDECREF(self->threads);
+    Py_XDECREF(self->path);
+    kern_TaskType.tp_dealloc((PyObject *) self);
+}
+
+static PyObject *
+kern_CoreTask_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    kern_CoreTaskObj *self = NULL;
+
+    self = (kern_CoreTaskObj *) kern_TaskType.tp_new(type, args, kwds);
+
+    if (self != NULL) {
+        self->task.ops = &kern_core_ops;
+        self->map = NULL;
+        self->map_size = 0;
+        self->segments = NULL;
+        self->nsegments = 0;
+        self->files = NULL;
+        self->nfiles = 0;
+
+        self->threads = PyList_New(0);
+        if (self->threads == NULL) {
+            Py_DECREF(self);
+            return NULL;
+        }
+
+        Py_INCREF(Py_None);
+        self->path = Py_None;
+    }
+
+    return (PyObject *) self;
+}
+
+static int
+kern_CoreTask_init (kern_CoreTaskObj *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *path = NULL, *tmp;
+
+    static char *kwlist[] = {"path", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "S", kwlist, &path))
+        return -1;
+
+    tmp = self->path;
+    Py_INCREF(path);
+    self->path = path;
+    Py_XDECREF(tmp);
+
+    return 0;
+}
+
+static PyMemberDef kern_CoreTaskMembers[] = {
+    {"path", T_OBJECT_EX, offsetof(kern_CoreTaskObj, path), READONLY,
+     "Core file path"},
+    {NULL} /* Sentinel */
+};
+
+static PyMethodDef kern_CoreTaskMethods[] = {
+    {"attach", (PyCFunction)kern_CoreTask_attach, METH_NOARGS,
+     "Open and map the core file"},
+    {"close", (PyCFunction)kern_CoreTask_close, METH_NOARGS,
+     "Unmap the core file"},
+    {"poll", (PyCFunction)kern_CoreTask_poll, METH_NOARGS,
+     "Poll the task for events"},
+    {"freeze", (PyCFunction)kern_CoreTask_freeze, METH_NOARGS,
+     "Saved tasks are always stopped"},
+    {"thaw", (PyCFunction)kern_CoreTask_thaw, METH_NOARGS,
+     "Saved tasks are always stopped"},
+    {"getThreads", (PyCFunction)kern_CoreTask_getThreads, METH_NOARGS,
+     "Return the task's list of threads" },
+    {"threadInfo", (PyCFunction)kern_CoreTask_threadInfo, METH_NOARGS,
+     "Return the saved threads' CPU times"},
+    {"basicInfo", (PyCFunction)kern_CoreTask_basicInfo, METH_NOARGS,
+     "Return basic information about the task"},
+    {NULL} /* Sentinel */
+};
+
+PyTypeObject kern_CoreTaskType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /* ob_size */
+    "mdb.kern.CoreTask",       /* tp_name */
+    sizeof(kern_CoreTaskObj),  /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    (destructor)kern_CoreTask_dealloc, /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_compare */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    &kern_CoreTask_as_buffer,  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    "Task objects backed by an ELF core file", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    kern_CoreTaskMethods,      /* tp_methods */
+    kern_CoreTaskMembers,      /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)kern_CoreTask_init, /* tp_init */
+    0,                         /* tp_alloc */
+    kern_CoreTask_new,         /* tp_new */
+};
+
+/*
+ * Get the saved execution state for the thread
+ *
+ * Arguments: None
+ * Returns:   Dictionary of registers
+ */
+static PyObject *
+kern_CoreThread_getState (kern_CoreThreadObj *self)
+{
+    return kern_thread_state_dict(self->thread.arch, &self->state);
+}
+
+/*
+ * Get the thread's saved CPU times
+ *
+ * Arguments: None
+ * Returns:   {thread, tid, name, state, cpu_usage, priority, user_time,
+ *             system_time}
+ */
+static PyObject *
+kern_CoreThread_info (kern_CoreThreadObj *self)
+{
+    kern_thread_info info;
+
+    kern_core_thread_info(self, &info);
+
+    return kern_thread_info_dict((kern_ThreadObj *) self, &info);
+}
+
+static PyObject *
+kern_CoreThread_readOnly (kern_CoreThreadObj *self, PyObject *args)
+{
+    PyErr_SetString(kern_Error, "Saved threads cannot be modified or run");
+    return NULL;
+}
+
+static PyMethodDef kern_CoreThreadMethods[] = {
+    {"getState", (PyCFunction)kern_CoreThread_getState, METH_NOARGS,
+     "Return execution state for the thread"},
+    {"info", (PyCFunction)kern_CoreThread_info, METH_NOARGS,
+     "Return the thread's saved CPU times"},
+    {"setState", (PyCFunction)kern_CoreThread_readOnly, METH_VARARGS,
+     "Saved threads are read-only"},
+    {"resume", (PyCFunction)kern_CoreThread_readOnly, METH_NOARGS,
+     "Saved threads cannot be resumed"},
+    {NULL} /* Sentinel */
+};
+
+PyTypeObject kern_CoreThreadType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /* ob_size */
+    "mdb.kern.CoreThread",     /* tp_name */
+    sizeof(kern_CoreThreadObj), /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    0,                         /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_compare */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    "Thread objects with saved state", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    kern_CoreThreadMethods,    /* tp_methods */
+    0,                         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new */
+};
@@ -0,0 +1,97 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_CORE_H
+#define _KERN_CORE_H
+
+#include <mach/mach_types.h>
+
+#include "structmember.h"
+
+#include "elf.h"
+#include "task.h"
+#include "thread.h"
+
+extern PyTypeObject kern_CoreTaskType;
+extern PyTypeObject kern_CoreThreadType;
+
+typedef struct {
+    uint64_t vaddr;
+    uint64_t memsz;
+    uint64_t offset;
+    uint64_t filesz;
+    vm_prot_t protection;
+} kern_core_segment;
+
+/* A file mapping listed in the NT_FILE note */
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    const char *path;
+} kern_core_file;
+
+typedef struct {
+    kern_TaskObj task;
+    PyObject *path;
+    unsigned char *map;
+    size_t map_size;
+    kern_core_segment *segments;
+    size_t nsegments;
+    kern_core_file *files;
+    size_t nfiles;
+    PyObject *threads;
+    kern_elf_timeval utime;
+    kern_elf_timeval stime;
+} kern_CoreTaskObj;
+
+/* A thread whose registers were saved, rather than a live Mach thread */
+typedef struct {
+    kern_ThreadObj thread;
+    kern_multi_arch_tstate state;
+    kern_elf_timeval utime;
+    kern_elf_timeval stime;
+} kern_CoreThreadObj;
+
+kern_CoreThreadObj *kern_core_thread_new (PyObject *task, int tid);
+int kern_core_add_thread (kern_CoreTaskObj *core, kern_elf_prstatus64 *prs);
+
+/* Backend ops shared with other saved-task types */
+size_t kern_core_find (kern_CoreTaskObj *core, uint64_t address);
+int kern_core_segment_cmp (const void *a, const void *b);
+void kern_core_reset (kern_CoreTaskObj *core);
+void kern_core_close (kern_CoreTaskObj *core);
+kern_return_t kern_core_write (kern_TaskObj *task, mach_vm_address_t address,
+                               const void *data, mach_vm_size_t size);
+kern_return_t kern_core_region (kern_TaskObj *task, kern_region *region);
+size_t kern_core_path (kern_TaskObj *task, mach_vm_address_t address,
+                       char *buf, size_t size);
+kern_return_t kern_core_residency (kern_TaskObj *task,
+                                   mach_vm_address_t address,
+                                   mach_vm_size_t size, uint8_t *present,
+                                   size_t first);
+
+#endif
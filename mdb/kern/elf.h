@@ -0,0 +1,165 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_ELF_H
+#define _KERN_ELF_H
+
+#include <stdint.h>
+
+/*
+ * Minimal ELF definitions, enough to read and write x86-64 core files. Darwin
+ * ships no <elf.h>, so the handful of structures we need live here.
+ */
+
+#define EI_NIDENT      16
+#define EI_CLASS       4
+#define EI_DATA        5
+
+#define ELFMAG         "\177ELF"
+#define SELFMAG        4
+#define ELFCLASS64     2
+#define ELFDATA2LSB    1
+#define EV_CURRENT     1
+
+#define ET_EXEC        2
+#define ET_DYN         3
+#define ET_CORE        4
+
+#define EM_X86_64      62
+
+#define PT_LOAD        1
+#define PT_NOTE        4
+
+#define SHT_SYMTAB     2
+#define SHT_NOTE       7
+#define SHT_DYNSYM     11
+
+#define SHN_UNDEF      0
+
+#define STT_NOTYPE     0
+#define STT_OBJECT     1
+#define STT_FUNC       2
+
+#define ELF64_ST_TYPE(i) ((i) & 0xf)
+
+#define PF_X           0x1
+#define PF_W           0x2
+#define PF_R           0x4
+
+#define NT_PRSTATUS    1
+#define NT_PRPSINFO    3
+#define NT_FILE        0x46494c45
+#define NT_GNU_BUILD_ID 3
+
+typedef struct {
+    unsigned char e_ident[EI_NIDENT];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} Elf64_Ehdr;
+
+typedef struct {
+    uint32_t p_type;
+    uint32_t p_flags;
+    uint64_t p_offset;
+    uint64_t p_vaddr;
+    uint64_t p_paddr;
+    uint64_t p_filesz;
+    uint64_t p_memsz;
+    uint64_t p_align;
+} Elf64_Phdr;
+
+typedef struct {
+    uint32_t sh_name;
+    uint32_t sh_type;
+    uint64_t sh_flags;
+    uint64_t sh_addr;
+    uint64_t sh_offset;
+    uint64_t sh_size;
+    uint32_t sh_link;
+    uint32_t sh_info;
+    uint64_t sh_addralign;
+    uint64_t sh_entsize;
+} Elf64_Shdr;
+
+typedef struct {
+    uint32_t st_name;
+    unsigned char st_info;
+    unsigned char st_other;
+    uint16_t st_shndx;
+    uint64_t st_value;
+    uint64_t st_size;
+} Elf64_Sym;
+
+typedef struct {
+    uint32_t n_namesz;
+    uint32_t n_descsz;
+    uint32_t n_type;
+} Elf64_Nhdr;
+
+/* Linux x86-64 struct user_regs_struct, as found in NT_PRSTATUS */
+typedef struct {
+    uint64_t r15, r14, r13, r12, rbp, rbx, r11, r10, r9, r8;
+    uint64_t rax, rcx, rdx, rsi, rdi, orig_rax, rip, cs, eflags, rsp, ss;
+    uint64_t fs_base, gs_base, ds, es, fs, gs;
+} kern_elf_regs64;
+
+typedef struct {
+    int64_t tv_sec;
+    int64_t tv_usec;
+} kern_elf_timeval;
+
+/* Linux x86-64 struct elf_prstatus */
+typedef struct {
+    int32_t si_signo;
+    int32_t si_code;
+    int32_t si_errno;
+    int16_t pr_cursig;
+    uint64_t pr_sigpend;
+    uint64_t pr_sighold;
+    int32_t pr_pid;
+    int32_t pr_ppid;
+    int32_t pr_pgrp;
+    int32_t pr_sid;
+    kern_elf_timeval pr_utime;
+    kern_elf_timeval pr_stime;
+    kern_elf_timeval pr_cutime;
+    kern_elf_timeval pr_cstime;
+    kern_elf_regs64 pr_reg;
+    int32_t pr_fpvalid;
+} kern_elf_prstatus64;
+
+#endif
@@ -74,13 +74,17 @@ extern kern_return_t catch_mach_exception_raise (
        mach_port_t             thread,
        mach_port_t             task,
        exception_type_t        exception,
-       exception_data_t        code,
+       mach_exception_data_t   code,
        mach_msg_type_number_t  codeCnt)
 {
     kern_return_t kr;
+    mach_msg_type_number_t i;
 
     saved_event.thread = thread;
     saved_event.type = exception;
+    saved_event.ncodes = codeCnt < 2 ? codeCnt : 2;
+    for (i = 0; i < 2; ++i)
+        saved_event.code[i] = i < codeCnt ? code[i] : 0;
 
     if ( (kr = thread_suspend(thread)) != KERN_SUCCESS) {
         return KERN_FAILURE;
@@ -42,6 +42,8 @@ typedef struct {
 typedef struct {
     mach_port_t thread;
     exception_type_t type;
+    mach_exception_data_type_t code[2];
+    mach_msg_type_number_t ncodes;
 } kern_exc_event;
 
 kern_return_t kern_excserv_init (mach_port_t task, mach_port_t *exc_port);
@@ -0,0 +1,440 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+
+#include "util.h"
+#include "kern.h"
+#include "task.h"
+#include "memory.h"
+#include "hash.h"
+
+/*
+ * Page hashing for finding identical memory across tasks.
+ *
+ * Pages are hashed with XXH64, whose four independent lanes keep a core
+ * close to memory bandwidth; a sweep is bound by reading the task, so
+ * reads and hashing are spread across native threads.
+ */
+
+#define XXH_PRIME1  0x9E3779B185EBCA87ULL
+#define XXH_PRIME2  0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3  0x165667B19E3779F9ULL
+#define XXH_PRIME4  0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5  0x27D4EB2F165667C5ULL
+
+#define XXH_ROTL(x, r)  (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t
+kern_xxh_read64 (const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t
+kern_xxh_read32 (const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t
+kern_xxh_round (uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    acc = XXH_ROTL(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+static inline uint64_t
+kern_xxh_merge (uint64_t acc, uint64_t val)
+{
+    acc ^= kern_xxh_round(0, val);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/*
+ * XXH64 of size bytes at data
+ *
+ * Arguments: data - bytes to hash, any alignment
+ *            size - number of bytes
+ *            seed - hash seed
+ * Returns:   the 64-bit hash
+ */
+uint64_t
+kern_xxh64 (const void *data, size_t size, uint64_t seed)
+{
+    const uint8_t *p = data, *end = p + size;
+    uint64_t h, v1, v2, v3, v4;
+
+    if (size >= 32) {
+        const uint8_t *limit = end - 32;
+
+        v1 = seed + XXH_PRIME1 + XXH_PRIME2;
+        v2 = seed + XXH_PRIME2;
+        v3 = seed;
+        v4 = seed - XXH_PRIME1;
+
+        do {
+            v1 = kern_xxh_round(v1, kern_xxh_read64(p));
+            v2 = kern_xxh_round(v2, kern_xxh_read64(p + 8));
+            v3 = kern_xxh_round(v3, kern_xxh_read64(p + 16));
+            v4 = kern_xxh_round(v4, kern_xxh_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = XXH_ROTL(v1, 1) + XXH_ROTL(v2, 7) + XXH_ROTL(v3, 12) +
+            XXH_ROTL(v4, 18);
+        h = kern_xxh_merge(h, v1);
+        h = kern_xxh_merge(h, v2);
+        h = kern_xxh_merge(h, v3);
+        h = kern_xxh_merge(h, v4);
+    } else
+        h = seed + XXH_PRIME5;
+
+    h += (uint64_t) size;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= kern_xxh_round(0, kern_xxh_read64(p));
+        h = XXH_ROTL(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t) kern_xxh_read32(p) * XXH_PRIME1;
+        h = XXH_ROTL(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+
+    for (; p < end; ++p) {
+        h ^= *p * XXH_PRIME5;
+        h = XXH_ROTL(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/*
+ * Hash a string
+ *
+ * Arguments: data - string to hash
+ *            seed - hash seed, default = 0
+ * Returns:   XXH64 of data, the hash pageHashes uses for pages
+ */
+PyObject *
+kern_hash (PyObject *self, PyObject *args, PyObject *kwds)
+{
+    const char *data;
+    int size;
+    unsigned long long seed = 0, h;
+
+    static char *kwlist[] = {"data", "seed", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "s#|K", kwlist,
+                                      &data, &size, &seed))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    h = kern_xxh64(data, (size_t) size, seed);
+    Py_END_ALLOW_THREADS
+
+    return PyLong_FromUnsignedLongLong(h);
+}
+
+/* Task.pageHashes */
+
+#define HASH_CHUNK        (1 << 20)
+#define HASH_MAX_THREADS  32
+
+typedef struct {
+    mach_vm_address_t address;
+    mach_vm_size_t size;
+    size_t slot;                /* index of the chunk's first page */
+} kern_hash_chunk;
+
+typedef struct {
+    kern_TaskObj *task;
+    kern_hash_chunk *chunks;
+    size_t nchunks, capacity;
+    size_t npages;
+    int resident;
+    uint64_t *hashes;
+    uint8_t *ok;                /* per page, 1 if hashed */
+    size_t next;                /* next chunk to claim */
+    int nomem;
+} kern_hash_job;
+
+static int
+kern_hash_add (kern_hash_job *job, mach_vm_address_t address,
+               mach_vm_address_t end)
+{
+    kern_hash_chunk *chunk;
+    mach_vm_size_t size;
+    void *p;
+
+    for (; address < end; address += size) {
+        size = end - address;
+        if (size > HASH_CHUNK)
+            size = HASH_CHUNK;
+
+        if (job->nchunks == job->capacity) {
+            job->capacity = job->capacity ? job->capacity * 2 : 256;
+            p = realloc(job->chunks, job->capacity * sizeof(*job->chunks));
+            if (p == NULL)
+                return -1;
+            job->chunks = p;
+        }
+
+        chunk = &job->chunks[job->nchunks++];
+        chunk->address = address;
+        chunk->size = size;
+        chunk->slot = job->npages;
+        job->npages += (size_t) (size / vm_page_size);
+    }
+
+    return 0;
+}
+
+/* Split the matching parts of [address, end) into page aligned chunks */
+static int
+kern_hash_plan (kern_hash_job *job, mach_vm_address_t address,
+                mach_vm_address_t end, int protection)
+{
+    kern_region region;
+    mach_vm_address_t lo, hi;
+
+    region.address = address;
+
+    while (region.address < end &&
+           kern_task_region(job->task, &region) == KERN_SUCCESS &&
+           region.address < end) {
+        hi = region.address + region.size;
+        if (hi <= region.address)
+            hi = end;
+
+        if ((region.info.protection & protection) == protection) {
+            lo = region.address > address ? region.address : address;
+            if (kern_hash_add(job, KERN_TRUNC_PAGE(lo),
+                              KERN_ROUND_PAGE(hi < end ? hi : end)) < 0)
+                return -1;
+        }
+
+        if (hi <= region.address || hi >= end)
+            break;
+        region.address = hi;
+    }
+
+    return 0;
+}
+
+static void *
+kern_hash_run (void *arg)
+{
+    kern_hash_job *job = arg;
+    kern_hash_chunk *chunk;
+    mach_vm_size_t out_size;
+    uint8_t *buf, *valid;
+    size_t i, j, n;
+
+    buf = malloc(HASH_CHUNK);
+    valid = malloc(HASH_CHUNK / vm_page_size / 8 + 1);
+    if (buf == NULL || valid == NULL) {
+        free(buf);
+        free(valid);
+        job->nomem = 1;
+        return NULL;
+    }
+
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->nchunks) {
+        chunk = &job->chunks[i];
+        n = (size_t) (chunk->size / vm_page_size);
+
+        if (! job->resident &&
+            kern_task_read(job->task, chunk->address, chunk->size, buf,
+                           &out_size) == KERN_SUCCESS &&
+            out_size == chunk->size)
+            memset(valid, 0xff, (n + 7) / 8);
+        else if (job->resident)
+            kern_memory_read_resident(job->task, chunk->address, chunk->size,
+                                      buf, valid);
+        else
+            kern_memory_read_partial(job->task, chunk->address, chunk->size,
+                                     buf, valid);
+
+        for (j = 0; j < n; ++j) {
+            if (! (valid[j >> 3] & (1 << (j & 7))))
+                continue;
+            job->hashes[chunk->slot + j] =
+                kern_xxh64(buf + j * vm_page_size, vm_page_size, 0);
+            job->ok[chunk->slot + j] = 1;
+        }
+    }
+
+    free(buf);
+    free(valid);
+
+    return NULL;
+}
+
+static int
+kern_hash_pages (kern_hash_job *job, int nthreads)
+{
+    pthread_t threads[HASH_MAX_THREADS];
+    int i, started = 0;
+
+    job->hashes = malloc(job->npages * sizeof(uint64_t) + 1);
+    job->ok = calloc(job->npages + 1, 1);
+    if (job->hashes == NULL || job->ok == NULL)
+        return -1;
+
+    /* The calling thread works too; a thread that can't start is no loss */
+    for (i = 1; i < nthreads && i < (int) job->nchunks; ++i) {
+        if (pthread_create(&threads[started], NULL, kern_hash_run, job) != 0)
+            break;
+        started++;
+    }
+
+    kern_hash_run(job);
+
+    for (i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    return job->nomem ? -1 : 0;
+}
+
+/*
+ * Hash each page of the task's memory, for finding pages that are identical
+ * within or across tasks. Pages are read and hashed in parallel with the
+ * GIL released; pages that can't be read are left out
+ *
+ * Arguments: address - start of the range, default = 0
+ *            size - size of the range, default = the rest of the address
+ *                   space
+ *            protection - protection regions must have, default = READ
+ *            resident - only hash resident pages, leaving paged out and
+ *                       untouched memory alone, default = False
+ *            threads - number of threads, default = online CPUs, up to 8
+ * Returns:   (addresses, hashes) arrays, hashes being XXH64 as for
+ *            mdb.kern.hash
+ */
+PyObject *
+kern_Task_pageHashes (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_hash_job job;
+    PyObject *resident = NULL, *ret;
+    unsigned long long address = 0, size = 0;
+    mach_vm_address_t end;
+    uint64_t *addresses;
+    size_t i, j, k, n;
+    int protection = VM_PROT_READ, nthreads = 0, r;
+
+    static char *kwlist[] = {"address", "size", "protection", "resident",
+                             "threads", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|KKiOi", kwlist,
+                                      &address, &size, &protection,
+                                      &resident, &nthreads))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (nthreads < 0 || nthreads > HASH_MAX_THREADS) {
+        PyErr_SetString(PyExc_ValueError, "threads out of range");
+        return NULL;
+    }
+
+    if (nthreads == 0) {
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads < 1)
+            nthreads = 1;
+        else if (nthreads > 8)
+            nthreads = 8;
+    }
+
+    end = size == 0 || address + size < address ?
+          (mach_vm_address_t) -1 : address + size;
+
+    memset(&job, 0, sizeof(job));
+    job.task = self;
+    job.resident = resident != NULL && PyObject_IsTrue(resident) == 1;
+
+    Py_BEGIN_ALLOW_THREADS
+    r = kern_hash_plan(&job, address, end, protection);
+    if (r == 0)
+        r = kern_hash_pages(&job, nthreads);
+    Py_END_ALLOW_THREADS
+
+    addresses = r == 0 ? malloc(job.npages * sizeof(uint64_t) + 1) : NULL;
+    if (addresses == NULL) {
+        free(job.chunks);
+        free(job.hashes);
+        free(job.ok);
+        return PyErr_NoMemory();
+    }
+
+    /* Compact down to the pages that were hashed */
+    for (i = 0, k = 0; i < job.nchunks; ++i) {
+        n = (size_t) (job.chunks[i].size / vm_page_size);
+        for (j = 0; j < n; ++j) {
+            if (! job.ok[job.chunks[i].slot + j])
+                continue;
+            addresses[k] = job.chunks[i].address + j * vm_page_size;
+            job.hashes[k++] = job.hashes[job.chunks[i].slot + j];
+        }
+    }
+
+    ret = Py_BuildValue("(NN)",
+                        kern_array_new("L", addresses, k * 8),
+                        kern_array_new("L", job.hashes, k * 8));
+
+    free(addresses);
+    free(job.chunks);
+    free(job.hashes);
+    free(job.ok);
+
+    return ret;
+}
@@ -0,0 +1,885 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+
+#include "util.h"
+#include "kern.h"
+#include "task.h"
+#include "heap.h"
+
+/*
+ * Native walker for glibc (ptmalloc2) heaps on x86-64.
+ *
+ * Chunks are walked sequentially through large windowed reads; free list
+ * pointer chasing goes through a small page cache, so neither costs a kernel
+ * call per chunk.
+ */
+
+#define HEAP_PAGE         4096
+#define HEAP_CACHE        1024            /* pages cached for list walks */
+#define HEAP_WINDOW       (1 << 20)       /* sequential chunk walk reads */
+#define HEAP_MAX_SIZE     (64ULL << 20)   /* non-main heap size/alignment */
+#define HEAP_MAX_ARENAS   1024
+#define HEAP_MAX_LIST     (1 << 24)       /* free list length sanity bound */
+#define HEAP_SCAN_MAX     (32 << 20)      /* largest region searched for
+                                             main_arena */
+
+#define CHUNK_PREV_INUSE  0x1
+#define CHUNK_SIZE(s)     ((s) & ~(uint64_t) 7)
+#define CHUNK_MIN_SIZE    32
+
+#define NFASTBINS         10
+#define NBINS             128
+#define NSMALLBINS        64
+#define TCACHE_BINS       64
+
+/* Size-class histogram: 16 byte classes up to 1024, then powers of two */
+#define HIST_SMALL        64
+#define HIST_CLASSES      (HIST_SMALL + 64)
+
+/* malloc_state field offsets; glibc 2.27 added have_fastchunks */
+typedef struct {
+    uint64_t fastbins;
+    uint64_t top;
+    uint64_t bins;
+    uint64_t next;
+    uint64_t system_mem;
+    uint64_t size;
+} kern_arena_layout;
+
+static const kern_arena_layout kern_arena_layouts[] = {
+    { 16, 96, 112, 2160, 2184, 2200 },   /* 2.27 and later */
+    {  8, 88, 104, 2152, 2176, 2192 },   /* 2.23 - 2.26 */
+};
+
+#define NLAYOUTS (sizeof(kern_arena_layouts) / sizeof(kern_arena_layout))
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    vm_prot_t protection;
+} kern_heap_region;
+
+typedef struct {
+    uint64_t address;
+    uint64_t top;
+    uint64_t top_size;
+    uint64_t system_mem;
+    uint64_t tcache;
+} kern_heap_arena;
+
+typedef struct {
+    kern_TaskObj *task;
+    const kern_arena_layout *layout;
+
+    kern_heap_region *regions;
+    size_t nregions;
+
+    uint64_t *tags;
+    unsigned char *cache;
+
+    kern_heap_arena arenas[HEAP_MAX_ARENAS];
+    size_t narenas;
+
+    uint64_t unreadable;            /* where a chunk walk couldn't read */
+
+    /* Results, one entry per chunk */
+    uint64_t *address;
+    uint64_t *size;
+    uint8_t *inuse;
+    uint16_t *arena;
+    size_t count, capacity;
+
+    /* Addresses of chunks found on free lists */
+    uint64_t *free;
+    size_t nfree, free_capacity;
+
+    uint64_t hist[HIST_CLASSES][4];
+} kern_heap_walk;
+
+
+static int
+kern_heap_regions (kern_heap_walk *w)
+{
+    kern_region region;
+    size_t capacity = 0;
+    void *tmp;
+
+    region.address = 0;
+    while (kern_task_region(w->task, &region) == KERN_SUCCESS) {
+        if (w->nregions == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            tmp = realloc(w->regions, capacity * sizeof(kern_heap_region));
+            if (tmp == NULL)
+                return -1;
+            w->regions = tmp;
+        }
+
+        w->regions[w->nregions].start = region.address;
+        w->regions[w->nregions].end = region.address + region.size;
+        w->regions[w->nregions].protection = region.info.protection;
+        w->nregions++;
+
+        if (region.address + region.size < region.address)
+            break;
+        region.address += region.size;
+    }
+
+    return 0;
+}
+
+static kern_heap_region *
+kern_heap_region_of (kern_heap_walk *w, uint64_t address)
+{
+    size_t lo = 0, hi = w->nregions, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (w->regions[mid].end <= address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < w->nregions && w->regions[lo].start <= address)
+        return &w->regions[lo];
+    return NULL;
+}
+
+/* Is p a plausible chunk pointer: 16-byte aligned, in writable memory */
+static int
+kern_heap_plausible (kern_heap_walk *w, uint64_t p)
+{
+    kern_heap_region *r;
+
+    if (p == 0 || (p & 15))
+        return 0;
+
+    r = kern_heap_region_of(w, p);
+    return r != NULL && (r->protection & (VM_PROT_READ | VM_PROT_WRITE)) ==
+                        (VM_PROT_READ | VM_PROT_WRITE);
+}
+
+static int
+kern_heap_read64 (kern_heap_walk *w, uint64_t address, uint64_t *value)
+{
+    uint64_t page = address & ~(uint64_t) (HEAP_PAGE - 1);
+    size_t slot = (size_t) (page / HEAP_PAGE) % HEAP_CACHE;
+    mach_vm_size_t out_size;
+
+    if ((address & 7) != 0)
+        return -1;
+
+    if (w->tags[slot] != page) {
+        if (kern_task_read(w->task, page, HEAP_PAGE,
+                           w->cache + slot * HEAP_PAGE, &out_size)
+            != KERN_SUCCESS || out_size != HEAP_PAGE) {
+            w->tags[slot] = ~(uint64_t) 0;
+            return -1;
+        }
+        w->tags[slot] = page;
+    }
+
+    memcpy(value, w->cache + slot * HEAP_PAGE + (address - page), 8);
+    return 0;
+}
+
+/* Undo glibc 2.32 safe-linking if the stored pointer is mangled */
+static uint64_t
+kern_heap_reveal (kern_heap_walk *w, uint64_t position, uint64_t value)
+{
+    uint64_t demangled;
+
+    if (value == 0 || kern_heap_plausible(w, value))
+        return value;
+
+    demangled = value ^ (position >> 12);
+    if (kern_heap_plausible(w, demangled))
+        return demangled;
+
+    return 0;
+}
+
+static int
+kern_heap_add_free (kern_heap_walk *w, uint64_t chunk)
+{
+    void *tmp;
+
+    if (w->nfree == w->free_capacity) {
+        w->free_capacity = w->free_capacity ? w->free_capacity * 2 : 4096;
+        tmp = realloc(w->free, w->free_capacity * sizeof(uint64_t));
+        if (tmp == NULL)
+            return -1;
+        w->free = tmp;
+    }
+
+    w->free[w->nfree++] = chunk;
+    return 0;
+}
+
+static int
+kern_heap_add_chunk (kern_heap_walk *w, uint64_t address, uint64_t size,
+                     int inuse, size_t arena)
+{
+    size_t capacity;
+    void *a, *s, *u, *r;
+
+    if (w->count == w->capacity) {
+        capacity = w->capacity ? w->capacity * 2 : 65536;
+        a = realloc(w->address, capacity * sizeof(uint64_t));
+        if (a) w->address = a;
+        s = realloc(w->size, capacity * sizeof(uint64_t));
+        if (s) w->size = s;
+        u = realloc(w->inuse, capacity * sizeof(uint8_t));
+        if (u) w->inuse = u;
+        r = realloc(w->arena, capacity * sizeof(uint16_t));
+        if (r) w->arena = r;
+        if (! (a && s && u && r))
+            return -1;
+        w->capacity = capacity;
+    }
+
+    w->address[w->count] = address;
+    w->size[w->count] = size;
+    w->inuse[w->count] = (uint8_t) inuse;
+    w->arena[w->count] = (uint16_t) arena;
+    w->count++;
+
+    return 0;
+}
+
+/* Does the arena at a look like a malloc_state for the given layout? */
+static int
+kern_heap_check_arena (kern_heap_walk *w, uint64_t a,
+                       const kern_arena_layout *l)
+{
+    uint64_t top, fd, bk, hdr, next;
+    int i, empty = 0, hops;
+
+    if (kern_heap_read64(w, a + l->top, &top) < 0)
+        return 0;
+    if (top != a + l->bins - 16 && ! kern_heap_plausible(w, top))
+        return 0;
+
+    for (i = 2; i < NSMALLBINS; ++i) {
+        hdr = a + l->bins + (uint64_t) (i - 1) * 16 - 16;
+        if (kern_heap_read64(w, hdr + 16, &fd) < 0 ||
+            kern_heap_read64(w, hdr + 24, &bk) < 0)
+            return 0;
+
+        if (fd == hdr && bk == hdr)
+            empty++;
+        else if (! kern_heap_plausible(w, fd) || ! kern_heap_plausible(w, bk))
+            return 0;
+    }
+
+    if (empty < 8)
+        return 0;
+
+    /* The arena list is circular */
+    next = a;
+    for (hops = 0; hops < HEAP_MAX_ARENAS; ++hops) {
+        if (kern_heap_read64(w, next + l->next, &next) < 0)
+            return 0;
+        if (next == a)
+            return 1;
+        if (next == 0 || (next & 7))
+            return 0;
+    }
+
+    return 0;
+}
+
+static int
+kern_heap_check_main (kern_heap_walk *w, uint64_t a)
+{
+    size_t i;
+
+    for (i = 0; i < NLAYOUTS; ++i) {
+        if (kern_heap_check_arena(w, a, &kern_arena_layouts[i])) {
+            w->layout = &kern_arena_layouts[i];
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Size of the heap_info at the start of a thread arena's heaps: 32 bytes,
+ * or 48 since glibc 2.35 added pagesize. A thread arena sits just after the
+ * heap_info of its first heap
+ */
+static uint64_t
+kern_heap_info_size (kern_heap_walk *w, uint64_t a)
+{
+    uint64_t heap = a & ~(HEAP_MAX_SIZE - 1), ar_ptr;
+
+    if ((a - heap != 32 && a - heap != 48) ||
+        kern_heap_read64(w, heap, &ar_ptr) < 0 || ar_ptr != a)
+        return 0;
+
+    return a - heap;
+}
+
+/*
+ * Search writable data regions for main_arena. Candidates are filtered on
+ * the in-buffer copy of the region before the full check.
+ */
+static uint64_t
+kern_heap_find_main (kern_heap_walk *w)
+{
+    const kern_arena_layout *l;
+    kern_heap_region *r;
+    unsigned char *buf;
+    mach_vm_size_t size, out_size;
+    uint64_t off, a, fd, hdr;
+    size_t i, k;
+    int b, empty;
+
+    buf = malloc(HEAP_SCAN_MAX);
+    if (buf == NULL)
+        return 0;
+
+    for (i = 0; i < w->nregions; ++i) {
+        r = &w->regions[i];
+        size = r->end - r->start;
+
+        if ((r->protection & (VM_PROT_READ | VM_PROT_WRITE)) !=
+            (VM_PROT_READ | VM_PROT_WRITE) || size > HEAP_SCAN_MAX)
+            continue;
+
+        if (kern_task_read(w->task, r->start, size, buf, &out_size)
+            != KERN_SUCCESS)
+            continue;
+
+        for (k = 0; k < NLAYOUTS; ++k) {
+            l = &kern_arena_layouts[k];
+
+            for (off = 0; off + l->size <= out_size; off += 8) {
+                a = r->start + off;
+
+                /* Most small bins of any arena are empty and self-linked */
+                for (b = 2, empty = 0; b < 10; ++b) {
+                    hdr = l->bins + (uint64_t) (b - 1) * 16 - 16;
+                    memcpy(&fd, buf + off + hdr + 16, 8);
+                    if (fd == a + hdr)
+                        empty++;
+                }
+                if (empty < 3)
+                    continue;
+
+                if (kern_heap_check_arena(w, a, l) &&
+                    kern_heap_info_size(w, a) == 0) {
+                    w->layout = l;
+                    free(buf);
+                    return a;
+                }
+            }
+        }
+    }
+
+    free(buf);
+    return 0;
+}
+
+/*
+ * Walk the chunks in [start, end), where end is the arena's top chunk or the
+ * end of a heap. Returns 0, -1 if out of memory or -2 if a chunk header
+ * couldn't be read, with its address in w->unreadable
+ */
+static int
+kern_heap_walk_range (kern_heap_walk *w, uint64_t start, uint64_t end,
+                      size_t arena, unsigned char *window)
+{
+    uint64_t c = start, size, next_size, win_start = 0, win_len = 0;
+    mach_vm_size_t out_size;
+    int first = 1;
+
+#define IN_WINDOW(p) ((p) >= win_start && (p) + 8 <= win_start + win_len)
+#define FIELD(p) (*(uint64_t *) (window + ((p) - win_start)))
+
+    while (c + 16 <= end) {
+        if (! IN_WINDOW(c + 8)) {
+            win_start = c;
+            win_len = end + 16 - c;
+            if (win_len > HEAP_WINDOW)
+                win_len = HEAP_WINDOW;
+            if (kern_task_read(w->task, win_start, win_len, window,
+                               &out_size) != KERN_SUCCESS)
+                out_size = 0;
+            win_len = out_size;
+            if (! IN_WINDOW(c + 8)) {
+                w->unreadable = c + 8;
+                return -2;
+            }
+        }
+
+        size = CHUNK_SIZE(FIELD(c + 8));
+        if (size < 16 || c + size > end || c + size < c)
+            break;
+
+        /* The next chunk's PREV_INUSE bit says whether this one is in use */
+        if (! IN_WINDOW(c + size + 8)) {
+            win_start = c;
+            win_len = end + 16 - c;
+            if (win_len > HEAP_WINDOW)
+                win_len = HEAP_WINDOW;
+            if (kern_task_read(w->task, win_start, win_len, window,
+                               &out_size) != KERN_SUCCESS)
+                out_size = 0;
+            win_len = out_size;
+            if (! IN_WINDOW(c + size + 8)) {
+                w->unreadable = c + size + 8;
+                return -2;
+            }
+        }
+        next_size = FIELD(c + size + 8);
+
+        /* The tcache_perthread_struct is the first chunk of its heap */
+        if (first && (size == 0x290 || size == 0x250) &&
+            w->arenas[arena].tcache == 0)
+            w->arenas[arena].tcache = c;
+        first = 0;
+
+        if (kern_heap_add_chunk(w, c, size, (int) (next_size &
+                                CHUNK_PREV_INUSE), arena) < 0)
+            return -1;
+
+        c += size;
+    }
+
+#undef FIELD
+#undef IN_WINDOW
+
+    return 0;
+}
+
+static int
+kern_heap_walk_arena (kern_heap_walk *w, size_t index, int main,
+                      unsigned char *window)
+{
+    const kern_arena_layout *l = w->layout;
+    kern_heap_arena *arena = &w->arenas[index];
+    kern_heap_region *r;
+    uint64_t heap, ar_ptr, prev, size, start, end, first, info_size;
+    int ret;
+
+    if (kern_heap_read64(w, arena->address + l->top, &arena->top) < 0 ||
+        kern_heap_read64(w, arena->address + l->system_mem,
+                         &arena->system_mem) < 0)
+        return 0;
+
+    /* Before the first allocation top is the unsorted bin */
+    if (arena->top == arena->address + l->bins - 16)
+        return 0;
+
+    if (kern_heap_read64(w, arena->top + 8, &arena->top_size) == 0)
+        arena->top_size = CHUNK_SIZE(arena->top_size);
+
+    if (main) {
+        r = kern_heap_region_of(w, arena->top);
+        if (r == NULL)
+            return 0;
+        return kern_heap_walk_range(w, r->start, arena->top, index, window);
+    }
+
+    info_size = kern_heap_info_size(w, arena->address);
+    if (info_size == 0)
+        return 0;
+
+    /* The first chunk follows the malloc_state, 16-byte aligned */
+    first = arena->address + l->size;
+    first += (16 - ((first + 16) & 15)) & 15;
+
+    heap = arena->top & ~(HEAP_MAX_SIZE - 1);
+    while (heap != 0) {
+        if (kern_heap_read64(w, heap, &ar_ptr) < 0 ||
+            kern_heap_read64(w, heap + 8, &prev) < 0 ||
+            kern_heap_read64(w, heap + 16, &size) < 0 ||
+            ar_ptr != arena->address || size > HEAP_MAX_SIZE)
+            break;
+
+        start = (arena->address == heap + info_size) ? first :
+                heap + info_size;
+        end = (arena->top >= heap && arena->top < heap + size) ?
+              arena->top : heap + size;
+
+        ret = kern_heap_walk_range(w, start, end, index, window);
+        if (ret < 0)
+            return ret;
+
+        heap = prev;
+    }
+
+    return 0;
+}
+
+static int
+kern_heap_collect_tcache (kern_heap_walk *w, uint64_t chunk)
+{
+    uint64_t size, entries, e, next, counts_width;
+    int i, n;
+
+    if (kern_heap_read64(w, chunk + 8, &size) < 0)
+        return 0;
+
+    /* 2.30 widened the per-bin counts from char to uint16_t */
+    size = CHUNK_SIZE(size);
+    if (size == 0x290)
+        counts_width = 2;
+    else if (size == 0x250)
+        counts_width = 1;
+    else
+        return 0;
+
+    entries = chunk + 16 + TCACHE_BINS * counts_width;
+
+    for (i = 0; i < TCACHE_BINS; ++i) {
+        if (kern_heap_read64(w, entries + (uint64_t) i * 8, &e) < 0)
+            return 0;
+
+        /* Entries point at chunk memory, 16 bytes past the header */
+        for (n = 0; e != 0 && n < HEAP_MAX_LIST; ++n) {
+            if (! kern_heap_plausible(w, e) ||
+                kern_heap_add_free(w, e - 16) < 0 ||
+                kern_heap_read64(w, e, &next) < 0)
+                break;
+            e = kern_heap_reveal(w, e, next);
+        }
+    }
+
+    return 0;
+}
+
+static int
+kern_heap_collect_free (kern_heap_walk *w, kern_heap_arena *arena)
+{
+    const kern_arena_layout *l = w->layout;
+    uint64_t p, fd, hdr;
+    int i, n;
+
+    for (i = 0; i < NFASTBINS; ++i) {
+        if (kern_heap_read64(w, arena->address + l->fastbins +
+                             (uint64_t) i * 8, &p) < 0)
+            return 0;
+
+        for (n = 0; p != 0 && n < HEAP_MAX_LIST; ++n) {
+            if (kern_heap_add_free(w, p) < 0)
+                return -1;
+            if (kern_heap_read64(w, p + 16, &fd) < 0)
+                break;
+            p = kern_heap_reveal(w, p + 16, fd);
+        }
+    }
+
+    for (i = 1; i < NBINS; ++i) {
+        hdr = arena->address + l->bins + (uint64_t) (i - 1) * 16 - 16;
+        if (kern_heap_read64(w, hdr + 16, &p) < 0)
+            return 0;
+
+        for (n = 0; p != hdr && n < HEAP_MAX_LIST; ++n) {
+            if (! kern_heap_plausible(w, p))
+                break;
+            if (kern_heap_add_free(w, p) < 0)
+                return -1;
+            if (kern_heap_read64(w, p + 16, &p) < 0)
+                break;
+        }
+    }
+
+    if (arena->tcache != 0)
+        return kern_heap_collect_tcache(w, arena->tcache);
+
+    return 0;
+}
+
+static int
+kern_heap_u64_cmp (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static size_t
+kern_heap_class (uint64_t size)
+{
+    size_t c = HIST_SMALL;
+
+    if (size <= 1024)
+        return (size_t) ((size + 15) / 16) - 1;
+
+    size = (size - 1) >> 10;
+    while (size) {
+        size >>= 1;
+        c++;
+    }
+
+    return c < HIST_CLASSES ? c : HIST_CLASSES - 1;
+}
+
+static void
+kern_heap_finish (kern_heap_walk *w)
+{
+    size_t i, c;
+    int inuse;
+
+    qsort(w->free, w->nfree, sizeof(uint64_t), kern_heap_u64_cmp);
+
+    for (i = 0; i < w->count; ++i) {
+        /* Fast and tcache chunks keep the next chunk's PREV_INUSE bit set */
+        if (w->inuse[i] && w->nfree &&
+            bsearch(&w->address[i], w->free, w->nfree, sizeof(uint64_t),
+                    kern_heap_u64_cmp))
+            w->inuse[i] = 0;
+
+        c = kern_heap_class(w->size[i]);
+        inuse = w->inuse[i] ? 0 : 2;
+        w->hist[c][inuse] += 1;
+        w->hist[c][inuse + 1] += w->size[i];
+    }
+}
+
+/* Returns: 0, 1 without a main_arena, or as kern_heap_walk_range() */
+static int
+kern_heap_run (kern_heap_walk *w, uint64_t main_arena, uint64_t *tcaches,
+               size_t ntcaches)
+{
+    unsigned char *window;
+    uint64_t a;
+    size_t i;
+    int r;
+
+    if (kern_heap_regions(w) < 0)
+        return -1;
+
+    if (main_arena == 0)
+        main_arena = kern_heap_find_main(w);
+    else if (! kern_heap_check_main(w, main_arena))
+        main_arena = 0;
+
+    if (main_arena == 0)
+        return 1;
+
+    /* Follow the circular arena list from main_arena */
+    a = main_arena;
+    do {
+        w->arenas[w->narenas++].address = a;
+        if (kern_heap_read64(w, a + w->layout->next, &a) < 0)
+            break;
+    } while (a != main_arena && w->narenas < HEAP_MAX_ARENAS);
+
+    window = malloc(HEAP_WINDOW);
+    if (window == NULL)
+        return -1;
+
+    for (i = 0; i < w->narenas; ++i) {
+        r = kern_heap_walk_arena(w, i, i == 0, window);
+        if (r < 0) {
+            free(window);
+            return r;
+        }
+    }
+
+    free(window);
+
+    for (i = 0; i < w->narenas; ++i)
+        if (kern_heap_collect_free(w, &w->arenas[i]) < 0)
+            return -1;
+
+    for (i = 0; i < ntcaches; ++i)
+        if (kern_heap_collect_tcache(w, tcaches[i] - 16) < 0)
+            return -1;
+
+    kern_heap_finish(w);
+
+    return 0;
+}
+
+static PyObject *
+kern_heap_result (kern_heap_walk *w)
+{
+    PyObject *result = NULL, *arenas = NULL, *hist = NULL, *item;
+    uint64_t bound;
+    size_t i;
+
+    arenas = PyList_New(0);
+    hist = PyList_New(0);
+    if (arenas == NULL || hist == NULL)
+        goto error;
+
+    for (i = 0; i < w->narenas; ++i) {
+        item = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K}",
+                             "address", w->arenas[i].address,
+                             "top", w->arenas[i].top,
+                             "top_size", w->arenas[i].top_size,
+                             "system_mem", w->arenas[i].system_mem,
+                             "tcache", w->arenas[i].tcache);
+        if (item == NULL || PyList_Append(arenas, item) < 0) {
+            Py_XDECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+    }
+
+    for (i = 0; i < HIST_CLASSES; ++i) {
+        if (w->hist[i][0] == 0 && w->hist[i][2] == 0)
+            continue;
+
+        bound = i < HIST_SMALL ? (i + 1) * 16 :
+                (uint64_t) 1024 << (i - HIST_SMALL);
+        item = Py_BuildValue("(KKKKK)", bound, w->hist[i][0], w->hist[i][1],
+                             w->hist[i][2], w->hist[i][3]);
+        if (item == NULL || PyList_Append(hist, item) < 0) {
+            Py_XDECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+    }
+
+    result = Py_BuildValue("{s:N,s:N,s:N,s:N,s:O,s:O}",
+                           "address", kern_array_new("L", w->address,
+                                                     w->count * 8),
+                           "size", kern_array_new("L", w->size, w->count * 8),
+                           "inuse", kern_array_new("B", w->inuse, w->count),
+                           "arena", kern_array_new("H", w->arena,
+                                                   w->count * 2),
+                           "arenas", arenas,
+                           "histogram", hist);
+
+ error:
+    Py_XDECREF(arenas);
+    Py_XDECREF(hist);
+
+    return result;
+}
+
+/*
+ * Walk the glibc malloc heap of the task: every arena's chunks, with free
+ * chunks identified from the fast, small, large and unsorted bins and the
+ * tcache
+ *
+ * Arguments: arena - address of main_arena, default = search for it
+ *            tcaches - addresses of additional tcache_perthread_structs
+ *                      (each thread's "tcache" variable), default = none
+ * Returns:   {address, size, inuse, arena, arenas, histogram} where the first
+ *            four are parallel arrays, one entry per chunk, arena indexes
+ *            arenas, and histogram holds (size_class, inuse_count,
+ *            inuse_bytes, free_count, free_bytes) tuples
+ */
+PyObject *
+kern_Task_walkHeap (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_heap_walk *w;
+    PyObject *tcache_seq = NULL, *fast = NULL, *result = NULL;
+    uint64_t main_arena = 0, *tcaches = NULL;
+    Py_ssize_t ntcaches = 0, i;
+    int ret;
+
+    static char *kwlist[] = {"arena", "tcaches", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|KO", kwlist,
+                                      &main_arena, &tcache_seq))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (tcache_seq != NULL && tcache_seq != Py_None) {
+        fast = PySequence_Fast(tcache_seq, "tcaches must be a sequence");
+        if (fast == NULL)
+            return NULL;
+
+        ntcaches = PySequence_Fast_GET_SIZE(fast);
+        tcaches = calloc((size_t) ntcaches + 1, sizeof(uint64_t));
+        if (tcaches == NULL) {
+            Py_DECREF(fast);
+            return PyErr_NoMemory();
+        }
+
+        for (i = 0; i < ntcaches; ++i) {
+            tcaches[i] = PyInt_AsUnsignedLongLongMask(
+                PySequence_Fast_GET_ITEM(fast, i));
+        }
+        Py_DECREF(fast);
+        if (PyErr_Occurred()) {
+            free(tcaches);
+            return NULL;
+        }
+    }
+
+    w = calloc(1, sizeof(kern_heap_walk));
+    if (w != NULL) {
+        w->tags = malloc(HEAP_CACHE * sizeof(uint64_t));
+        w->cache = malloc(HEAP_CACHE * HEAP_PAGE);
+    }
+    if (w == NULL || w->tags == NULL || w->cache == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    memset(w->tags, 0xff, HEAP_CACHE * sizeof(uint64_t));
+    w->task = self;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = kern_heap_run(w, main_arena, tcaches, (size_t) ntcaches);
+    Py_END_ALLOW_THREADS
+
+    if (ret == -2)
+        PyErr_Format(kern_Error, "Could not read heap chunks from %p",
+                     (void *) (uintptr_t) w->unreadable);
+    else if (ret < 0)
+        PyErr_NoMemory();
+    else if (ret > 0)
+        PyErr_SetString(kern_Error, "Could not locate a glibc main_arena");
+    else
+        result = kern_heap_result(w);
+
+ done:
+    if (w != NULL) {
+        free(w->tags);
+        free(w->cache);
+        free(w->regions);
+        free(w->address);
+        free(w->size);
+        free(w->inuse);
+        free(w->arena);
+        free(w->free);
+        free(w);
+    }
+    free(tcaches);
+
+    return result;
+}
@@ -0,0 +1,564 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+#include <mach/mach_vm.h>
+
+#include "util.h"
+#include "kern.h"
+#include "task.h"
+#include "thread.h"
+#include "x86.h"
+#include "scratch.h"
+#include "breakpoint.h"
+#include "hook.h"
+#include "syscalls.h"
+
+/*
+ * Inline hooks. The start of the function is replaced with a jmp to a stub
+ * in scratch memory, which logs the call to a ring shared with the debugger
+ * and falls through to the trampoline: the displaced instructions,
+ * relocated, then a jmp back to the rest of the function. A hit costs
+ * tens of cycles and never stops the task.
+ *
+ * stub (rcx, rdx and rax are saved; flags needn't be at a function's entry):
+ *   push rax; push rcx; push rdx; push r11
+ *   mov rcx, RING
+ * 1: mov rax, [rcx + head]
+ *   mov rdx, rax
+ *   sub rdx, [rcx + tail]
+ *   cmp rdx, CAPACITY
+ *   jae 2f
+ *   lea rdx, [rax + 1]
+ *   lock cmpxchg [rcx + head], rdx
+ *   jnz 1b
+ *   mov r11, rdx
+ *   and eax, CAPACITY - 1
+ *   imul rax, rax, sizeof(kern_hook_record)
+ *   lea rcx, [rcx + rax + records]
+ *   (arguments, the return address, sp at entry, gs:[0], ADDRESS and
+ *    rdtsc into the record)
+ *   mov [rcx + seq], r11
+ *   jmp 3f
+ * 2: lock inc qword [rcx + dropped]
+ * 3: pop r11; pop rdx; pop rcx; pop rax
+ */
+
+static const uint8_t kern_hook_code[] = {
+    0x50, 0x51, 0x52, 0x41, 0x53, 0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x48, 0x8b, 0x41, 0x40, 0x48, 0x89, 0xc2, 0x48, 0x2b,
+    0x91, 0x80, 0x00, 0x00, 0x00, 0x48, 0x81, 0xfa, 0x00, 0x00, 0x00, 0x00,
+    0x0f, 0x83, 0x81, 0x00, 0x00, 0x00, 0x48, 0x8d, 0x50, 0x01, 0xf0, 0x48,
+    0x0f, 0xb1, 0x51, 0x40, 0x75, 0xd9, 0x49, 0x89, 0xd3, 0x25, 0x00, 0x00,
+    0x00, 0x00, 0x48, 0x6b, 0xc0, 0x60, 0x48, 0x8d, 0x8c, 0x01, 0xc0, 0x00,
+    0x00, 0x00, 0x48, 0x89, 0x79, 0x30, 0x48, 0x89, 0x71, 0x38, 0x48, 0x8b,
+    0x44, 0x24, 0x08, 0x48, 0x89, 0x41, 0x40, 0x48, 0x8b, 0x44, 0x24, 0x10,
+    0x48, 0x89, 0x41, 0x48, 0x4c, 0x89, 0x41, 0x50, 0x4c, 0x89, 0x49, 0x58,
+    0x48, 0x8b, 0x44, 0x24, 0x20, 0x48, 0x89, 0x41, 0x20, 0x48, 0x8d, 0x44,
+    0x24, 0x20, 0x48, 0x89, 0x41, 0x28, 0x65, 0x48, 0x8b, 0x04, 0x25, 0x00,
+    0x00, 0x00, 0x00, 0x48, 0x89, 0x41, 0x10, 0x48, 0xb8, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x48, 0x89, 0x41, 0x08, 0x0f, 0x31, 0x48,
+    0xc1, 0xe2, 0x20, 0x48, 0x09, 0xd0, 0x48, 0x89, 0x41, 0x18, 0x4c, 0x89,
+    0x19, 0xeb, 0x08, 0xf0, 0x48, 0xff, 0x81, 0x88, 0x00, 0x00, 0x00, 0x41,
+    0x5b, 0x5a, 0x59, 0x58,
+};
+
+/* Immediates patched into each copy of the stub */
+#define HOOK_RING       7
+#define HOOK_CAPACITY   32
+#define HOOK_MASK       58
+#define HOOK_ADDRESS    141
+
+#define HOOK_RECORDS    (64 * 1024)
+#define HOOK_INSNS      _KERN_HOOK_PATCH
+#define HOOK_TRAMPOLINE (HOOK_INSNS * _KERN_X86_RELOCATED_MAX)
+
+#define VOLATILE(x) (*(volatile __typeof__(x) *) &(x))
+
+static size_t
+kern_hook_find (struct kern_hooks *hooks, mach_vm_address_t address)
+{
+    size_t lo = 0, hi = hooks->count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (hooks->items[mid].address < address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/*
+ * Whether [address, address + size) meets the bytes a hook or a traced
+ * syscall replaced
+ */
+int
+kern_hook_overlaps (kern_TaskObj *task, mach_vm_address_t address,
+                    mach_vm_size_t size)
+{
+    struct kern_hooks *hooks = task->hooks;
+    size_t i;
+
+    if (kern_syscall_overlaps(task, address, size))
+        return 1;
+
+    if (hooks == NULL || hooks->count == 0)
+        return 0;
+
+    i = kern_hook_find(hooks, address + size);
+    if (i == 0)
+        return 0;
+
+    return address < hooks->items[i - 1].address + hooks->items[i - 1].length;
+}
+
+/*
+ * Stubs may still be running after the hooks are gone, so the ring stays
+ * allocated in the task; only our mapping of it goes
+ */
+void
+kern_hooks_free (kern_TaskObj *task)
+{
+    struct kern_hooks *hooks = task->hooks;
+
+    if (hooks == NULL)
+        return;
+
+    mach_vm_deallocate(mach_task_self(), (mach_vm_address_t) hooks->ring,
+                       KERN_HOOK_RING_SIZE(HOOK_RECORDS));
+    free(hooks->items);
+    free(hooks);
+    task->hooks = NULL;
+}
+
+static struct kern_hooks *
+kern_hooks_new (kern_TaskObj *task)
+{
+    kern_return_t kr;
+    struct kern_hooks *hooks;
+    mach_vm_address_t local;
+
+    hooks = calloc(1, sizeof(struct kern_hooks));
+    if (hooks == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    kr = kern_shared_alloc(task, KERN_HOOK_RING_SIZE(HOOK_RECORDS), &local,
+                           &hooks->remote);
+    if (kr != KERN_SUCCESS) {
+        free(hooks);
+        kern_handle_kr(kr);
+        return NULL;
+    }
+
+    hooks->ring = (kern_hook_ring *) (uintptr_t) local;
+    hooks->ring->magic = KERN_HOOK_MAGIC;
+    hooks->ring->capacity = HOOK_RECORDS;
+
+    return hooks;
+}
+
+/*
+ * Replace size bytes at address with data, the task stopped so no thread
+ * sees them half written. A thread stopped at one of the count replaced
+ * instructions at address + from[i] moves to to[i]
+ *
+ * Returns: 0, or -1 with an exception set
+ */
+int
+kern_hook_patch (kern_TaskObj *task, mach_vm_address_t address,
+                 const uint8_t *data, size_t size, const uint8_t *from,
+                 const mach_vm_address_t *to, size_t count)
+{
+    kern_return_t kr = KERN_SUCCESS;
+    PyObject *r, *threads, *type, *value, *traceback;
+    kern_ThreadObj *thread;
+    uint64_t pc;
+    Py_ssize_t i;
+    size_t j;
+    int frozen = task->frozen;
+
+    if (! frozen) {
+        r = PyObject_CallMethod((PyObject *) task, "freeze", NULL);
+        if (r == NULL)
+            return -1;
+        Py_DECREF(r);
+    }
+
+    threads = PyObject_CallMethod((PyObject *) task, "getThreads", NULL);
+    if (threads != NULL) {
+        for (i = 0; i < PyList_GET_SIZE(threads); ++i) {
+            thread = (kern_ThreadObj *) PyList_GET_ITEM(threads, i);
+            if (kern_thread_get_pc(thread, &pc) != KERN_SUCCESS ||
+                pc <= address || pc >= address + size)
+                continue;
+
+            for (j = 0; j < count; ++j)
+                if (pc == address + from[j])
+                    break;
+            kr = j < count ? kern_thread_set_pc(thread, to[j]) :
+                             KERN_FAILURE;
+            if (kr != KERN_SUCCESS)
+                break;
+        }
+        Py_DECREF(threads);
+
+        if (kr == KERN_SUCCESS)
+            kr = kern_code_write(task, address, data, size);
+        if (kr != KERN_SUCCESS)
+            kern_handle_kr(kr);
+    }
+
+    if (! frozen) {
+        PyErr_Fetch(&type, &value, &traceback);
+        r = PyObject_CallMethod((PyObject *) task, "thaw", NULL);
+        Py_XDECREF(r);
+        if (type != NULL)
+            PyErr_Restore(type, value, traceback);
+    }
+
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+/*
+ * Hook a function. Each call is then logged to a ring the debugger drains
+ * with drainHooks(), while the function carries on at nearly full speed.
+ * The instructions replaced must not be jump targets within the function.
+ * 64-bit tasks only
+ *
+ * Arguments: address - the function's first instruction
+ * Returns:   Address of the trampoline, which runs the original function
+ */
+PyObject *
+kern_Task_hook (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_return_t kr;
+    struct kern_hooks *hooks;
+    kern_hook *items, *hook;
+    kern_x86_insn insn;
+    mach_vm_address_t address, stub, trampoline, to[HOOK_INSNS], next;
+    mach_vm_size_t out_size;
+    uint8_t code[_KERN_HOOK_MAX + _KERN_X86_MAX_LENGTH], patch[_KERN_HOOK_MAX];
+    uint8_t from[HOOK_INSNS], op;
+    uint8_t out[sizeof(kern_hook_code) + HOOK_TRAMPOLINE];
+    uint32_t imm;
+    size_t i, count = 0, length = 0, n = sizeof(kern_hook_code), capacity;
+    int r;
+
+    static char *kwlist[] = {"address", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "K", kwlist, &address))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (self->ops != &kern_task_mach_ops) {
+        PyErr_SetString(kern_Error, "hooks run in live tasks only");
+        return NULL;
+    }
+
+    if (! kern_task_is64(self)) {
+        PyErr_SetString(kern_Error, "hooks run in 64-bit tasks only");
+        return NULL;
+    }
+
+    kr = kern_task_read(self, address, sizeof(code), code, &out_size);
+    if (kr != KERN_SUCCESS)
+        kr = kern_task_read(self, address, vm_page_size -
+                            (address & (vm_page_size - 1)), code, &out_size);
+    CHECK_KR(kr);
+
+    /* Only whole instructions are replaced, at most _KERN_HOOK_MAX bytes */
+    if (kern_hook_overlaps(self, address, _KERN_HOOK_MAX)) {
+        PyErr_Format(kern_Error, "already hooked near 0x%llx",
+                     (unsigned long long) address);
+        return NULL;
+    }
+
+    for (i = 0; i < _KERN_HOOK_MAX; ++i)
+        if (kern_breakpoint_slot(self, address + i)) {
+            PyErr_Format(kern_Error, "breakpoint at 0x%llx",
+                         (unsigned long long) (address + i));
+            return NULL;
+        }
+
+    /* Stub and trampoline in one slot, reachable by the jmp rel32 */
+    kr = kern_scratch_alloc(self, address, sizeof(out), &stub);
+    CHECK_KR(kr);
+    trampoline = stub + sizeof(kern_hook_code);
+
+    memcpy(out, kern_hook_code, sizeof(kern_hook_code));
+
+    /* Relocate whole instructions until there's room for the jmp */
+    while (length < _KERN_HOOK_PATCH) {
+        if (kern_x86_decode(code + length, (size_t) out_size - length, 1,
+                            &insn) < 0) {
+            PyErr_Format(kern_Error, "can't decode instruction at 0x%llx",
+                         (unsigned long long) (address + length));
+            return NULL;
+        }
+
+        r = kern_x86_relocate(code + length, &insn, 1, address + length,
+                              stub + n, out + n);
+        if (r < 0) {
+            PyErr_Format(kern_Error, "can't displace instruction at 0x%llx",
+                         (unsigned long long) (address + length));
+            return NULL;
+        }
+
+        from[count] = (uint8_t) length;
+        to[count++] = stub + n;
+        length += insn.length;
+
+        /*
+         * Every relocation ends in a jmp to the next instruction, which
+         * must be the next relocated one until the last. Calls return and
+         * jmp and ret end the function there, into bytes the patch spans
+         */
+        if (length < _KERN_HOOK_PATCH) {
+            op = code[length - insn.length + insn.opcode];
+            if (insn.branch == _KERN_X86_BRANCH_CALL ||
+                insn.branch == _KERN_X86_BRANCH_CALL_RM ||
+                insn.branch == _KERN_X86_BRANCH_JMP ||
+                (insn.map == 0 && (op == 0xc2 || op == 0xc3))) {
+                PyErr_Format(kern_Error, "function at 0x%llx too short to "
+                             "hook", (unsigned long long) address);
+                return NULL;
+            }
+
+            if (insn.branch == _KERN_X86_BRANCH_NONE) {
+                r -= 14;
+            } else {
+                next = stub + n + r;
+                memcpy(out + n + r - 8, &next, 8);
+            }
+        }
+
+        n += r;
+    }
+
+    if (self->hooks == NULL && (self->hooks = kern_hooks_new(self)) == NULL)
+        return NULL;
+    hooks = self->hooks;
+
+    memcpy(out + HOOK_RING, &hooks->remote, 8);
+    imm = HOOK_RECORDS;
+    memcpy(out + HOOK_CAPACITY, &imm, 4);
+    imm = HOOK_RECORDS - 1;
+    memcpy(out + HOOK_MASK, &imm, 4);
+    memcpy(out + HOOK_ADDRESS, &address, 8);
+
+    /* jmp stub, then int3 over what's left of the last instruction */
+    patch[0] = 0xe9;
+    imm = (uint32_t) (stub - (address + 5));
+    memcpy(patch + 1, &imm, 4);
+    memset(patch + _KERN_HOOK_PATCH, 0xcc, length - _KERN_HOOK_PATCH);
+
+    if (hooks->count == hooks->capacity) {
+        capacity = hooks->capacity ? hooks->capacity * 2 : 16;
+        items = realloc(hooks->items, capacity * sizeof(kern_hook));
+        if (items == NULL)
+            return PyErr_NoMemory();
+        hooks->items = items;
+        hooks->capacity = capacity;
+    }
+
+    /* The stub must be in place before any thread can take the jmp */
+    kr = kern_scratch_write(self, stub, out, (mach_vm_size_t) n);
+    CHECK_KR(kr);
+
+    if (kern_hook_patch(self, address, patch, length, from, to, count) < 0)
+        return NULL;
+
+    i = kern_hook_find(hooks, address);
+    memmove(&hooks->items[i + 1], &hooks->items[i],
+            (hooks->count - i) * sizeof(kern_hook));
+    hook = &hooks->items[i];
+    hook->address = address;
+    hook->stub = stub;
+    hook->trampoline = trampoline;
+    hook->length = (uint8_t) length;
+    memcpy(hook->original, code, length);
+    hooks->count++;
+
+    return PyLong_FromUnsignedLongLong(trampoline);
+}
+
+/*
+ * Remove a hook. Its stub and trampoline stay valid for threads already in
+ * them, and calls they log can still turn up in drainHooks()
+ *
+ * Arguments: address - hooked function
+ * Returns:   None
+ */
+PyObject *
+kern_Task_unhook (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    struct kern_hooks *hooks = self->hooks;
+    kern_hook *hook;
+    mach_vm_address_t address;
+    size_t i;
+
+    static char *kwlist[] = {"address", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "K", kwlist, &address))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    i = hooks != NULL ? kern_hook_find(hooks, address) : 0;
+    if (hooks == NULL || i == hooks->count ||
+        hooks->items[i].address != address) {
+        PyErr_Format(PyExc_KeyError, "no hook at 0x%llx",
+                     (unsigned long long) address);
+        return NULL;
+    }
+
+    /* No thread can be inside the patch: it's a jmp then int3s */
+    hook = &hooks->items[i];
+    if (kern_hook_patch(self, address, hook->original, hook->length, NULL,
+                        NULL, 0) < 0)
+        return NULL;
+
+    memmove(&hooks->items[i], &hooks->items[i + 1],
+            (hooks->count - i - 1) * sizeof(kern_hook));
+    hooks->count--;
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Get the task's hooks
+ *
+ * Arguments: None
+ * Returns:   Dictionary of hooked function address to trampoline address
+ */
+PyObject *
+kern_Task_getHooks (kern_TaskObj *self)
+{
+    PyObject *result, *key, *value;
+    size_t i;
+
+    result = PyDict_New();
+    if (result == NULL || self->hooks == NULL)
+        return result;
+
+    for (i = 0; i < self->hooks->count; ++i) {
+        key = PyLong_FromUnsignedLongLong(self->hooks->items[i].address);
+        value = PyLong_FromUnsignedLongLong(self->hooks->items[i].trampoline);
+        if (key == NULL || value == NULL ||
+            PyDict_SetItem(result, key, value) < 0) {
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(key);
+        Py_DECREF(value);
+    }
+
+    return result;
+}
+
+/*
+ * Take the calls logged by hooks since the last drain, oldest first. The
+ * task isn't stopped; records still being written are left for next time
+ *
+ * Arguments: limit - most records to take, default = 0 (all)
+ * Returns:   ([(address, thread, time, caller, sp, args)], dropped), thread
+ *            being the caller's pthread_t, time its TSC, sp the stack
+ *            pointer at entry (at the return address), args the six
+ *            integer argument registers; dropped counts calls lost to a
+ *            full ring since the last drain
+ */
+PyObject *
+kern_Task_drainHooks (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    struct kern_hooks *hooks = self->hooks;
+    kern_hook_ring *ring;
+    kern_hook_record record;
+    PyObject *records, *item;
+    uint64_t tail, dropped;
+    unsigned long long limit = 0, count;
+
+    static char *kwlist[] = {"limit", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|K", kwlist, &limit))
+        return NULL;
+
+    records = PyList_New(0);
+    if (records == NULL || hooks == NULL)
+        return records != NULL ? Py_BuildValue("(Ni)", records, 0) : NULL;
+
+    ring = hooks->ring;
+    tail = ring->tail;
+
+    for (count = 0; limit == 0 || count < limit; ++count) {
+        if (VOLATILE(ring->records[tail & (HOOK_RECORDS - 1)].seq) !=
+            tail + 1)
+            break;
+
+        /* Read the record after its seq, and free it after reading */
+        __sync_synchronize();
+        record = ring->records[tail & (HOOK_RECORDS - 1)];
+        __sync_synchronize();
+        ring->tail = ++tail;
+
+        item = Py_BuildValue("(KKKKK(KKKKKK))",
+                             record.address, record.thread, record.time,
+                             record.caller, record.sp, record.arg[0],
+                             record.arg[1], record.arg[2], record.arg[3],
+                             record.arg[4], record.arg[5]);
+        if (item == NULL || PyList_Append(records, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(records);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+
+    dropped = ring->dropped;
+    count = dropped - hooks->dropped;
+    hooks->dropped = dropped;
+
+    return Py_BuildValue("(NK)", records, count);
+}
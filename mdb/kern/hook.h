@@ -0,0 +1,76 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_HOOK_H
+#define _KERN_HOOK_H
+
+#include <mach/mach_types.h>
+
+#include "task.h"
+#include "x86.h"
+#include "shared.h"
+
+/* A jmp rel32 replaces at least this much of the function */
+#define _KERN_HOOK_PATCH    5
+#define _KERN_HOOK_MAX      (_KERN_HOOK_PATCH + _KERN_X86_MAX_LENGTH - 1)
+
+typedef struct {
+    mach_vm_address_t address;
+    mach_vm_address_t stub;         /* records the call, then trampoline */
+    mach_vm_address_t trampoline;   /* the displaced prologue, then back */
+    uint8_t length;                 /* bytes replaced */
+    uint8_t original[_KERN_HOOK_MAX];
+} kern_hook;
+
+struct kern_hooks {
+    kern_hook_ring *ring;           /* mapped here */
+    mach_vm_address_t remote;       /* and in the task */
+    uint64_t dropped;               /* ring->dropped at the last drain */
+    kern_hook *items;               /* sorted by address */
+    size_t count;
+    size_t capacity;
+};
+
+int kern_hook_overlaps (kern_TaskObj *task, mach_vm_address_t address,
+                        mach_vm_size_t size);
+
+int kern_hook_patch (kern_TaskObj *task, mach_vm_address_t address,
+                     const uint8_t *data, size_t size, const uint8_t *from,
+                     const mach_vm_address_t *to, size_t count);
+
+void kern_hooks_free (kern_TaskObj *task);
+
+PyObject *kern_Task_hook (kern_TaskObj *self, PyObject *args, PyObject *kwds);
+
+PyObject *kern_Task_unhook (kern_TaskObj *self, PyObject *args,
+                            PyObject *kwds);
+
+PyObject *kern_Task_getHooks (kern_TaskObj *self);
+
+PyObject *kern_Task_drainHooks (kern_TaskObj *self, PyObject *args,
+                                PyObject *kwds);
+
+#endif
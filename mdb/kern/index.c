@@ -0,0 +1,1395 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+
+#include "util.h"
+#include "kern.h"
+#include "task.h"
+#include "memory.h"
+#include "regex.h"
+#include "index.h"
+
+/*
+ * A trigram index of a task's memory, for running many searches against
+ * one frozen or saved task.
+ *
+ * Every page is broken into the trigrams starting in it (the last two run
+ * into the next page), and each trigram keeps a posting list of the pages
+ * it occurs in, as varint-coded deltas. Building is parallel: threads claim
+ * chunks of pages, collect a chunk's (trigram, page) keys, radix sort them
+ * and keep them as varint-coded deltas, and the chunks' sorted runs are
+ * merged into the posting lists. Only one chunk's keys are held uncoded per
+ * thread, so building takes about as much memory again as the finished
+ * postings. Pages with more distinct trigrams than are worth listing
+ * (compressed or random data) are marked dense instead, and always searched.
+ *
+ * A literal search looks up the needle's trigrams and only reads the pages
+ * where a match could start; a regular expression search works out what
+ * runs of bytes every match must contain (kern_regex_query_new) and scans
+ * only the pages within reach of them. The index holds no contents: matches
+ * are confirmed against the task's memory, which should still be as it was
+ * when the index was built.
+ */
+
+#define INDEX_CHUNK         (1 << 20)  /* at most 256 pages, for the keys */
+#define INDEX_MAX_THREADS   32
+#define INDEX_GRAMS         (1 << 24)
+#define INDEX_DENSE         2048    /* distinct grams that make a page dense */
+#define INDEX_MAX_SET       4       /* widest byte set expanded into grams */
+#define INDEX_RADIX_BITS    16
+#define REGEX_CHUNK         (1 << 20)
+
+#define GRAM(p)  ((uint32_t) (p)[0] << 16 | (uint32_t) (p)[1] << 8 | (p)[2])
+
+typedef struct {
+    mach_vm_address_t address;
+    mach_vm_size_t size;
+    size_t slot;                /* number of the chunk's first page */
+    int first;                  /* starts a region */
+    uint8_t *run;               /* sorted keys, as varint-coded deltas */
+    size_t run_size, nkeys;
+    size_t head;                /* merge position in run */
+    uint32_t key;               /* and the key there */
+} kern_index_chunk;
+
+typedef struct {
+    kern_TaskObj *task;
+    kern_index_chunk *chunks;
+    size_t nchunks, capacity;
+    size_t npages;
+    int resident;
+    uint8_t *flags;
+    size_t next;                /* next chunk to claim */
+} kern_index_job;
+
+typedef struct {
+    kern_index_job *job;
+    uint32_t *keys;             /* gram << 8 | page in the chunk */
+    uint32_t *tmp;              /* for sorting them */
+    size_t *count;
+    size_t nkeys, capacity;
+    int nomem;
+} kern_index_worker;
+
+typedef struct {
+    uint32_t *p;
+    size_t n;
+    int all;
+} kern_pageset;
+
+/* Building */
+
+static int
+kern_index_add (kern_index_job *job, mach_vm_address_t address,
+                mach_vm_address_t end)
+{
+    kern_index_chunk *chunk;
+    mach_vm_size_t size;
+    int first = 1;
+    void *p;
+
+    for (; address < end; address += size, first = 0) {
+        size = end - address;
+        if (size > INDEX_CHUNK)
+            size = INDEX_CHUNK;
+
+        if (job->nchunks == job->capacity) {
+            job->capacity = job->capacity ? job->capacity * 2 : 256;
+            p = realloc(job->chunks, job->capacity * sizeof(*job->chunks));
+            if (p == NULL)
+                return -1;
+            job->chunks = p;
+        }
+
+        chunk = &job->chunks[job->nchunks++];
+        memset(chunk, 0, sizeof(*chunk));
+        chunk->address = address;
+        chunk->size = size;
+        chunk->slot = job->npages;
+        chunk->first = first;
+        job->npages += (size_t) (size / vm_page_size);
+    }
+
+    return 0;
+}
+
+static int
+kern_index_plan (kern_index_job *job, int protection)
+{
+    kern_region region;
+    mach_vm_address_t end;
+
+    region.address = 0;
+
+    while (kern_task_region(job->task, &region) == KERN_SUCCESS) {
+        end = region.address + region.size;
+
+        if ((region.info.protection & protection) == protection &&
+            kern_index_add(job, region.address, end) < 0)
+            return -1;
+
+        if (end <= region.address)
+            break;
+        region.address = end;
+    }
+
+    return 0;
+}
+
+static int
+kern_index_key (kern_index_worker *w, uint32_t gram, size_t page)
+{
+    void *p;
+
+    if (w->nkeys == w->capacity) {
+        w->capacity = w->capacity ? w->capacity * 2 : 1 << 16;
+        p = realloc(w->keys, w->capacity * sizeof(uint32_t));
+        if (p == NULL)
+            return -1;
+        w->keys = p;
+        p = realloc(w->tmp, w->capacity * sizeof(uint32_t));
+        if (p == NULL)
+            return -1;
+        w->tmp = p;
+    }
+
+    w->keys[w->nkeys++] = gram << 8 | (uint32_t) page;
+
+    return 0;
+}
+
+/* LSD radix sort of the 32-bit keys, in an even number of passes */
+static void
+kern_index_sort (kern_index_worker *w)
+{
+    uint32_t *src = w->keys, *dst = w->tmp, *t;
+    size_t *count = w->count, i, sum, c;
+    unsigned shift;
+
+    for (shift = 0; shift < 32; shift += INDEX_RADIX_BITS) {
+        memset(count, 0, (1 << INDEX_RADIX_BITS) * sizeof(size_t));
+        for (i = 0; i < w->nkeys; ++i)
+            count[(src[i] >> shift) & ((1 << INDEX_RADIX_BITS) - 1)]++;
+
+        for (i = 0, sum = 0; i < (1 << INDEX_RADIX_BITS); ++i) {
+            c = count[i];
+            count[i] = sum;
+            sum += c;
+        }
+
+        for (i = 0; i < w->nkeys; ++i)
+            dst[count[(src[i] >> shift) &
+                      ((1 << INDEX_RADIX_BITS) - 1)]++] = src[i];
+
+        t = src;
+        src = dst;
+        dst = t;
+    }
+}
+
+/* Sort the worker's keys and move them into the chunk, varint coded */
+static int
+kern_index_compact (kern_index_worker *w, kern_index_chunk *chunk)
+{
+    uint32_t delta, last = 0;
+    size_t i, size = 0;
+    uint8_t *out;
+
+    kern_index_sort(w);
+
+    for (i = 0; i < w->nkeys; ++i) {
+        for (delta = w->keys[i] - last; delta >= 0x80; delta >>= 7)
+            size++;
+        size++;
+        last = w->keys[i];
+    }
+
+    if ((chunk->run = malloc(size + 1)) == NULL)
+        return -1;
+
+    out = chunk->run;
+    for (i = 0, last = 0; i < w->nkeys; ++i) {
+        for (delta = w->keys[i] - last; delta >= 0x80; delta >>= 7)
+            *out++ = (uint8_t) (delta | 0x80);
+        *out++ = (uint8_t) delta;
+        last = w->keys[i];
+    }
+
+    chunk->run_size = size;
+    chunk->nkeys = w->nkeys;
+    w->nkeys = 0;
+
+    return 0;
+}
+
+/* Add the distinct grams of one page; avail counts bytes from its start */
+static int
+kern_index_page (kern_index_worker *w, const uint8_t *data, size_t avail,
+                 kern_index_chunk *chunk, size_t page, uint8_t *seen,
+                 uint32_t *list)
+{
+    size_t i, n = 0, end;
+    uint32_t g;
+    int r = 0;
+
+    end = avail < vm_page_size + 2 ? avail - 2 : vm_page_size;
+
+    for (i = 0; i < end; ++i) {
+        g = GRAM(data + i);
+        if (seen[g >> 3] & (1 << (g & 7)))
+            continue;
+        seen[g >> 3] |= (uint8_t) (1 << (g & 7));
+        list[n++] = g;
+    }
+
+    if (n > INDEX_DENSE)
+        w->job->flags[chunk->slot + page] |= _KERN_INDEX_DENSE;
+
+    for (i = 0; i < n; ++i) {
+        if (n <= INDEX_DENSE && r == 0)
+            r = kern_index_key(w, list[i], page);
+        seen[list[i] >> 3] = 0;
+    }
+
+    return r;
+}
+
+static void *
+kern_index_run (void *arg)
+{
+    kern_index_worker *w = arg;
+    kern_index_job *job = w->job;
+    kern_index_chunk *chunk;
+    mach_vm_size_t out_size;
+    uint8_t *buf, *valid, *seen, tail[1];
+    uint32_t *list;
+    size_t i, j, n, avail;
+
+    buf = malloc(INDEX_CHUNK + 2);
+    valid = malloc(INDEX_CHUNK / vm_page_size / 8 + 2);
+    seen = calloc(INDEX_GRAMS / 8, 1);
+    list = malloc(vm_page_size * sizeof(uint32_t));
+    w->count = malloc((1 << INDEX_RADIX_BITS) * sizeof(size_t));
+    if (buf == NULL || valid == NULL || seen == NULL || list == NULL ||
+        w->count == NULL)
+        goto nomem;
+
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->nchunks) {
+        chunk = &job->chunks[i];
+        n = (size_t) (chunk->size / vm_page_size);
+
+        if (! job->resident &&
+            kern_task_read(job->task, chunk->address, chunk->size, buf,
+                           &out_size) == KERN_SUCCESS &&
+            out_size == chunk->size)
+            memset(valid, 0xff, (n + 7) / 8);
+        else if (job->resident)
+            kern_memory_read_resident(job->task, chunk->address, chunk->size,
+                                      buf, valid);
+        else
+            kern_memory_read_partial(job->task, chunk->address, chunk->size,
+                                     buf, valid);
+
+        /* The grams starting at the end of the chunk run into the next */
+        tail[0] = 0;
+        if (i + 1 < job->nchunks && ! job->chunks[i + 1].first) {
+            if (job->resident)
+                kern_memory_read_resident(job->task,
+                                          chunk->address + chunk->size, 2,
+                                          buf + chunk->size, tail);
+            else
+                kern_memory_read_partial(job->task,
+                                         chunk->address + chunk->size, 2,
+                                         buf + chunk->size, tail);
+        }
+
+        for (j = 0; j < n; ++j) {
+            if (! (valid[j >> 3] & (1 << (j & 7))))
+                continue;
+            job->flags[chunk->slot + j] |= _KERN_INDEX_VALID;
+
+            if (j + 1 < n)
+                avail = valid[(j + 1) >> 3] & (1 << ((j + 1) & 7)) ?
+                        vm_page_size + 2 : vm_page_size;
+            else
+                avail = tail[0] & 1 ? vm_page_size + 2 : vm_page_size;
+
+            if (kern_index_page(w, buf + j * vm_page_size, avail, chunk, j,
+                                seen, list) < 0)
+                goto nomem;
+        }
+
+        if (kern_index_compact(w, chunk) < 0)
+            goto nomem;
+    }
+
+    free(buf);
+    free(valid);
+    free(seen);
+    free(list);
+
+    return NULL;
+
+ nomem:
+    /* Let the other threads finish up rather than take on more */
+    job->next = job->nchunks;
+    w->nomem = 1;
+    free(buf);
+    free(valid);
+    free(seen);
+    free(list);
+
+    return NULL;
+}
+
+static int
+kern_index_append (kern_IndexObj *self, size_t *capacity, size_t need)
+{
+    uint8_t *p;
+    size_t n = *capacity ? *capacity : 1 << 16;
+
+    if (self->postings_size + need <= *capacity)
+        return 0;
+
+    while (n < self->postings_size + need)
+        n *= 2;
+    if ((p = realloc(self->postings, n)) == NULL)
+        return -1;
+
+    self->postings = p;
+    *capacity = n;
+
+    return 0;
+}
+
+/* Decode the chunk's next key, or return 0 at the end of its run */
+static int
+kern_index_next (kern_index_chunk *chunk)
+{
+    uint32_t delta = 0;
+    unsigned shift = 0;
+    uint8_t b;
+
+    if (chunk->head == chunk->run_size)
+        return 0;
+
+    do {
+        b = chunk->run[chunk->head++];
+        delta |= (uint32_t) (b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    chunk->key += delta;
+
+    return 1;
+}
+
+/* Heap order: by gram, then by chunk, so a gram's pages come out in order */
+static int
+kern_index_before (kern_index_chunk *chunks, size_t a, size_t b)
+{
+    return (chunks[a].key >> 8) < (chunks[b].key >> 8) ||
+           ((chunks[a].key >> 8) == (chunks[b].key >> 8) && a < b);
+}
+
+static void
+kern_index_sift (kern_index_chunk *chunks, size_t *heap, size_t n, size_t i)
+{
+    size_t child, t;
+
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n &&
+            kern_index_before(chunks, heap[child + 1], heap[child]))
+            child++;
+        if (! kern_index_before(chunks, heap[child], heap[i]))
+            break;
+        t = heap[i];
+        heap[i] = heap[child];
+        heap[child] = t;
+        i = child;
+    }
+}
+
+/* Merge the chunks' sorted runs into posting lists, freeing them as we go */
+static int
+kern_index_merge (kern_IndexObj *self, kern_index_job *job)
+{
+    kern_index_chunk *chunk;
+    uint32_t gram, page, delta, last = 0;
+    size_t capacity = 0, grams_capacity = 0, *heap, n = 0, i;
+    uint8_t *out;
+    void *p;
+    int r = -1;
+
+    if ((heap = malloc(job->nchunks * sizeof(size_t) + 1)) == NULL)
+        return -1;
+
+    self->npostings = 0;
+    for (i = 0; i < job->nchunks; ++i) {
+        self->npostings += job->chunks[i].nkeys;
+        if (kern_index_next(&job->chunks[i]))
+            heap[n++] = i;
+    }
+    for (i = n / 2; i-- > 0; )
+        kern_index_sift(job->chunks, heap, n, i);
+
+    while (n > 0) {
+        chunk = &job->chunks[heap[0]];
+        gram = chunk->key >> 8;
+
+        if (self->ngrams == 0 || self->grams[self->ngrams - 1] != gram) {
+            if (self->ngrams + 1 >= grams_capacity) {
+                grams_capacity = grams_capacity ? grams_capacity * 2 : 4096;
+                if ((p = realloc(self->grams,
+                                 grams_capacity * sizeof(uint32_t))) == NULL)
+                    goto out;
+                self->grams = p;
+                if ((p = realloc(self->offsets,
+                                 grams_capacity * sizeof(uint64_t))) == NULL)
+                    goto out;
+                self->offsets = p;
+            }
+            self->grams[self->ngrams] = gram;
+            self->offsets[self->ngrams++] = self->postings_size;
+            last = 0;
+        }
+
+        /* All of the gram's pages in this chunk, then the next chunk's */
+        do {
+            if (kern_index_append(self, &capacity, 5) < 0)
+                goto out;
+
+            /* Deltas from the last page + 1, so the first can be 0 */
+            page = (uint32_t) chunk->slot + (chunk->key & 0xff);
+            out = self->postings + self->postings_size;
+            for (delta = page + 1 - last; delta >= 0x80; delta >>= 7)
+                *out++ = (uint8_t) (delta | 0x80);
+            *out++ = (uint8_t) delta;
+            self->postings_size = (size_t) (out - self->postings);
+            last = page + 1;
+
+            if (! kern_index_next(chunk)) {
+                free(chunk->run);
+                chunk->run = NULL;
+                heap[0] = heap[--n];
+                break;
+            }
+        } while (chunk->key >> 8 == gram);
+
+        kern_index_sift(job->chunks, heap, n, 0);
+    }
+
+    if (self->offsets == NULL &&
+        (self->offsets = malloc(sizeof(uint64_t))) == NULL)
+        goto out;
+    self->offsets[self->ngrams] = self->postings_size;
+
+    r = 0;
+
+ out:
+    free(heap);
+
+    return r;
+}
+
+static int
+kern_index_build (kern_IndexObj *self, int protection, int resident,
+                  int nthreads)
+{
+    kern_index_worker workers[INDEX_MAX_THREADS];
+    pthread_t threads[INDEX_MAX_THREADS];
+    kern_index_job job;
+    size_t i, j, n;
+    int k, started = 0, r = -1;
+
+    memset(&job, 0, sizeof(job));
+    memset(workers, 0, sizeof(workers));
+    job.task = self->task;
+    job.resident = resident;
+
+    if (kern_index_plan(&job, protection) < 0)
+        goto out;
+
+    if (job.npages > UINT32_MAX)
+        goto out;
+
+    self->npages = job.npages;
+    self->pages = malloc(job.npages * sizeof(uint64_t) + 1);
+    self->flags = job.flags = calloc(job.npages + 1, 1);
+    if (self->pages == NULL || self->flags == NULL)
+        goto out;
+
+    for (i = 0; i < job.nchunks; ++i) {
+        n = (size_t) (job.chunks[i].size / vm_page_size);
+        for (j = 0; j < n; ++j)
+            self->pages[job.chunks[i].slot + j] =
+                job.chunks[i].address + j * vm_page_size;
+        if (job.chunks[i].first && n > 0)
+            job.flags[job.chunks[i].slot] |= _KERN_INDEX_FIRST;
+    }
+
+    for (k = 0; k < nthreads; ++k)
+        workers[k].job = &job;
+
+    /* The calling thread works too; a thread that can't start is no loss */
+    for (k = 1; k < nthreads && k < (int) job.nchunks; ++k) {
+        if (pthread_create(&threads[started], NULL, kern_index_run,
+                           &workers[k]) != 0)
+            break;
+        started++;
+    }
+
+    kern_index_run(&workers[0]);
+
+    for (k = 0; k < started; ++k)
+        pthread_join(threads[k], NULL);
+
+    for (k = 0; k <= started; ++k)
+        if (workers[k].nomem)
+            goto out;
+
+    if (kern_index_merge(self, &job) < 0)
+        goto out;
+
+    for (i = 0; i < self->npages; ++i)
+        if (self->flags[i] & _KERN_INDEX_DENSE)
+            self->ndense++;
+    self->dense = malloc(self->ndense * sizeof(uint32_t) + 1);
+    if (self->dense == NULL)
+        goto out;
+    for (i = 0, n = 0; i < self->npages; ++i)
+        if (self->flags[i] & _KERN_INDEX_DENSE)
+            self->dense[n++] = (uint32_t) i;
+
+    r = 0;
+
+ out:
+    for (k = 0; k < INDEX_MAX_THREADS; ++k) {
+        free(workers[k].keys);
+        free(workers[k].tmp);
+        free(workers[k].count);
+    }
+    for (i = 0; i < job.nchunks; ++i)
+        free(job.chunks[i].run);
+    free(job.chunks);
+
+    return r;
+}
+
+/* Queries */
+
+/* Decode the posting list of gram, empty if it's not in the index */
+static int
+kern_index_postings (kern_IndexObj *self, uint32_t gram, kern_pageset *set)
+{
+    const uint8_t *p, *end;
+    size_t lo = 0, hi = self->ngrams, mid;
+    uint32_t page = 0, delta;
+    unsigned shift;
+
+    memset(set, 0, sizeof(*set));
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (self->grams[mid] < gram)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == self->ngrams || self->grams[lo] != gram)
+        return 0;
+
+    p = self->postings + self->offsets[lo];
+    end = self->postings + self->offsets[lo + 1];
+
+    /* At most one byte per posting */
+    set->p = malloc((size_t) (end - p) * sizeof(uint32_t) + 1);
+    if (set->p == NULL)
+        return -1;
+
+    while (p < end) {
+        for (delta = 0, shift = 0; *p & 0x80; shift += 7)
+            delta |= (uint32_t) (*p++ & 0x7f) << shift;
+        delta |= (uint32_t) *p++ << shift;
+
+        page += delta;
+        set->p[set->n++] = page - 1;
+    }
+
+    return 0;
+}
+
+/* Whether set holds a page in [lo, hi] */
+static int
+kern_pageset_any (const uint32_t *p, size_t n, uint32_t lo, uint32_t hi)
+{
+    size_t a = 0, b = n, mid;
+
+    while (a < b) {
+        mid = a + (b - a) / 2;
+        if (p[mid] < lo)
+            a = mid + 1;
+        else
+            b = mid;
+    }
+
+    return a < n && p[a] <= hi;
+}
+
+static int
+kern_u32_cmp (const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sort and drop duplicates */
+static void
+kern_pageset_unique (kern_pageset *set)
+{
+    size_t i, n = 0;
+
+    qsort(set->p, set->n, sizeof(uint32_t), kern_u32_cmp);
+    for (i = 0; i < set->n; ++i)
+        if (n == 0 || set->p[n - 1] != set->p[i])
+            set->p[n++] = set->p[i];
+    set->n = n;
+}
+
+/* Every page from which one in set is at most w pages ahead */
+static int
+kern_pageset_dilate (kern_pageset *set, uint32_t w)
+{
+    uint32_t *out, lo, page;
+    size_t i, n = 0;
+    int64_t next = 0;
+
+    if (w == 0 || set->n == 0)
+        return 0;
+
+    out = malloc(set->n * ((size_t) w + 1) * sizeof(uint32_t));
+    if (out == NULL)
+        return -1;
+
+    for (i = 0; i < set->n; ++i) {
+        lo = set->p[i] > w ? set->p[i] - w : 0;
+        if ((int64_t) lo < next)
+            lo = (uint32_t) next;
+        for (page = lo; page <= set->p[i]; ++page)
+            out[n++] = page;
+        next = (int64_t) set->p[i] + 1;
+    }
+
+    free(set->p);
+    set->p = out;
+    set->n = n;
+
+    return 0;
+}
+
+/* a = a AND b, or a OR b; frees b */
+static int
+kern_pageset_combine (kern_pageset *a, kern_pageset *b, int op)
+{
+    uint32_t *out;
+    size_t i = 0, j = 0, n = 0;
+
+    /* Everything AND b is b; everything OR b is everything */
+    if (a->all || b->all) {
+        if (op == _KERN_QUERY_AND && a->all) {
+            *a = *b;
+        } else if (op == _KERN_QUERY_AND) {
+            free(b->p);
+        } else {
+            free(a->p);
+            free(b->p);
+            memset(a, 0, sizeof(*a));
+            a->all = 1;
+        }
+        return 0;
+    }
+
+    out = malloc((a->n + b->n) * sizeof(uint32_t) + 1);
+    if (out == NULL) {
+        free(b->p);
+        return -1;
+    }
+
+    while (i < a->n && j < b->n) {
+        if (a->p[i] == b->p[j]) {
+            out[n++] = a->p[i++];
+            j++;
+        } else if (a->p[i] < b->p[j]) {
+            if (op == _KERN_QUERY_OR)
+                out[n++] = a->p[i];
+            i++;
+        } else {
+            if (op == _KERN_QUERY_OR)
+                out[n++] = b->p[j];
+            j++;
+        }
+    }
+    if (op == _KERN_QUERY_OR) {
+        for (; i < a->n; ++i)
+            out[n++] = a->p[i];
+        for (; j < b->n; ++j)
+            out[n++] = b->p[j];
+    }
+
+    free(a->p);
+    free(b->p);
+    a->p = out;
+    a->n = n;
+
+    return 0;
+}
+
+/* The bytes in a position's set, or 0 if there are too many to expand */
+static int
+kern_index_set_bytes (const uint8_t *set, uint8_t *bytes)
+{
+    int c, n = 0;
+
+    for (c = 0; c < 256; ++c) {
+        if (! (set[c >> 3] & (1 << (c & 7))))
+            continue;
+        if (n == INDEX_MAX_SET)
+            return 0;
+        bytes[n++] = (uint8_t) c;
+    }
+
+    return n;
+}
+
+/* Pages from which any spelling of a trigram, or a dense page, is within w */
+static int
+kern_index_gram_pages (kern_IndexObj *self, uint8_t bytes[3][INDEX_MAX_SET],
+                       const int *nb, uint32_t w, kern_pageset *set)
+{
+    kern_pageset list;
+    uint32_t *p;
+    int a, b, c;
+
+    set->all = 0;
+    set->n = self->ndense;
+    set->p = malloc(self->ndense * sizeof(uint32_t) + 1);
+    if (set->p == NULL)
+        return -1;
+    memcpy(set->p, self->dense, self->ndense * sizeof(uint32_t));
+
+    for (a = 0; a < nb[0]; ++a)
+        for (b = 0; b < nb[1]; ++b)
+            for (c = 0; c < nb[2]; ++c) {
+                if (kern_index_postings(self, (uint32_t) bytes[0][a] << 16 |
+                                        (uint32_t) bytes[1][b] << 8 |
+                                        bytes[2][c], &list) < 0)
+                    return -1;
+                if (list.n == 0)
+                    continue;
+
+                p = realloc(set->p, (set->n + list.n) * sizeof(uint32_t));
+                if (p == NULL) {
+                    free(list.p);
+                    return -1;
+                }
+                set->p = p;
+                memcpy(set->p + set->n, list.p, list.n * sizeof(uint32_t));
+                set->n += list.n;
+                free(list.p);
+            }
+
+    kern_pageset_unique(set);
+
+    return kern_pageset_dilate(set, w);
+}
+
+/*
+ * Pages from which every trigram of a run is within w pages. Trigrams with
+ * a position too wide to expand are left out
+ */
+static int
+kern_index_run_pages (kern_IndexObj *self, kern_regex_query *q, uint32_t w,
+                      kern_pageset *out)
+{
+    uint8_t bytes[3][INDEX_MAX_SET];
+    kern_pageset set;
+    int nb[3];
+    size_t i;
+
+    memset(out, 0, sizeof(*out));
+    out->all = 1;
+
+    for (i = 0; i + 3 <= q->length; ++i) {
+        nb[0] = kern_index_set_bytes(q->sets[i], bytes[0]);
+        nb[1] = kern_index_set_bytes(q->sets[i + 1], bytes[1]);
+        nb[2] = kern_index_set_bytes(q->sets[i + 2], bytes[2]);
+        if (nb[0] == 0 || nb[1] == 0 || nb[2] == 0)
+            continue;
+
+        if (kern_index_gram_pages(self, bytes, nb, w, &set) < 0) {
+            free(set.p);
+            free(out->p);
+            return -1;
+        }
+        if (kern_pageset_combine(out, &set, _KERN_QUERY_AND) < 0) {
+            free(out->p);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+kern_index_eval (kern_IndexObj *self, kern_regex_query *q, uint32_t w,
+                 kern_pageset *out)
+{
+    kern_regex_query *c;
+    kern_pageset set;
+
+    memset(out, 0, sizeof(*out));
+
+    switch (q->op) {
+    case _KERN_QUERY_RUN:
+        return kern_index_run_pages(self, q, w, out);
+    case _KERN_QUERY_AND:
+    case _KERN_QUERY_OR:
+        for (c = q->child; c != NULL; c = c->next) {
+            if (kern_index_eval(self, c, w, &set) < 0) {
+                free(out->p);
+                return -1;
+            }
+            if (c == q->child) {
+                *out = set;
+            } else if (kern_pageset_combine(out, &set, q->op) < 0) {
+                free(out->p);
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    out->all = 1;
+    return 0;
+}
+
+/* Find the needle in page number i, including matches running on past it */
+static int
+kern_index_verify (kern_IndexObj *self, size_t i, const uint8_t *needle,
+                   size_t len, uint8_t *buf, uint8_t *valid,
+                   kern_regex_hits *hits)
+{
+    mach_vm_address_t address = self->pages[i];
+    size_t size = vm_page_size + len - 1, k, last;
+    const uint8_t *p, *end;
+
+    kern_memory_read_partial(self->task, address, size, buf, valid);
+    if (! (valid[0] & 1))
+        return 0;
+
+    end = buf + vm_page_size;
+    for (p = buf; p < end; ++p) {
+        p = memchr(p, needle[0], (size_t) (end - p));
+        if (p == NULL)
+            break;
+        if (memcmp(p, needle, len) != 0)
+            continue;
+
+        /* Only on into the next pages of the same region, as regexSearch */
+        last = (size_t) (p - buf + len - 1) / vm_page_size;
+        for (k = 1; k <= last; ++k)
+            if (! (valid[k >> 3] & (1 << (k & 7))) || i + k >= self->npages ||
+                (self->flags[i + k] & (_KERN_INDEX_VALID | _KERN_INDEX_FIRST))
+                != _KERN_INDEX_VALID ||
+                self->pages[i + k] != address + k * vm_page_size)
+                break;
+        if (k <= last)
+            continue;
+
+        if (kern_regex_hit(hits, address + (p - buf), len) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+kern_index_literal (kern_IndexObj *self, const uint8_t *needle, size_t len,
+                    kern_regex_hits *hits)
+{
+    kern_pageset *lists = NULL, start;
+    uint8_t *buf, *valid;
+    size_t i, j, n = len >= 3 ? len - 2 : 0;
+    uint32_t page, reach;
+    int r = -1;
+
+    buf = malloc(vm_page_size + len);
+    valid = malloc(KERN_MEMORY_VALID_SIZE(0, vm_page_size + len) + 1);
+    lists = calloc(n + 1, sizeof(kern_pageset));
+    memset(&start, 0, sizeof(start));
+    if (buf == NULL || valid == NULL || lists == NULL)
+        goto out;
+
+    /* Short needles have no trigrams, so every page is a candidate */
+    if (n == 0) {
+        for (i = 0; i < self->npages; ++i)
+            if ((self->flags[i] & _KERN_INDEX_VALID) &&
+                kern_index_verify(self, i, needle, len, buf, valid, hits) < 0)
+                goto out;
+        r = 0;
+        goto out;
+    }
+
+    for (j = 0; j < n; ++j)
+        if (kern_index_postings(self, GRAM(needle + j), &lists[j]) < 0)
+            goto out;
+
+    /* A match starts on a page listing its first trigram */
+    start.p = malloc(self->ndense * sizeof(uint32_t) + 1);
+    if (start.p == NULL)
+        goto out;
+    memcpy(start.p, self->dense, self->ndense * sizeof(uint32_t));
+    start.n = self->ndense;
+    if (kern_pageset_combine(&start, &lists[0], _KERN_QUERY_OR) < 0) {
+        lists[0].p = NULL;
+        goto out;
+    }
+    lists[0].p = NULL;
+
+    for (i = 0; i < start.n; ++i) {
+        page = start.p[i];
+
+        /* and the trigram j bytes on is on that page or one after */
+        for (j = 1; j < n; ++j) {
+            reach = page + (uint32_t) ((vm_page_size - 1 + j) / vm_page_size);
+            if (! kern_pageset_any(lists[j].p, lists[j].n, page, reach) &&
+                ! kern_pageset_any(self->dense, self->ndense, page, reach))
+                break;
+        }
+
+        if (j == n &&
+            kern_index_verify(self, page, needle, len, buf, valid, hits) < 0)
+            goto out;
+    }
+
+    r = 0;
+
+ out:
+    for (j = 0; lists != NULL && j < n; ++j)
+        free(lists[j].p);
+    free(lists);
+    free(start.p);
+    free(buf);
+    free(valid);
+
+    return r;
+}
+
+/* Scan pages [lo, hi] a region at a time, as Task.regexSearch would */
+static int
+kern_index_scan (kern_IndexObj *self, kern_regex_stream *st, size_t lo,
+                 size_t hi, kern_regex_hits *hits)
+{
+    mach_vm_address_t address;
+    mach_vm_size_t size;
+    size_t i;
+    int r;
+
+    while (lo <= hi) {
+        for (i = lo + 1; i <= hi && ! (self->flags[i] & _KERN_INDEX_FIRST) &&
+             self->pages[i] == self->pages[i - 1] + vm_page_size; ++i)
+            ;
+
+        address = self->pages[lo];
+        kern_regex_stream_reset(st, address);
+
+        for (; lo < i; lo += (size_t) (size / vm_page_size)) {
+            size = (mach_vm_size_t) (i - lo) * vm_page_size;
+            if (size > st->chunk)
+                size = st->chunk;
+
+            r = kern_regex_scan_pages(self->task, st, self->pages[lo], size,
+                                      0, hits);
+            if (r != 0)
+                return r;
+        }
+
+        r = kern_regex_stream_finish(st, kern_regex_hit, hits);
+        if (r != 0)
+            return r;
+    }
+
+    return 0;
+}
+
+static int
+kern_index_regex (kern_IndexObj *self, kern_regex *re, size_t max_length,
+                  kern_regex_stream *st, kern_regex_hits *hits)
+{
+    kern_regex_query *q;
+    kern_pageset set;
+    uint32_t w;
+    size_t i, lo, hi, last;
+    int r = 0;
+
+    /* A match starting on a page ends at most w pages on */
+    w = (uint32_t) ((vm_page_size + max_length - 2) / vm_page_size);
+
+    q = kern_regex_query_new(re);
+    if (q == NULL)
+        return -1;
+    r = kern_index_eval(self, q, w, &set);
+    kern_regex_query_free(q);
+    if (r < 0)
+        return -1;
+
+    if (set.all) {
+        for (lo = 0; lo < self->npages && r == 0; lo = hi + 1) {
+            if (! (self->flags[lo] & _KERN_INDEX_VALID)) {
+                hi = lo;
+                continue;
+            }
+            for (hi = lo; hi + 1 < self->npages &&
+                 (self->flags[hi + 1] & _KERN_INDEX_VALID); ++hi)
+                ;
+            r = kern_index_scan(self, st, lo, hi, hits);
+        }
+        return r;
+    }
+
+    /* Scan each candidate and the pages its matches could reach */
+    for (i = 0; i < set.n && r == 0; i = last) {
+        lo = set.p[i];
+        hi = MIN((size_t) set.p[i] + w, self->npages - 1);
+        for (last = i + 1; last < set.n && set.p[last] <= hi + 1; ++last)
+            hi = MIN((size_t) set.p[last] + w, self->npages - 1);
+        if (lo < self->npages)
+            r = kern_index_scan(self, st, lo, hi, hits);
+    }
+
+    free(set.p);
+
+    return r;
+}
+
+/*
+ * Find every occurrence of a string, overlapping ones included
+ *
+ * Arguments: needle - bytes to find
+ * Returns:   Array of addresses
+ */
+static PyObject *
+kern_Index_search (kern_IndexObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_regex_hits hits;
+    const char *needle;
+    PyObject *ret;
+    int size, r;
+
+    static char *kwlist[] = {"needle", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "s#", kwlist, &needle,
+                                      &size))
+        return NULL;
+
+    if (! self->task->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (size == 0 || size > INDEX_CHUNK) {
+        PyErr_SetString(PyExc_ValueError, "needle length out of range");
+        return NULL;
+    }
+
+    memset(&hits, 0, sizeof(hits));
+
+    Py_BEGIN_ALLOW_THREADS
+    r = kern_index_literal(self, (const uint8_t *) needle, (size_t) size,
+                           &hits);
+    Py_END_ALLOW_THREADS
+
+    if (r != 0 || hits.nomem) {
+        free(hits.address);
+        free(hits.length);
+        return PyErr_NoMemory();
+    }
+
+    ret = kern_array_new("L", hits.address, hits.count * 8);
+
+    free(hits.address);
+    free(hits.length);
+
+    return ret;
+}
+
+/*
+ * Search for a regular expression, as Task.regexSearch does, but only in
+ * pages within reach of what every match has to contain. Parts of matches
+ * longer than maxLength past the first aren't reported
+ *
+ * Arguments: pattern - byte regular expression
+ *            ignoreCase - ASCII case-insensitive matching, default = False
+ *            maxLength - longest match reported, default = 4096
+ * Returns:   (addresses, lengths) arrays
+ */
+static PyObject *
+kern_Index_regexSearch (kern_IndexObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_regex *re;
+    kern_regex_stream st;
+    kern_regex_hits hits;
+    PyObject *icase = NULL;
+    const char *pattern;
+    char err[128];
+    unsigned long long max_length = 4096;
+    int size, r;
+
+    static char *kwlist[] = {"pattern", "ignoreCase", "maxLength", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "s#|OK", kwlist,
+                                      &pattern, &size, &icase, &max_length))
+        return NULL;
+
+    if (! self->task->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (max_length == 0 || max_length > REGEX_CHUNK) {
+        PyErr_SetString(PyExc_ValueError, "maxLength out of range");
+        return NULL;
+    }
+
+    re = kern_regex_compile(pattern, (size_t) size,
+                            icase != NULL && PyObject_IsTrue(icase) ?
+                            _KERN_REGEX_ICASE : 0,
+                            (size_t) max_length, err, sizeof(err));
+    if (re == NULL) {
+        PyErr_SetString(PyExc_ValueError, err);
+        return NULL;
+    }
+
+    if (kern_regex_stream_init(&st, re, REGEX_CHUNK) < 0) {
+        kern_regex_free(re);
+        return PyErr_NoMemory();
+    }
+
+    memset(&hits, 0, sizeof(hits));
+
+    Py_BEGIN_ALLOW_THREADS
+    r = kern_index_regex(self, re, (size_t) max_length, &st, &hits);
+    Py_END_ALLOW_THREADS
+
+    kern_regex_stream_free(&st);
+    kern_regex_free(re);
+
+    if (r != 0 || hits.nomem) {
+        free(hits.address);
+        free(hits.length);
+        return PyErr_NoMemory();
+    }
+
+    args = Py_BuildValue("(NN)",
+                         kern_array_new("L", hits.address, hits.count * 8),
+                         kern_array_new("L", hits.length, hits.count * 8));
+
+    free(hits.address);
+    free(hits.length);
+
+    return args;
+}
+
+/*
+ * Get the size of the index
+ *
+ * Arguments: None
+ * Returns:   {pages, dense, grams, postings, bytes}
+ */
+static PyObject *
+kern_Index_stats (kern_IndexObj *self)
+{
+    size_t i, pages = 0;
+
+    for (i = 0; i < self->npages; ++i)
+        if (self->flags[i] & _KERN_INDEX_VALID)
+            pages++;
+
+    return Py_BuildValue("{s:n,s:n,s:n,s:K,s:K}",
+                         "pages", (Py_ssize_t) pages,
+                         "dense", (Py_ssize_t) self->ndense,
+                         "grams", (Py_ssize_t) self->ngrams,
+                         "postings", self->npostings,
+                         "bytes", (uint64_t) self->postings_size +
+                         self->ngrams * (sizeof(uint32_t) + sizeof(uint64_t)) +
+                         self->npages * (sizeof(uint64_t) + 1) +
+                         self->ndense * sizeof(uint32_t));
+}
+
+static void
+kern_Index_dealloc (kern_IndexObj *self)
+{
+    free(self->pages);
+    free(self->flags);
+    free(self->dense);
+    free(self->grams);
+    free(self->offsets);
+    free(self->postings);
+    Py_XDECREF(self->task);
+    self->ob_type->tp_free((PyObject *) self);
+}
+
+static PyMemberDef kern_IndexMembers[] = {
+    {"task", T_OBJECT_EX, offsetof(kern_IndexObj, task), READONLY,
+     "Indexed task"},
+    {NULL} /* Sentinel */
+};
+
+static PyMethodDef kern_IndexMethods[] = {
+    {"search", (PyCFunction)kern_Index_search, METH_KEYWORDS,
+     "Find every occurrence of a string"},
+    {"regexSearch", (PyCFunction)kern_Index_regexSearch, METH_KEYWORDS,
+     "Search the indexed pages for a regular expression"},
+    {"stats", (PyCFunction)kern_Index_stats, METH_NOARGS,
+     "Return the size of the index"},
+    {NULL} /* Sentinel */
+};
+
+PyTypeObject kern_IndexType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /* ob_size */
+    "mdb.kern.Index",          /* tp_name */
+    sizeof(kern_IndexObj),     /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    (destructor)kern_Index_dealloc, /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_compare */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,        /* tp_flags */
+    "Trigram index of a task's memory", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    kern_IndexMethods,         /* tp_methods */
+    kern_IndexMembers,         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    0,                         /* tp_new */
+};
+
+/*
+ * Build a trigram index of the task's memory for repeated searches. The
+ * index describes memory as it is now, so freeze the task first or index a
+ * saved one
+ *
+ * Arguments: protection - protection regions must have, default = READ
+ *            resident - only index resident pages, default = False
+ *            threads - worker threads, default = one per CPU up to 8
+ * Returns:   Index
+ */
+PyObject *
+kern_Task_buildIndex (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_IndexObj *index;
+    PyObject *resident = NULL;
+    int protection = VM_PROT_READ, nthreads = 0, only_resident, r;
+
+    static char *kwlist[] = {"protection", "resident", "threads", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|iOi", kwlist,
+                                      &protection, &resident, &nthreads))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (nthreads < 0 || nthreads > INDEX_MAX_THREADS) {
+        PyErr_SetString(PyExc_ValueError, "threads out of range");
+        return NULL;
+    }
+
+    if (nthreads == 0) {
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads < 1)
+            nthreads = 1;
+        else if (nthreads > 8)
+            nthreads = 8;
+    }
+
+    index = PyObject_New(kern_IndexObj, &kern_IndexType);
+    if (index == NULL)
+        return NULL;
+
+    memset((char *) index + sizeof(PyObject), 0,
+           sizeof(*index) - sizeof(PyObject));
+    Py_INCREF(self);
+    index->task = self;
+
+    only_resident = resident != NULL && PyObject_IsTrue(resident) == 1;
+
+    Py_BEGIN_ALLOW_THREADS
+    r = kern_index_build(index, protection, only_resident, nthreads);
+    Py_END_ALLOW_THREADS
+
+    if (r < 0) {
+        Py_DECREF(index);
+        return PyErr_NoMemory();
+    }
+
+    return (PyObject *) index;
+}
@@ -0,0 +1,63 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_INDEX_H
+#define _KERN_INDEX_H
+
+#include <stdint.h>
+
+#include "structmember.h"
+
+#include "task.h"
+
+extern PyTypeObject kern_IndexType;
+
+/* Per-page flags */
+#define _KERN_INDEX_VALID   0x1     /* read and indexed */
+#define _KERN_INDEX_FIRST   0x2     /* starts a region */
+#define _KERN_INDEX_DENSE   0x4     /* too many grams to list; always a
+                                       candidate */
+
+typedef struct {
+    PyObject_HEAD
+    kern_TaskObj *task;
+    uint64_t *pages;            /* address of each page */
+    uint8_t *flags;
+    size_t npages;
+    uint32_t *dense;            /* numbers of the dense pages */
+    size_t ndense;
+    uint32_t *grams;            /* trigrams present, sorted */
+    uint64_t *offsets;          /* ngrams + 1 offsets into postings */
+    size_t ngrams;
+    uint8_t *postings;          /* per gram, varint deltas of page numbers */
+    size_t postings_size;
+    uint64_t npostings;
+} kern_IndexObj;
+
+PyObject *kern_Task_buildIndex (kern_TaskObj *self, PyObject *args,
+                                PyObject *kwds);
+
+#endif
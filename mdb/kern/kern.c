@@ -29,6 +29,15 @@
 #include "task.h"
 #include "memory.h"
 #include "thread.h"
+#include "core.h"
+#include "symbols.h"
+#include "sampler.h"
+#include "text.h"
+#include "hash.h"
+#include "store.h"
+#include "remote.h"
+#include "record.h"
+#include "index.h"
 #include "kern.h"
 
 
@@ -40,6 +49,10 @@ PyObject *kern_Error,
          *kern_NotPausedError;
 
 static PyMethodDef kern_methods[] = {
+	{ "printable", (PyCFunction)kern_printable, METH_KEYWORDS,
+	  "Render the bytes around offsets for display" },
+	{ "hash", (PyCFunction)kern_hash, METH_KEYWORDS,
+	  "XXH64 of a string" },
 	{ NULL } /* Sentinel */
 };
 
@@ -61,15 +74,67 @@ initkern(void)
     if (PyType_Ready(&kern_ThreadType) < 0)
         return;
 
+    kern_CoreTaskType.tp_base = &kern_TaskType;
+    if (PyType_Ready(&kern_CoreTaskType) < 0)
+        return;
+
+    kern_CoreThreadType.tp_base = &kern_ThreadType;
+    if (PyType_Ready(&kern_CoreThreadType) < 0)
+        return;
+
+    if (PyType_Ready(&kern_StoreType) < 0)
+        return;
+
+    kern_StoreTaskType.tp_base = &kern_CoreTaskType;
+    if (PyType_Ready(&kern_StoreTaskType) < 0)
+        return;
+
+    kern_RemoteTaskType.tp_base = &kern_CoreTaskType;
+    if (PyType_Ready(&kern_RemoteTaskType) < 0)
+        return;
+
+    kern_ReplayTaskType.tp_base = &kern_CoreTaskType;
+    if (PyType_Ready(&kern_ReplayTaskType) < 0)
+        return;
+
+    if (PyType_Ready(&kern_IndexType) < 0)
+        return;
+
+    if (PyType_Ready(&kern_SymbolsType) < 0)
+        return;
+
+    if (PyType_Ready(&kern_SamplerType) < 0)
+        return;
+
     m = Py_InitModule3("mdb.kern", kern_methods,
                        "Kernel module.");
     Py_INCREF(&kern_TaskType);
     Py_INCREF(&kern_MemoryType);
     Py_INCREF(&kern_ThreadType);
+    Py_INCREF(&kern_CoreTaskType);
+    Py_INCREF(&kern_CoreThreadType);
+    Py_INCREF(&kern_StoreType);
+    Py_INCREF(&kern_StoreTaskType);
+    Py_INCREF(&kern_RemoteTaskType);
+    Py_INCREF(&kern_ReplayTaskType);
+    Py_INCREF(&kern_IndexType);
+    Py_INCREF(&kern_SymbolsType);
+    Py_INCREF(&kern_SamplerType);
 
     PyModule_AddObject(m, "Task", (PyObject *)&kern_TaskType);
     PyModule_AddObject(m, "Memory", (PyObject *)&kern_MemoryType);
     PyModule_AddObject(m, "Thread", (PyObject *)&kern_ThreadType);
+    PyModule_AddObject(m, "CoreTask", (PyObject *)&kern_CoreTaskType);
+    PyModule_AddObject(m, "CoreThread", (PyObject *)&kern_CoreThreadType);
+    PyModule_AddObject(m, "Store", (PyObject *)&kern_StoreType);
+    PyModule_AddObject(m, "StoreTask", (PyObject *)&kern_StoreTaskType);
+    PyModule_AddObject(m, "RemoteTask", (PyObject *)&kern_RemoteTaskType);
+    PyModule_AddObject(m, "ReplayTask", (PyObject *)&kern_ReplayTaskType);
+    PyModule_AddObject(m, "Index", (PyObject *)&kern_IndexType);
+    PyModule_AddObject(m, "Symbols", (PyObject *)&kern_SymbolsType);
+    PyModule_AddObject(m, "Sampler", (PyObject *)&kern_SamplerType);
+
+    PyModule_AddIntConstant(m, "pageSize", (long) vm_page_size);
 
     /*
      * ADD_EXCEPTION(dict,name,base) expands to a correct Exception declaration,
@@ -0,0 +1,220 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "lz.h"
+
+/*
+ * Block compression in the LZ4 block format: a stream of sequences, each a
+ * token (literal count, match length - 4), the literals, and a 16-bit
+ * backwards offset to the match; the last sequence is literals only. Greedy
+ * matching against a small hash table of 4-byte prefixes is enough to make
+ * short work of the zero runs, pointers and repeated structures that fill
+ * process memory.
+ */
+
+#define LZ_MIN_MATCH      4
+#define LZ_LAST_LITERALS  5     /* the format ends on at least 5 literals */
+#define LZ_MATCH_LIMIT    12    /* and no match starts in the last 12 bytes */
+#define LZ_MAX_OFFSET     65535
+#define LZ_HASH_BITS      12
+
+static inline uint32_t
+kern_lz_read32 (const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t
+kern_lz_hash (uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Encode a length beyond what fits in the token */
+static inline uint8_t *
+kern_lz_length (uint8_t *op, size_t n)
+{
+    for (; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t) n;
+
+    return op;
+}
+
+/*
+ * Compress size bytes of src into dst
+ *
+ * Arguments: src, size - input
+ *            dst, capacity - output, KERN_LZ_BOUND(size) always suffices
+ * Returns:   compressed size, or 0 if it doesn't fit in capacity
+ */
+size_t
+kern_lz_compress (const uint8_t *src, size_t size, uint8_t *dst,
+                  size_t capacity)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *ip = src, *anchor = src, *end = src + size, *ref;
+    const uint8_t *limit = end - LZ_LAST_LITERALS;
+    uint8_t *op = dst, *oend = dst + capacity, *token;
+    size_t literals, length, misses = 0;
+    uint32_t h;
+
+    memset(table, 0, sizeof(table));
+
+    if (size > LZ_MATCH_LIMIT) {
+        while (ip < end - LZ_MATCH_LIMIT) {
+            h = kern_lz_hash(kern_lz_read32(ip));
+            ref = src + table[h];
+            table[h] = (uint32_t) (ip - src);
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+                kern_lz_read32(ref) != kern_lz_read32(ip)) {
+                /* Skip faster through incompressible data */
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            for (length = LZ_MIN_MATCH; ip + length < limit &&
+                 ip[length] == ref[length]; ++length)
+                ;
+
+            literals = (size_t) (ip - anchor);
+            if (op + 1 + literals + literals / 255 + 3 + length / 255 + 1 >
+                oend)
+                return 0;
+
+            token = op++;
+            *token = (uint8_t) ((literals < 15 ? literals : 15) << 4);
+            if (literals >= 15)
+                op = kern_lz_length(op, literals - 15);
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            *op++ = (uint8_t) (ip - ref);
+            *op++ = (uint8_t) ((ip - ref) >> 8);
+
+            length -= LZ_MIN_MATCH;
+            *token |= (uint8_t) (length < 15 ? length : 15);
+            if (length >= 15)
+                op = kern_lz_length(op, length - 15);
+
+            ip += length + LZ_MIN_MATCH;
+            anchor = ip;
+        }
+    }
+
+    literals = (size_t) (end - anchor);
+    if (op + 1 + literals + literals / 255 + 1 > oend)
+        return 0;
+
+    token = op++;
+    *token = (uint8_t) ((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15)
+        op = kern_lz_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return (size_t) (op - dst);
+}
+
+/*
+ * Decompress a block, checking every length and offset against the buffers
+ *
+ * Arguments: src, size - compressed block
+ *            dst, capacity - output
+ * Returns:   decompressed size, or -1 if the block is corrupt or too large
+ */
+int
+kern_lz_decompress (const uint8_t *src, size_t size, uint8_t *dst,
+                    size_t capacity)
+{
+    const uint8_t *ip = src, *end = src + size, *ref;
+    uint8_t *op = dst, *oend = dst + capacity;
+    size_t literals, length, offset;
+    uint8_t token, b;
+
+    while (ip < end) {
+        token = *ip++;
+
+        literals = token >> 4;
+        if (literals == 15) {
+            do {
+                if (ip >= end)
+                    return -1;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+
+        if (literals > (size_t) (end - ip) || literals > (size_t) (oend - op))
+            return -1;
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        offset = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - dst))
+            return -1;
+
+        length = token & 15;
+        if (length == 15) {
+            do {
+                if (ip >= end)
+                    return -1;
+                b = *ip++;
+                length += b;
+            } while (b == 255);
+        }
+        length += LZ_MIN_MATCH;
+
+        if (length > (size_t) (oend - op))
+            return -1;
+
+        /* Matches may overlap their own output, as in runs */
+        ref = op - offset;
+        if (offset >= length) {
+            memcpy(op, ref, length);
+            op += length;
+        } else {
+            while (length--)
+                *op++ = *ref++;
+        }
+    }
+
+    return (int) (op - dst);
+}
@@ -36,8 +36,244 @@
 #include "util.h"
 #include "task.h"
 #include "memory.h"
+#include "text.h"
+#include "agent.h"
 
 
+/*
+ * Bytes [offset, offset+size) of memory as a string, trimmed if the read
+ * comes up short
+ */
+static PyObject *
+kern_memory_read (kern_MemoryObj *self, uint64_t offset, uint64_t size)
+{
+    kern_return_t kr;
+    PyObject *data;
+    mach_vm_size_t out_size;
+
+    /* Read straight into the string's storage */
+    data = PyString_FromStringAndSize(NULL, (Py_ssize_t) size);
+    if (data == NULL)
+        return NULL;
+
+    kr = kern_task_read((kern_TaskObj *) self->task, self->address + offset,
+                        size, PyString_AS_STRING(data), &out_size);
+    if (kr != KERN_SUCCESS) {
+        Py_DECREF(data);
+        KERN_ERROR(kr);
+    }
+
+    if (out_size < size &&
+        _PyString_Resize(&data, (Py_ssize_t) out_size) < 0)
+        return NULL;
+
+    return data;
+}
+
+/*
+ * As kern_memory_read, but backends that keep the address space mapped
+ * (e.g. core files) return a buffer object over it instead of copying
+ */
+PyObject *
+kern_memory_view (kern_MemoryObj *self, uint64_t offset, uint64_t size)
+{
+    kern_TaskObj *task = (kern_TaskObj *) self->task;
+    Py_ssize_t direct;
+
+    if (task->ops->direct != NULL) {
+        direct = task->ops->direct(task, self->address + offset, size);
+        if (direct >= 0)
+            return PyBuffer_FromObject((PyObject *) task, direct,
+                                       (Py_ssize_t) size);
+    }
+
+    return kern_memory_read(self, offset, size);
+}
+
+/* Zero [lo, hi) of the read and clear its pages' bits */
+static void
+kern_memory_invalid (mach_vm_address_t base, mach_vm_address_t lo,
+                     mach_vm_address_t hi, uint8_t *buf, uint8_t *valid)
+{
+    size_t i, end;
+
+    memset(buf + (lo - base), 0, (size_t) (hi - lo));
+
+    i = (size_t) ((KERN_TRUNC_PAGE(lo) - KERN_TRUNC_PAGE(base)) /
+                  vm_page_size);
+    end = (size_t) ((KERN_ROUND_PAGE(hi) - KERN_TRUNC_PAGE(base)) /
+                    vm_page_size);
+    for (; i < end; ++i)
+        valid[i >> 3] &= (uint8_t) ~(1 << (i & 7));
+}
+
+static mach_vm_size_t
+kern_memory_partial (kern_TaskObj *task, mach_vm_address_t base,
+                     mach_vm_address_t lo, mach_vm_address_t hi,
+                     uint8_t *buf, uint8_t *valid)
+{
+    kern_return_t kr;
+    kern_region region;
+    mach_vm_address_t page, mid, end;
+    mach_vm_size_t out_size, total = 0;
+
+    while (lo < hi) {
+        kr = kern_task_read(task, lo, hi - lo, buf + (lo - base), &out_size);
+        if (kr == KERN_SUCCESS && out_size > 0) {
+            /* Short reads carry on from where they stopped */
+            total += out_size;
+            lo += out_size;
+            continue;
+        }
+
+        /* Skip holes and unreadable regions whole */
+        region.address = lo;
+        kr = kern_task_region(task, &region);
+        if (kr != KERN_SUCCESS || region.address > lo ||
+            ! (region.info.protection & VM_PROT_READ)) {
+            end = kr != KERN_SUCCESS ? hi : region.address > lo ?
+                  region.address : region.address + region.size;
+            if (end > hi)
+                end = hi;
+            kern_memory_invalid(base, lo, end, buf, valid);
+            lo = end;
+            continue;
+        }
+
+        /* The trouble is past the end of this region */
+        end = region.address + region.size;
+        if (end < hi) {
+            total += kern_memory_partial(task, base, lo, end, buf, valid);
+            lo = end;
+            continue;
+        }
+
+        page = KERN_TRUNC_PAGE(lo);
+        if (hi <= page + vm_page_size) {
+            kern_memory_invalid(base, lo, hi, buf, valid);
+            break;
+        }
+
+        /* Split on a page boundary and retry each half whole */
+        mid = KERN_TRUNC_PAGE(lo + (hi - lo) / 2);
+        if (mid <= lo)
+            mid = page + vm_page_size;
+        total += kern_memory_partial(task, base, lo, mid, buf, valid);
+        lo = mid;
+    }
+
+    return total;
+}
+
+/*
+ * Read [address, address+size) into buf, zero-filling what can't be read.
+ * valid receives a bit per page from the page containing address, LSB
+ * first, set if all of the page's bytes in the range were read. The range
+ * is read whole first, so a fully readable range costs one call. After a
+ * failure, holes and unreadable regions are skipped whole and anything
+ * else is bisected, down to single pages
+ *
+ * Returns: number of bytes read
+ */
+mach_vm_size_t
+kern_memory_read_partial (kern_TaskObj *task, mach_vm_address_t address,
+                          mach_vm_size_t size, void *buf, uint8_t *valid)
+{
+    memset(valid, 0xff, KERN_MEMORY_VALID_SIZE(address, size));
+
+    return kern_memory_partial(task, address, address, address + size, buf,
+                               valid);
+}
+
+/*
+ * Find which pages of [address, address+size) are resident, without
+ * touching them. present receives a bit per page as for
+ * kern_memory_read_partial; holes count as not resident, and backends that
+ * can't tell report every page as resident. The query is made per region
+ */
+kern_return_t
+kern_memory_residency (kern_TaskObj *task, mach_vm_address_t address,
+                       mach_vm_size_t size, uint8_t *present)
+{
+    kern_return_t kr;
+    kern_region region;
+    mach_vm_address_t base = KERN_TRUNC_PAGE(address), lo, hi,
+                      end = KERN_ROUND_PAGE(address + size);
+
+    if (task->ops->residency == NULL) {
+        memset(present, 0xff, KERN_MEMORY_VALID_SIZE(address, size));
+        return KERN_SUCCESS;
+    }
+
+    memset(present, 0, KERN_MEMORY_VALID_SIZE(address, size));
+
+    region.address = base;
+    while (region.address < end &&
+           kern_task_region(task, &region) == KERN_SUCCESS &&
+           region.address < end) {
+        lo = region.address > base ? region.address : base;
+        hi = region.address + region.size < end ?
+             region.address + region.size : end;
+
+        kr = kern_task_residency(task, lo, hi - lo, present,
+                                 (size_t) ((lo - base) / vm_page_size));
+        if (kr != KERN_SUCCESS)
+            return kr;
+
+        if (region.address + region.size <= region.address)
+            break;
+        region.address += region.size;
+    }
+
+    return KERN_SUCCESS;
+}
+
+/*
+ * As kern_memory_read_partial, but only resident pages are read; the rest
+ * are zeroed and their bits cleared, so the target's working set is left
+ * as it was
+ *
+ * Returns: number of bytes read
+ */
+mach_vm_size_t
+kern_memory_read_resident (kern_TaskObj *task, mach_vm_address_t address,
+                           mach_vm_size_t size, void *buf, uint8_t *valid)
+{
+    mach_vm_address_t base = KERN_TRUNC_PAGE(address), end = address + size,
+                      lo, hi;
+    mach_vm_size_t total = 0;
+    size_t page, npages;
+    int resident;
+
+    if (kern_memory_residency(task, address, size, valid) != KERN_SUCCESS)
+        return kern_memory_read_partial(task, address, size, buf, valid);
+
+    npages = (size_t) ((KERN_ROUND_PAGE(end) - base) / vm_page_size);
+
+    /* Read runs of resident pages, zero the rest */
+    for (page = 0; page < npages; ) {
+        resident = (valid[page >> 3] >> (page & 7)) & 1;
+
+        lo = base + page * vm_page_size;
+        while (page < npages && ((valid[page >> 3] >> (page & 7)) & 1) ==
+               resident)
+            page++;
+        hi = base + page * vm_page_size;
+
+        if (lo < address)
+            lo = address;
+        if (hi > end)
+            hi = end;
+
+        if (resident)
+            total += kern_memory_partial(task, address, lo, hi, buf, valid);
+        else
+            memset((uint8_t *) buf + (lo - address), 0, (size_t) (hi - lo));
+    }
+
+    return total;
+}
+
 /*
  * Read the specified range of memory. The range is trimmed if it exceeds the
  * size of the memory
@@ -50,8 +286,6 @@
 static PyObject *
 kern_Memory_read (kern_MemoryObj *self, PyObject *args, PyObject *kwds)
 {
-    kern_return_t kr;
-    unsigned char *buf;
     uint64_t offset = 0;
     uint64_t buf_size = self->size;
 
@@ -63,19 +297,164 @@ kern_Memory_read (kern_MemoryObj *self, PyObject *args, PyObject *kwds)
     if (offset + buf_size > self->size)
         buf_size = self->size - offset;
 
-    buf = (unsigned char *) malloc((size_t) buf_size);
-    if (buf == NULL)
+    return kern_memory_read(self, offset, buf_size);
+}
+
+/* readPartial() and readResident() */
+static PyObject *
+kern_memory_read_pages (kern_MemoryObj *self, PyObject *args, PyObject *kwds,
+                        int resident)
+{
+    PyObject *data;
+    uint8_t *valid;
+    uint64_t offset = 0;
+    uint64_t size = self->size;
+    mach_vm_address_t address;
+    size_t nvalid;
+
+    static char *kwlist[] = {"offset", "size", NULL};
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|KK", kwlist,
+                                      &offset, &size))
         return NULL;
 
-    kr = mach_vm_read_overwrite( ( (kern_TaskObj *)self->task)->port,
-                                 (vm_address_t) (self->address + offset),
-                                 (vm_size_t) buf_size,
-                                 (vm_address_t) buf,
-                                 (mach_vm_size_t *) &buf_size);
-    CHECK_KR(kr);
+    if (offset > self->size)
+        offset = self->size;
+    if (offset + size > self->size)
+        size = self->size - offset;
+
+    address = self->address + offset;
+    nvalid = KERN_MEMORY_VALID_SIZE(address, size);
+
+    data = PyString_FromStringAndSize(NULL, (Py_ssize_t) size);
+    valid = malloc(nvalid + 1);
+    if (data == NULL || valid == NULL) {
+        Py_XDECREF(data);
+        free(valid);
+        return PyErr_NoMemory();
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (resident)
+        kern_memory_read_resident((kern_TaskObj *) self->task, address, size,
+                                  PyString_AS_STRING(data), valid);
+    else
+        kern_memory_read_partial((kern_TaskObj *) self->task, address, size,
+                                 PyString_AS_STRING(data), valid);
+    Py_END_ALLOW_THREADS
+
+    args = Py_BuildValue("(NN)", data, kern_array_new("B", valid, nvalid));
+    free(valid);
+
+    return args;
+}
+
+/*
+ * Read the specified range of memory, skipping pages that can't be read
+ * rather than failing. The range is trimmed if it exceeds the size of the
+ * memory
+ *
+ * Arguments: offset - byte offset from memory start, default = 0
+ *            size - number of bytes to read, default = self->size
+ * Returns:   (data, valid) where data is a byte string with unreadable
+ *            pages zeroed, and valid an array holding a bit per page, from
+ *            the page containing the start of the range, LSB first
+ */
+static PyObject *
+kern_Memory_readPartial (kern_MemoryObj *self, PyObject *args,
+                         PyObject *kwds)
+{
+    return kern_memory_read_pages(self, args, kwds, 0);
+}
+
+/*
+ * Read the resident pages of the specified range of memory, without
+ * faulting in pages that are paged out or were never touched. The range is
+ * trimmed if it exceeds the size of the memory
+ *
+ * Arguments: offset - byte offset from memory start, default = 0
+ *            size - number of bytes to read, default = self->size
+ * Returns:   (data, valid) as for readPartial, pages not read being zeroed
+ */
+static PyObject *
+kern_Memory_readResident (kern_MemoryObj *self, PyObject *args,
+                          PyObject *kwds)
+{
+    return kern_memory_read_pages(self, args, kwds, 1);
+}
+
+/*
+ * Find which pages of the specified range of memory are resident
+ *
+ * Arguments: offset - byte offset from memory start, default = 0
+ *            size - number of bytes, default = self->size
+ * Returns:   Array holding a bit per page, from the page containing the
+ *            start of the range, LSB first
+ */
+static PyObject *
+kern_Memory_residency (kern_MemoryObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_return_t kr;
+    PyObject *result;
+    uint8_t *present;
+    uint64_t offset = 0;
+    uint64_t size = self->size;
+    size_t n;
+
+    static char *kwlist[] = {"offset", "size", NULL};
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|KK", kwlist,
+                                      &offset, &size))
+        return NULL;
+
+    if (offset > self->size)
+        offset = self->size;
+    if (offset + size > self->size)
+        size = self->size - offset;
+
+    n = KERN_MEMORY_VALID_SIZE(self->address + offset, size);
+    present = malloc(n + 1);
+    if (present == NULL)
+        return PyErr_NoMemory();
+
+    Py_BEGIN_ALLOW_THREADS
+    kr = kern_memory_residency((kern_TaskObj *) self->task,
+                               self->address + offset, size, present);
+    Py_END_ALLOW_THREADS
 
-    return PyString_FromStringAndSize((const char *) buf,
-                                      (Py_ssize_t) buf_size);
+    if (kr != KERN_SUCCESS) {
+        free(present);
+        KERN_ERROR(kr);
+    }
+
+    result = kern_array_new("B", present, n);
+    free(present);
+
+    return result;
+}
+
+/*
+ * Get a read-only view of the specified range of memory. Backends that keep
+ * the address space mapped (e.g. core files) serve the view without copying;
+ * otherwise this is equivalent to read()
+ *
+ * Arguments: offset - byte offset from memory start, default = 0
+ *            size - number of bytes, default = self->size
+ * Returns:   Buffer object or byte string
+ */
+static PyObject *
+kern_Memory_view (kern_MemoryObj *self, PyObject *args, PyObject *kwds)
+{
+    uint64_t offset = 0;
+    uint64_t size = self->size;
+
+    static char *kwlist[] = {"offset", "size", NULL};
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|KK", kwlist,
+                                      &offset, &size))
+        return NULL;
+
+    if (offset + size > self->size)
+        size = self->size - offset;
+
+    return kern_memory_view(self, offset, size);
 }
 
 /*
@@ -93,7 +472,7 @@ kern_Memory_write (kern_MemoryObj *self, PyObject *args, PyObject *kwds)
     kern_return_t kr;
     PyObject *data = NULL;
     uint64_t data_size = 0;
-    vm_address_t offset = 0;
+    uint64_t offset = 0;
     static char *kwlist[] = {"data", "offset", NULL};
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "O!|K", kwlist,
@@ -105,15 +484,33 @@ kern_Memory_write (kern_MemoryObj *self, PyObject *args, PyObject *kwds)
     if (offset + data_size > self->size)
         data_size = self->size - offset;
 
-    kr = mach_vm_write( ( (kern_TaskObj *)self->task)->port,
-                        self->address + offset,
-                        (pointer_t) PyString_AsString(data),
-                        (mach_msg_type_number_t) data_size);
+    kr = kern_task_write((kern_TaskObj *) self->task, self->address + offset,
+                         PyString_AsString(data), data_size);
     CHECK_KR(kr);
 
     Py_RETURN_NONE;
 }
 
+/*
+ * Create a Memory object covering [address, address+size) of the task
+ */
+PyObject *
+kern_memory_new (PyObject *task, uint64_t address, uint64_t size)
+{
+    kern_MemoryObj *vm;
+
+    vm = PyObject_New(kern_MemoryObj, &kern_MemoryType);
+    if (vm == NULL)
+        return NULL;
+
+    Py_INCREF(task);
+    vm->task = task;
+    vm->address = address;
+    vm->size = size;
+
+    return (PyObject *) vm;
+}
+
 static void
 kern_Memory_dealloc(kern_MemoryObj *self)
 {
@@ -173,8 +570,20 @@ static PyMemberDef kern_MemoryMembers[] = {
 static PyMethodDef kern_MemoryMethods[] = {
     {"read", (PyCFunction)kern_Memory_read, METH_KEYWORDS,
      "Read bytes of memory"},
+    {"readPartial", (PyCFunction)kern_Memory_readPartial, METH_KEYWORDS,
+     "Read bytes of memory, zero-filling unreadable pages"},
+    {"readResident", (PyCFunction)kern_Memory_readResident, METH_KEYWORDS,
+     "Read the resident pages of memory, zero-filling the rest"},
+    {"residency", (PyCFunction)kern_Memory_residency, METH_KEYWORDS,
+     "Return a bitmap of the resident pages of memory"},
+    {"view", (PyCFunction)kern_Memory_view, METH_KEYWORDS,
+     "Return a read-only view of memory, without copying where possible"},
     {"write", (PyCFunction)kern_Memory_write, METH_KEYWORDS,
      "Write bytes to memory"},
+    {"strings", (PyCFunction)kern_Memory_strings, METH_KEYWORDS,
+     "Find ASCII and UTF-16LE strings in memory"},
+    {"search", (PyCFunction)kern_Memory_search, METH_KEYWORDS,
+     "Find a byte string in memory"},
     {NULL} /* Sentinel */
 };
 
@@ -27,10 +27,13 @@
 #ifndef _KERN_MEMORY_H
 #define _KERN_MEMORY_H
 
+#include <mach/mach.h>
 #include <mach/mach_types.h>
 
 #include "structmember.h"
 
+#include "task.h"
+
 extern PyTypeObject kern_MemoryType;
 
 typedef struct {
@@ -40,4 +43,28 @@ typedef struct {
     PyObject *task;
 } kern_MemoryObj;
 
+#define KERN_TRUNC_PAGE(a) \
+    ((mach_vm_address_t) (a) & ~((mach_vm_address_t) vm_page_size - 1))
+#define KERN_ROUND_PAGE(a) KERN_TRUNC_PAGE((a) + vm_page_size - 1)
+
+/* Bytes of page bitmap for kern_memory_read_partial */
+#define KERN_MEMORY_VALID_SIZE(address, size) \
+    ((size_t) ((KERN_ROUND_PAGE((address) + (size)) - \
+                KERN_TRUNC_PAGE(address)) / vm_page_size + 7) / 8)
+
+PyObject *kern_memory_new (PyObject *task, uint64_t address, uint64_t size);
+mach_vm_size_t kern_memory_read_partial (kern_TaskObj *task,
+                                         mach_vm_address_t address,
+                                         mach_vm_size_t size, void *buf,
+                                         uint8_t *valid);
+kern_return_t kern_memory_residency (kern_TaskObj *task,
+                                     mach_vm_address_t address,
+                                     mach_vm_size_t size, uint8_t *present);
+mach_vm_size_t kern_memory_read_resident (kern_TaskObj *task,
+                                          mach_vm_address_t address,
+                                          mach_vm_size_t size, void *buf,
+                                          uint8_t *valid);
+PyObject *kern_memory_view (kern_MemoryObj *self, uint64_t offset,
+                            uint64_t size);
+
 #endif
@@ -0,0 +1,812 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+
+#include "kern.h"
+#include "task.h"
+#include "memory.h"
+#include "thread.h"
+#include "core.h"
+#include "exception.h"
+#include "record.h"
+
+/*
+ * Recordings of the events poll() delivers, and ReplayTask to play them back.
+ *
+ * A recording is a header, then one record per event, each field an unsigned
+ * LEB128 varint:
+ *
+ *   dt          ns since the previous event, or since recording started
+ *   type        EXC_*
+ *   tid
+ *   breakpoint  address of the breakpoint hit, or 0
+ *   ncodes      then each code, zigzag encoded
+ *   arch        _KERN_THREAD_ARCH_*, 0 if the registers couldn't be read
+ *   registers   21 (x86-64) or 16 (x86), each XORed with the same register
+ *               of the previous event of that arch, so unchanged ones take
+ *               a byte
+ *   size        then size bytes read at pc, then the same for sp
+ *
+ * poll() only encodes the event into a buffer; a writer thread writes the
+ * buffer out, so a slow disk never lengthens the time a thread is stopped.
+ * Events that arrive while the buffer is full are dropped and counted.
+ */
+
+#define RECORD_PENDING      (1 << 22)   /* encoded bytes waiting at most */
+#define RECORD_MAX_MEMORY   (1 << 16)   /* at pc or sp */
+#define RECORD_MAX_EVENT    (32 * 10)   /* varints, without memory */
+
+typedef struct {
+    char magic[8];              /* "MDBREC01" */
+    int32_t pid;
+    uint32_t memory;            /* bytes asked for at pc and sp */
+    uint64_t start;             /* wall clock, us since the epoch */
+} kern_record_header;
+
+static uint8_t *
+kern_record_put (uint8_t *p, uint64_t value)
+{
+    while (value >= 0x80) {
+        *p++ = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t) value;
+
+    return p;
+}
+
+/* Returns: 0, or -1 if the varint runs past end */
+static int
+kern_record_get (const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+    unsigned int shift = 0;
+
+    *value = 0;
+    while (*p < end && shift < 64) {
+        *value |= (uint64_t) (**p & 0x7f) << shift;
+        if (! (*(*p)++ & 0x80))
+            return 0;
+        shift += 7;
+    }
+
+    return -1;
+}
+
+/* As much of [address, address+size) as reads, up to the first failure */
+static mach_vm_size_t
+kern_record_memory (kern_TaskObj *task, mach_vm_address_t address,
+                    mach_vm_size_t size, uint8_t *buf)
+{
+    mach_vm_size_t out = 0, head;
+
+    if (size == 0 || address == 0)
+        return 0;
+
+    if (kern_task_read(task, address, size, buf, &out) == KERN_SUCCESS)
+        return out;
+
+    /* The rest of the page, e.g. code at the end of a mapping */
+    head = vm_page_size - (address & (vm_page_size - 1));
+    if (head < size &&
+        kern_task_read(task, address, head, buf, &out) == KERN_SUCCESS)
+        return out;
+
+    return 0;
+}
+
+/*
+ * Append an event from kern_task_event to the task's recording, if any.
+ * Called with the thread still stopped
+ */
+void
+kern_record_event (kern_TaskObj *task, kern_exc_event *event,
+                   kern_ThreadObj *thread, uint64_t breakpoint)
+{
+    struct kern_recorder *rec = task->recorder;
+    kern_multi_arch_tstate state;
+    uint64_t regs64[_KERN_RECORD_REGS64], now, pc = 0, sp = 0;
+    uint32_t regs32[_KERN_RECORD_REGS32];
+    mach_vm_size_t n;
+    uint8_t *p, *q;
+    int arch = 0;
+    size_t i;
+
+    if (rec == NULL)
+        return;
+
+    now = kern_stats_now();
+
+    p = rec->scratch;
+    p = kern_record_put(p, now - rec->last);
+    p = kern_record_put(p, (uint64_t) event->type);
+    p = kern_record_put(p, thread->tid);
+    p = kern_record_put(p, breakpoint);
+
+    p = kern_record_put(p, event->ncodes);
+    for (i = 0; i < event->ncodes; ++i)
+        p = kern_record_put(p, ((uint64_t) event->code[i] << 1) ^
+                               (uint64_t) (event->code[i] >> 63));
+
+    if (kern_thread_state(thread, &state) == KERN_SUCCESS)
+        arch = thread->arch;
+
+    if (arch == _KERN_THREAD_ARCH_X86_64) {
+        memcpy(regs64, &state.state64, sizeof(regs64));
+        pc = state.state64.__rip;
+        sp = state.state64.__rsp;
+    } else if (arch == _KERN_THREAD_ARCH_X86) {
+        memcpy(regs32, &state.state32, sizeof(regs32));
+        pc = state.state32.__eip;
+        sp = state.state32.__esp;
+    } else {
+        arch = 0;
+    }
+
+    p = kern_record_put(p, (uint64_t) arch);
+    if (arch == _KERN_THREAD_ARCH_X86_64) {
+        for (i = 0; i < _KERN_RECORD_REGS64; ++i)
+            p = kern_record_put(p, regs64[i] ^ rec->regs64[i]);
+    } else if (arch == _KERN_THREAD_ARCH_X86) {
+        for (i = 0; i < _KERN_RECORD_REGS32; ++i)
+            p = kern_record_put(p, regs32[i] ^ rec->regs32[i]);
+    }
+
+    /* Read past the room a varint takes, then close the gap */
+    for (i = 0; i < 2; ++i) {
+        n = kern_record_memory(task, i == 0 ? pc : sp, rec->memory, p + 10);
+        q = kern_record_put(p, n);
+        memmove(q, p + 10, (size_t) n);
+        p = q + n;
+    }
+
+    pthread_mutex_lock(&rec->lock);
+
+    if (rec->error != 0 || rec->npending + (size_t) (p - rec->scratch) >
+        RECORD_PENDING) {
+        rec->dropped++;
+    } else {
+        memcpy(rec->pending + rec->npending, rec->scratch,
+               (size_t) (p - rec->scratch));
+        rec->npending += (size_t) (p - rec->scratch);
+        rec->events++;
+
+        /* The next event is relative to this one only if it was kept */
+        rec->last = now;
+        if (arch == _KERN_THREAD_ARCH_X86_64)
+            memcpy(rec->regs64, regs64, sizeof(regs64));
+        else if (arch == _KERN_THREAD_ARCH_X86)
+            memcpy(rec->regs32, regs32, sizeof(regs32));
+
+        pthread_cond_signal(&rec->cond);
+    }
+
+    pthread_mutex_unlock(&rec->lock);
+}
+
+static void *
+kern_record_writer (void *arg)
+{
+    struct kern_recorder *rec = arg;
+    uint8_t *tmp;
+    size_t n, done;
+    ssize_t w;
+    int error;
+
+    pthread_mutex_lock(&rec->lock);
+
+    while (1) {
+        while (rec->npending == 0 && ! rec->stop)
+            pthread_cond_wait(&rec->cond, &rec->lock);
+        if (rec->npending == 0)
+            break;
+
+        tmp = rec->writing;
+        rec->writing = rec->pending;
+        rec->pending = tmp;
+        n = rec->npending;
+        rec->npending = 0;
+
+        pthread_mutex_unlock(&rec->lock);
+
+        error = 0;
+        for (done = 0; done < n; done += (size_t) w) {
+            w = write(rec->fd, rec->writing + done, n - done);
+            if (w < 0 && errno == EINTR) {
+                w = 0;
+            } else if (w < 0) {
+                error = errno;
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&rec->lock);
+        rec->bytes += done;
+        if (error != 0)
+            rec->error = error;
+    }
+
+    pthread_mutex_unlock(&rec->lock);
+
+    return NULL;
+}
+
+/* Stop the writer once it has written everything, and close the file */
+static int
+kern_recorder_stop (struct kern_recorder *rec)
+{
+    pthread_mutex_lock(&rec->lock);
+    rec->stop = 1;
+    pthread_cond_signal(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+
+    pthread_join(rec->writer, NULL);
+
+    if (close(rec->fd) < 0 && rec->error == 0)
+        rec->error = errno;
+
+    return rec->error == 0 ? 0 : -1;
+}
+
+static void
+kern_recorder_release (struct kern_recorder *rec)
+{
+    pthread_mutex_destroy(&rec->lock);
+    pthread_cond_destroy(&rec->cond);
+    free(rec->pending);
+    free(rec->writing);
+    free(rec->scratch);
+    free(rec);
+}
+
+void
+kern_recorder_free (kern_TaskObj *task)
+{
+    if (task->recorder == NULL)
+        return;
+
+    kern_recorder_stop(task->recorder);
+    kern_recorder_release(task->recorder);
+    task->recorder = NULL;
+}
+
+/*
+ * Start recording the events poll() delivers, for ReplayTask
+ *
+ * Arguments: path - file to write, replaced if it exists
+ *            memory - bytes to keep at each stopped thread's pc and sp
+ * Returns:   None
+ */
+PyObject *
+kern_Task_record (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    struct kern_recorder *rec;
+    kern_record_header header;
+    struct timeval tv;
+    const char *path;
+    unsigned long long memory = 0;
+    ssize_t w;
+
+    static char *kwlist[] = {"path", "memory", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|K", kwlist, &path,
+                                      &memory))
+        return NULL;
+
+    if (memory > RECORD_MAX_MEMORY) {
+        PyErr_Format(PyExc_ValueError, "memory must be at most %d",
+                     RECORD_MAX_MEMORY);
+        return NULL;
+    }
+
+    if (self->recorder != NULL) {
+        PyErr_SetString(kern_Error, "already recording");
+        return NULL;
+    }
+
+    rec = calloc(1, sizeof(*rec));
+    if (rec == NULL)
+        return PyErr_NoMemory();
+
+    rec->pending = malloc(RECORD_PENDING);
+    rec->writing = malloc(RECORD_PENDING);
+    rec->scratch = malloc(RECORD_MAX_EVENT + 2 * ((size_t) memory + 10));
+    if (rec->pending == NULL || rec->writing == NULL ||
+        rec->scratch == NULL) {
+        free(rec->pending);
+        free(rec->writing);
+        free(rec->scratch);
+        free(rec);
+        return PyErr_NoMemory();
+    }
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->cond, NULL);
+    rec->memory = memory;
+
+    rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (rec->fd < 0) {
+        kern_recorder_release(rec);
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) path);
+    }
+
+    gettimeofday(&tv, NULL);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "MDBREC01", 8);
+    header.pid = self->pid;
+    header.memory = (uint32_t) memory;
+    header.start = (uint64_t) tv.tv_sec * 1000000 + (uint64_t) tv.tv_usec;
+
+    w = write(rec->fd, &header, sizeof(header));
+    if (w != (ssize_t) sizeof(header) ||
+        pthread_create(&rec->writer, NULL, kern_record_writer, rec) != 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) path);
+        close(rec->fd);
+        kern_recorder_release(rec);
+        return NULL;
+    }
+
+    rec->last = kern_stats_now();
+    self->recorder = rec;
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Stop recording, once everything recorded is written
+ *
+ * Arguments: None
+ * Returns:   {events, dropped, bytes}, dropped being events lost to a full
+ *            buffer and bytes those written after the header
+ */
+PyObject *
+kern_Task_stopRecording (kern_TaskObj *self)
+{
+    struct kern_recorder *rec = self->recorder;
+    PyObject *ret;
+    int r;
+
+    if (rec == NULL) {
+        PyErr_SetString(kern_Error, "not recording");
+        return NULL;
+    }
+
+    self->recorder = NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    r = kern_recorder_stop(rec);
+    Py_END_ALLOW_THREADS
+
+    if (r < 0) {
+        errno = rec->error;
+        PyErr_SetFromErrno(PyExc_IOError);
+        ret = NULL;
+    } else {
+        ret = Py_BuildValue("{s:K,s:K,s:K}", "events", rec->events,
+                            "dropped", rec->dropped, "bytes", rec->bytes);
+    }
+
+    kern_recorder_release(rec);
+
+    return ret;
+}
+
+/* ReplayTask */
+
+/* Drop what attach() set up, so a failed attach can be retried */
+static void
+kern_replay_reset (kern_ReplayTaskObj *self)
+{
+    kern_core_reset(&self->core);
+    self->offset = 0;
+    self->time = 0;
+    memset(self->regs64, 0, sizeof(self->regs64));
+    memset(self->regs32, 0, sizeof(self->regs32));
+    PyDict_Clear(self->by_tid);
+}
+
+/*
+ * Open and map the recording
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_ReplayTask_attach (kern_ReplayTaskObj *self)
+{
+    kern_CoreTaskObj *core = &self->core;
+    kern_record_header *header;
+    struct stat st;
+    PyObject *vm;
+    void *map;
+    int fd;
+
+    if (core->task.attached) {
+        PyErr_SetNone(kern_AlreadyAttachedError);
+        return NULL;
+    }
+
+    fd = open(PyString_AsString(core->path), O_RDONLY);
+    if (fd < 0)
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError,
+                                                    core->path);
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError,
+                                                    core->path);
+    }
+
+    if ((size_t) st.st_size < sizeof(*header)) {
+        close(fd);
+        PyErr_SetString(kern_Error, "Not an mdb recording");
+        return NULL;
+    }
+
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError,
+                                                    core->path);
+
+    core->map = map;
+    core->map_size = (size_t) st.st_size;
+
+    header = map;
+    if (memcmp(header->magic, "MDBREC01", 8) != 0) {
+        PyErr_SetString(kern_Error, "Not an mdb recording");
+        goto fail;
+    }
+
+    /* The memory kept with the current event: at pc, and at sp */
+    core->segments = calloc(2, sizeof(kern_core_segment));
+    if (core->segments == NULL) {
+        PyErr_NoMemory();
+        goto fail;
+    }
+
+    core->task.pid = header->pid;
+    self->offset = sizeof(*header);
+
+    vm = kern_memory_new((PyObject *) self, 0, UINT64_MAX);
+    if (vm == NULL)
+        goto fail;
+
+    Py_DECREF(core->task.vm);
+    core->task.vm = vm;
+
+    core->task.attached = 1;
+
+    Py_RETURN_NONE;
+
+ fail:
+    kern_replay_reset(self);
+
+    return NULL;
+}
+
+/*
+ * Unmap the recording and drop the replayed threads
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_ReplayTask_close (kern_ReplayTaskObj *self)
+{
+    kern_replay_reset(self);
+    kern_core_close(&self->core);
+
+    Py_RETURN_NONE;
+}
+
+/* The replayed thread with this tid, made when it's first seen */
+static kern_CoreThreadObj *
+kern_replay_thread (kern_ReplayTaskObj *self, uint64_t tid)
+{
+    kern_CoreThreadObj *thread;
+    PyObject *key;
+
+    key = PyLong_FromUnsignedLongLong(tid);
+    if (key == NULL)
+        return NULL;
+
+    thread = (kern_CoreThreadObj *) PyDict_GetItem(self->by_tid, key);
+    if (thread != NULL) {
+        Py_DECREF(key);
+        Py_INCREF(thread);
+        return thread;
+    }
+
+    thread = kern_core_thread_new((PyObject *) self, (int) tid);
+    if (thread == NULL ||
+        PyDict_SetItem(self->by_tid, key, (PyObject *) thread) < 0 ||
+        PyList_Append(self->core.threads, (PyObject *) thread) < 0) {
+        Py_DECREF(key);
+        Py_XDECREF(thread);
+        return NULL;
+    }
+
+    Py_DECREF(key);
+    return thread;
+}
+
+/*
+ * Point the task's memory at the bytes kept with the event: n at address,
+ * starting at p
+ */
+static int
+kern_replay_memory (kern_ReplayTaskObj *self, const uint8_t **p,
+                    const uint8_t *end, uint64_t address, vm_prot_t prot)
+{
+    kern_CoreTaskObj *core = &self->core;
+    kern_core_segment *seg;
+    uint64_t n;
+
+    if (kern_record_get(p, end, &n) < 0 || n > (uint64_t) (end - *p))
+        return -1;
+
+    if (n > 0) {
+        seg = &core->segments[core->nsegments++];
+        seg->vaddr = address;
+        seg->memsz = n;
+        seg->filesz = n;
+        seg->offset = (uint64_t) (*p - core->map);
+        seg->protection = prot;
+    }
+
+    *p += n;
+    return 0;
+}
+
+/*
+ * Deliver the next recorded event. The thread's registers and the memory
+ * kept at its pc and sp are as they were when it stopped
+ *
+ * Arguments: None
+ * Returns:   {type, thread, breakpoint, codes, time}, time being ns since
+ *            recording started, or None after the last event
+ */
+static PyObject *
+kern_ReplayTask_poll (kern_ReplayTaskObj *self)
+{
+    kern_CoreTaskObj *core = &self->core;
+    kern_core_segment *seg;
+    kern_CoreThreadObj *thread;
+    const uint8_t *p, *end;
+    uint64_t dt, type, tid, breakpoint, ncodes, arch, value, pc, sp;
+    PyObject *codes = NULL, *bp;
+    size_t i;
+
+    if (! core->task.attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (self->offset >= core->map_size)
+        Py_RETURN_NONE;
+
+    p = core->map + self->offset;
+    end = core->map + core->map_size;
+
+    if (kern_record_get(&p, end, &dt) < 0 ||
+        kern_record_get(&p, end, &type) < 0 ||
+        kern_record_get(&p, end, &tid) < 0 ||
+        kern_record_get(&p, end, &breakpoint) < 0 ||
+        kern_record_get(&p, end, &ncodes) < 0 || ncodes > 2)
+        goto corrupt;
+
+    codes = PyTuple_New((Py_ssize_t) ncodes);
+    if (codes == NULL)
+        return NULL;
+
+    for (i = 0; i < ncodes; ++i) {
+        if (kern_record_get(&p, end, &value) < 0)
+            goto corrupt;
+        bp = PyLong_FromLongLong((int64_t) (value >> 1) ^
+                                 -(int64_t) (value & 1));
+        if (bp == NULL) {
+            Py_DECREF(codes);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(codes, i, bp);
+    }
+
+    if (kern_record_get(&p, end, &arch) < 0)
+        goto corrupt;
+
+    if (arch == _KERN_THREAD_ARCH_X86_64) {
+        for (i = 0; i < _KERN_RECORD_REGS64; ++i) {
+            if (kern_record_get(&p, end, &value) < 0)
+                goto corrupt;
+            self->regs64[i] ^= value;
+        }
+    } else if (arch == _KERN_THREAD_ARCH_X86) {
+        for (i = 0; i < _KERN_RECORD_REGS32; ++i) {
+            if (kern_record_get(&p, end, &value) < 0)
+                goto corrupt;
+            self->regs32[i] ^= (uint32_t) value;
+        }
+    } else if (arch != 0) {
+        goto corrupt;
+    }
+
+    thread = kern_replay_thread(self, tid);
+    if (thread == NULL) {
+        Py_DECREF(codes);
+        return NULL;
+    }
+
+    pc = sp = 0;
+    if (arch == _KERN_THREAD_ARCH_X86_64) {
+        thread->thread.arch = _KERN_THREAD_ARCH_X86_64;
+        memcpy(&thread->state.state64, self->regs64, sizeof(self->regs64));
+        pc = thread->state.state64.__rip;
+        sp = thread->state.state64.__rsp;
+    } else if (arch == _KERN_THREAD_ARCH_X86) {
+        thread->thread.arch = _KERN_THREAD_ARCH_X86;
+        memcpy(&thread->state.state32, self->regs32, sizeof(self->regs32));
+        pc = thread->state.state32.__eip;
+        sp = thread->state.state32.__esp;
+    }
+
+    core->nsegments = 0;
+    if (kern_replay_memory(self, &p, end, pc,
+                           VM_PROT_READ | VM_PROT_EXECUTE) < 0 ||
+        kern_replay_memory(self, &p, end, sp,
+                           VM_PROT_READ | VM_PROT_WRITE) < 0) {
+        Py_DECREF(thread);
+        goto corrupt;
+    }
+
+    /* Sorted, and the first cut short if the two overlap */
+    if (core->nsegments == 2) {
+        qsort(core->segments, 2, sizeof(kern_core_segment),
+              kern_core_segment_cmp);
+        seg = core->segments;
+        if (seg[0].vaddr + seg[0].memsz > seg[1].vaddr) {
+            seg[0].memsz = seg[0].filesz = seg[1].vaddr - seg[0].vaddr;
+            if (seg[0].memsz == 0) {
+                seg[0] = seg[1];
+                core->nsegments = 1;
+            }
+        }
+    }
+
+    self->offset = (size_t) (p - core->map);
+    self->time += dt;
+
+    if (breakpoint != 0)
+        bp = PyLong_FromUnsignedLongLong(breakpoint);
+    else {
+        Py_INCREF(Py_None);
+        bp = Py_None;
+    }
+
+    return Py_BuildValue("{s:N,s:s,s:N,s:N,s:K}", "thread", (PyObject *) thread,
+                         "type", kern_exc_string((unsigned int) type),
+                         "breakpoint", bp, "codes", codes,
+                         "time", self->time);
+
+ corrupt:
+    Py_XDECREF(codes);
+    PyErr_Format(kern_Error, "Corrupt recording %s",
+                 PyString_AS_STRING(core->path));
+    return NULL;
+}
+
+static void
+kern_ReplayTask_dealloc (kern_ReplayTaskObj *self)
+{
+    Py_XDECREF(self->by_tid);
+    kern_CoreTaskType.tp_dealloc((PyObject *) self);
+}
+
+static PyObject *
+kern_ReplayTask_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    kern_ReplayTaskObj *self = NULL;
+
+    self = (kern_ReplayTaskObj *) kern_CoreTaskType.tp_new(type, args, kwds);
+
+    if (self != NULL) {
+        self->offset = 0;
+        self->time = 0;
+        memset(self->regs64, 0, sizeof(self->regs64));
+        memset(self->regs32, 0, sizeof(self->regs32));
+
+        self->by_tid = PyDict_New();
+        if (self->by_tid == NULL) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+
+    return (PyObject *) self;
+}
+
+static PyMethodDef kern_ReplayTaskMethods[] = {
+    {"attach", (PyCFunction)kern_ReplayTask_attach, METH_NOARGS,
+     "Open and map the recording"},
+    {"close", (PyCFunction)kern_ReplayTask_close, METH_NOARGS,
+     "Unmap the recording"},
+    {"poll", (PyCFunction)kern_ReplayTask_poll, METH_NOARGS,
+     "Deliver the next recorded event"},
+    {NULL} /* Sentinel */
+};
+
+PyTypeObject kern_ReplayTaskType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /* ob_size */
+    "mdb.kern.ReplayTask",     /* tp_name */
+    sizeof(kern_ReplayTaskObj), /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    (destructor)kern_ReplayTask_dealloc, /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_compare */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    "Task objects replaying a recording of events", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    kern_ReplayTaskMethods,    /* tp_methods */
+    0,                         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    kern_ReplayTask_new,       /* tp_new */
+};
@@ -0,0 +1,86 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_RECORD_H
+#define _KERN_RECORD_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <mach/mach_types.h>
+
+#include "structmember.h"
+
+#include "task.h"
+#include "thread.h"
+#include "core.h"
+#include "exception.h"
+
+extern PyTypeObject kern_ReplayTaskType;
+
+#define _KERN_RECORD_REGS64  21     /* x86_thread_state64_t, as uint64_t */
+#define _KERN_RECORD_REGS32  16     /* x86_thread_state32_t, as uint32_t */
+
+/* Events appended by poll(), written out by a thread of their own */
+struct kern_recorder {
+    int fd;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t *pending;           /* encoded, waiting for the writer */
+    size_t npending;
+    uint8_t *writing;           /* swapped with pending by the writer */
+    uint8_t *scratch;           /* one event being encoded */
+    char stop;
+    int error;                  /* errno of a failed write, or 0 */
+    mach_vm_size_t memory;      /* bytes kept at pc and sp */
+    uint64_t last;              /* kern_stats_now() of the last event */
+    uint64_t regs64[_KERN_RECORD_REGS64];   /* the last registers, */
+    uint32_t regs32[_KERN_RECORD_REGS32];   /* which the next are XORed with */
+    uint64_t events, dropped, bytes;
+};
+
+/* A recording played back through poll() */
+typedef struct {
+    kern_CoreTaskObj core;
+    size_t offset;              /* of the next event in core.map */
+    uint64_t time;              /* ns since recording started */
+    uint64_t regs64[_KERN_RECORD_REGS64];
+    uint32_t regs32[_KERN_RECORD_REGS32];
+    PyObject *by_tid;           /* tid -> CoreThread */
+} kern_ReplayTaskObj;
+
+void kern_record_event (kern_TaskObj *task, kern_exc_event *event,
+                        kern_ThreadObj *thread, uint64_t breakpoint);
+
+void kern_recorder_free (kern_TaskObj *task);
+
+PyObject *kern_Task_record (kern_TaskObj *self, PyObject *args,
+                            PyObject *kwds);
+
+PyObject *kern_Task_stopRecording (kern_TaskObj *self);
+
+#endif
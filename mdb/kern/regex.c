@@ -0,0 +1,2118 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+
+#include "util.h"
+#include "kern.h"
+#include "task.h"
+#include "memory.h"
+#include "regex.h"
+
+/*
+ * Regular expressions over raw bytes, matched with lazily built DFAs.
+ *
+ * The pattern is parsed into a syntax tree and compiled twice into Thompson
+ * NFAs, forwards and reversed. DFA states are sets of NFA states, built the
+ * first time a transition is taken and cached; bytes that every set treats
+ * alike share a column. Matching runs four automata:
+ *
+ *   search   unanchored forward DFA; stops at the first byte that ends a
+ *            match. Its state is all that carries over between chunks.
+ *   reverse  anchored reversed DFA, run backwards from that end to find the
+ *            leftmost start of a match ending there.
+ *   prefix   reversed DFA started in every state, run backwards from the
+ *            same end to find the earliest start of a match still in
+ *            progress. Usually there is none before the leftmost start;
+ *            otherwise the matches from those starts are followed forwards
+ *            (with extend) until they die, an earlier match ending on the
+ *            way moving the start back.
+ *   extend   anchored forward DFA, run from the start to the longest match.
+ *
+ * Matches are leftmost-longest, and searching resumes at the end of each,
+ * so they don't overlap.
+ * Matches are cut at max_length bytes, the rest of a longer one being found
+ * as further matches; this bounds the history kept between chunks to locate
+ * starts, and nothing is read twice.
+ *
+ * Syntax: literals, ".", "[...]" classes with ranges and "^" negation,
+ * escapes \d \w \s \D \W \S \xHH \n \r \t \f \v \0, groups "(...)" and
+ * "(?:...)", "|", and the quantifiers * + ? {n} {n,} {n,m}. Lazy quantifiers
+ * are accepted but match greedily. "." matches any byte and there are no
+ * anchors, since memory has no lines.
+ */
+
+#define RE_MAX_NODES      100000
+#define RE_MAX_REPEAT     1000
+#define RE_MAX_DEPTH      200
+
+#define DFA_MAX_STATES    4096      /* cache size before starting over */
+#define DFA_UNKNOWN       (-1)
+#define DFA_ERROR         (-2)
+#define DFA_ACCEPT        0x40000000
+#define DFA_ID(e)         ((e) & (DFA_ACCEPT - 1))
+#define DFA_DEAD          0
+
+#define SET_HAS(s, b)     ((s)->bits[(b) >> 3] & (1 << ((b) & 7)))
+#define SET_ADD(s, b)     ((s)->bits[(b) >> 3] |= (uint8_t) (1 << ((b) & 7)))
+
+typedef struct {
+    uint8_t bits[32];
+} kern_charset;
+
+enum { AST_SET, AST_CAT, AST_ALT, AST_REPEAT };
+
+typedef struct {
+    int type;
+    int min, max;               /* REPEAT, max -1 = unbounded */
+    int set;                    /* SET, index into sets */
+    int child, next;            /* first child and next sibling, or -1 */
+} kern_ast;
+
+enum { NFA_SET, NFA_SPLIT, NFA_JMP, NFA_MATCH };
+
+typedef struct {
+    int type;
+    int out, out1;
+    int set;
+} kern_nfa_node;
+
+typedef struct {
+    kern_nfa_node *nodes;
+    int count, capacity;
+    int start;
+} kern_nfa;
+
+struct kern_regex {
+    kern_charset *sets;
+    int nsets, sets_capacity;
+    kern_ast *ast;
+    int nast, ast_capacity;
+    kern_nfa forward, backward;
+    uint8_t cls[256];           /* byte -> column */
+    uint8_t rep[256];           /* column -> a byte in it */
+    int ncls;
+    size_t max_length;
+    int flags;
+    int root;
+};
+
+struct kern_dfa {
+    kern_regex *re;
+    kern_nfa *nfa;
+    int unanchored;
+    int everywhere;             /* start in every NFA state */
+    int nstates, capacity;
+    int32_t *trans;             /* nstates * ncls encoded states */
+    uint8_t *accept;
+    int *off, *len;             /* each state's NFA set in arena */
+    int *arena;
+    size_t arena_len, arena_capacity;
+    int *table;                 /* hash of NFA sets -> state, -1 = empty */
+    int32_t start;
+    unsigned *mark;
+    unsigned gen;
+    int *stack, *tmp, *save;
+    int ntmp;
+};
+
+typedef struct {
+    kern_regex *re;
+    const unsigned char *pattern, *p, *end;
+    int depth;
+    char *err;
+    size_t errlen;
+} kern_parser;
+
+/* Parsing */
+
+static int kern_parse_alt (kern_parser *P);
+
+static int
+kern_parse_error (kern_parser *P, const char *msg)
+{
+    snprintf(P->err, P->errlen, "%s at position %d", msg,
+             (int) (P->p - P->pattern));
+    return -1;
+}
+
+static int
+kern_ast_new (kern_parser *P, int type)
+{
+    kern_regex *re = P->re;
+    kern_ast *ast;
+
+    if (re->nast == re->ast_capacity) {
+        re->ast_capacity = re->ast_capacity ? re->ast_capacity * 2 : 64;
+        ast = realloc(re->ast, re->ast_capacity * sizeof(kern_ast));
+        if (ast == NULL) {
+            snprintf(P->err, P->errlen, "out of memory");
+            return -1;
+        }
+        re->ast = ast;
+    }
+
+    ast = &re->ast[re->nast];
+    ast->type = type;
+    ast->min = ast->max = 0;
+    ast->set = ast->child = ast->next = -1;
+
+    return re->nast++;
+}
+
+/* New SET node with an empty character set */
+static int
+kern_ast_set (kern_parser *P)
+{
+    kern_regex *re = P->re;
+    kern_charset *sets;
+    int n;
+
+    if (re->nsets == re->sets_capacity) {
+        re->sets_capacity = re->sets_capacity ? re->sets_capacity * 2 : 64;
+        sets = realloc(re->sets, re->sets_capacity * sizeof(kern_charset));
+        if (sets == NULL) {
+            snprintf(P->err, P->errlen, "out of memory");
+            return -1;
+        }
+        re->sets = sets;
+    }
+
+    n = kern_ast_new(P, AST_SET);
+    if (n < 0)
+        return -1;
+
+    memset(&re->sets[re->nsets], 0, sizeof(kern_charset));
+    re->ast[n].set = re->nsets++;
+
+    return n;
+}
+
+static void
+kern_charset_range (kern_charset *cs, int lo, int hi)
+{
+    for (; lo <= hi; ++lo)
+        SET_ADD(cs, lo);
+}
+
+static void
+kern_charset_fold (kern_charset *cs)
+{
+    int c;
+
+    for (c = 'A'; c <= 'Z'; ++c) {
+        if (SET_HAS(cs, c))
+            SET_ADD(cs, c + 32);
+        else if (SET_HAS(cs, c + 32))
+            SET_ADD(cs, c);
+    }
+}
+
+static void
+kern_charset_invert (kern_charset *cs)
+{
+    int i;
+
+    for (i = 0; i < 32; ++i)
+        cs->bits[i] = (uint8_t) ~cs->bits[i];
+}
+
+static int
+kern_hex (int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Parse the escape following a backslash. Single byte escapes return the
+ * byte; class escapes (\d etc.) are added to cs and return 256
+ */
+static int
+kern_parse_escape (kern_parser *P, kern_charset *cs)
+{
+    kern_charset class;
+    int c, hi, lo;
+
+    if (P->p == P->end)
+        return kern_parse_error(P, "trailing backslash");
+
+    c = *P->p++;
+    memset(&class, 0, sizeof(class));
+
+    switch (c) {
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 't': return '\t';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    case 'a': return '\a';
+    case 'e': return 27;
+    case '0': return 0;
+    case 'x':
+        if (P->end - P->p < 2 || (hi = kern_hex(P->p[0])) < 0 ||
+            (lo = kern_hex(P->p[1])) < 0)
+            return kern_parse_error(P, "bad \\x escape");
+        P->p += 2;
+        return hi << 4 | lo;
+    case 'd': case 'D':
+        kern_charset_range(&class, '0', '9');
+        break;
+    case 'w': case 'W':
+        kern_charset_range(&class, '0', '9');
+        kern_charset_range(&class, 'A', 'Z');
+        kern_charset_range(&class, 'a', 'z');
+        SET_ADD(&class, '_');
+        break;
+    case 's': case 'S':
+        kern_charset_range(&class, '\t', '\r');
+        SET_ADD(&class, ' ');
+        break;
+    default:
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            (c >= '1' && c <= '9')) {
+            P->p--;
+            return kern_parse_error(P, "unknown escape");
+        }
+        return c;
+    }
+
+    if (c == 'D' || c == 'W' || c == 'S')
+        kern_charset_invert(&class);
+    for (c = 0; c < 32; ++c)
+        cs->bits[c] |= class.bits[c];
+
+    return 256;
+}
+
+static int
+kern_parse_class (kern_parser *P)
+{
+    kern_charset *cs;
+    int n, lo, hi, negate = 0, first = 1;
+
+    n = kern_ast_set(P);
+    if (n < 0)
+        return -1;
+    cs = &P->re->sets[P->re->ast[n].set];
+
+    if (P->p < P->end && *P->p == '^') {
+        negate = 1;
+        P->p++;
+    }
+
+    for (;;) {
+        if (P->p == P->end)
+            return kern_parse_error(P, "unterminated character class");
+        if (*P->p == ']' && ! first)
+            break;
+        first = 0;
+
+        lo = *P->p++;
+        if (lo == '\\' && (lo = kern_parse_escape(P, cs)) < 0)
+            return -1;
+        if (lo == 256)
+            continue;
+
+        if (P->end - P->p >= 2 && P->p[0] == '-' && P->p[1] != ']') {
+            P->p++;
+            hi = *P->p++;
+            if (hi == '\\' && (hi = kern_parse_escape(P, cs)) < 0)
+                return -1;
+            if (hi == 256 || hi < lo)
+                return kern_parse_error(P, "bad character range");
+            kern_charset_range(cs, lo, hi);
+        } else {
+            SET_ADD(cs, lo);
+        }
+    }
+    P->p++;
+
+    if (P->re->flags & _KERN_REGEX_ICASE)
+        kern_charset_fold(cs);
+    if (negate)
+        kern_charset_invert(cs);
+
+    return n;
+}
+
+static int
+kern_parse_atom (kern_parser *P)
+{
+    kern_charset *cs;
+    int n, c;
+
+    c = *P->p++;
+
+    switch (c) {
+    case '(':
+        if (P->end - P->p >= 2 && P->p[0] == '?' && P->p[1] == ':')
+            P->p += 2;
+        else if (P->p < P->end && *P->p == '?')
+            return kern_parse_error(P, "unsupported group");
+
+        if (++P->depth > RE_MAX_DEPTH)
+            return kern_parse_error(P, "groups nested too deeply");
+        n = kern_parse_alt(P);
+        if (n < 0)
+            return -1;
+        if (P->p == P->end || *P->p != ')')
+            return kern_parse_error(P, "missing )");
+        P->p++;
+        P->depth--;
+        return n;
+    case '[':
+        return kern_parse_class(P);
+    case '^':
+    case '$':
+        P->p--;
+        return kern_parse_error(P, "anchors are not supported");
+    case '*':
+    case '+':
+    case '?':
+        P->p--;
+        return kern_parse_error(P, "nothing to repeat");
+    }
+
+    n = kern_ast_set(P);
+    if (n < 0)
+        return -1;
+    cs = &P->re->sets[P->re->ast[n].set];
+
+    if (c == '.') {
+        kern_charset_invert(cs);
+        return n;
+    }
+
+    if (c == '\\' && (c = kern_parse_escape(P, cs)) < 0)
+        return -1;
+    if (c < 256)
+        SET_ADD(cs, c);
+    if (P->re->flags & _KERN_REGEX_ICASE)
+        kern_charset_fold(cs);
+
+    return n;
+}
+
+static int
+kern_parse_count (kern_parser *P, int *value)
+{
+    int n = 0;
+
+    if (P->p == P->end || *P->p < '0' || *P->p > '9')
+        return 0;
+
+    while (P->p < P->end && *P->p >= '0' && *P->p <= '9') {
+        n = n * 10 + (*P->p++ - '0');
+        if (n > RE_MAX_REPEAT)
+            return kern_parse_error(P, "repeat count too large");
+    }
+
+    *value = n;
+    return 1;
+}
+
+/* {n}, {n,} or {n,m}; returns 0 if the brace doesn't start a quantifier */
+static int
+kern_parse_braces (kern_parser *P, int *min, int *max)
+{
+    const unsigned char *save = P->p;
+    int r;
+
+    P->p++;
+    r = kern_parse_count(P, min);
+    if (r <= 0) {
+        P->p = save;
+        return r;
+    }
+
+    *max = *min;
+    if (P->p < P->end && *P->p == ',') {
+        P->p++;
+        *max = -1;
+        if (kern_parse_count(P, max) < 0)
+            return -1;
+    }
+
+    if (P->p == P->end || *P->p != '}') {
+        P->p = save;
+        return 0;
+    }
+    P->p++;
+
+    if (*max >= 0 && *max < *min)
+        return kern_parse_error(P, "bad repeat range");
+
+    return 1;
+}
+
+static int
+kern_parse_repeat (kern_parser *P)
+{
+    int n, r, min, max;
+
+    n = kern_parse_atom(P);
+
+    while (n >= 0 && P->p < P->end) {
+        switch (*P->p) {
+        case '*':
+            min = 0, max = -1;
+            P->p++;
+            break;
+        case '+':
+            min = 1, max = -1;
+            P->p++;
+            break;
+        case '?':
+            min = 0, max = 1;
+            P->p++;
+            break;
+        case '{':
+            r = kern_parse_braces(P, &min, &max);
+            if (r < 0)
+                return -1;
+            if (r == 0)
+                return n;
+            break;
+        default:
+            return n;
+        }
+
+        /* Lazy quantifiers make no difference to a longest match */
+        if (P->p < P->end && *P->p == '?')
+            P->p++;
+
+        r = kern_ast_new(P, AST_REPEAT);
+        if (r < 0)
+            return -1;
+        P->re->ast[r].min = min;
+        P->re->ast[r].max = max;
+        P->re->ast[r].child = n;
+        n = r;
+    }
+
+    return n;
+}
+
+static int
+kern_parse_cat (kern_parser *P)
+{
+    int cat, n, last = -1;
+
+    cat = kern_ast_new(P, AST_CAT);
+    if (cat < 0)
+        return -1;
+
+    while (P->p < P->end && *P->p != '|' && *P->p != ')') {
+        n = kern_parse_repeat(P);
+        if (n < 0)
+            return -1;
+
+        if (last < 0)
+            P->re->ast[cat].child = n;
+        else
+            P->re->ast[last].next = n;
+        last = n;
+    }
+
+    return cat;
+}
+
+static int
+kern_parse_alt (kern_parser *P)
+{
+    int alt, n, last;
+
+    n = kern_parse_cat(P);
+    if (n < 0 || P->p == P->end || *P->p != '|')
+        return n;
+
+    alt = kern_ast_new(P, AST_ALT);
+    if (alt < 0)
+        return -1;
+    P->re->ast[alt].child = last = n;
+
+    while (P->p < P->end && *P->p == '|') {
+        P->p++;
+        n = kern_parse_cat(P);
+        if (n < 0)
+            return -1;
+        P->re->ast[last].next = n;
+        last = n;
+    }
+
+    return alt;
+}
+
+/* Thompson construction */
+
+static int
+kern_nfa_node_new (kern_nfa *nfa, int type, int out, int out1, int set)
+{
+    kern_nfa_node *nodes;
+
+    if (nfa->count == nfa->capacity) {
+        if (nfa->capacity >= RE_MAX_NODES)
+            return -1;
+        nfa->capacity = nfa->capacity ? nfa->capacity * 2 : 256;
+        nodes = realloc(nfa->nodes, nfa->capacity * sizeof(kern_nfa_node));
+        if (nodes == NULL)
+            return -1;
+        nfa->nodes = nodes;
+    }
+
+    nodes = &nfa->nodes[nfa->count];
+    nodes->type = type;
+    nodes->out = out;
+    nodes->out1 = out1;
+    nodes->set = set;
+
+    return nfa->count++;
+}
+
+/*
+ * Compile the subtree at n. Returns its entry node and stores its exit, a
+ * JMP node whose out is left for the caller to patch
+ */
+static int
+kern_nfa_compile (kern_regex *re, kern_nfa *nfa, int n, int reverse,
+                  int *end)
+{
+    int children[RE_MAX_DEPTH], *child = children, nchild = 0;
+    int c, i, s, e, start = -1, last = -1, split;
+    kern_ast ast = re->ast[n];
+
+#define NODE(t, o, o1, st) do { \
+        if ((c = kern_nfa_node_new(nfa, t, o, o1, st)) < 0) \
+            goto error; \
+    } while (0)
+#define CHAIN(s, e) do { \
+        if (start < 0) \
+            start = (s); \
+        else \
+            nfa->nodes[last].out = (s); \
+        last = (e); \
+    } while (0)
+
+    switch (ast.type) {
+    case AST_SET:
+        NODE(NFA_JMP, -1, -1, -1);
+        e = c;
+        NODE(NFA_SET, e, -1, ast.set);
+        *end = e;
+        return c;
+
+    case AST_CAT:
+        for (i = ast.child; i >= 0; i = re->ast[i].next)
+            nchild++;
+        if (nchild == 0) {
+            NODE(NFA_JMP, -1, -1, -1);
+            *end = c;
+            return c;
+        }
+        if (nchild > RE_MAX_DEPTH &&
+            (child = malloc(nchild * sizeof(int))) == NULL)
+            return -1;
+        for (i = ast.child, c = 0; i >= 0; i = re->ast[i].next)
+            child[c++] = i;
+
+        for (i = 0; i < nchild; ++i) {
+            s = kern_nfa_compile(re, nfa, child[reverse ? nchild - 1 - i : i],
+                                 reverse, &e);
+            if (s < 0)
+                goto error;
+            CHAIN(s, e);
+        }
+        break;
+
+    case AST_ALT:
+        NODE(NFA_JMP, -1, -1, -1);
+        last = c;
+        for (i = ast.child; i >= 0; i = re->ast[i].next) {
+            s = kern_nfa_compile(re, nfa, i, reverse, &e);
+            if (s < 0)
+                goto error;
+            nfa->nodes[e].out = last;
+            if (start < 0) {
+                start = s;
+            } else {
+                NODE(NFA_SPLIT, s, start, -1);
+                start = c;
+            }
+        }
+        break;
+
+    case AST_REPEAT:
+        for (i = 0; i < ast.min; ++i) {
+            s = kern_nfa_compile(re, nfa, ast.child, reverse, &e);
+            if (s < 0)
+                goto error;
+            CHAIN(s, e);
+        }
+
+        if (ast.max < 0) {
+            s = kern_nfa_compile(re, nfa, ast.child, reverse, &e);
+            if (s < 0)
+                goto error;
+            NODE(NFA_JMP, -1, -1, -1);
+            NODE(NFA_SPLIT, s, c, -1);
+            split = c;
+            nfa->nodes[e].out = split;
+            CHAIN(split, nfa->nodes[split].out1);
+        }
+
+        for (i = ast.min; i < ast.max; ++i) {
+            s = kern_nfa_compile(re, nfa, ast.child, reverse, &e);
+            if (s < 0)
+                goto error;
+            NODE(NFA_SPLIT, s, e, -1);
+            CHAIN(c, e);
+        }
+
+        if (start < 0) {
+            NODE(NFA_JMP, -1, -1, -1);
+            start = last = c;
+        }
+        break;
+    }
+
+    if (child != children)
+        free(child);
+
+    *end = last;
+    return start;
+
+ error:
+    if (child != children)
+        free(child);
+    return -1;
+
+#undef NODE
+#undef CHAIN
+}
+
+static int
+kern_nfa_build (kern_regex *re, kern_nfa *nfa, int root, int reverse)
+{
+    int start, end, match;
+
+    start = kern_nfa_compile(re, nfa, root, reverse, &end);
+    if (start < 0)
+        return -1;
+
+    match = kern_nfa_node_new(nfa, NFA_MATCH, -1, -1, -1);
+    if (match < 0)
+        return -1;
+
+    nfa->nodes[end].out = match;
+    nfa->start = start;
+
+    return 0;
+}
+
+/* Group bytes that every character set treats alike into columns */
+static void
+kern_regex_classes (kern_regex *re)
+{
+    uint8_t split[256];
+    int b, i, n = 0;
+
+    memset(split, 0, sizeof(split));
+    for (i = 0; i < re->nsets; ++i)
+        for (b = 1; b < 256; ++b)
+            if (! SET_HAS(&re->sets[i], b) != ! SET_HAS(&re->sets[i], b - 1))
+                split[b] = 1;
+
+    re->rep[0] = 0;
+    re->cls[0] = 0;
+    for (b = 1; b < 256; ++b) {
+        if (split[b])
+            re->rep[++n] = (uint8_t) b;
+        re->cls[b] = (uint8_t) n;
+    }
+    re->ncls = n + 1;
+}
+
+/* Whether the NFA matches the empty string */
+static int
+kern_nfa_nullable (kern_nfa *nfa)
+{
+    int *stack, n = 0, i, found = 0;
+    uint8_t *seen;
+
+    stack = malloc(nfa->count * sizeof(int));
+    seen = calloc(nfa->count, 1);
+    if (stack == NULL || seen == NULL) {
+        free(stack);
+        free(seen);
+        return -1;
+    }
+
+    stack[n++] = nfa->start;
+    seen[nfa->start] = 1;
+    while (n > 0 && ! found) {
+        i = stack[--n];
+        switch (nfa->nodes[i].type) {
+        case NFA_MATCH:
+            found = 1;
+            break;
+        case NFA_SPLIT:
+            if (! seen[nfa->nodes[i].out1]) {
+                seen[nfa->nodes[i].out1] = 1;
+                stack[n++] = nfa->nodes[i].out1;
+            }
+            /* fall through */
+        case NFA_JMP:
+            if (! seen[nfa->nodes[i].out]) {
+                seen[nfa->nodes[i].out] = 1;
+                stack[n++] = nfa->nodes[i].out;
+            }
+            break;
+        }
+    }
+
+    free(stack);
+    free(seen);
+
+    return found;
+}
+
+void
+kern_regex_free (kern_regex *re)
+{
+    if (re == NULL)
+        return;
+
+    free(re->sets);
+    free(re->ast);
+    free(re->forward.nodes);
+    free(re->backward.nodes);
+    free(re);
+}
+
+/*
+ * Compile a pattern
+ *
+ * Arguments: pattern, size - the pattern
+ *            flags - _KERN_REGEX_ICASE for case-insensitive ASCII
+ *            max_length - longest match reported
+ *            err, errlen - receives a message on failure
+ * Returns:   Compiled pattern or NULL
+ */
+kern_regex *
+kern_regex_compile (const char *pattern, size_t size, int flags,
+                    size_t max_length, char *err, size_t errlen)
+{
+    kern_parser P;
+    kern_regex *re;
+    int root;
+
+    re = calloc(1, sizeof(kern_regex));
+    if (re == NULL) {
+        snprintf(err, errlen, "out of memory");
+        return NULL;
+    }
+    re->flags = flags;
+    re->max_length = max_length;
+
+    P.re = re;
+    P.pattern = P.p = (const unsigned char *) pattern;
+    P.end = P.p + size;
+    P.depth = 0;
+    P.err = err;
+    P.errlen = errlen;
+
+    root = kern_parse_alt(&P);
+    if (root >= 0 && P.p != P.end) {
+        kern_parse_error(&P, "unbalanced )");
+        root = -1;
+    }
+    if (root < 0)
+        goto error;
+    re->root = root;
+
+    if (kern_nfa_build(re, &re->forward, root, 0) < 0 ||
+        kern_nfa_build(re, &re->backward, root, 1) < 0) {
+        snprintf(err, errlen, "pattern too large");
+        goto error;
+    }
+
+    switch (kern_nfa_nullable(&re->forward)) {
+    case 1:
+        snprintf(err, errlen, "pattern matches the empty string");
+        goto error;
+    case -1:
+        snprintf(err, errlen, "out of memory");
+        goto error;
+    }
+
+    kern_regex_classes(re);
+
+    return re;
+
+ error:
+    kern_regex_free(re);
+    return NULL;
+}
+
+/* Index queries */
+
+#define QUERY_MAX_RUN     256       /* positions kept in one run */
+#define QUERY_MAX_ALT     16        /* alternatives merged position-wise */
+
+typedef struct {
+    int exact;                  /* the node matches exactly run */
+    kern_charset *run;
+    size_t length;
+    kern_regex_query *query;    /* otherwise, what it must contain */
+} kern_query_info;
+
+static kern_regex_query *
+kern_query_new (int op)
+{
+    kern_regex_query *q;
+
+    q = calloc(1, sizeof(kern_regex_query));
+    if (q != NULL)
+        q->op = op;
+
+    return q;
+}
+
+static kern_regex_query *
+kern_query_run (const kern_charset *run, size_t length)
+{
+    kern_regex_query *q;
+
+    if (length == 0)
+        return kern_query_new(_KERN_QUERY_ANY);
+
+    q = calloc(1, sizeof(kern_regex_query) + length * sizeof(kern_charset));
+    if (q == NULL)
+        return NULL;
+
+    q->op = _KERN_QUERY_RUN;
+    q->length = length;
+    q->sets = (uint8_t (*)[32]) (q + 1);
+    memcpy(q->sets, run, length * sizeof(kern_charset));
+
+    return q;
+}
+
+void
+kern_regex_query_free (kern_regex_query *q)
+{
+    kern_regex_query *next;
+
+    for (; q != NULL; q = next) {
+        next = q->next;
+        kern_regex_query_free(q->child);
+        free(q);
+    }
+}
+
+/* Combine two queries with AND or OR, taking ownership of both */
+static kern_regex_query *
+kern_query_combine (int op, kern_regex_query *a, kern_regex_query *b)
+{
+    kern_regex_query *n, **tail;
+
+    if (a == NULL || b == NULL)
+        goto fail;
+
+    /* Anything AND x is x; anything OR x is anything */
+    if (op == _KERN_QUERY_AND && a->op == _KERN_QUERY_ANY) {
+        free(a);
+        return b;
+    }
+    if (op == _KERN_QUERY_AND && b->op == _KERN_QUERY_ANY) {
+        free(b);
+        return a;
+    }
+    if (a->op == _KERN_QUERY_ANY || b->op == _KERN_QUERY_ANY) {
+        kern_regex_query_free(a);
+        kern_regex_query_free(b);
+        return kern_query_new(_KERN_QUERY_ANY);
+    }
+
+    if (a->op != op) {
+        n = kern_query_new(op);
+        if (n == NULL)
+            goto fail;
+        n->child = a;
+        a = n;
+    }
+
+    for (tail = &a->child; *tail != NULL; tail = &(*tail)->next)
+        ;
+    if (b->op == op) {
+        *tail = b->child;
+        free(b);
+    } else
+        *tail = b;
+
+    return a;
+
+ fail:
+    kern_regex_query_free(a);
+    kern_regex_query_free(b);
+    return NULL;
+}
+
+/* The node's query, consuming its info */
+static kern_regex_query *
+kern_query_of (kern_query_info *info)
+{
+    kern_regex_query *q;
+
+    if (! info->exact)
+        return info->query;
+
+    q = kern_query_run(info->run, info->length);
+    free(info->run);
+
+    return q;
+}
+
+static int
+kern_query_append (kern_query_info *info, const kern_charset *run,
+                   size_t length)
+{
+    kern_charset *p;
+
+    if (length == 0)
+        return 0;
+
+    p = realloc(info->run, (info->length + length) * sizeof(kern_charset));
+    if (p == NULL)
+        return -1;
+
+    memcpy(p + info->length, run, length * sizeof(kern_charset));
+    info->run = p;
+    info->length += length;
+
+    return 0;
+}
+
+static int kern_query_node (kern_regex *re, int n, kern_query_info *info);
+
+/*
+ * Runs of exact children join up; a child that isn't exact ends the run and
+ * adds its own query
+ */
+static int
+kern_query_cat (kern_regex *re, int n, kern_query_info *info)
+{
+    kern_query_info run, ci;
+    kern_regex_query *q;
+    int c, r;
+
+    memset(&run, 0, sizeof(run));
+    run.exact = 1;
+    q = kern_query_new(_KERN_QUERY_ANY);
+    info->exact = 1;
+
+    for (c = re->ast[n].child; c >= 0 && q != NULL; c = re->ast[c].next) {
+        if (kern_query_node(re, c, &ci) < 0)
+            goto nomem;
+
+        if (ci.exact && run.length + ci.length <= QUERY_MAX_RUN) {
+            r = kern_query_append(&run, ci.run, ci.length);
+            free(ci.run);
+            if (r < 0)
+                goto nomem;
+            continue;
+        }
+
+        info->exact = 0;
+        q = kern_query_combine(_KERN_QUERY_AND, q, kern_query_of(&run));
+        memset(&run, 0, sizeof(run));
+        run.exact = 1;
+
+        if (ci.exact) {
+            run.run = ci.run;
+            run.length = ci.length;
+        } else
+            q = kern_query_combine(_KERN_QUERY_AND, q, ci.query);
+    }
+
+    if (q == NULL) {
+        free(run.run);
+        return -1;
+    }
+
+    if (info->exact) {
+        kern_regex_query_free(q);
+        info->run = run.run;
+        info->length = run.length;
+        return 0;
+    }
+
+    info->query = kern_query_combine(_KERN_QUERY_AND, q, kern_query_of(&run));
+    return info->query != NULL ? 0 : -1;
+
+ nomem:
+    free(run.run);
+    kern_regex_query_free(q);
+    return -1;
+}
+
+/*
+ * Alternatives of the same short length merge into one run of the union of
+ * their sets, which keeps the run joined up with its neighbours; otherwise
+ * any one of their queries will do
+ */
+static int
+kern_query_alt (kern_regex *re, int n, kern_query_info *info)
+{
+    kern_query_info ci;
+    kern_regex_query *q = NULL;
+    size_t i, j;
+    int c, first = 1;
+
+    info->exact = 1;
+    info->run = NULL;
+    info->length = 0;
+
+    for (c = re->ast[n].child; c >= 0; c = re->ast[c].next) {
+        if (kern_query_node(re, c, &ci) < 0)
+            goto nomem;
+
+        if (ci.exact && ci.length <= QUERY_MAX_ALT &&
+            (first || ci.length == info->length) && info->exact) {
+            if (first) {
+                if (kern_query_append(info, ci.run, ci.length) < 0) {
+                    free(ci.run);
+                    goto nomem;
+                }
+            } else {
+                for (i = 0; i < ci.length; ++i)
+                    for (j = 0; j < 32; ++j)
+                        info->run[i].bits[j] |= ci.run[i].bits[j];
+            }
+        } else
+            info->exact = 0;
+        first = 0;
+
+        q = q == NULL ? kern_query_of(&ci) :
+            kern_query_combine(_KERN_QUERY_OR, q, kern_query_of(&ci));
+        if (q == NULL)
+            goto nomem;
+    }
+
+    if (info->exact) {
+        kern_regex_query_free(q);
+        return 0;
+    }
+
+    free(info->run);
+    info->run = NULL;
+    info->query = q;
+    return 0;
+
+ nomem:
+    free(info->run);
+    kern_regex_query_free(q);
+    return -1;
+}
+
+static int
+kern_query_node (kern_regex *re, int n, kern_query_info *info)
+{
+    kern_ast *ast = &re->ast[n];
+    kern_query_info ci;
+    int i;
+
+    memset(info, 0, sizeof(*info));
+
+    switch (ast->type) {
+    case AST_SET:
+        info->exact = 1;
+        return kern_query_append(info, &re->sets[ast->set], 1);
+    case AST_CAT:
+        return kern_query_cat(re, n, info);
+    case AST_ALT:
+        return kern_query_alt(re, n, info);
+    }
+
+    /* AST_REPEAT */
+    if (ast->max == 0) {
+        info->exact = 1;
+        return 0;
+    }
+
+    if (ast->min == 0) {
+        info->query = kern_query_new(_KERN_QUERY_ANY);
+        return info->query != NULL ? 0 : -1;
+    }
+
+    if (kern_query_node(re, ast->child, &ci) < 0)
+        return -1;
+
+    if (ci.exact && ast->min == ast->max &&
+        ci.length * (size_t) ast->min <= QUERY_MAX_RUN) {
+        info->exact = 1;
+        for (i = 0; i < ast->min; ++i) {
+            if (kern_query_append(info, ci.run, ci.length) < 0) {
+                free(ci.run);
+                free(info->run);
+                return -1;
+            }
+        }
+        free(ci.run);
+        return 0;
+    }
+
+    /* At least one copy of the child is in every match */
+    info->query = kern_query_of(&ci);
+    return info->query != NULL ? 0 : -1;
+}
+
+/*
+ * Work out what every match of a pattern contains
+ *
+ * Arguments: re - compiled pattern
+ * Returns:   Query to free with kern_regex_query_free(), or NULL when out of
+ *            memory
+ */
+kern_regex_query *
+kern_regex_query_new (kern_regex *re)
+{
+    kern_query_info info;
+
+    if (kern_query_node(re, re->root, &info) < 0)
+        return NULL;
+
+    return kern_query_of(&info);
+}
+
+/* Lazy DFA */
+
+static void
+kern_dfa_closure (kern_dfa *d, int node)
+{
+    kern_nfa_node *nodes = d->nfa->nodes;
+    int n = 0, i;
+
+    if (d->mark[node] == d->gen)
+        return;
+    d->mark[node] = d->gen;
+    d->stack[n++] = node;
+
+    while (n > 0) {
+        i = d->stack[--n];
+        switch (nodes[i].type) {
+        case NFA_SET:
+        case NFA_MATCH:
+            d->tmp[d->ntmp++] = i;
+            break;
+        case NFA_SPLIT:
+            if (d->mark[nodes[i].out1] != d->gen) {
+                d->mark[nodes[i].out1] = d->gen;
+                d->stack[n++] = nodes[i].out1;
+            }
+            /* fall through */
+        case NFA_JMP:
+            if (d->mark[nodes[i].out] != d->gen) {
+                d->mark[nodes[i].out] = d->gen;
+                d->stack[n++] = nodes[i].out;
+            }
+            break;
+        }
+    }
+}
+
+static void
+kern_dfa_begin (kern_dfa *d)
+{
+    if (++d->gen == 0) {
+        memset(d->mark, 0, d->nfa->count * sizeof(unsigned));
+        d->gen = 1;
+    }
+    d->ntmp = 0;
+}
+
+static int
+kern_int_cmp (const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+static uint32_t
+kern_dfa_hash (const int *set, int n)
+{
+    uint32_t h = 2166136261U;
+    int i;
+
+    for (i = 0; i < n; ++i)
+        h = (h ^ (uint32_t) set[i]) * 16777619U;
+
+    return h;
+}
+
+/*
+ * Find or add the state for an NFA set. Returns its id, -1 on allocation
+ * failure or -2 when the cache is full
+ */
+static int
+kern_dfa_intern (kern_dfa *d, int *set, int n)
+{
+    uint32_t mask = 2 * DFA_MAX_STATES - 1, h;
+    size_t need;
+    void *p;
+    int id, i;
+
+    qsort(set, (size_t) n, sizeof(int), kern_int_cmp);
+
+    for (h = kern_dfa_hash(set, n) & mask; (id = d->table[h]) >= 0;
+         h = (h + 1) & mask) {
+        if (d->len[id] == n &&
+            memcmp(d->arena + d->off[id], set, n * sizeof(int)) == 0)
+            return id;
+    }
+
+    if (d->nstates == DFA_MAX_STATES)
+        return -2;
+
+    if (d->nstates == d->capacity) {
+        d->capacity = d->capacity ? d->capacity * 2 : 64;
+        if ((p = realloc(d->trans, (size_t) d->capacity * d->re->ncls *
+                         sizeof(int32_t))) == NULL)
+            return -1;
+        d->trans = p;
+        if ((p = realloc(d->accept, d->capacity)) == NULL)
+            return -1;
+        d->accept = p;
+        if ((p = realloc(d->off, d->capacity * sizeof(int))) == NULL)
+            return -1;
+        d->off = p;
+        if ((p = realloc(d->len, d->capacity * sizeof(int))) == NULL)
+            return -1;
+        d->len = p;
+    }
+
+    need = d->arena_len + (size_t) n;
+    if (need > d->arena_capacity) {
+        d->arena_capacity = need * 2;
+        if ((p = realloc(d->arena, d->arena_capacity * sizeof(int))) == NULL)
+            return -1;
+        d->arena = p;
+    }
+
+    id = d->nstates++;
+    memcpy(d->arena + d->arena_len, set, n * sizeof(int));
+    d->off[id] = (int) d->arena_len;
+    d->len[id] = n;
+    d->arena_len = need;
+    d->table[h] = id;
+
+    d->accept[id] = 0;
+    for (i = 0; i < n; ++i)
+        if (d->nfa->nodes[set[i]].type == NFA_MATCH)
+            d->accept[id] = 1;
+
+    for (i = 0; i < d->re->ncls; ++i)
+        d->trans[id * d->re->ncls + i] = DFA_UNKNOWN;
+
+    return id;
+}
+
+#define DFA_ENCODE(d, id) ((id) | ((d)->accept[id] ? DFA_ACCEPT : 0))
+
+/* Drop every state, leaving the dead and start states */
+static int
+kern_dfa_reset (kern_dfa *d)
+{
+    int id;
+
+    d->nstates = 0;
+    d->arena_len = 0;
+    memset(d->table, 0xff, 2 * DFA_MAX_STATES * sizeof(int));
+
+    kern_dfa_begin(d);
+    if (kern_dfa_intern(d, d->tmp, 0) != DFA_DEAD)
+        return -1;
+
+    kern_dfa_begin(d);
+    if (d->everywhere)
+        for (id = 0; id < d->nfa->count; ++id)
+            kern_dfa_closure(d, id);
+    else
+        kern_dfa_closure(d, d->nfa->start);
+    id = kern_dfa_intern(d, d->tmp, d->ntmp);
+    if (id < 0)
+        return -1;
+    d->start = DFA_ENCODE(d, id);
+
+    return 0;
+}
+
+static void
+kern_dfa_free (kern_dfa *d)
+{
+    if (d == NULL)
+        return;
+
+    free(d->trans);
+    free(d->accept);
+    free(d->off);
+    free(d->len);
+    free(d->arena);
+    free(d->table);
+    free(d->mark);
+    free(d->stack);
+    free(d->tmp);
+    free(d->save);
+    free(d);
+}
+
+static kern_dfa *
+kern_dfa_new (kern_regex *re, kern_nfa *nfa, int unanchored, int everywhere)
+{
+    kern_dfa *d;
+
+    d = calloc(1, sizeof(kern_dfa));
+    if (d == NULL)
+        return NULL;
+
+    d->re = re;
+    d->nfa = nfa;
+    d->unanchored = unanchored;
+    d->everywhere = everywhere;
+    d->table = malloc(2 * DFA_MAX_STATES * sizeof(int));
+    d->mark = calloc(nfa->count, sizeof(unsigned));
+    d->stack = malloc(nfa->count * sizeof(int));
+    d->tmp = malloc(nfa->count * sizeof(int));
+    d->save = malloc(nfa->count * sizeof(int));
+
+    if (d->table == NULL || d->mark == NULL || d->stack == NULL ||
+        d->tmp == NULL || d->save == NULL || kern_dfa_reset(d) < 0) {
+        kern_dfa_free(d);
+        return NULL;
+    }
+
+    return d;
+}
+
+/* Slow path of a transition: build the next state from the NFA */
+static int32_t
+kern_dfa_compute (kern_dfa *d, int32_t state, int byte)
+{
+    kern_nfa_node *nodes = d->nfa->nodes;
+    int id = DFA_ID(state), *set, n, i, next;
+
+    kern_dfa_begin(d);
+
+    set = d->arena + d->off[id];
+    n = d->len[id];
+    for (i = 0; i < n; ++i)
+        if (nodes[set[i]].type == NFA_SET &&
+            SET_HAS(&d->re->sets[nodes[set[i]].set], byte))
+            kern_dfa_closure(d, nodes[set[i]].out);
+
+    /* A match may start at any byte */
+    if (d->unanchored)
+        kern_dfa_closure(d, d->nfa->start);
+
+    next = kern_dfa_intern(d, d->tmp, d->ntmp);
+    if (next == -2) {
+        /* Cache full: start over, and don't remember this transition */
+        n = d->ntmp;
+        memcpy(d->save, d->tmp, n * sizeof(int));
+        if (kern_dfa_reset(d) < 0)
+            return DFA_ERROR;
+        next = kern_dfa_intern(d, d->save, n);
+        return next < 0 ? DFA_ERROR : DFA_ENCODE(d, next);
+    }
+    if (next < 0)
+        return DFA_ERROR;
+
+    d->trans[id * d->re->ncls + d->re->cls[byte]] = DFA_ENCODE(d, next);
+    return DFA_ENCODE(d, next);
+}
+
+static inline int32_t
+kern_dfa_next (kern_dfa *d, int32_t state, int byte)
+{
+    int32_t next = d->trans[DFA_ID(state) * d->re->ncls + d->re->cls[byte]];
+
+    return next != DFA_UNKNOWN ? next : kern_dfa_compute(d, state, byte);
+}
+
+/* The state of to with the NFA set of from's state; both share an NFA */
+static int32_t
+kern_dfa_import (kern_dfa *to, kern_dfa *from, int32_t state)
+{
+    int id = DFA_ID(state), n = from->len[id];
+
+    memcpy(to->save, from->arena + from->off[id], n * sizeof(int));
+    id = kern_dfa_intern(to, to->save, n);
+    if (id == -2) {
+        if (kern_dfa_reset(to) < 0)
+            return DFA_ERROR;
+        id = kern_dfa_intern(to, to->save, n);
+    }
+
+    return id < 0 ? DFA_ERROR : DFA_ENCODE(to, id);
+}
+
+/* Streaming */
+
+int
+kern_regex_stream_init (kern_regex_stream *st, kern_regex *re, size_t chunk)
+{
+    memset(st, 0, sizeof(*st));
+    st->re = re;
+    st->chunk = chunk;
+
+    st->search = kern_dfa_new(re, &re->forward, 1, 0);
+    st->reverse = kern_dfa_new(re, &re->backward, 0, 0);
+    st->prefix = kern_dfa_new(re, &re->backward, 0, 1);
+    st->extend = kern_dfa_new(re, &re->forward, 0, 0);
+    st->buf = malloc(re->max_length + chunk);
+    if (st->search == NULL || st->reverse == NULL || st->prefix == NULL ||
+        st->extend == NULL || st->buf == NULL) {
+        kern_regex_stream_free(st);
+        return -1;
+    }
+
+    kern_regex_stream_reset(st, 0);
+
+    return 0;
+}
+
+void
+kern_regex_stream_free (kern_regex_stream *st)
+{
+    kern_dfa_free(st->search);
+    kern_dfa_free(st->reverse);
+    kern_dfa_free(st->prefix);
+    kern_dfa_free(st->extend);
+    free(st->buf);
+    memset(st, 0, sizeof(*st));
+}
+
+/* Begin a new stream at address; matches don't span streams */
+void
+kern_regex_stream_reset (kern_regex_stream *st, uint64_t address)
+{
+    st->base = address;
+    st->hist = 0;
+    st->pos = 0;
+    st->low = 0;
+    st->leading = 0;
+    st->extending = 0;
+    st->state = st->search->start;
+}
+
+/* Where the next chunk, of up to st->chunk bytes, goes */
+unsigned char *
+kern_regex_buffer (kern_regex_stream *st)
+{
+    return st->buf + st->hist;
+}
+
+/*
+ * Run the search DFA over [pos, hi). Returns 1 and the end of the first
+ * match, 0 if there is none, or -1 on allocation failure
+ */
+static int
+kern_regex_search (kern_regex_stream *st, size_t hi, size_t *end)
+{
+    kern_dfa *d = st->search;
+    const unsigned char *buf = st->buf;
+    const uint8_t *cls = st->re->cls;
+    const int32_t *trans = d->trans;
+    int ncls = st->re->ncls;
+    int32_t s = st->state, next;
+    size_t i;
+
+    for (i = st->pos; i < hi; ++i) {
+        next = trans[DFA_ID(s) * ncls + cls[buf[i]]];
+
+        /* One test catches both unknown transitions and matches */
+        if ((uint32_t) next >= DFA_ACCEPT) {
+            if (next == DFA_UNKNOWN) {
+                next = kern_dfa_compute(d, s, buf[i]);
+                if (next == DFA_ERROR)
+                    return -1;
+                trans = d->trans;
+            }
+            if (next & DFA_ACCEPT) {
+                st->state = next;
+                st->pos = i + 1;
+                *end = i + 1;
+                return 1;
+            }
+        }
+        s = next;
+    }
+
+    st->state = s;
+    st->pos = hi;
+    return 0;
+}
+
+/* How far back a match ending at end may start */
+static size_t
+kern_regex_floor (kern_regex_stream *st, size_t end)
+{
+    size_t floor;
+
+    floor = end > st->re->max_length ? end - st->re->max_length : 0;
+
+    return floor < st->low ? st->low : floor;
+}
+
+/*
+ * Run a reversed DFA back from end, no further than floor: with reverse,
+ * find the leftmost start of a match ending at end; with prefix, the
+ * earliest start of one that has got as far as end. Returns 0 with
+ * *start, 1 if there is none in range, -1 on allocation failure
+ */
+static int
+kern_regex_start (kern_regex_stream *st, kern_dfa *d, size_t end,
+                  size_t floor, size_t *start)
+{
+    int32_t s = d->start;
+    size_t i;
+    int found = 0;
+
+    for (i = end; i > floor; --i) {
+        s = kern_dfa_next(d, s, st->buf[i - 1]);
+        if (s == DFA_ERROR)
+            return -1;
+        if (DFA_ID(s) == DFA_DEAD)
+            break;
+        if (s & DFA_ACCEPT) {
+            *start = i - 1;
+            found = 1;
+        }
+    }
+
+    return ! found;
+}
+
+/*
+ * Having found a match at st->start ending at end, follow any matches in
+ * progress there that started before it. Returns 0 with their state from
+ * st->start, 1 if there are none, -1 on allocation failure
+ */
+static int
+kern_regex_lead (kern_regex_stream *st, size_t end)
+{
+    kern_dfa *d = st->search;
+    size_t first, i;
+    int32_t s;
+    int r;
+
+    r = kern_regex_start(st, st->prefix, end, kern_regex_floor(st, end),
+                         &first);
+    if (r != 0 || first >= st->start)
+        return r < 0 ? -1 : 1;
+
+    /* Every match started from first up to st->start, then no more */
+    s = d->start;
+    for (i = first; i + 1 < st->start && s != DFA_ERROR; ++i)
+        s = kern_dfa_next(d, s, st->buf[i]);
+    if (s != DFA_ERROR)
+        s = kern_dfa_import(st->extend, d, s);
+    if (s != DFA_ERROR)
+        s = kern_dfa_next(st->extend, s, st->buf[st->start - 1]);
+    if (s == DFA_ERROR)
+        return -1;
+
+    st->state = s;
+    st->pos = st->start;
+
+    return 0;
+}
+
+/*
+ * Run the matches kern_regex_lead() follows over [pos, hi), moving
+ * st->start back to any that ends first. Returns 1 once none is left that
+ * could, 0 if more input is needed, -1 on allocation failure
+ */
+static int
+kern_regex_follow (kern_regex_stream *st, size_t hi)
+{
+    kern_dfa *d = st->extend;
+    size_t limit, start;
+    int32_t s = st->state;
+    int r;
+
+    for (;;) {
+        /* None longer than max_length counts */
+        limit = st->start - 1 + st->re->max_length;
+        if (limit > hi)
+            limit = hi;
+
+        for (; st->pos < limit; st->pos++) {
+            s = kern_dfa_next(d, s, st->buf[st->pos]);
+            if (s == DFA_ERROR)
+                return -1;
+            if (DFA_ID(s) == DFA_DEAD)
+                return 1;
+            if (s & DFA_ACCEPT)
+                break;
+        }
+        if (st->pos == limit) {
+            st->state = s;
+            return st->pos == st->start - 1 + st->re->max_length;
+        }
+
+        st->pos++;
+        r = kern_regex_start(st, st->reverse, st->pos,
+                             kern_regex_floor(st, st->pos), &start);
+        if (r < 0)
+            return -1;
+        if (r > 0 || start >= st->start)
+            continue;
+
+        /* Start again from the earlier match */
+        st->start = start;
+        st->last = st->pos;
+        r = kern_regex_lead(st, st->pos);
+        if (r != 0)
+            return r;
+        s = st->state;
+    }
+}
+
+/*
+ * Extend the match at st->start over [pos, hi). Returns 1 once the longest
+ * match is known, 0 if more input is needed, -1 on allocation failure
+ */
+static int
+kern_regex_extend (kern_regex_stream *st, size_t hi)
+{
+    kern_dfa *d = st->extend;
+    size_t limit = st->start + st->re->max_length;
+    int32_t s = st->state;
+
+    if (limit > hi)
+        limit = hi;
+
+    for (; st->pos < limit; st->pos++) {
+        s = kern_dfa_next(d, s, st->buf[st->pos]);
+        if (s == DFA_ERROR)
+            return -1;
+        if (DFA_ID(s) == DFA_DEAD)
+            return 1;
+        if (s & DFA_ACCEPT)
+            st->last = st->pos + 1;
+    }
+    st->state = s;
+
+    return st->pos == st->start + st->re->max_length;
+}
+
+/*
+ * Match over buf[pos, hi). At the end of the stream (final), a match still
+ * being extended ends at hi. Returns 0, 1 if emit stopped the scan or -1 on
+ * allocation failure
+ */
+static int
+kern_regex_process (kern_regex_stream *st, size_t hi, int final,
+                    kern_regex_emit emit, void *arg)
+{
+    size_t end, start;
+    int r;
+
+    for (;;) {
+        if (! st->leading && ! st->extending) {
+            r = kern_regex_search(st, hi, &end);
+            if (r <= 0)
+                return r;
+
+            r = kern_regex_start(st, st->reverse, end,
+                                 kern_regex_floor(st, end), &start);
+            if (r < 0)
+                return -1;
+            if (r > 0) {
+                /*
+                 * Starts before the last match or max_length back: skip it,
+                 * but not the other matches in progress
+                 */
+                continue;
+            }
+
+            st->start = start;
+            st->last = end;
+            r = kern_regex_lead(st, end);
+            if (r < 0)
+                return -1;
+            st->leading = r == 0;
+        }
+
+        if (st->leading) {
+            r = kern_regex_follow(st, hi);
+            if (r < 0)
+                return -1;
+            if (r == 0 && ! final)
+                return 0;
+            st->leading = 0;
+        }
+
+        if (! st->extending) {
+            st->extending = 1;
+            st->pos = st->start;
+            st->state = st->extend->start;
+        }
+
+        r = kern_regex_extend(st, hi);
+        if (r < 0)
+            return -1;
+        if (r == 0 && ! final)
+            return 0;
+
+        if (emit(arg, st->base + st->start, st->last - st->start))
+            return 1;
+
+        st->extending = 0;
+        st->pos = st->low = st->last;
+        st->state = st->search->start;
+    }
+}
+
+/*
+ * Match the size bytes just read into kern_regex_buffer()
+ *
+ * Returns: 0, 1 if emit stopped the scan, or -1 on allocation failure
+ */
+int
+kern_regex_stream_feed (kern_regex_stream *st, size_t size,
+                        kern_regex_emit emit, void *arg)
+{
+    size_t hi = st->hist + size, keep, drop;
+    int r;
+
+    r = kern_regex_process(st, hi, 0, emit, arg);
+    if (r != 0)
+        return r;
+
+    /* Keep enough history to find the start of any match in progress */
+    keep = hi < st->re->max_length ? hi : st->re->max_length;
+    drop = hi - keep;
+    memmove(st->buf, st->buf + drop, keep);
+    st->base += drop;
+    st->hist = keep;
+    st->pos -= drop;
+    st->low = st->low > drop ? st->low - drop : 0;
+    if (st->leading || st->extending) {
+        st->start -= drop;
+        st->last -= drop;
+    }
+
+    return 0;
+}
+
+/* End the stream, reporting any match that runs up to its end */
+int
+kern_regex_stream_finish (kern_regex_stream *st, kern_regex_emit emit,
+                          void *arg)
+{
+    int r;
+
+    r = kern_regex_process(st, st->hist, 1, emit, arg);
+    kern_regex_stream_reset(st, st->base + st->hist);
+
+    return r;
+}
+
+/* Task.regexSearch */
+
+#define REGEX_CHUNK       (1 << 20)
+
+int
+kern_regex_hit (void *arg, uint64_t address, uint64_t length)
+{
+    kern_regex_hits *hits = arg;
+    void *p;
+
+    if (hits->count == hits->capacity) {
+        hits->capacity = hits->capacity ? hits->capacity * 2 : 256;
+        if ((p = realloc(hits->address, hits->capacity * 8)) == NULL)
+            goto nomem;
+        hits->address = p;
+        if ((p = realloc(hits->length, hits->capacity * 8)) == NULL)
+            goto nomem;
+        hits->length = p;
+    }
+
+    hits->address[hits->count] = address;
+    hits->length[hits->count] = length;
+    hits->count++;
+
+    return 0;
+
+ nomem:
+    hits->nomem = 1;
+    return 1;
+}
+
+/* Start a new stream if address doesn't follow on from the last chunk */
+static int
+kern_regex_resume (kern_regex_stream *st, mach_vm_address_t address,
+                   kern_regex_hits *hits)
+{
+    int r;
+
+    if (address == st->base + st->hist)
+        return 0;
+
+    /* Matches don't span unreadable pages */
+    r = kern_regex_stream_finish(st, kern_regex_hit, hits);
+    kern_regex_stream_reset(st, address);
+
+    return r;
+}
+
+/*
+ * Scan the pages of a chunk that can be read, or with resident set, only
+ * those that are resident
+ */
+int
+kern_regex_scan_pages (kern_TaskObj *task, kern_regex_stream *st,
+                       mach_vm_address_t address, mach_vm_size_t size,
+                       int resident, kern_regex_hits *hits)
+{
+    mach_vm_address_t pos = address, end = address + size, next;
+    uint8_t *buf, *valid;
+    size_t page;
+    int r = 0, ok;
+
+    buf = malloc((size_t) size);
+    valid = malloc(KERN_MEMORY_VALID_SIZE(address, size));
+    if (buf == NULL || valid == NULL) {
+        free(buf);
+        free(valid);
+        return -1;
+    }
+
+    if (resident)
+        kern_memory_read_resident(task, address, size, buf, valid);
+    else
+        kern_memory_read_partial(task, address, size, buf, valid);
+
+    while (pos < end && r == 0) {
+        page = (size_t) ((KERN_TRUNC_PAGE(pos) - KERN_TRUNC_PAGE(address)) /
+                         vm_page_size);
+        ok = valid[page >> 3] & (1 << (page & 7));
+
+        /* Find the end of this run of readable or unreadable pages */
+        for (next = pos; next < end; ++page) {
+            if (! (valid[page >> 3] & (1 << (page & 7))) != ! ok)
+                break;
+            next = KERN_TRUNC_PAGE(next) + vm_page_size;
+        }
+        if (next > end)
+            next = end;
+
+        if (ok) {
+            r = kern_regex_resume(st, pos, hits);
+            if (r == 0) {
+                memcpy(kern_regex_buffer(st), buf + (pos - address),
+                       (size_t) (next - pos));
+                r = kern_regex_stream_feed(st, (size_t) (next - pos),
+                                           kern_regex_hit, hits);
+            }
+        }
+        pos = next;
+    }
+
+    free(buf);
+    free(valid);
+
+    return r;
+}
+
+static int
+kern_regex_scan (kern_TaskObj *task, kern_regex_stream *st, int protection,
+                 const char *pattern, int resident, kern_regex_hits *hits)
+{
+    kern_region region;
+    mach_vm_address_t address, end;
+    mach_vm_size_t size, out_size;
+    char path[MAXPATHLEN];
+    int r;
+
+    region.address = 0;
+
+    while (kern_task_region(task, &region) == KERN_SUCCESS) {
+        if ((region.info.protection & protection) != protection)
+            goto next;
+
+        if (pattern != NULL &&
+            (! kern_task_path(task, region.address, path, sizeof(path)) ||
+             fnmatch(pattern, path, 0) != 0))
+            goto next;
+
+        address = region.address;
+        end = region.address + region.size;
+        kern_regex_stream_reset(st, address);
+
+        while (address < end) {
+            size = end - address;
+            if (size > st->chunk)
+                size = st->chunk;
+
+            r = kern_regex_resume(st, address, hits);
+            if (r != 0)
+                return r;
+
+            if (resident ||
+                kern_task_read(task, address, size, kern_regex_buffer(st),
+                               &out_size) != KERN_SUCCESS || out_size == 0) {
+                r = kern_regex_scan_pages(task, st, address, size, resident,
+                                          hits);
+                if (r != 0)
+                    return r;
+                address += size;
+                continue;
+            }
+
+            r = kern_regex_stream_feed(st, out_size, kern_regex_hit, hits);
+            if (r != 0)
+                return r;
+            address += out_size;
+        }
+
+        r = kern_regex_stream_finish(st, kern_regex_hit, hits);
+        if (r != 0)
+            return r;
+
+     next:
+        if (region.address + region.size <= region.address)
+            break;
+        region.address += region.size;
+    }
+
+    return 0;
+}
+
+/*
+ * Search the task's memory for a regular expression. Each region is
+ * scanned as a stream of chunks with the GIL released; matches are
+ * leftmost-longest, don't overlap and don't span regions
+ *
+ * Arguments: pattern - byte regular expression
+ *            protection - protection regions must have, default = READ
+ *            path - shell pattern the region's file must match, e.g.
+ *                   "*libssl*", default = any region
+ *            ignoreCase - ASCII case-insensitive matching, default = False
+ *            maxLength - longest match reported, longer ones are cut into
+ *                        pieces, default = 4096
+ *            resident - only scan resident pages, leaving paged out and
+ *                       untouched memory alone, default = False
+ * Returns:   (addresses, lengths) arrays
+ */
+PyObject *
+kern_Task_regexSearch (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_regex *re;
+    kern_regex_stream st;
+    kern_regex_hits hits;
+    PyObject *icase = NULL, *resident = NULL;
+    const char *pattern, *path = NULL;
+    char err[128];
+    unsigned long long max_length = 4096;
+    int size, protection = VM_PROT_READ, only_resident, r;
+
+    static char *kwlist[] = {"pattern", "protection", "path", "ignoreCase",
+                             "maxLength", "resident", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "s#|izOKO", kwlist,
+                                      &pattern, &size, &protection, &path,
+                                      &icase, &max_length, &resident))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (max_length == 0 || max_length > REGEX_CHUNK) {
+        PyErr_SetString(PyExc_ValueError, "maxLength out of range");
+        return NULL;
+    }
+
+    /* Before the GIL is released: resident may be any object */
+    only_resident = resident == NULL ? 0 : PyObject_IsTrue(resident);
+    if (only_resident < 0)
+        return NULL;
+
+    re = kern_regex_compile(pattern, (size_t) size,
+                            icase != NULL && PyObject_IsTrue(icase) ?
+                            _KERN_REGEX_ICASE : 0,
+                            (size_t) max_length, err, sizeof(err));
+    if (re == NULL) {
+        PyErr_SetString(PyExc_ValueError, err);
+        return NULL;
+    }
+
+    if (kern_regex_stream_init(&st, re, REGEX_CHUNK) < 0) {
+        kern_regex_free(re);
+        return PyErr_NoMemory();
+    }
+
+    memset(&hits, 0, sizeof(hits));
+
+    Py_BEGIN_ALLOW_THREADS
+    r = kern_regex_scan(self, &st, protection, path, only_resident, &hits);
+    Py_END_ALLOW_THREADS
+
+    kern_regex_stream_free(&st);
+    kern_regex_free(re);
+
+    if (r != 0 || hits.nomem) {
+        free(hits.address);
+        free(hits.length);
+        return PyErr_NoMemory();
+    }
+
+    args = Py_BuildValue("(NN)",
+                         kern_array_new("L", hits.address, hits.count * 8),
+                         kern_array_new("L", hits.length, hits.count * 8));
+
+    free(hits.address);
+    free(hits.length);
+
+    return args;
+}
@@ -0,0 +1,121 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_REGEX_H
+#define _KERN_REGEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "task.h"
+
+#define _KERN_REGEX_ICASE   0x1
+
+typedef struct kern_regex kern_regex;
+typedef struct kern_dfa kern_dfa;
+
+/* Called for each match; a non-zero return stops the scan */
+typedef int (*kern_regex_emit) (void *arg, uint64_t address, uint64_t length);
+
+/*
+ * Streaming matcher. Chunks are read into kern_regex_buffer() and fed in
+ * address order; the automaton state and enough history to locate match
+ * starts carry over from one chunk to the next.
+ */
+typedef struct {
+    kern_regex *re;
+    kern_dfa *search;           /* unanchored, finds match ends */
+    kern_dfa *reverse;          /* anchored reversed pattern, finds starts */
+    kern_dfa *prefix;           /* reversed, finds matches in progress */
+    kern_dfa *extend;           /* anchored, extends to the longest match */
+    unsigned char *buf;
+    size_t chunk;
+    size_t hist;                /* bytes of history at the front of buf */
+    uint64_t base;              /* address of buf[0] */
+    int leading;                /* looking for earlier starts */
+    int extending;
+    int32_t state;
+    size_t pos;                 /* next byte to match */
+    size_t low;                 /* end of the last match */
+    size_t start, last;         /* match being extended */
+} kern_regex_stream;
+
+/* Matches collected by kern_regex_hit() */
+typedef struct {
+    uint64_t *address;
+    uint64_t *length;
+    size_t count, capacity;
+    int nomem;
+} kern_regex_hits;
+
+/*
+ * What every match of a pattern must contain, for narrowing a search down
+ * with an index: a RUN is a string of byte sets that appears in every
+ * match, AND and OR combine their children, and ANY rules nothing out.
+ */
+enum {
+    _KERN_QUERY_ANY,
+    _KERN_QUERY_RUN,
+    _KERN_QUERY_AND,
+    _KERN_QUERY_OR
+};
+
+typedef struct kern_regex_query kern_regex_query;
+
+struct kern_regex_query {
+    int op;
+    kern_regex_query *child;    /* AND, OR */
+    kern_regex_query *next;
+    size_t length;              /* RUN positions */
+    uint8_t (*sets)[32];        /* RUN: bitmap of the bytes at each */
+};
+
+kern_regex *kern_regex_compile (const char *pattern, size_t size, int flags,
+                                size_t max_length, char *err, size_t errlen);
+void kern_regex_free (kern_regex *re);
+
+kern_regex_query *kern_regex_query_new (kern_regex *re);
+void kern_regex_query_free (kern_regex_query *q);
+
+int kern_regex_stream_init (kern_regex_stream *st, kern_regex *re,
+                            size_t chunk);
+void kern_regex_stream_reset (kern_regex_stream *st, uint64_t address);
+unsigned char *kern_regex_buffer (kern_regex_stream *st);
+int kern_regex_stream_feed (kern_regex_stream *st, size_t size,
+                            kern_regex_emit emit, void *arg);
+int kern_regex_stream_finish (kern_regex_stream *st, kern_regex_emit emit,
+                              void *arg);
+void kern_regex_stream_free (kern_regex_stream *st);
+
+int kern_regex_hit (void *arg, uint64_t address, uint64_t length);
+int kern_regex_scan_pages (kern_TaskObj *task, kern_regex_stream *st,
+                           mach_vm_address_t address, mach_vm_size_t size,
+                           int resident, kern_regex_hits *hits);
+
+PyObject *kern_Task_regexSearch (kern_TaskObj *self, PyObject *args,
+                                 PyObject *kwds);
+
+#endif
@@ -0,0 +1,1301 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+
+#include "kern.h"
+#include "task.h"
+#include "memory.h"
+#include "thread.h"
+#include "core.h"
+#include "remote.h"
+
+/*
+ * A Task backend for targets only reachable through a GDB remote protocol
+ * stub: gdbserver, QEMU's gdbstub, debugserver and the like.
+ *
+ * The stub is asked for its memory map and thread list once, at attach, and
+ * threads' registers are read then; after that the task behaves like a core
+ * file whose pages come over the wire. Reads are cached a page at a time, and
+ * the pages missing from a read are fetched with up to REMOTE_WINDOW requests
+ * in flight at once, each as large as the stub's PacketSize allows, so a
+ * large read costs about one round trip rather than one per packet.
+ *
+ * The target is expected to stay stopped while it's attached. flush() drops
+ * the cache if it has run since.
+ */
+
+#define REMOTE_MAX_PACKET   (1 << 20)   /* PacketSize we'll use at most */
+#define REMOTE_MIN_PACKET   400         /* and assume without one */
+#define REMOTE_WINDOW       32          /* requests in flight */
+#define REMOTE_RUN          (1 << 20)   /* missing bytes fetched at a time */
+#define REMOTE_CACHE_PAGES  4096
+#define REMOTE_TIMEOUT      10          /* seconds without a reply */
+
+typedef struct {
+    uint64_t address;
+    uint64_t size;
+    uint8_t *out;
+} kern_remote_range;
+
+/* Connection */
+
+static int
+kern_remote_reserve (char **buf, size_t *size, size_t need)
+{
+    char *tmp;
+    size_t n = *size ? *size : 4096;
+
+    if (need <= *size)
+        return 0;
+
+    while (n < need)
+        n *= 2;
+
+    tmp = realloc(*buf, n);
+    if (tmp == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    *buf = tmp;
+    *size = n;
+
+    return 0;
+}
+
+static int
+kern_remote_connect (kern_RemoteTaskObj *self, const char *address)
+{
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_un sun;
+    struct timeval tv = {REMOTE_TIMEOUT, 0};
+    const char *colon;
+    char host[256];
+    int fd = -1, one = 1, r;
+
+    colon = strrchr(address, ':');
+
+    if (strchr(address, '/') != NULL || colon == NULL) {
+        if (strlen(address) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, address);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        if ((size_t) (colon - address) >= sizeof(host)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(host, address, (size_t) (colon - address));
+        host[colon - address] = '\0';
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        r = getaddrinfo(*host ? host : "localhost", colon + 1, &hints, &res);
+        if (r != 0) {
+            errno = ECONNREFUSED;
+            return -1;
+        }
+
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd < 0)
+            return -1;
+
+        /* Requests go out as soon as they're queued */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    self->fd = fd;
+
+    return 0;
+}
+
+static int
+kern_remote_send (kern_RemoteTaskObj *self, const char *data, size_t size)
+{
+    ssize_t n;
+
+    while (size > 0) {
+        n = send(self->fd, data, size, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        size -= (size_t) n;
+    }
+
+    return 0;
+}
+
+/* Queue a packet. Our payloads are plain ASCII, so need no escaping */
+static int
+kern_remote_queue (kern_RemoteTaskObj *self, const char *format, ...)
+{
+    char payload[256];
+    uint8_t sum = 0;
+    va_list ap;
+    int i, n;
+
+    va_start(ap, format);
+    n = vsnprintf(payload, sizeof(payload), format, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t) n >= sizeof(payload)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (kern_remote_reserve(&self->out, &self->out_size,
+                            self->out_len + (size_t) n + 4) < 0)
+        return -1;
+
+    for (i = 0; i < n; ++i)
+        sum += (uint8_t) payload[i];
+
+    sprintf(self->out + self->out_len, "$%s#%02x", payload, sum);
+    self->out_len += (size_t) n + 4;
+    self->packets++;
+
+    return 0;
+}
+
+static int
+kern_remote_flush (kern_RemoteTaskObj *self)
+{
+    int r = kern_remote_send(self, self->out, self->out_len);
+
+    self->out_len = 0;
+    return r;
+}
+
+/* Unescape and run-length decode a reply payload into self->reply */
+static int
+kern_remote_decode (kern_RemoteTaskObj *self, const char *p, size_t size)
+{
+    size_t i, n = 0;
+    int repeat;
+    char c;
+
+    if (kern_remote_reserve(&self->reply, &self->reply_size, 1) < 0)
+        return -1;
+
+    for (i = 0; i < size; ++i) {
+        c = p[i];
+        repeat = 1;
+
+        if (c == '}' && i + 1 < size) {
+            c = (char) (p[++i] ^ 0x20);
+        } else if (c == '*' && i + 1 < size && n > 0) {
+            /* The previous character, count - 29 more times */
+            c = self->reply[n - 1];
+            repeat = (unsigned char) p[++i] - 29;
+            if (repeat < 0)
+                repeat = 0;
+        }
+
+        if (kern_remote_reserve(&self->reply, &self->reply_size,
+                                n + (size_t) repeat + 1) < 0)
+            return -1;
+        memset(self->reply + n, c, (size_t) repeat);
+        n += (size_t) repeat;
+    }
+
+    self->reply[n] = '\0';
+    self->reply_len = n;
+
+    return 0;
+}
+
+/*
+ * Wait for the next reply, skipping acks and notifications
+ *
+ * Returns: 0 with the reply in self->reply, or -1 with errno set
+ */
+static int
+kern_remote_recv (kern_RemoteTaskObj *self)
+{
+    size_t i = 0, end, j;
+    uint8_t sum;
+    unsigned int check;
+    ssize_t n;
+    char hex[3];
+
+    while (1) {
+        while (i < self->in_len) {
+            if (self->in[i] == '-' && self->acks) {
+                /* We never send a packet the stub could have garbled */
+                errno = EPROTO;
+                return -1;
+            }
+
+            if (self->in[i] != '$' && self->in[i] != '%') {
+                i++;
+                continue;
+            }
+
+            end = i + 1;
+            while (end < self->in_len && self->in[end] != '#')
+                end++;
+            if (end + 3 > self->in_len)
+                break;
+
+            for (sum = 0, j = i + 1; j < end; ++j)
+                sum += (uint8_t) self->in[j];
+            hex[0] = self->in[end + 1];
+            hex[1] = self->in[end + 2];
+            hex[2] = '\0';
+
+            if (sscanf(hex, "%x", &check) != 1 || check != sum) {
+                if (! self->acks) {
+                    errno = EPROTO;
+                    return -1;
+                }
+                if (kern_remote_send(self, "-", 1) < 0)
+                    return -1;
+                i = end + 3;
+                continue;
+            }
+
+            /* Notifications aren't replies, and nothing asked for them */
+            if (self->in[i] == '%') {
+                i = end + 3;
+                continue;
+            }
+
+            if (self->acks && kern_remote_send(self, "+", 1) < 0)
+                return -1;
+
+            if (kern_remote_decode(self, self->in + i + 1, end - i - 1) < 0)
+                return -1;
+
+            i = end + 3;
+            memmove(self->in, self->in + i, self->in_len - i);
+            self->in_len -= i;
+
+            return 0;
+        }
+
+        /* Keep the partial packet, drop what was skipped */
+        memmove(self->in, self->in + i, self->in_len - i);
+        self->in_len -= i;
+        i = 0;
+
+        if (kern_remote_reserve(&self->in, &self->in_size,
+                                self->in_len + 65536) < 0)
+            return -1;
+
+        n = recv(self->fd, self->in + self->in_len, 65536, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            errno = ETIMEDOUT;
+        if (n == 0)
+            errno = ECONNRESET;
+        if (n <= 0)
+            return -1;
+
+        self->in_len += (size_t) n;
+        self->bytes += (uint64_t) n;
+    }
+}
+
+/* Send one packet and wait for its reply */
+static int
+kern_remote_request (kern_RemoteTaskObj *self, const char *format, ...)
+{
+    char payload[256];
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vsnprintf(payload, sizeof(payload), format, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t) n >= sizeof(payload)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (kern_remote_queue(self, "%s", payload) < 0 ||
+        kern_remote_flush(self) < 0)
+        return -1;
+
+    return kern_remote_recv(self);
+}
+
+static int
+kern_remote_is_error (kern_RemoteTaskObj *self)
+{
+    return self->reply_len == 0 ||
+           (self->reply[0] == 'E' && self->reply_len == 3);
+}
+
+static int
+kern_remote_hexdigit (char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return 0;                   /* 'x', an unavailable register */
+}
+
+/* Decode up to size bytes of hex, returning the number decoded */
+static size_t
+kern_remote_unhex (const char *hex, size_t len, uint8_t *out, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size && 2 * i + 1 < len; ++i)
+        out[i] = (uint8_t) (kern_remote_hexdigit(hex[2 * i]) << 4 |
+                            kern_remote_hexdigit(hex[2 * i + 1]));
+
+    return i;
+}
+
+/* Memory */
+
+/*
+ * Read [address, address+size) into out, keeping up to REMOTE_WINDOW
+ * requests in flight. Stubs may answer with less than was asked for; the
+ * rest is asked for again
+ *
+ * Returns: 0, or -1 with errno set, EFAULT if some of it couldn't be read
+ */
+static int
+kern_remote_fetch (kern_RemoteTaskObj *self, uint64_t address, uint64_t size,
+                   uint8_t *out)
+{
+    kern_remote_range *reqs, *req, *tmp;
+    size_t nreqs = 0, capacity, sent = 0, done = 0, got;
+    uint64_t chunk;
+    const char *data;
+    int failed = 0;
+
+    /* Leave room for the framing, and for a few escapes in x replies */
+    chunk = self->binary ? self->packet_size - 64 :
+                           (self->packet_size - 8) / 2;
+
+    capacity = (size_t) (size / chunk) + 1 + REMOTE_WINDOW;
+    reqs = malloc(capacity * sizeof(*reqs));
+    if (reqs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (; size > 0; nreqs++) {
+        reqs[nreqs].address = address;
+        reqs[nreqs].size = MIN(size, chunk);
+        reqs[nreqs].out = out;
+        address += reqs[nreqs].size;
+        out += reqs[nreqs].size;
+        size -= reqs[nreqs].size;
+    }
+
+    while (done < nreqs) {
+        for (; sent < nreqs && sent - done < REMOTE_WINDOW; ++sent)
+            if (kern_remote_queue(self, "%c%llx,%llx",
+                                  self->binary ? 'x' : 'm',
+                                  (unsigned long long) reqs[sent].address,
+                                  (unsigned long long) reqs[sent].size) < 0)
+                goto error;
+
+        if (kern_remote_flush(self) < 0 || kern_remote_recv(self) < 0)
+            goto error;
+
+        req = &reqs[done++];
+
+        /* Every reply still has to be read, failed or not */
+        if (failed || kern_remote_is_error(self)) {
+            failed = 1;
+            continue;
+        }
+
+        if (self->binary) {
+            data = self->reply + (self->reply[0] == 'b');
+            got = MIN(self->reply_len - (size_t) (data - self->reply),
+                      (size_t) req->size);
+            memcpy(req->out, data, got);
+        } else {
+            got = kern_remote_unhex(self->reply, self->reply_len, req->out,
+                                    (size_t) req->size);
+        }
+
+        if (got == 0) {
+            failed = 1;
+        } else if (got < req->size) {
+            if (nreqs == capacity) {
+                capacity *= 2;
+                tmp = realloc(reqs, capacity * sizeof(*reqs));
+                if (tmp == NULL) {
+                    errno = ENOMEM;
+                    goto error;
+                }
+                reqs = tmp;
+                req = &reqs[done - 1];
+            }
+            reqs[nreqs].address = req->address + got;
+            reqs[nreqs].size = req->size - got;
+            reqs[nreqs].out = req->out + got;
+            nreqs++;
+        }
+    }
+
+    free(reqs);
+
+    if (failed) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    return 0;
+
+ error:
+    free(reqs);
+    return -1;
+}
+
+static kern_return_t
+kern_remote_kr (void)
+{
+    return errno == EFAULT ? KERN_INVALID_ADDRESS : KERN_FAILURE;
+}
+
+/* Cache slot for the page at address, or NULL if it isn't cached */
+static uint8_t *
+kern_remote_cached (kern_RemoteTaskObj *self, uint64_t page)
+{
+    size_t slot = (size_t) ((page / vm_page_size) & (REMOTE_CACHE_PAGES - 1));
+
+    if (self->cache_ids[slot] != page + 1)
+        return NULL;
+
+    return self->cache + slot * vm_page_size;
+}
+
+static void
+kern_remote_cache (kern_RemoteTaskObj *self, uint64_t page,
+                   const uint8_t *data)
+{
+    size_t slot = (size_t) ((page / vm_page_size) & (REMOTE_CACHE_PAGES - 1));
+
+    memcpy(self->cache + slot * vm_page_size, data, vm_page_size);
+    self->cache_ids[slot] = page + 1;
+}
+
+/* Doesn't need the GIL */
+static kern_return_t
+kern_remote_read (kern_TaskObj *task, mach_vm_address_t address,
+                  mach_vm_size_t size, void *buf, mach_vm_size_t *out_size)
+{
+    kern_RemoteTaskObj *self = (kern_RemoteTaskObj *) task;
+    uint64_t page, end = address + size, run, n, within, i;
+    uint8_t *out = buf, *cached;
+
+    pthread_mutex_lock(&self->lock);
+
+    while (address < end) {
+        page = address & ~((uint64_t) vm_page_size - 1);
+        within = address - page;
+        n = MIN(vm_page_size - within, end - address);
+
+        if ((cached = kern_remote_cached(self, page)) != NULL) {
+            self->hits++;
+            memcpy(out, cached + within, (size_t) n);
+            out += n;
+            address += n;
+            continue;
+        }
+
+        /* The missing pages from here, fetched together */
+        run = vm_page_size;
+        while (page + run < end && run < REMOTE_RUN &&
+               kern_remote_cached(self, page + run) == NULL)
+            run += vm_page_size;
+
+        if (kern_remote_fetch(self, page, run, self->staging) < 0) {
+            pthread_mutex_unlock(&self->lock);
+            return kern_remote_kr();
+        }
+
+        self->misses += run / vm_page_size;
+        for (i = 0; i < run; i += vm_page_size)
+            kern_remote_cache(self, page + i, self->staging + i);
+
+        n = MIN(page + run, end) - address;
+        memcpy(out, self->staging + within, (size_t) n);
+        out += n;
+        address += n;
+    }
+
+    pthread_mutex_unlock(&self->lock);
+
+    *out_size = size;
+
+    return KERN_SUCCESS;
+}
+
+static kern_return_t
+kern_remote_write (kern_TaskObj *task, mach_vm_address_t address,
+                   const void *data, mach_vm_size_t size)
+{
+    kern_RemoteTaskObj *self = (kern_RemoteTaskObj *) task;
+    const uint8_t *in = data;
+    uint64_t chunk = (self->packet_size - 64) / 2, n, page;
+    size_t slot, i, len;
+    uint8_t sum;
+    char head[64];
+    int r = 0;
+
+    pthread_mutex_lock(&self->lock);
+
+    /* Written pages are fetched again when next read */
+    for (page = address & ~((uint64_t) vm_page_size - 1);
+         page < address + size; page += vm_page_size) {
+        slot = (size_t) ((page / vm_page_size) & (REMOTE_CACHE_PAGES - 1));
+        if (self->cache_ids[slot] == page + 1)
+            self->cache_ids[slot] = 0;
+    }
+
+    for (; size > 0 && r == 0; address += n, in += n, size -= n) {
+        n = MIN(size, chunk);
+        len = (size_t) snprintf(head, sizeof(head), "M%llx,%llx:",
+                                (unsigned long long) address,
+                                (unsigned long long) n);
+
+        if (kern_remote_reserve(&self->out, &self->out_size,
+                                len + (size_t) n * 2 + 5) < 0) {
+            r = -1;
+            break;
+        }
+
+        sum = 0;
+        self->out[0] = '$';
+        memcpy(self->out + 1, head, len);
+        for (i = 0; i < n; ++i)
+            sprintf(self->out + 1 + len + 2 * i, "%02x", in[i]);
+        for (i = 1; i < 1 + len + (size_t) n * 2; ++i)
+            sum += (uint8_t) self->out[i];
+        sprintf(self->out + i, "#%02x", sum);
+        self->out_len = i + 3;
+        self->packets++;
+
+        if (kern_remote_flush(self) < 0 || kern_remote_recv(self) < 0)
+            r = -1;
+        else if (strcmp(self->reply, "OK") != 0)
+            r = -1, errno = EFAULT;
+    }
+
+    pthread_mutex_unlock(&self->lock);
+
+    return r == 0 ? KERN_SUCCESS : kern_remote_kr();
+}
+
+static const kern_task_ops kern_remote_ops = {
+    kern_remote_read,
+    kern_remote_write,
+    kern_core_region,
+    kern_core_path,
+    NULL,
+    NULL,
+};
+
+/* Attach */
+
+/*
+ * Read a whole qXfer object
+ *
+ * Returns: malloc'd NUL-terminated text, or NULL with errno set, ENOTSUP if
+ *          the stub doesn't have it
+ */
+static char *
+kern_remote_xfer (kern_RemoteTaskObj *self, const char *object,
+                  const char *annex)
+{
+    char *text = NULL;
+    size_t len = 0, size = 0;
+    size_t chunk = self->packet_size - 64;
+
+    while (1) {
+        if (kern_remote_request(self, "qXfer:%s:read:%s:%zx,%zx", object,
+                                annex, len, chunk) < 0)
+            goto error;
+
+        if (self->reply_len == 0 || (self->reply[0] != 'm' &&
+                                     self->reply[0] != 'l')) {
+            errno = ENOTSUP;
+            goto error;
+        }
+
+        if (kern_remote_reserve(&text, &size, len + self->reply_len) < 0)
+            goto error;
+        memcpy(text + len, self->reply + 1, self->reply_len - 1);
+        len += self->reply_len - 1;
+        text[len] = '\0';
+
+        if (self->reply[0] == 'l' || self->reply_len == 1)
+            return text;
+    }
+
+ error:
+    free(text);
+    return NULL;
+}
+
+/* The value of attribute name in the XML element at p, or 0 */
+static uint64_t
+kern_remote_attr (const char *p, const char *end, const char *name)
+{
+    char pattern[32];
+    const char *at;
+
+    snprintf(pattern, sizeof(pattern), " %s=\"", name);
+    at = strstr(p, pattern);
+    if (at == NULL || at > end)
+        return 0;
+
+    return strtoull(at + strlen(pattern), NULL, 16);
+}
+
+/* Parse a thread id, which may be p<pid>.<tid>, taking the pid if it's new */
+static uint64_t
+kern_remote_thread_id (kern_RemoteTaskObj *self, const char *p)
+{
+    char *end;
+    long pid;
+
+    if (*p != 'p')
+        return strtoull(p, NULL, 16);
+
+    pid = strtol(p + 1, &end, 16);
+    if (self->core.task.pid == 0)
+        self->core.task.pid = (int) pid;
+
+    return *end == '.' ? strtoull(end + 1, NULL, 16) : 0;
+}
+
+static int
+kern_remote_parse_map (kern_RemoteTaskObj *self, const char *xml)
+{
+    kern_CoreTaskObj *core = &self->core;
+    kern_core_segment *seg;
+    const char *p, *end;
+    size_t n = 0;
+
+    for (p = xml; (p = strstr(p, "<memory ")) != NULL; p++)
+        n++;
+
+    core->segments = calloc(n + 1, sizeof(kern_core_segment));
+    if (core->segments == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (p = xml; (p = strstr(p, "<memory ")) != NULL; p = end) {
+        end = strchr(p, '>');
+        if (end == NULL)
+            break;
+
+        seg = &core->segments[core->nsegments];
+        seg->vaddr = kern_remote_attr(p, end, "start");
+        seg->memsz = kern_remote_attr(p, end, "length");
+        seg->filesz = seg->memsz;
+        if (seg->memsz == 0)
+            continue;
+
+        /* Flash and ROM are no more writable through the stub than ours */
+        seg->protection = VM_PROT_READ | VM_PROT_EXECUTE;
+        if (strstr(p, "type=\"ram\"") != NULL &&
+            strstr(p, "type=\"ram\"") < end)
+            seg->protection |= VM_PROT_WRITE;
+
+        core->nsegments++;
+    }
+
+    qsort(core->segments, core->nsegments, sizeof(kern_core_segment),
+          kern_core_segment_cmp);
+
+    return 0;
+}
+
+/* Without a memory map, anything might be readable */
+static int
+kern_remote_whole_map (kern_RemoteTaskObj *self)
+{
+    kern_CoreTaskObj *core = &self->core;
+
+    core->segments = calloc(2, sizeof(kern_core_segment));
+    if (core->segments == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    core->segments[0].memsz = UINT64_MAX;
+    core->segments[0].filesz = UINT64_MAX;
+    core->segments[0].protection = VM_PROT_READ | VM_PROT_WRITE |
+                                   VM_PROT_EXECUTE;
+    core->nsegments = 1;
+
+    return 0;
+}
+
+static int
+kern_remote_add_thread (kern_RemoteTaskObj *self, uint64_t tid)
+{
+    kern_CoreThreadObj *thread;
+    int ret;
+
+    thread = kern_core_thread_new((PyObject *) self, (int) tid);
+    if (thread == NULL)
+        return -1;
+
+    if (PyList_GET_SIZE(self->core.threads) == 0 && self->core.task.pid == 0)
+        self->core.task.pid = (int) tid;
+
+    ret = PyList_Append(self->core.threads, (PyObject *) thread);
+    Py_DECREF(thread);
+
+    return ret;
+}
+
+static int
+kern_remote_list_threads (kern_RemoteTaskObj *self)
+{
+    const char *p, *end;
+    char *xml;
+    int first = 1;
+
+    xml = kern_remote_xfer(self, "threads", "");
+    if (xml != NULL) {
+        for (p = xml; (p = strstr(p, "<thread ")) != NULL; p = end) {
+            end = strchr(p, '>');
+            if (end == NULL)
+                break;
+
+            p = strstr(p, " id=\"");
+            if (p == NULL || p > end)
+                continue;
+
+            if (kern_remote_add_thread(self,
+                                       kern_remote_thread_id(self, p + 5)) < 0) {
+                free(xml);
+                return -1;
+            }
+        }
+        free(xml);
+        return 0;
+    }
+
+    if (errno != ENOTSUP)
+        return -1;
+
+    /* Older stubs list them a few at a time */
+    while (1) {
+        if (kern_remote_request(self, first ? "qfThreadInfo" :
+                                "qsThreadInfo") < 0)
+            return -1;
+        first = 0;
+
+        if (self->reply[0] != 'm')
+            return 0;
+
+        for (p = self->reply + 1; *p; p = *end ? end + 1 : end) {
+            end = strchr(p, ',');
+            if (end == NULL)
+                end = p + strlen(p);
+            if (kern_remote_add_thread(self,
+                                       kern_remote_thread_id(self, p)) < 0)
+                return -1;
+        }
+    }
+}
+
+/*
+ * Read every thread's general registers, pipelined. The stub's g reply is
+ * in gdb's amd64 order
+ */
+static int
+kern_remote_read_registers (kern_RemoteTaskObj *self)
+{
+    static const int order[] = {
+        offsetof(x86_thread_state64_t, __rax),
+        offsetof(x86_thread_state64_t, __rbx),
+        offsetof(x86_thread_state64_t, __rcx),
+        offsetof(x86_thread_state64_t, __rdx),
+        offsetof(x86_thread_state64_t, __rsi),
+        offsetof(x86_thread_state64_t, __rdi),
+        offsetof(x86_thread_state64_t, __rbp),
+        offsetof(x86_thread_state64_t, __rsp),
+        offsetof(x86_thread_state64_t, __r8),
+        offsetof(x86_thread_state64_t, __r9),
+        offsetof(x86_thread_state64_t, __r10),
+        offsetof(x86_thread_state64_t, __r11),
+        offsetof(x86_thread_state64_t, __r12),
+        offsetof(x86_thread_state64_t, __r13),
+        offsetof(x86_thread_state64_t, __r14),
+        offsetof(x86_thread_state64_t, __r15),
+        offsetof(x86_thread_state64_t, __rip),
+    };
+    kern_CoreThreadObj *thread;
+    x86_thread_state64_t *s;
+    uint8_t regs[17 * 8 + 7 * 4];
+    uint32_t value;
+    Py_ssize_t i, n = PyList_GET_SIZE(self->core.threads);
+    size_t j;
+
+    for (i = 0; i < n; ++i) {
+        thread = (kern_CoreThreadObj *) PyList_GET_ITEM(self->core.threads, i);
+        if (kern_remote_queue(self, "Hg%llx",
+                              (unsigned long long) thread->thread.tid) < 0 ||
+            kern_remote_queue(self, "g") < 0)
+            return -1;
+    }
+
+    if (kern_remote_flush(self) < 0)
+        return -1;
+
+    for (i = 0; i < n; ++i) {
+        thread = (kern_CoreThreadObj *) PyList_GET_ITEM(self->core.threads, i);
+        s = &thread->state.state64;
+
+        if (kern_remote_recv(self) < 0 || kern_remote_recv(self) < 0)
+            return -1;
+
+        /* Not amd64, or not a thread any more; its registers read as 0 */
+        if (kern_remote_unhex(self->reply, self->reply_len, regs,
+                              sizeof(regs)) < sizeof(regs))
+            continue;
+
+        for (j = 0; j < 17; ++j)
+            memcpy((char *) s + order[j], regs + j * 8, 8);
+
+        memcpy(&value, regs + 17 * 8, 4);
+        s->__rflags = value;
+        memcpy(&value, regs + 17 * 8 + 4, 4);
+        s->__cs = value;
+        memcpy(&value, regs + 17 * 8 + 5 * 4, 4);
+        s->__fs = value;
+        memcpy(&value, regs + 17 * 8 + 6 * 4, 4);
+        s->__gs = value;
+    }
+
+    return 0;
+}
+
+static int
+kern_remote_handshake (kern_RemoteTaskObj *self)
+{
+    const char *p;
+    char *xml;
+    unsigned long long size;
+
+    if (kern_remote_request(self, "qSupported:binary-upload+") < 0)
+        return -1;
+
+    self->packet_size = REMOTE_MIN_PACKET;
+    p = strstr(self->reply, "PacketSize=");
+    if (p != NULL && sscanf(p + 11, "%llx", &size) == 1)
+        self->packet_size = (size_t) MIN(MAX(size, REMOTE_MIN_PACKET),
+                                         REMOTE_MAX_PACKET);
+
+    self->binary = strstr(self->reply, "binary-upload+") != NULL;
+
+    if (strstr(self->reply, "QStartNoAckMode+") != NULL) {
+        if (kern_remote_request(self, "QStartNoAckMode") < 0)
+            return -1;
+        if (strcmp(self->reply, "OK") == 0)
+            self->acks = 0;
+    }
+
+    xml = kern_remote_xfer(self, "memory-map", "");
+    if (xml == NULL && errno != ENOTSUP)
+        return -1;
+
+    if (xml != NULL) {
+        if (kern_remote_parse_map(self, xml) < 0) {
+            free(xml);
+            errno = 0;
+            return -1;
+        }
+        free(xml);
+    } else if (kern_remote_whole_map(self) < 0) {
+        errno = 0;
+        return -1;
+    }
+
+    if (kern_remote_list_threads(self) < 0 ||
+        kern_remote_read_registers(self) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Forget a previous session: each connection starts over in ack mode */
+static void
+kern_remote_reset (kern_RemoteTaskObj *self)
+{
+    kern_core_reset(&self->core);
+
+    self->packet_size = REMOTE_MIN_PACKET;
+    self->acks = 1;
+    self->binary = 0;
+    self->in_len = self->out_len = self->reply_len = 0;
+
+    if (self->cache_ids != NULL)
+        memset(self->cache_ids, 0, REMOTE_CACHE_PAGES * sizeof(uint64_t));
+}
+
+/*
+ * Connect to the stub and read the target's memory map and threads
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_RemoteTask_attach (kern_RemoteTaskObj *self)
+{
+    PyObject *vm;
+    int r;
+
+    if (self->core.task.attached) {
+        PyErr_SetNone(kern_AlreadyAttachedError);
+        return NULL;
+    }
+
+    kern_remote_reset(self);
+
+    Py_BEGIN_ALLOW_THREADS
+    r = kern_remote_connect(self, PyString_AS_STRING(self->address));
+    Py_END_ALLOW_THREADS
+
+    if (r < 0)
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError,
+                                                    self->address);
+
+    if (self->cache == NULL) {
+        self->cache = malloc(REMOTE_CACHE_PAGES * vm_page_size);
+        self->cache_ids = calloc(REMOTE_CACHE_PAGES, sizeof(uint64_t));
+        self->staging = malloc(REMOTE_RUN);
+    }
+    if (self->cache == NULL || self->cache_ids == NULL ||
+        self->staging == NULL)
+        return PyErr_NoMemory();
+
+    if (kern_remote_handshake(self) < 0) {
+        if (! PyErr_Occurred())
+            PyErr_Format(kern_Error, "%s: %s",
+                         PyString_AS_STRING(self->address),
+                         errno ? strerror(errno) : "bad reply from stub");
+        close(self->fd);
+        self->fd = -1;
+        return NULL;
+    }
+
+    vm = kern_memory_new((PyObject *) self, 0, UINT64_MAX);
+    if (vm == NULL) {
+        close(self->fd);
+        self->fd = -1;
+        return NULL;
+    }
+
+    Py_DECREF(self->core.task.vm);
+    self->core.task.vm = vm;
+
+    self->core.task.attached = 1;
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Detach from the target, which the stub leaves running, and close the
+ * connection
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_RemoteTask_detach (kern_RemoteTaskObj *self)
+{
+    if (! self->core.task.attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&self->lock);
+
+    /* The stub may close first, so the reply doesn't matter */
+    Py_BEGIN_ALLOW_THREADS
+    if (kern_remote_request(self, "D") < 0)
+        errno = 0;
+    Py_END_ALLOW_THREADS
+
+    close(self->fd);
+    self->fd = -1;
+    self->core.task.attached = 0;
+
+    pthread_mutex_unlock(&self->lock);
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Detach if still attached, and drop the task's vm and threads
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_RemoteTask_close (kern_RemoteTaskObj *self)
+{
+    PyObject *r;
+
+    if (self->core.task.attached) {
+        if ((r = kern_RemoteTask_detach(self)) == NULL)
+            return NULL;
+        Py_DECREF(r);
+    }
+
+    kern_remote_reset(self);
+    kern_core_close(&self->core);
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Drop cached pages, e.g. after the target has run
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_RemoteTask_flush (kern_RemoteTaskObj *self)
+{
+    if (! self->core.task.attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&self->lock);
+    memset(self->cache_ids, 0, REMOTE_CACHE_PAGES * sizeof(uint64_t));
+    pthread_mutex_unlock(&self->lock);
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Get the connection's counters
+ *
+ * Arguments: None
+ * Returns:   {packet_size, binary, hits, misses, packets, bytes}, hits and
+ *            misses in pages, bytes received
+ */
+static PyObject *
+kern_RemoteTask_remoteStats (kern_RemoteTaskObj *self)
+{
+    PyObject *ret;
+
+    pthread_mutex_lock(&self->lock);
+    ret = Py_BuildValue("{s:n,s:O,s:K,s:K,s:K,s:K}",
+                        "packet_size", (Py_ssize_t) self->packet_size,
+                        "binary", self->binary ? Py_True : Py_False,
+                        "hits", self->hits,
+                        "misses", self->misses,
+                        "packets", self->packets,
+                        "bytes", self->bytes);
+    pthread_mutex_unlock(&self->lock);
+
+    return ret;
+}
+
+static void
+kern_RemoteTask_dealloc (kern_RemoteTaskObj *self)
+{
+    if (self->fd >= 0)
+        close(self->fd);
+    free(self->in);
+    free(self->out);
+    free(self->reply);
+    free(self->cache_ids);
+    free(self->cache);
+    free(self->staging);
+    pthread_mutex_destroy(&self->lock);
+    Py_XDECREF(self->address);
+    kern_CoreTaskType.tp_dealloc((PyObject *) self);
+}
+
+static PyObject *
+kern_RemoteTask_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    kern_RemoteTaskObj *self = NULL;
+
+    self = (kern_RemoteTaskObj *) kern_CoreTaskType.tp_new(type, args, kwds);
+
+    if (self != NULL) {
+        self->core.task.ops = &kern_remote_ops;
+        pthread_mutex_init(&self->lock, NULL);
+        self->fd = -1;
+        self->packet_size = REMOTE_MIN_PACKET;
+        self->acks = 1;
+        self->binary = 0;
+        self->in = self->out = self->reply = NULL;
+        self->in_len = self->in_size = 0;
+        self->out_len = self->out_size = 0;
+        self->reply_len = self->reply_size = 0;
+        self->cache_ids = NULL;
+        self->cache = NULL;
+        self->staging = NULL;
+        self->hits = self->misses = self->packets = self->bytes = 0;
+
+        Py_INCREF(Py_None);
+        self->address = Py_None;
+    }
+
+    return (PyObject *) self;
+}
+
+static int
+kern_RemoteTask_init (kern_RemoteTaskObj *self, PyObject *args,
+                      PyObject *kwds)
+{
+    PyObject *address = NULL, *tmp;
+
+    static char *kwlist[] = {"address", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "S", kwlist, &address))
+        return -1;
+
+    tmp = self->address;
+    Py_INCREF(address);
+    self->address = address;
+    Py_XDECREF(tmp);
+
+    return 0;
+}
+
+static PyMemberDef kern_RemoteTaskMembers[] = {
+    {"address", T_OBJECT_EX, offsetof(kern_RemoteTaskObj, address), READONLY,
+     "The stub's host:port or Unix socket path"},
+    {NULL} /* Sentinel */
+};
+
+static PyMethodDef kern_RemoteTaskMethods[] = {
+    {"attach", (PyCFunction)kern_RemoteTask_attach, METH_NOARGS,
+     "Connect to the stub and read the target's memory map and threads"},
+    {"detach", (PyCFunction)kern_RemoteTask_detach, METH_NOARGS,
+     "Detach from the target and close the connection"},
+    {"close", (PyCFunction)kern_RemoteTask_close, METH_NOARGS,
+     "Detach, and drop the task's memory map and threads"},
+    {"flush", (PyCFunction)kern_RemoteTask_flush, METH_NOARGS,
+     "Drop cached pages"},
+    {"remoteStats", (PyCFunction)kern_RemoteTask_remoteStats, METH_NOARGS,
+     "Return the connection's counters"},
+    {NULL} /* Sentinel */
+};
+
+PyTypeObject kern_RemoteTaskType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /* ob_size */
+    "mdb.kern.RemoteTask",     /* tp_name */
+    sizeof(kern_RemoteTaskObj), /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    (destructor)kern_RemoteTask_dealloc, /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_compare */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    "Task objects behind a GDB remote protocol stub", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    kern_RemoteTaskMethods,    /* tp_methods */
+    kern_RemoteTaskMembers,    /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)kern_RemoteTask_init, /* tp_init */
+    0,                         /* tp_alloc */
+    kern_RemoteTask_new,       /* tp_new */
+};
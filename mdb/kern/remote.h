@@ -0,0 +1,61 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_REMOTE_H
+#define _KERN_REMOTE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "structmember.h"
+
+#include "task.h"
+#include "core.h"
+
+extern PyTypeObject kern_RemoteTaskType;
+
+/* A target behind a gdbserver or another GDB remote protocol stub */
+typedef struct {
+    kern_CoreTaskObj core;
+    PyObject *address;          /* "host:port", or a Unix socket path */
+    int fd;
+    size_t packet_size;         /* the stub's PacketSize */
+    char acks;                  /* cleared by QStartNoAckMode */
+    char binary;                /* reads with x rather than m */
+    char *in;                   /* received, not yet parsed */
+    size_t in_len, in_size;
+    char *out;                  /* packets queued to send */
+    size_t out_len, out_size;
+    char *reply;                /* the latest reply, decoded */
+    size_t reply_len, reply_size;
+    uint64_t *cache_ids;        /* page address + 1, 0 for an empty slot */
+    uint8_t *cache;
+    uint8_t *staging;
+    uint64_t hits, misses, packets, bytes;
+    pthread_mutex_t lock;
+} kern_RemoteTaskObj;
+
+#endif
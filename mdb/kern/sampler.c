@@ -0,0 +1,735 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+
+#include "util.h"
+#include "kern.h"
+#include "task.h"
+#include "stats.h"
+#include "sampler.h"
+
+/*
+ * Fixed rate sampling of scalar watches from a native thread.
+ *
+ * Watches are coalesced into spans once, so each tick costs one read per
+ * span (a single read when the watches sit close together, as counters in
+ * one structure do). Samples go into a ring of per-watch columns drained
+ * by read(), and optionally to a file that only stores the values that
+ * changed since the previous record. The file is truncated and given its
+ * header when the sampler first starts; a restart carries on after the
+ * record that marked the stop:
+ *
+ *   header:  "MDBSAMP1" | u32 nwatches | u32 0 | u64 wall clock ns |
+ *            u64 origin ns | nwatches * (u64 address, u8 type, 7 pad)
+ *   record:  varint ns since previous record | changed bitmap |
+ *            changed values, little-endian, in watch order
+ *
+ * A record with an empty bitmap marks where sampling stopped.
+ */
+
+#define SAMPLER_MAGIC     "MDBSAMP1"
+#define SAMPLER_GAP       4096          /* merge watches this close */
+#define SAMPLER_SPAN_MAX  (1 << 20)
+
+static int
+kern_sampler_size (char type)
+{
+    switch (type) {
+    case 'b': case 'B':
+        return 1;
+    case 'h': case 'H':
+        return 2;
+    case 'i': case 'I': case 'f':
+        return 4;
+    case 'q': case 'Q': case 'd':
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+/* array typecode for a watch type; Python 2 arrays spell int64 'l' */
+static const char *
+kern_sampler_typecode (char type)
+{
+    switch (type) {
+    case 'q':
+        return "l";
+    case 'Q':
+        return "L";
+    case 'b': return "b";
+    case 'B': return "B";
+    case 'h': return "h";
+    case 'H': return "H";
+    case 'i': return "i";
+    case 'I': return "I";
+    case 'f': return "f";
+    default:  return "d";
+    }
+}
+
+static int
+kern_watch_cmp (const void *a, const void *b)
+{
+    const kern_watch *x = *(const kern_watch **) a;
+    const kern_watch *y = *(const kern_watch **) b;
+
+    return x->address < y->address ? -1 : x->address > y->address;
+}
+
+static int
+kern_sampler_plan (kern_SamplerObj *self)
+{
+    kern_watch **order, *w;
+    kern_span *span = NULL;
+    size_t i, total = 0;
+    mach_vm_address_t end;
+
+    order = malloc(self->nwatches * sizeof(kern_watch *));
+    self->spans = malloc(self->nwatches * sizeof(kern_span));
+    if (order == NULL || self->spans == NULL) {
+        free(order);
+        return -1;
+    }
+
+    for (i = 0; i < self->nwatches; ++i)
+        order[i] = &self->watches[i];
+    qsort(order, self->nwatches, sizeof(kern_watch *), kern_watch_cmp);
+
+    self->nspans = 0;
+    for (i = 0; i < self->nwatches; ++i) {
+        w = order[i];
+        end = w->address + w->size;
+
+        if (span != NULL && w->address <= span->address + span->size +
+            SAMPLER_GAP && end - span->address <= SAMPLER_SPAN_MAX) {
+            if (end > span->address + span->size) {
+                total += end - (span->address + span->size);
+                span->size = end - span->address;
+            }
+        } else {
+            span = &self->spans[self->nspans++];
+            span->address = w->address;
+            span->size = w->size;
+            span->offset = total;
+            total += w->size;
+        }
+
+        w->span = self->nspans - 1;
+        w->offset = span->offset + (w->address - span->address);
+    }
+
+    free(order);
+
+    self->buf = malloc(total);
+    self->span_ok = malloc(self->nspans * sizeof(int));
+    if (self->buf == NULL || self->span_ok == NULL)
+        return -1;
+
+    return 0;
+}
+
+static void
+kern_sampler_put_varint (FILE *f, uint64_t v)
+{
+    while (v >= 0x80) {
+        fputc((int) (v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    fputc((int) v, f);
+}
+
+static void
+kern_sampler_write_header (kern_SamplerObj *self, uint64_t origin)
+{
+    struct timeval tv;
+    uint32_t n = (uint32_t) self->nwatches, zero = 0;
+    uint64_t wall;
+    uint8_t pad[8] = { 0 };
+    size_t i;
+
+    gettimeofday(&tv, NULL);
+    wall = (uint64_t) tv.tv_sec * 1000000000ULL +
+           (uint64_t) tv.tv_usec * 1000;
+
+    fwrite(SAMPLER_MAGIC, 8, 1, self->file);
+    fwrite(&n, 4, 1, self->file);
+    fwrite(&zero, 4, 1, self->file);
+    fwrite(&wall, 8, 1, self->file);
+    fwrite(&origin, 8, 1, self->file);
+
+    for (i = 0; i < self->nwatches; ++i) {
+        fwrite(&self->watches[i].address, 8, 1, self->file);
+        pad[0] = (uint8_t) self->watches[i].type;
+        fwrite(pad, 8, 1, self->file);
+    }
+
+    self->file_time = origin;
+}
+
+static void
+kern_sampler_write_record (kern_SamplerObj *self, uint64_t now,
+                           const uint64_t *values, int first)
+{
+    unsigned char bitmap[512];
+    size_t i, nbytes = (self->nwatches + 7) / 8;
+    int changed = 0;
+
+    memset(bitmap, 0, nbytes);
+    for (i = 0; values != NULL && i < self->nwatches; ++i) {
+        if (first || values[i] != self->last[i]) {
+            bitmap[i / 8] |= (unsigned char) (1 << (i % 8));
+            changed = 1;
+        }
+    }
+
+    if (values != NULL && ! changed)
+        return;
+
+    kern_sampler_put_varint(self->file, now - self->file_time);
+    fwrite(bitmap, nbytes, 1, self->file);
+    for (i = 0; values != NULL && i < self->nwatches; ++i)
+        if (bitmap[i / 8] & (1 << (i % 8)))
+            fwrite(&values[i], (size_t) self->watches[i].size, 1,
+                   self->file);
+
+    self->file_time = now;
+}
+
+static void
+kern_sampler_tick (kern_SamplerObj *self, uint64_t *values, int first)
+{
+    kern_TaskObj *task = (kern_TaskObj *) self->task;
+    kern_span *span;
+    kern_watch *w;
+    mach_vm_size_t out_size;
+    uint64_t now, slot;
+    size_t i;
+
+    now = kern_stats_now();
+
+    for (i = 0; i < self->nspans; ++i) {
+        span = &self->spans[i];
+        self->span_ok[i] = kern_task_read(task, span->address, span->size,
+                                          self->buf + span->offset,
+                                          &out_size) == KERN_SUCCESS &&
+                           out_size == span->size;
+        if (! self->span_ok[i])
+            self->errors++;
+    }
+
+    /* Unreadable watches hold their last value */
+    for (i = 0; i < self->nwatches; ++i) {
+        w = &self->watches[i];
+        values[i] = self->last[i];
+        if (self->span_ok[w->span]) {
+            values[i] = 0;
+            memcpy(&values[i], self->buf + w->offset, (size_t) w->size);
+        }
+    }
+
+    pthread_mutex_lock(&self->lock);
+    slot = self->head % self->capacity;
+    self->times[slot] = now;
+    for (i = 0; i < self->nwatches; ++i)
+        self->values[i * self->capacity + slot] = values[i];
+    self->head++;
+    self->samples++;
+    pthread_mutex_unlock(&self->lock);
+
+    if (self->file != NULL)
+        kern_sampler_write_record(self, now, values, first);
+
+    memcpy(self->last, values, self->nwatches * sizeof(uint64_t));
+}
+
+static void *
+kern_sampler_run (void *arg)
+{
+    kern_SamplerObj *self = arg;
+    struct timespec ts;
+    uint64_t *values, next, now, late;
+    int first = 1;
+
+    values = malloc(self->nwatches * sizeof(uint64_t));
+    if (values == NULL) {
+        self->running = 0;
+        return NULL;
+    }
+
+    next = kern_stats_now();
+
+    /* Absolute deadlines, so sleep jitter doesn't accumulate */
+    while (self->running) {
+        now = kern_stats_now();
+        if (now < next) {
+            ts.tv_sec = (time_t) ((next - now) / 1000000000ULL);
+            ts.tv_nsec = (long) ((next - now) % 1000000000ULL);
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        kern_sampler_tick(self, values, first);
+        first = 0;
+
+        next += self->period;
+        now = kern_stats_now();
+        if (now >= next + self->period) {
+            late = (now - next) / self->period;
+            self->overruns += late;
+            next += late * self->period;
+        }
+    }
+
+    if (self->file != NULL) {
+        kern_sampler_write_record(self, kern_stats_now(), NULL, 0);
+        fflush(self->file);
+    }
+
+    free(values);
+    return NULL;
+}
+
+static void
+kern_sampler_stop (kern_SamplerObj *self)
+{
+    /* running may already be clear if the thread couldn't start sampling */
+    if (! self->started)
+        return;
+
+    self->running = 0;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_join(self->thread, NULL);
+    Py_END_ALLOW_THREADS
+    self->started = 0;
+}
+
+/*
+ * Start sampling
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_Sampler_start (kern_SamplerObj *self)
+{
+    const char *path;
+    int err;
+
+    if (self->running) {
+        PyErr_SetString(kern_Error, "sampler already running");
+        return NULL;
+    }
+
+    if (! ((kern_TaskObj *) self->task)->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (self->path != Py_None && self->file == NULL) {
+        path = PyString_AsString(self->path);
+        if (path == NULL)
+            return NULL;
+
+        self->file = fopen(path, "wb");
+        if (self->file == NULL)
+            return PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+                                                  (char *) path);
+        kern_sampler_write_header(self, kern_stats_now());
+    }
+
+    /* Reap a thread that gave up without being stopped */
+    kern_sampler_stop(self);
+
+    self->running = 1;
+    err = pthread_create(&self->thread, NULL, kern_sampler_run, self);
+    if (err != 0) {
+        self->running = 0;
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    self->started = 1;
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Stop sampling, flushing the file if there is one
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_Sampler_stop (kern_SamplerObj *self)
+{
+    kern_sampler_stop(self);
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Take the samples collected since the last read(). Samples older than the
+ * ring's capacity are lost, and counted in stats()
+ *
+ * Arguments: None
+ * Returns:   {time, values}, time being an array of sample times in ns and
+ *            values a list of arrays, one per watch
+ */
+static PyObject *
+kern_Sampler_read (kern_SamplerObj *self)
+{
+    PyObject *times = NULL, *values = NULL, *column;
+    uint64_t *t = NULL, *v = NULL, n, i, slot;
+    unsigned char *packed = NULL;
+    size_t w;
+    int size;
+
+    pthread_mutex_lock(&self->lock);
+    n = self->head - self->tail;
+    if (n > self->capacity) {
+        self->dropped += n - self->capacity;
+        self->tail = self->head - self->capacity;
+        n = self->capacity;
+    }
+
+    t = malloc(n * sizeof(uint64_t) + 1);
+    v = malloc(n * self->nwatches * sizeof(uint64_t) + 1);
+    if (t != NULL && v != NULL) {
+        for (i = 0; i < n; ++i) {
+            slot = (self->tail + i) % self->capacity;
+            t[i] = self->times[slot];
+            for (w = 0; w < self->nwatches; ++w)
+                v[w * n + i] = self->values[w * self->capacity + slot];
+        }
+        self->tail = self->head;
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    packed = malloc(n * sizeof(uint64_t) + 1);
+    if (t == NULL || v == NULL || packed == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    times = kern_array_new("L", t, n * sizeof(uint64_t));
+    values = PyList_New(0);
+    if (times == NULL || values == NULL)
+        goto done;
+
+    for (w = 0; w < self->nwatches; ++w) {
+        size = self->watches[w].size;
+        for (i = 0; i < n; ++i)
+            memcpy(packed + i * size, &v[w * n + i], (size_t) size);
+
+        column = kern_array_new(kern_sampler_typecode(self->watches[w].type),
+                                packed, n * size);
+        if (column == NULL || PyList_Append(values, column) < 0) {
+            Py_XDECREF(column);
+            goto done;
+        }
+        Py_DECREF(column);
+    }
+
+    free(t);
+    free(v);
+    free(packed);
+
+    return Py_BuildValue("{s:N,s:N}", "time", times, "values", values);
+
+ done:
+    free(t);
+    free(v);
+    free(packed);
+    Py_XDECREF(times);
+    Py_XDECREF(values);
+
+    return NULL;
+}
+
+/*
+ * Get sampling counters
+ *
+ * Arguments: None
+ * Returns:   {samples, dropped, errors, overruns, spans}. dropped counts
+ *            samples overwritten before read(), errors failed span reads
+ *            and overruns ticks skipped because sampling fell behind
+ */
+static PyObject *
+kern_Sampler_stats (kern_SamplerObj *self)
+{
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:n}",
+                         "samples", self->samples,
+                         "dropped", self->dropped,
+                         "errors", self->errors,
+                         "overruns", self->overruns,
+                         "spans", (Py_ssize_t) self->nspans);
+}
+
+/* Free the watches and buffers, so init() can be tried again */
+static void
+kern_sampler_clear (kern_SamplerObj *self)
+{
+    free(self->watches);
+    free(self->spans);
+    free(self->buf);
+    free(self->last);
+    free(self->span_ok);
+    free(self->times);
+    free(self->values);
+
+    self->watches = NULL;
+    self->spans = NULL;
+    self->buf = NULL;
+    self->last = NULL;
+    self->span_ok = NULL;
+    self->times = NULL;
+    self->values = NULL;
+    self->nwatches = self->nspans = 0;
+}
+
+static void
+kern_Sampler_dealloc (kern_SamplerObj *self)
+{
+    kern_sampler_stop(self);
+
+    if (self->file != NULL)
+        fclose(self->file);
+
+    kern_sampler_clear(self);
+    pthread_mutex_destroy(&self->lock);
+
+    Py_XDECREF(self->task);
+    Py_XDECREF(self->path);
+    self->ob_type->tp_free( (PyObject*) self);
+}
+
+static PyObject *
+kern_Sampler_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    kern_SamplerObj *self = NULL;
+
+    self = (kern_SamplerObj *) type->tp_alloc(type, 0);
+
+    if (self != NULL) {
+        pthread_mutex_init(&self->lock, NULL);
+        self->started = 0;
+        self->running = 0;
+        self->file = NULL;
+
+        Py_INCREF(Py_None);
+        self->task = Py_None;
+        Py_INCREF(Py_None);
+        self->path = Py_None;
+    }
+
+    return (PyObject *) self;
+}
+
+static int
+kern_Sampler_init (kern_SamplerObj *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *task = NULL, *watches = NULL, *path = Py_None, *fast, *item;
+    unsigned long long capacity = 1 << 16;
+    unsigned long long address;
+    double rate = 1000.0;
+    const char *type;
+    Py_ssize_t n, i;
+
+    static char *kwlist[] = {"task", "watches", "rate", "capacity", "path",
+                             NULL};
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O!O|dKO", kwlist,
+                                      &kern_TaskType, &task, &watches,
+                                      &rate, &capacity, &path))
+        return -1;
+
+    if (self->watches != NULL) {
+        PyErr_SetString(kern_Error, "sampler already initialized");
+        return -1;
+    }
+
+    if (rate <= 0 || rate > 1e9 || capacity == 0) {
+        PyErr_SetString(PyExc_ValueError, "rate and capacity must be "
+                        "positive");
+        return -1;
+    }
+
+    if (path != Py_None && ! PyString_Check(path)) {
+        PyErr_SetString(PyExc_TypeError, "path must be a string");
+        return -1;
+    }
+
+    fast = PySequence_Fast(watches, "watches must be a sequence of "
+                           "(address, type)");
+    if (fast == NULL)
+        return -1;
+
+    n = PySequence_Fast_GET_SIZE(fast);
+    if (n == 0 || n > 4096) {
+        Py_DECREF(fast);
+        PyErr_SetString(PyExc_ValueError, "between 1 and 4096 watches");
+        return -1;
+    }
+
+    if (capacity > SIZE_MAX / (size_t) n / sizeof(uint64_t)) {
+        Py_DECREF(fast);
+        PyErr_SetString(PyExc_ValueError, "capacity too large");
+        return -1;
+    }
+
+    self->watches = calloc((size_t) n, sizeof(kern_watch));
+    if (self->watches == NULL) {
+        Py_DECREF(fast);
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->nwatches = (size_t) n;
+
+    for (i = 0; i < n; ++i) {
+        item = PySequence_Fast_GET_ITEM(fast, i);
+        if (! PyArg_ParseTuple(item, "Ks", &address, &type)) {
+            Py_DECREF(fast);
+            kern_sampler_clear(self);
+            return -1;
+        }
+
+        self->watches[i].address = address;
+        self->watches[i].type = type[0];
+        self->watches[i].size = strlen(type) == 1 ?
+                                kern_sampler_size(type[0]) : 0;
+        if (self->watches[i].size == 0) {
+            PyErr_Format(PyExc_ValueError, "unknown watch type '%s'", type);
+            Py_DECREF(fast);
+            kern_sampler_clear(self);
+            return -1;
+        }
+    }
+    Py_DECREF(fast);
+
+    self->rate = rate;
+    self->period = (uint64_t) (1e9 / rate);
+    if (self->period == 0)
+        self->period = 1;
+    self->capacity = capacity;
+
+    self->last = calloc(self->nwatches, sizeof(uint64_t));
+    self->times = calloc((size_t) capacity, sizeof(uint64_t));
+    self->values = calloc((size_t) capacity * self->nwatches,
+                          sizeof(uint64_t));
+    if (self->last == NULL || self->times == NULL || self->values == NULL ||
+        kern_sampler_plan(self) < 0) {
+        kern_sampler_clear(self);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    Py_INCREF(task);
+    Py_DECREF(self->task);
+    self->task = task;
+
+    Py_INCREF(path);
+    Py_DECREF(self->path);
+    self->path = path;
+
+    return 0;
+}
+
+static PyMemberDef kern_SamplerMembers[] = {
+    {"task", T_OBJECT_EX, offsetof(kern_SamplerObj, task), READONLY,
+     "Task being sampled"},
+    {"path", T_OBJECT_EX, offsetof(kern_SamplerObj, path), READONLY,
+     "File samples are written to, or None"},
+    {"rate", T_DOUBLE, offsetof(kern_SamplerObj, rate), READONLY,
+     "Samples per second"},
+    {"running", T_BOOL, offsetof(kern_SamplerObj, running), READONLY,
+     "Sampling status"},
+    {NULL} /* Sentinel */
+};
+
+static PyMethodDef kern_SamplerMethods[] = {
+    {"start", (PyCFunction)kern_Sampler_start, METH_NOARGS,
+     "Start sampling"},
+    {"stop", (PyCFunction)kern_Sampler_stop, METH_NOARGS,
+     "Stop sampling"},
+    {"read", (PyCFunction)kern_Sampler_read, METH_NOARGS,
+     "Take the samples collected since the last read"},
+    {"stats", (PyCFunction)kern_Sampler_stats, METH_NOARGS,
+     "Return sampling counters"},
+    {NULL} /* Sentinel */
+};
+
+PyTypeObject kern_SamplerType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /* ob_size */
+    "mdb.kern.Sampler",        /* tp_name */
+    sizeof(kern_SamplerObj),   /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    (destructor)kern_Sampler_dealloc, /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_compare */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    "Sampler objects",         /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    kern_SamplerMethods,       /* tp_methods */
+    kern_SamplerMembers,       /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)kern_Sampler_init, /* tp_init */
+    0,                         /* tp_alloc */
+    kern_Sampler_new,          /* tp_new */
+};
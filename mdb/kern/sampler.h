@@ -0,0 +1,85 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_SAMPLER_H
+#define _KERN_SAMPLER_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include <mach/mach_types.h>
+
+#include "structmember.h"
+
+extern PyTypeObject kern_SamplerType;
+
+typedef struct {
+    mach_vm_address_t address;
+    char type;
+    int size;
+    size_t offset;      /* in the span buffer */
+    size_t span;
+} kern_watch;
+
+/* Watches close together are read in one go */
+typedef struct {
+    mach_vm_address_t address;
+    mach_vm_size_t size;
+    size_t offset;
+} kern_span;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *task;
+    PyObject *path;
+    double rate;
+    uint64_t period;
+    kern_watch *watches;
+    size_t nwatches;
+    kern_span *spans;
+    size_t nspans;
+    unsigned char *buf;
+    uint64_t *last;
+    int *span_ok;
+    /* Ring of samples, one column per watch */
+    uint64_t capacity;
+    uint64_t *times;
+    uint64_t *values;
+    uint64_t head;
+    uint64_t tail;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    char started;       /* thread is yet to be joined */
+    volatile char running;
+    FILE *file;
+    uint64_t file_time;
+    uint64_t samples;
+    uint64_t dropped;
+    uint64_t errors;
+    uint64_t overruns;
+} kern_SamplerObj;
+
+#endif
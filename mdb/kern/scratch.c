@@ -0,0 +1,254 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <stdlib.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+#include <mach/mach_vm.h>
+
+#include "task.h"
+#include "scratch.h"
+
+/*
+ * Scratch memory lives in the task, within rel32 reach of the code that
+ * jumps to it, so relocated rip-relative operands still fit. Areas are
+ * mapped rwx and never unmapped or reused while attached: a thread may be
+ * part way through any slot.
+ */
+
+#define SCRATCH_AREA   (64 * 1024)
+#define SCRATCH_REACH  (0x7fffffffULL - SCRATCH_AREA)
+#define SCRATCH_ALIGN  16
+
+static int
+kern_scratch_near (mach_vm_address_t a, mach_vm_address_t b)
+{
+    return (a > b ? a - b : b - a) < SCRATCH_REACH;
+}
+
+/* Map a new area within reach of near, or anywhere if near is 0 */
+static kern_return_t
+kern_scratch_map (kern_TaskObj *task, mach_vm_address_t near,
+                  mach_vm_address_t *address)
+{
+    kern_return_t kr;
+    kern_region region;
+    mach_vm_address_t addr, hi;
+
+    if (near == 0) {
+        *address = 0;
+        kr = mach_vm_allocate(task->port, address, SCRATCH_AREA,
+                              VM_FLAGS_ANYWHERE);
+        goto protect;
+    }
+
+    addr = near > SCRATCH_REACH ? near - SCRATCH_REACH : vm_page_size;
+    addr = (addr + vm_page_size - 1) & ~((mach_vm_address_t) vm_page_size - 1);
+    hi = near + SCRATCH_REACH < near ? ~(mach_vm_address_t) 0 :
+         near + SCRATCH_REACH;
+
+    /* First gap in range that's big enough */
+    kr = KERN_NO_SPACE;
+    while (addr + SCRATCH_AREA <= hi) {
+        region.address = addr;
+        kr = kern_task_region(task, &region);
+        if (kr == KERN_INVALID_ADDRESS)
+            region.address = hi;
+        else if (kr != KERN_SUCCESS)
+            return kr;
+
+        if (region.address >= addr + SCRATCH_AREA) {
+            kr = mach_vm_allocate(task->port, &addr, SCRATCH_AREA,
+                                  VM_FLAGS_FIXED);
+            if (kr == KERN_SUCCESS)
+                break;
+        }
+
+        if (region.address >= hi)
+            return KERN_NO_SPACE;
+        addr = region.address + region.size;
+    }
+
+    if (kr != KERN_SUCCESS)
+        return KERN_NO_SPACE;
+    *address = addr;
+
+ protect:
+    if (kr != KERN_SUCCESS)
+        return kr;
+
+    /* Patched while other threads may be running code in the same page */
+    return mach_vm_protect(task->port, *address, SCRATCH_AREA, FALSE,
+                           VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXECUTE);
+}
+
+/*
+ * Allocate size bytes of scratch memory within rel32 reach of near (any
+ * address if near is 0)
+ */
+kern_return_t
+kern_scratch_alloc (kern_TaskObj *task, mach_vm_address_t near,
+                    mach_vm_size_t size, mach_vm_address_t *address)
+{
+    kern_return_t kr;
+    struct kern_scratch *area;
+    mach_vm_address_t base;
+
+    if (task->ops != &kern_task_mach_ops)
+        return KERN_NOT_SUPPORTED;
+
+    size = (size + SCRATCH_ALIGN - 1) & ~(mach_vm_size_t) (SCRATCH_ALIGN - 1);
+    if (size > SCRATCH_AREA)
+        return KERN_INVALID_ARGUMENT;
+
+    for (area = task->scratch; area != NULL; area = area->next) {
+        if (area->size - area->used < size)
+            continue;
+        if (near && (! kern_scratch_near(near, area->base) ||
+                     ! kern_scratch_near(near, area->base + area->size)))
+            continue;
+        break;
+    }
+
+    if (area == NULL) {
+        kr = kern_scratch_map(task, near, &base);
+        if (kr != KERN_SUCCESS)
+            return kr;
+
+        area = malloc(sizeof(struct kern_scratch));
+        if (area == NULL) {
+            mach_vm_deallocate(task->port, base, SCRATCH_AREA);
+            return KERN_RESOURCE_SHORTAGE;
+        }
+
+        area->base = base;
+        area->size = SCRATCH_AREA;
+        area->used = 0;
+        area->next = task->scratch;
+        task->scratch = area;
+    }
+
+    *address = area->base + area->used;
+    area->used += size;
+
+    return KERN_SUCCESS;
+}
+
+kern_return_t
+kern_scratch_write (kern_TaskObj *task, mach_vm_address_t address,
+                    const void *data, mach_vm_size_t size)
+{
+    return mach_vm_write(task->port, address, (vm_offset_t) data,
+                         (mach_msg_type_number_t) size);
+}
+
+/*
+ * Patch code in place. The region is made writable copy-on-write for the
+ * duration, keeping execute so running threads don't fault
+ */
+kern_return_t
+kern_code_write (kern_TaskObj *task, mach_vm_address_t address,
+                 const void *data, mach_vm_size_t size)
+{
+    kern_return_t kr, kr2;
+    kern_region region;
+    mach_vm_address_t page;
+    mach_vm_size_t span;
+
+    if (task->ops != &kern_task_mach_ops)
+        return KERN_NOT_SUPPORTED;
+
+    region.address = address;
+    kr = kern_task_region(task, &region);
+    if (kr != KERN_SUCCESS)
+        return kr;
+    if (region.address > address ||
+        region.address + region.size < address + size)
+        return KERN_INVALID_ADDRESS;
+
+    page = address & ~((mach_vm_address_t) vm_page_size - 1);
+    span = address + size - page;
+
+    kr = mach_vm_protect(task->port, page, span, FALSE,
+                         region.info.protection | VM_PROT_WRITE |
+                         VM_PROT_COPY);
+    if (kr != KERN_SUCCESS)
+        return kr;
+
+    kr = mach_vm_write(task->port, address, (vm_offset_t) data,
+                       (mach_msg_type_number_t) size);
+
+    kr2 = mach_vm_protect(task->port, page, span, FALSE,
+                          region.info.protection);
+
+    return kr != KERN_SUCCESS ? kr : kr2;
+}
+
+/*
+ * Allocate size bytes in the task and map them here too, for structures
+ * both sides work on at once. Neither mapping is tracked: the caller frees
+ * them with mach_vm_deallocate
+ */
+kern_return_t
+kern_shared_alloc (kern_TaskObj *task, mach_vm_size_t size,
+                   mach_vm_address_t *local, mach_vm_address_t *remote)
+{
+    kern_return_t kr;
+    vm_prot_t cur, max;
+
+    if (task->ops != &kern_task_mach_ops)
+        return KERN_NOT_SUPPORTED;
+
+    *remote = 0;
+    kr = mach_vm_allocate(task->port, remote, size, VM_FLAGS_ANYWHERE);
+    if (kr != KERN_SUCCESS)
+        return kr;
+
+    *local = 0;
+    kr = mach_vm_remap(mach_task_self(), local, size, 0, VM_FLAGS_ANYWHERE,
+                       task->port, *remote, FALSE, &cur, &max,
+                       VM_INHERIT_NONE);
+    if (kr != KERN_SUCCESS)
+        mach_vm_deallocate(task->port, *remote, size);
+
+    return kr;
+}
+
+void
+kern_scratch_free (kern_TaskObj *task)
+{
+    struct kern_scratch *area, *next;
+
+    for (area = task->scratch; area != NULL; area = next) {
+        next = area->next;
+        free(area);
+    }
+
+    task->scratch = NULL;
+}
@@ -0,0 +1,59 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_SCRATCH_H
+#define _KERN_SCRATCH_H
+
+#include <mach/mach_types.h>
+
+#include "task.h"
+
+/* Executable memory allocated in the task for relocated code and stubs */
+struct kern_scratch {
+    mach_vm_address_t base;
+    mach_vm_size_t size;
+    mach_vm_size_t used;
+    struct kern_scratch *next;
+};
+
+kern_return_t kern_scratch_alloc (kern_TaskObj *task, mach_vm_address_t near,
+                                  mach_vm_size_t size,
+                                  mach_vm_address_t *address);
+
+kern_return_t kern_scratch_write (kern_TaskObj *task,
+                                  mach_vm_address_t address,
+                                  const void *data, mach_vm_size_t size);
+
+kern_return_t kern_code_write (kern_TaskObj *task, mach_vm_address_t address,
+                               const void *data, mach_vm_size_t size);
+
+kern_return_t kern_shared_alloc (kern_TaskObj *task, mach_vm_size_t size,
+                                 mach_vm_address_t *local,
+                                 mach_vm_address_t *remote);
+
+void kern_scratch_free (kern_TaskObj *task);
+
+#endif
@@ -0,0 +1,194 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_SHARED_H
+#define _KERN_SHARED_H
+
+/*
+ * Layouts of memory shared between the debugger and code running in the
+ * task. Both sides include this, so it mustn't depend on Python; the task
+ * side is always 64-bit x86, so fields are fixed width and 8 byte aligned.
+ */
+
+#include <stdint.h>
+
+/*
+ * Agent request queue. The debugger is the only producer and the agent's
+ * thread the only consumer, so the ring needs no locks: the debugger fills
+ * ring[head % SLOTS] then publishes it by bumping head; the agent serves
+ * requests in order and bumps tail as each is done. Each slot has its own
+ * window of the data area for input and results.
+ */
+
+#define KERN_AGENT_MAGIC      0x746e656761626d64ULL   /* "mdbagent" */
+#define KERN_AGENT_VERSION    1
+#define KERN_AGENT_SLOTS      64
+#define KERN_AGENT_WINDOW     (64 * 1024)
+#define KERN_AGENT_SYMBOL     "kern_agent_main"
+
+/* Agent states */
+#define _KERN_AGENT_LOADING   0
+#define _KERN_AGENT_READY     1
+#define _KERN_AGENT_STOPPED   2
+
+/* Requests */
+#define _KERN_AGENT_READ      1     /* copy [address, address+size) */
+#define _KERN_AGENT_WALK      2     /* follow a linked list */
+#define _KERN_AGENT_GATHER    3     /* copy size bytes at each address */
+#define _KERN_AGENT_SEARCH    4     /* find a byte string */
+#define _KERN_AGENT_STOP      5
+
+typedef struct {
+    uint32_t op;
+    int32_t status;             /* kern_return_t, set by the agent */
+    uint64_t address;
+    uint64_t size;
+    uint64_t arg[2];
+    uint64_t in_size;           /* input at the start of the window */
+    uint64_t out_size;          /* results from KERN_AGENT_OUT(in_size) */
+    uint64_t count;             /* results */
+    uint64_t next;              /* where to carry on, 0 if done */
+} kern_agent_request;
+
+/* Results start 8 byte aligned after the input */
+#define KERN_AGENT_OUT(in_size) (((in_size) + 7) & ~(uint64_t) 7)
+
+/*
+ * Written by the debugger for the bootstrap code that starts the agent's
+ * thread; the offsets are baked into that code (see agent.c)
+ */
+typedef struct {
+    uint64_t create;            /* 0: pthread_create_from_mach_thread */
+    uint64_t start;             /* 8: the loader, the new thread's start */
+    uint64_t dlopen;            /* 16 */
+    uint64_t dlsym;             /* 24 */
+    uint64_t dlerror;           /* 32 */
+    uint64_t shared;            /* 40: this area, in the task */
+    uint64_t pthread;           /* 48: out */
+    uint64_t error;             /* 56: out, dlerror() string in the task */
+    int32_t status;             /* 64: out, -1 until the thread is created */
+    int32_t pad;
+    char symbol[24];            /* 72 */
+    char path[1024];            /* 96 */
+} kern_agent_boot;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    volatile uint32_t state;
+    uint64_t size;              /* of the whole area */
+    uint64_t data;              /* offset of the first window */
+    uint64_t tid;               /* the agent's thread */
+    uint32_t wake;              /* port name, in the task, to wake it with */
+    volatile uint32_t sleeping; /* set while the agent waits on wake */
+    volatile uint64_t head;
+    volatile uint64_t tail;
+    kern_agent_boot boot;
+    kern_agent_request ring[KERN_AGENT_SLOTS];
+} kern_agent_shared;
+
+#define KERN_AGENT_DATA  ((sizeof(kern_agent_shared) + 4095) & ~(size_t) 4095)
+#define KERN_AGENT_SIZE  (KERN_AGENT_DATA + KERN_AGENT_SLOTS * KERN_AGENT_WINDOW)
+
+#define KERN_AGENT_WINDOW_AT(shared, slot) \
+    ((uint8_t *) (shared) + (shared)->data + \
+     (uint64_t) (slot) * KERN_AGENT_WINDOW)
+
+/*
+ * Hook record ring. Hooked functions in any thread of the task are the
+ * producers: a stub reserves a record by advancing head with a
+ * compare-and-swap, fills it in, then publishes it by setting seq to its
+ * position + 1. The debugger alone drains records in order and advances
+ * tail. A stub finding the ring full counts the record as dropped rather
+ * than wait. The offsets are baked into the stub (see hook.c)
+ */
+
+#define KERN_HOOK_MAGIC       0x6b6f6f68626d64ULL     /* "mdbhook" */
+
+typedef struct {
+    uint64_t seq;               /* 0: position + 1, once written */
+    uint64_t address;           /* 8: the hooked function */
+    uint64_t thread;            /* 16: the caller's pthread_t */
+    uint64_t time;              /* 24: TSC at entry */
+    uint64_t caller;            /* 32: return address */
+    uint64_t sp;                /* 40: stack pointer at entry */
+    uint64_t arg[6];            /* 48: rdi, rsi, rdx, rcx, r8, r9 */
+} kern_hook_record;
+
+typedef struct {
+    uint64_t magic;
+    uint64_t capacity;          /* records, a power of two */
+    uint64_t pad0[6];
+    volatile uint64_t head;     /* 64: reserved by the stubs */
+    uint64_t pad1[7];
+    volatile uint64_t tail;     /* 128: drained by the debugger */
+    volatile uint64_t dropped;  /* 136 */
+    uint64_t pad2[6];
+    kern_hook_record records[]; /* 192 */
+} kern_hook_ring;
+
+#define KERN_HOOK_RING_SIZE(capacity) \
+    (sizeof(kern_hook_ring) + (uint64_t) (capacity) * sizeof(kern_hook_record))
+
+/*
+ * Syscall record ring, shared and drained the same way as the hook ring.
+ * A traced syscall stub reserves its record once the syscall returns, so a
+ * thread blocked in one holds up nothing (see syscalls.c)
+ */
+
+#define KERN_SYSCALL_MAGIC    0x6c6c61637362646dULL   /* "mdbscall" */
+
+typedef struct {
+    uint64_t seq;               /* 0: position + 1, once written */
+    uint64_t number;            /* 8: as loaded into eax, class included */
+    uint64_t thread;            /* 16: the caller's pthread_t */
+    uint64_t start;             /* 24: TSC before the syscall */
+    uint64_t end;               /* 32: TSC after it */
+    uint64_t caller;            /* 40: return address */
+    uint64_t ret;               /* 48: rax, an errno if CF is set */
+    uint64_t flags;             /* 56: rflags after the syscall */
+    uint64_t address;           /* 64: the traced stub */
+    uint64_t arg[6];            /* 72: rdi, rsi, rdx, r10, r8, r9 */
+    uint64_t pad;
+} kern_syscall_record;
+
+typedef struct {
+    uint64_t magic;
+    uint64_t capacity;          /* records, a power of two */
+    uint64_t pad0[6];
+    volatile uint64_t head;     /* 64: reserved by the stubs */
+    uint64_t pad1[7];
+    volatile uint64_t tail;     /* 128: drained by the debugger */
+    volatile uint64_t dropped;  /* 136 */
+    uint64_t pad2[6];
+    kern_syscall_record records[]; /* 192 */
+} kern_syscall_ring;
+
+#define KERN_SYSCALL_RING_SIZE(capacity) \
+    (sizeof(kern_syscall_ring) + \
+     (uint64_t) (capacity) * sizeof(kern_syscall_record))
+
+#endif
@@ -0,0 +1,630 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+
+#include "util.h"
+#include "kern.h"
+#include "task.h"
+#include "thread.h"
+#include "memory.h"
+#include "core.h"
+#include "elf.h"
+#include "snapshot.h"
+
+/*
+ * Snapshots of a task as ELF core files, readable by CoreTask.
+ *
+ * The task only has to be stopped while its state is captured, not while
+ * the file is written: mach_vm_read gives us a copy-on-write copy of a range
+ * without copying a byte, so a live snapshot freezes the task, takes a copy
+ * of every region and the threads' registers, and thaws it again. Pages the
+ * task writes afterwards are copied by the VM on demand, and the file comes
+ * out as it would from a task stopped throughout.
+ */
+
+/* mach_vm_read sizes are 32-bit */
+#define SNAPSHOT_COPY_CHUNK   (1 << 30)
+#define SNAPSHOT_WRITE_CHUNK  (1 << 20)
+
+static void *
+kern_snap_grow (void *p, size_t *capacity, size_t need, size_t item)
+{
+    size_t n = *capacity ? *capacity : 64;
+
+    if (need <= *capacity)
+        return p;
+
+    while (n < need)
+        n *= 2;
+    if ((p = realloc(p, n * item)) != NULL)
+        *capacity = n;
+
+    return p;
+}
+
+static int
+kern_snap_add_file (kern_snap *snap, kern_region *region, const char *path,
+                    size_t len)
+{
+    uint64_t *files;
+    char *paths;
+
+    files = kern_snap_grow(snap->files, &snap->files_capacity,
+                           (snap->nfiles + 1) * 3, sizeof(uint64_t));
+    if (files == NULL)
+        return -1;
+    snap->files = files;
+
+    paths = kern_snap_grow(snap->paths, &snap->paths_capacity,
+                           snap->paths_size + len + 1, 1);
+    if (paths == NULL)
+        return -1;
+    snap->paths = paths;
+
+    files[snap->nfiles * 3] = region->address;
+    files[snap->nfiles * 3 + 1] = region->address + region->size;
+    files[snap->nfiles * 3 + 2] = region->info.offset / vm_page_size;
+    snap->nfiles++;
+
+    memcpy(paths + snap->paths_size, path, len + 1);
+    snap->paths_size += len + 1;
+
+    return 0;
+}
+
+/*
+ * Record every region; with copy set, also take the contents of the readable
+ * ones, as copy-on-write copies where the backend allows
+ */
+static int
+kern_snap_regions (kern_snap *snap, int copy)
+{
+    kern_TaskObj *task = snap->task;
+    kern_snap_segment *seg;
+    kern_region region;
+    mach_vm_address_t address, end;
+    mach_msg_type_number_t count;
+    kern_return_t kr;
+    uint8_t *valid;
+    char path[MAXPATHLEN];
+    size_t len;
+    uint64_t start;
+
+    region.address = 0;
+
+    while (kern_task_region(task, &region) == KERN_SUCCESS) {
+        len = kern_task_path(task, region.address, path, sizeof(path));
+        if (len && kern_snap_add_file(snap, &region, path, len) < 0)
+            return -1;
+
+        end = region.address + region.size;
+        for (address = region.address; address < end; address += seg->size) {
+            seg = kern_snap_grow(snap->segments, &snap->capacity,
+                                 snap->nsegments + 1, sizeof(*seg));
+            if (seg == NULL)
+                return -1;
+            snap->segments = seg;
+
+            seg = &snap->segments[snap->nsegments++];
+            memset(seg, 0, sizeof(*seg));
+            seg->address = address;
+            seg->size = end - address;
+            if (seg->size > SNAPSHOT_COPY_CHUNK)
+                seg->size = SNAPSHOT_COPY_CHUNK;
+            seg->protection = region.info.protection;
+
+            if (! copy || ! (seg->protection & VM_PROT_READ))
+                continue;
+
+            if (task->ops == &kern_task_mach_ops) {
+                start = kern_stats_now();
+                kr = mach_vm_read(task->port, seg->address, seg->size,
+                                  &seg->copy, &count);
+                kern_stats_record(&task->stats, _KERN_STAT_READ,
+                                  seg->address,
+                                  kr == KERN_SUCCESS ? count : 0, start, kr);
+                if (kr == KERN_SUCCESS)
+                    continue;
+                seg->copy = 0;
+            }
+
+            /* Holes in the range (e.g. guard pages) come back zeroed */
+            seg->buf = malloc((size_t) seg->size);
+            valid = malloc(KERN_MEMORY_VALID_SIZE(seg->address, seg->size));
+            if (seg->buf == NULL || valid == NULL) {
+                free(valid);
+                return -1;
+            }
+            kern_memory_read_partial(task, seg->address, seg->size, seg->buf,
+                                     valid);
+            free(valid);
+        }
+
+        if (end <= region.address)
+            break;
+        region.address = end;
+    }
+
+    return 0;
+}
+
+static void
+kern_snap_regs (kern_elf_regs64 *regs, int arch, kern_multi_arch_tstate *ms)
+{
+    memset(regs, 0, sizeof(*regs));
+
+    if (arch == _KERN_THREAD_ARCH_X86_64) {
+        x86_thread_state64_t *s = &ms->state64;
+#define R(mach, elf) regs->elf = s->__##mach
+        R(rax, rax); R(rbx, rbx); R(rcx, rcx); R(rdx, rdx);
+        R(rdi, rdi); R(rsi, rsi); R(rbp, rbp); R(rsp, rsp);
+        R(r8, r8); R(r9, r9); R(r10, r10); R(r11, r11);
+        R(r12, r12); R(r13, r13); R(r14, r14); R(r15, r15);
+        R(rip, rip); R(rflags, eflags); R(cs, cs); R(fs, fs); R(gs, gs);
+#undef R
+    } else {
+        x86_thread_state32_t *s = &ms->state32;
+#define R(mach, elf) regs->elf = s->__##mach
+        R(eax, rax); R(ebx, rbx); R(ecx, rcx); R(edx, rdx);
+        R(edi, rdi); R(esi, rsi); R(ebp, rbp); R(esp, rsp);
+        R(eip, rip); R(eflags, eflags); R(cs, cs); R(ss, ss);
+        R(ds, ds); R(es, es); R(fs, fs); R(gs, gs);
+#undef R
+    }
+}
+
+/* Registers and CPU times of each thread, as NT_PRSTATUS */
+static int
+kern_snap_threads (kern_snap *snap, PyObject *threads)
+{
+    kern_elf_prstatus64 *prs;
+    kern_ThreadObj *thread;
+    kern_CoreThreadObj *saved;
+    kern_multi_arch_tstate ms;
+    kern_thread_info info;
+    Py_ssize_t i, n = PyList_GET_SIZE(threads);
+
+    snap->threads = calloc((size_t) n + 1, sizeof(*snap->threads));
+    if (snap->threads == NULL)
+        return -1;
+
+    for (i = 0; i < n; ++i) {
+        thread = (kern_ThreadObj *) PyList_GET_ITEM(threads, i);
+        prs = &snap->threads[snap->nthreads];
+
+        if (PyObject_TypeCheck(thread, &kern_CoreThreadType)) {
+            saved = (kern_CoreThreadObj *) thread;
+            kern_snap_regs(&prs->pr_reg, thread->arch, &saved->state);
+            prs->pr_utime = saved->utime;
+            prs->pr_stime = saved->stime;
+        } else {
+            /* Threads that exited since the list was taken are left out */
+            if (kern_thread_state(thread, &ms) != KERN_SUCCESS)
+                continue;
+            kern_snap_regs(&prs->pr_reg, thread->arch, &ms);
+
+            if (kern_thread_get_info(thread, &info) == KERN_SUCCESS) {
+                prs->pr_utime.tv_sec = info.user_time / 1000000;
+                prs->pr_utime.tv_usec = info.user_time % 1000000;
+                prs->pr_stime.tv_sec = info.system_time / 1000000;
+                prs->pr_stime.tv_usec = info.system_time % 1000000;
+            }
+        }
+
+        /* CoreTask takes the pid from the first thread */
+        prs->pr_pid = snap->nthreads == 0 ? snap->task->pid :
+                      (int32_t) thread->tid;
+        prs->pr_ppid = prs->pr_pgrp = prs->pr_sid = 0;
+        snap->nthreads++;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Freeze the task and capture its regions, threads and mapped files; a live
+ * snapshot also captures the memory and thaws the task again
+ *
+ * Arguments: snap - snapshot to fill in, freed with kern_snap_free()
+ *            task - task to capture
+ *            live - capture memory now and thaw
+ * Returns:   0, or -1 with an exception set and the task thawed
+ */
+int
+kern_snap_take (kern_snap *snap, kern_TaskObj *task, int live)
+{
+    PyObject *threads, *type, *value, *tb;
+    int r;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->task = task;
+    snap->live = live;
+
+    if (task->frozen) {
+        PyErr_SetNone(kern_AlreadyPausedError);
+        return -1;
+    }
+
+    /* Overridden by offline backends, which are always stopped */
+    snap->window = PyObject_CallMethod((PyObject *) task, "freeze", NULL);
+    if (snap->window == NULL)
+        return -1;
+
+    threads = PyObject_CallMethod((PyObject *) task, "getThreads", NULL);
+    if (threads == NULL)
+        goto error;
+    if (! PyList_Check(threads)) {
+        PyErr_SetString(PyExc_TypeError, "getThreads() must return a list");
+        goto error;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    r = kern_snap_regions(snap, live);
+    Py_END_ALLOW_THREADS
+    if (r < 0 || kern_snap_threads(snap, threads) < 0) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    Py_CLEAR(threads);
+
+    if (live)
+        return kern_snap_done(snap);
+
+    return 0;
+
+ error:
+    /* Don't leave the task stopped behind an error */
+    Py_XDECREF(threads);
+    PyErr_Fetch(&type, &value, &tb);
+    kern_snap_done(snap);
+    PyErr_Restore(type, value, tb);
+
+    return -1;
+}
+
+/*
+ * Get the captured contents of [address, address+size) within seg, reading
+ * them into buf if they weren't captured up front. Unreadable pages are
+ * zeroed. Doesn't need the GIL
+ *
+ * Returns: the contents
+ */
+const uint8_t *
+kern_snap_data (kern_snap *snap, kern_snap_segment *seg,
+                mach_vm_address_t address, size_t size, uint8_t *buf,
+                uint8_t *valid)
+{
+    mach_vm_size_t out_size;
+
+    if (seg->copy)
+        return (const uint8_t *) seg->copy + (address - seg->address);
+
+    if (seg->buf != NULL)
+        return seg->buf + (address - seg->address);
+
+    if (kern_task_read(snap->task, address, size, buf, &out_size) !=
+        KERN_SUCCESS || out_size != size)
+        kern_memory_read_partial(snap->task, address, size, buf, valid);
+
+    return buf;
+}
+
+/* Drop a segment's captured contents once they've been used */
+void
+kern_snap_release (kern_snap_segment *seg)
+{
+    if (seg->copy)
+        mach_vm_deallocate(mach_task_self(), seg->copy, seg->size);
+    seg->copy = 0;
+
+    free(seg->buf);
+    seg->buf = NULL;
+}
+
+/*
+ * Thaw the task if it's still frozen
+ *
+ * Returns: 0, or -1 with an exception set
+ */
+int
+kern_snap_done (kern_snap *snap)
+{
+    if (snap->pause != NULL || snap->window == NULL)
+        return 0;
+
+    snap->pause = PyObject_CallMethod((PyObject *) snap->task, "thaw", NULL);
+
+    return snap->pause != NULL ? 0 : -1;
+}
+
+void
+kern_snap_free (kern_snap *snap)
+{
+    size_t i;
+
+    for (i = 0; i < snap->nsegments; ++i)
+        kern_snap_release(&snap->segments[i]);
+
+    free(snap->segments);
+    free(snap->threads);
+    free(snap->files);
+    free(snap->paths);
+    Py_XDECREF(snap->window);
+    Py_XDECREF(snap->pause);
+}
+
+/* ELF core files */
+
+static int
+kern_snap_note (FILE *f, uint32_t type, const void *desc, size_t size)
+{
+    static const char pad[4], name[8] = "CORE";
+    Elf64_Nhdr note;
+
+    note.n_namesz = 5;
+    note.n_descsz = (uint32_t) size;
+    note.n_type = type;
+
+    return fwrite(&note, sizeof(note), 1, f) != 1 ||
+           fwrite(name, 8, 1, f) != 1 ||
+           (size && fwrite(desc, size, 1, f) != 1) ||
+           ((size & 3) && fwrite(pad, 4 - (size & 3), 1, f) != 1) ? -1 : 0;
+}
+
+static size_t
+kern_snap_note_size (size_t size)
+{
+    return sizeof(Elf64_Nhdr) + 8 + ((size + 3) & ~(size_t) 3);
+}
+
+static int
+kern_snap_write (kern_snap *snap, FILE *f, uint64_t *written)
+{
+    kern_snap_segment *seg;
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdr;
+    mach_vm_address_t address;
+    uint64_t offset, header, *desc;
+    uint8_t *buf, *valid;
+    size_t i, notes, size;
+    int r = 0;
+
+    notes = snap->nthreads * kern_snap_note_size(sizeof(kern_elf_prstatus64));
+    if (snap->nfiles)
+        notes += kern_snap_note_size(16 + snap->nfiles * 24 +
+                                     snap->paths_size);
+
+    header = sizeof(ehdr) + (snap->nsegments + 1) * sizeof(phdr);
+
+    memset(&ehdr, 0, sizeof(ehdr));
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[6] = EV_CURRENT;
+    ehdr.e_type = ET_CORE;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_phoff = sizeof(ehdr);
+    ehdr.e_ehsize = sizeof(ehdr);
+    ehdr.e_phentsize = sizeof(phdr);
+    ehdr.e_phnum = (uint16_t) (snap->nsegments + 1);
+
+    if (fwrite(&ehdr, sizeof(ehdr), 1, f) != 1)
+        return -1;
+
+    memset(&phdr, 0, sizeof(phdr));
+    phdr.p_type = PT_NOTE;
+    phdr.p_offset = header;
+    phdr.p_filesz = notes;
+    phdr.p_align = 4;
+    if (fwrite(&phdr, sizeof(phdr), 1, f) != 1)
+        return -1;
+
+    offset = KERN_ROUND_PAGE(header + notes);
+    for (i = 0; i < snap->nsegments; ++i) {
+        seg = &snap->segments[i];
+
+        memset(&phdr, 0, sizeof(phdr));
+        phdr.p_type = PT_LOAD;
+        phdr.p_flags = ((seg->protection & VM_PROT_READ) ? PF_R : 0) |
+                       ((seg->protection & VM_PROT_WRITE) ? PF_W : 0) |
+                       ((seg->protection & VM_PROT_EXECUTE) ? PF_X : 0);
+        phdr.p_offset = offset;
+        phdr.p_vaddr = seg->address;
+        phdr.p_memsz = seg->size;
+        phdr.p_filesz = (seg->protection & VM_PROT_READ) ? seg->size : 0;
+        phdr.p_align = vm_page_size;
+        offset += phdr.p_filesz;
+
+        if (fwrite(&phdr, sizeof(phdr), 1, f) != 1)
+            return -1;
+    }
+
+    for (i = 0; i < snap->nthreads; ++i)
+        if (kern_snap_note(f, NT_PRSTATUS, &snap->threads[i],
+                           sizeof(kern_elf_prstatus64)) < 0)
+            return -1;
+
+    if (snap->nfiles) {
+        size = 16 + snap->nfiles * 24 + snap->paths_size;
+        if ((desc = malloc(size)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        desc[0] = snap->nfiles;
+        desc[1] = vm_page_size;
+        memcpy(desc + 2, snap->files, snap->nfiles * 24);
+        memcpy(desc + 2 + snap->nfiles * 3, snap->paths, snap->paths_size);
+
+        r = kern_snap_note(f, NT_FILE, desc, size);
+        free(desc);
+        if (r < 0)
+            return -1;
+    }
+
+    if (fseeko(f, (off_t) KERN_ROUND_PAGE(header + notes), SEEK_SET) != 0)
+        return -1;
+
+    buf = malloc(SNAPSHOT_WRITE_CHUNK);
+    valid = malloc(KERN_MEMORY_VALID_SIZE(0, SNAPSHOT_WRITE_CHUNK));
+    if (buf == NULL || valid == NULL) {
+        free(buf);
+        free(valid);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (i = 0; i < snap->nsegments && r == 0; ++i) {
+        seg = &snap->segments[i];
+        if (! (seg->protection & VM_PROT_READ))
+            continue;
+
+        for (address = seg->address;
+             address < seg->address + seg->size && r == 0;
+             address += size) {
+            size = (size_t) (seg->address + seg->size - address);
+            if (size > SNAPSHOT_WRITE_CHUNK)
+                size = SNAPSHOT_WRITE_CHUNK;
+
+            if (fwrite(kern_snap_data(snap, seg, address, size, buf, valid),
+                       size, 1, f) != 1)
+                r = -1;
+        }
+
+        kern_snap_release(seg);
+    }
+
+    free(buf);
+    free(valid);
+
+    *written = offset;
+
+    return r;
+}
+
+/*
+ * Save the task as an ELF core file that CoreTask can open. A live snapshot
+ * freezes the task only to take copy-on-write copies of its memory and its
+ * registers, then writes the file while the task runs on; otherwise the task
+ * stays frozen until the file is written. Either way the file holds the
+ * task's state at the moment it was frozen
+ *
+ * Arguments: path - file to write
+ *            live - thaw before writing, default = True
+ * Returns:   {pause, window, bytes, segments, threads}, pause being how long
+ *            the task was frozen and window how long it took to stop, in ns
+ */
+PyObject *
+kern_Task_snapshot (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_snap snap;
+    PyObject *live = NULL, *ret = NULL;
+    const char *path;
+    uint64_t written = 0;
+    FILE *f;
+    int r, err = 0;
+
+    static char *kwlist[] = {"path", "live", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|O", kwlist, &path,
+                                      &live))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    f = fopen(path, "wb");
+    if (f == NULL)
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) path);
+
+    if (kern_snap_take(&snap, self,
+                       live == NULL || PyObject_IsTrue(live) == 1) < 0) {
+        fclose(f);
+        remove(path);
+        kern_snap_free(&snap);
+        return NULL;
+    }
+
+    if (snap.nsegments >= 0xffff) {
+        PyErr_SetString(kern_Error, "Too many regions for an ELF core");
+        fclose(f);
+        remove(path);
+        goto out;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    r = kern_snap_write(&snap, f, &written);
+    if (r < 0)
+        err = errno;
+    if (fclose(f) != 0 && r == 0) {
+        r = -1;
+        err = errno;
+    }
+    if (r < 0)
+        remove(path);
+    Py_END_ALLOW_THREADS
+
+    if (kern_snap_done(&snap) < 0)
+        goto out;
+
+    if (r < 0) {
+        errno = err;
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) path);
+        goto out;
+    }
+
+    ret = Py_BuildValue("{s:O,s:O,s:K,s:n,s:n}", "pause", snap.pause,
+                        "window", snap.window, "bytes", written,
+                        "segments", (Py_ssize_t) snap.nsegments,
+                        "threads", (Py_ssize_t) snap.nthreads);
+
+ out:
+    /* Thaw even if something failed */
+    if (ret == NULL && snap.pause == NULL) {
+        PyObject *type, *value, *tb;
+
+        PyErr_Fetch(&type, &value, &tb);
+        kern_snap_done(&snap);
+        PyErr_Restore(type, value, tb);
+    }
+    kern_snap_free(&snap);
+
+    return ret;
+}
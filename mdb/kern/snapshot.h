@@ -0,0 +1,74 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_SNAPSHOT_H
+#define _KERN_SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "task.h"
+#include "elf.h"
+
+typedef struct {
+    mach_vm_address_t address;
+    mach_vm_size_t size;
+    vm_prot_t protection;
+    vm_offset_t copy;           /* copy-on-write copy, or 0 */
+    uint8_t *buf;               /* captured where no copy could be made */
+} kern_snap_segment;
+
+/*
+ * A task's regions, threads and mapped files as of one instant. Memory is
+ * captured up front only for live snapshots; otherwise the task stays frozen
+ * until kern_snap_done() and contents are read as they're needed.
+ */
+typedef struct {
+    kern_TaskObj *task;
+    int live;
+    PyObject *window;           /* ns to stop the task */
+    PyObject *pause;            /* ns the task was frozen, once thawed */
+    kern_snap_segment *segments;
+    size_t nsegments, capacity;
+    kern_elf_prstatus64 *threads;
+    size_t nthreads;
+    uint64_t *files;            /* NT_FILE (start, end, page offset) */
+    size_t nfiles, files_capacity;
+    char *paths;
+    size_t paths_size, paths_capacity;
+} kern_snap;
+
+int kern_snap_take (kern_snap *snap, kern_TaskObj *task, int live);
+const uint8_t *kern_snap_data (kern_snap *snap, kern_snap_segment *seg,
+                               mach_vm_address_t address, size_t size,
+                               uint8_t *buf, uint8_t *valid);
+void kern_snap_release (kern_snap_segment *seg);
+int kern_snap_done (kern_snap *snap);
+void kern_snap_free (kern_snap *snap);
+
+PyObject *kern_Task_snapshot (kern_TaskObj *self, PyObject *args,
+                              PyObject *kwds);
+
+#endif
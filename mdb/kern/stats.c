@@ -0,0 +1,345 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/mach_types.h>
+
+#include "stats.h"
+#include "trace.h"
+
+/*
+ * Operation counters and latency histograms.
+ *
+ * Each OS thread records into its own block of a task's counters, found
+ * through a small thread-local cache, so recording takes no locks and
+ * doesn't share cache lines between threads scanning in parallel. Readers
+ * sum the blocks; reset just moves the baseline the sums are reported
+ * against.
+ *
+ * A thread keeps one block per task it has recorded for, so a cache miss
+ * only allocates the first time. When the thread exits its blocks are
+ * folded into each task's retired counts and freed, and a task destroyed
+ * first takes its blocks back from the threads. The lists linking blocks,
+ * tasks and threads are under one global lock, taken only on cache misses,
+ * thread exit and by readers.
+ */
+
+#define STATS_CACHE 4
+
+typedef struct {
+    uint64_t id;
+    kern_stat_block *block;
+} kern_stats_cached;
+
+struct kern_stats_thread {
+    kern_stats_cached cache[STATS_CACHE];
+    unsigned int victim;
+    kern_stat_block *blocks;
+};
+
+static __thread struct kern_stats_thread *kern_stats_self;
+
+static pthread_key_t kern_stats_key;
+static pthread_once_t kern_stats_once = PTHREAD_ONCE_INIT;
+
+static uint64_t kern_stats_next_id = 1;
+static pthread_mutex_t kern_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *kern_stats_names[_KERN_STAT_OPS] = {
+    "read", "write", "region", "get_state", "set_state", "suspend", "resume",
+    "exc_wait", "residency",
+};
+
+static void
+kern_stats_add (kern_stat_block *total, const kern_stat_block *block)
+{
+    const kern_stat_counter *c;
+    kern_stat_counter *t;
+    int op, i;
+
+    for (op = 0; op < _KERN_STAT_OPS; ++op) {
+        c = &block->ops[op];
+        t = &total->ops[op];
+        t->calls += c->calls;
+        t->errors += c->errors;
+        t->bytes += c->bytes;
+        t->ns += c->ns;
+        for (i = 0; i < _KERN_STAT_BUCKETS; ++i)
+            t->histogram[i] += c->histogram[i];
+    }
+}
+
+/* Unlink block from its stats' list; the caller holds kern_stats_lock */
+static void
+kern_stats_unlink (kern_stat_block *block)
+{
+    kern_stat_block **p;
+
+    for (p = &block->stats->blocks; *p != block; p = &(*p)->next)
+        ;
+    *p = block->next;
+}
+
+/* Thread exit: fold the thread's blocks into their tasks' retired counts */
+static void
+kern_stats_thread_exit (void *arg)
+{
+    struct kern_stats_thread *thread = arg;
+    kern_stat_block *block, *next;
+
+    pthread_mutex_lock(&kern_stats_lock);
+    for (block = thread->blocks; block != NULL; block = next) {
+        next = block->thread_next;
+        kern_stats_add(&block->stats->retired, block);
+        kern_stats_unlink(block);
+        free(block);
+    }
+    pthread_mutex_unlock(&kern_stats_lock);
+
+    free(thread);
+}
+
+static void
+kern_stats_key_init (void)
+{
+    pthread_key_create(&kern_stats_key, kern_stats_thread_exit);
+}
+
+void
+kern_stats_init (kern_stats *stats)
+{
+    /* Ids are never reused, so stale cache entries can't match */
+    pthread_mutex_lock(&kern_stats_lock);
+    stats->id = kern_stats_next_id++;
+    pthread_mutex_unlock(&kern_stats_lock);
+
+    stats->blocks = NULL;
+    stats->trace = NULL;
+    stats->trace_epoch = 0;
+    stats->trace_writers[0] = stats->trace_writers[1] = 0;
+    memset(&stats->retired, 0, sizeof(kern_stat_block));
+    memset(&stats->baseline, 0, sizeof(kern_stat_block));
+}
+
+void
+kern_stats_destroy (kern_stats *stats)
+{
+    kern_stat_block *block, *next, **p;
+
+    pthread_mutex_lock(&kern_stats_lock);
+    for (block = stats->blocks; block != NULL; block = next) {
+        next = block->next;
+        for (p = &block->thread->blocks; *p != block; p = &(*p)->thread_next)
+            ;
+        *p = block->thread_next;
+        free(block);
+    }
+    stats->blocks = NULL;
+    pthread_mutex_unlock(&kern_stats_lock);
+}
+
+uint64_t
+kern_stats_now (void)
+{
+    static mach_timebase_info_data_t timebase;
+
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+
+static kern_stat_block *
+kern_stats_block (kern_stats *stats)
+{
+    struct kern_stats_thread *thread = kern_stats_self;
+    kern_stat_block *block;
+    unsigned int i;
+
+    if (thread == NULL) {
+        pthread_once(&kern_stats_once, kern_stats_key_init);
+        thread = calloc(1, sizeof(struct kern_stats_thread));
+        if (thread == NULL)
+            return NULL;
+        if (pthread_setspecific(kern_stats_key, thread) != 0) {
+            free(thread);
+            return NULL;
+        }
+        kern_stats_self = thread;
+    }
+
+    for (i = 0; i < STATS_CACHE; ++i)
+        if (thread->cache[i].id == stats->id)
+            return thread->cache[i].block;
+
+    pthread_mutex_lock(&kern_stats_lock);
+
+    for (block = thread->blocks; block != NULL; block = block->thread_next)
+        if (block->stats == stats)
+            break;
+
+    if (block == NULL && (block = calloc(1, sizeof(*block))) != NULL) {
+        block->stats = stats;
+        block->next = stats->blocks;
+        stats->blocks = block;
+        block->thread = thread;
+        block->thread_next = thread->blocks;
+        thread->blocks = block;
+    }
+
+    pthread_mutex_unlock(&kern_stats_lock);
+
+    if (block == NULL)
+        return NULL;
+
+    i = thread->victim++ % STATS_CACHE;
+    thread->cache[i].id = stats->id;
+    thread->cache[i].block = block;
+
+    return block;
+}
+
+/*
+ * Record one call of op that started at start (from kern_stats_now) and
+ * moved bytes. arg (an address or thread port) only goes to the trace.
+ * stats may be NULL
+ */
+void
+kern_stats_record (kern_stats *stats, int op, uint64_t arg, uint64_t bytes,
+                   uint64_t start, kern_return_t kr)
+{
+    kern_stat_block *block;
+    kern_stat_counter *c;
+    uint64_t end = kern_stats_now(), ns = end - start;
+    int bucket = 0;
+
+    if (stats == NULL)
+        return;
+
+    kern_trace_emit(stats, op, arg, bytes, start, end, kr);
+
+    block = kern_stats_block(stats);
+    if (block == NULL)
+        return;
+
+    while (bucket < _KERN_STAT_BUCKETS - 1 && (ns >> bucket))
+        bucket++;
+
+    c = &block->ops[op];
+    c->calls++;
+    c->bytes += bytes;
+    c->ns += ns;
+    c->histogram[bucket]++;
+    if (kr != KERN_SUCCESS)
+        c->errors++;
+}
+
+static void
+kern_stats_sum (kern_stats *stats, kern_stat_block *total)
+{
+    kern_stat_block *block;
+
+    pthread_mutex_lock(&kern_stats_lock);
+    *total = stats->retired;
+    for (block = stats->blocks; block != NULL; block = block->next)
+        kern_stats_add(total, block);
+    pthread_mutex_unlock(&kern_stats_lock);
+}
+
+/*
+ * Counters since the last reset, as {op: {calls, errors, bytes, ns,
+ * histogram}}. histogram lists (upper bound ns, calls) for non-empty buckets
+ */
+PyObject *
+kern_stats_dict (kern_stats *stats)
+{
+    kern_stat_block total;
+    kern_stat_counter *t, *b;
+    PyObject *result, *histogram, *item;
+    uint64_t count;
+    int op, i;
+
+    kern_stats_sum(stats, &total);
+
+    result = PyDict_New();
+    if (result == NULL)
+        return NULL;
+
+    for (op = 0; op < _KERN_STAT_OPS; ++op) {
+        t = &total.ops[op];
+        b = &stats->baseline.ops[op];
+
+        histogram = PyList_New(0);
+        if (histogram == NULL)
+            goto error;
+
+        for (i = 0; i < _KERN_STAT_BUCKETS; ++i) {
+            count = t->histogram[i] - b->histogram[i];
+            if (count == 0)
+                continue;
+
+            item = Py_BuildValue("(KK)", 1ULL << i, count);
+            if (item == NULL || PyList_Append(histogram, item) < 0) {
+                Py_XDECREF(item);
+                Py_DECREF(histogram);
+                goto error;
+            }
+            Py_DECREF(item);
+        }
+
+        item = Py_BuildValue("{s:K,s:K,s:K,s:K,s:N}",
+                             "calls", t->calls - b->calls,
+                             "errors", t->errors - b->errors,
+                             "bytes", t->bytes - b->bytes,
+                             "ns", t->ns - b->ns,
+                             "histogram", histogram);
+        if (item == NULL ||
+            PyDict_SetItemString(result, kern_stats_names[op], item) < 0) {
+            Py_XDECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+    }
+
+    return result;
+
+ error:
+    Py_DECREF(result);
+    return NULL;
+}
+
+void
+kern_stats_reset (kern_stats *stats)
+{
+    kern_stats_sum(stats, &stats->baseline);
+}
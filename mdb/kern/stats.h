@@ -0,0 +1,93 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_STATS_H
+#define _KERN_STATS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <mach/mach_types.h>
+
+/* Instrumented operations */
+#define _KERN_STAT_READ          0
+#define _KERN_STAT_WRITE         1
+#define _KERN_STAT_REGION        2
+#define _KERN_STAT_GET_STATE     3
+#define _KERN_STAT_SET_STATE     4
+#define _KERN_STAT_SUSPEND       5
+#define _KERN_STAT_RESUME        6
+#define _KERN_STAT_EXC_WAIT      7
+#define _KERN_STAT_RESIDENCY     8
+#define _KERN_STAT_OPS           9
+
+/* Latency buckets, bucket i counting calls under 2^i ns */
+#define _KERN_STAT_BUCKETS       40
+
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t ns;
+    uint64_t histogram[_KERN_STAT_BUCKETS];
+} kern_stat_counter;
+
+struct kern_stats;
+struct kern_stats_thread;
+
+/* Accumulators written by a single OS thread */
+typedef struct kern_stat_block {
+    kern_stat_counter ops[_KERN_STAT_OPS];
+    struct kern_stats *stats;
+    struct kern_stat_block *next;           /* of the stats' blocks */
+    struct kern_stats_thread *thread;
+    struct kern_stat_block *thread_next;    /* of the thread's blocks */
+} kern_stat_block;
+
+struct kern_trace;
+
+typedef struct kern_stats {
+    uint64_t id;
+    kern_stat_block *blocks;
+    kern_stat_block retired;   /* counts of threads that have exited */
+    kern_stat_block baseline;  /* totals at the last reset */
+    struct kern_trace *trace;  /* timeline, if recording */
+    volatile uint64_t trace_epoch;      /* see kern_trace_swap */
+    volatile uint64_t trace_writers[2]; /* in the trace, by epoch parity */
+} kern_stats;
+
+void kern_stats_init (kern_stats *stats);
+void kern_stats_destroy (kern_stats *stats);
+
+uint64_t kern_stats_now (void);
+
+void kern_stats_record (kern_stats *stats, int op, uint64_t arg,
+                        uint64_t bytes, uint64_t start, kern_return_t kr);
+
+PyObject *kern_stats_dict (kern_stats *stats);
+void kern_stats_reset (kern_stats *stats);
+
+#endif
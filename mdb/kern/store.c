@@ -0,0 +1,1390 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+
+#include "kern.h"
+#include "task.h"
+#include "memory.h"
+#include "core.h"
+#include "elf.h"
+#include "hash.h"
+#include "lz.h"
+#include "snapshot.h"
+#include "store.h"
+
+/*
+ * A content-addressed store of snapshots.
+ *
+ * Successive snapshots of a task, or snapshots of many tasks forked from the
+ * same parent, are mostly the same pages. A store keeps each distinct page
+ * once, keyed by a 128-bit hash of its contents, compressed, and doesn't
+ * keep zero pages at all. A store is a directory of:
+ *
+ *   pages               page records, appended as they're first seen
+ *   index               "MDBPIDX1", page size, then one kern_store_entry
+ *                       per record; page id n is the nth entry
+ *   snapshots/<name>    a manifest: regions, threads and mapped files as in
+ *                       a core file, then the id of every readable page,
+ *                       0 for zero pages
+ *
+ * Records are written before the index entries for them, and manifests are
+ * written to a temporary file and renamed into place, so a store interrupted
+ * mid-add still opens with every complete snapshot intact. Writers, in this
+ * process or others, take turns with an flock on the index, and pick up the
+ * pages the others added before adding their own; readers pick them up when
+ * a snapshot refers to pages they haven't seen.
+ *
+ * StoreTask reads a snapshot back through the usual Task and Memory API,
+ * decompressing pages as they're read into a small cache.
+ */
+
+#define STORE_CHUNK         (1 << 20)   /* read from the task at a time */
+#define STORE_PENDING       (1 << 22)   /* records buffered before writing */
+#define STORE_CACHE_PAGES   256         /* decompressed pages kept */
+#define STORE_SEED          0x9e3779b97f4a7c15ULL
+
+typedef struct {
+    char magic[8];              /* "MDBPIDX1" */
+    uint32_t page_size;
+    uint32_t reserved;
+} kern_store_header;
+
+typedef struct {
+    char magic[8];              /* "MDBSNAP1" */
+    uint32_t page_size;
+    int32_t pid;
+    uint64_t nsegments;
+    uint64_t nthreads;
+    uint64_t nfiles;
+    uint64_t paths_size;
+    uint64_t npages;
+} kern_store_manifest;
+
+typedef struct {
+    uint64_t address;
+    uint64_t size;
+    int32_t protection;
+    uint32_t reserved;
+} kern_store_segment;
+
+typedef struct {
+    uint64_t pages;
+    uint64_t zero;
+    uint64_t added;
+    uint64_t bytes;
+} kern_store_counts;
+
+static int
+kern_store_pread (int fd, void *buf, size_t size, uint64_t offset)
+{
+    uint8_t *p = buf;
+    ssize_t n;
+
+    while (size > 0) {
+        n = pread(fd, p, size, (off_t) offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = EIO;
+            return -1;
+        }
+        p += n;
+        size -= (size_t) n;
+        offset += (uint64_t) n;
+    }
+
+    return 0;
+}
+
+static int
+kern_store_pwrite (int fd, const void *buf, size_t size, uint64_t offset)
+{
+    const uint8_t *p = buf;
+    ssize_t n;
+
+    while (size > 0) {
+        n = pwrite(fd, p, size, (off_t) offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        p += n;
+        size -= (size_t) n;
+        offset += (uint64_t) n;
+    }
+
+    return 0;
+}
+
+/* Make room for one more entry, rehashing as the table fills */
+static int
+kern_store_reserve (kern_StoreObj *self)
+{
+    kern_store_entry *entries;
+    uint32_t *table;
+    size_t n, i, j, mask;
+
+    if (self->nentries >= UINT32_MAX - 1) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (self->nentries >= self->capacity) {
+        for (n = self->capacity ? self->capacity : 1024; n <= self->nentries;
+             n *= 2)
+            ;
+        entries = realloc(self->entries, n * sizeof(*entries));
+        if (entries == NULL)
+            return -1;
+        self->entries = entries;
+        self->capacity = n;
+    }
+
+    if ((self->nentries + 1) * 2 <= self->table_size)
+        return 0;
+
+    for (n = self->table_size ? self->table_size : 4096;
+         n < (self->nentries + 1) * 2; n *= 2)
+        ;
+    table = calloc(n, sizeof(*table));
+    if (table == NULL)
+        return -1;
+
+    mask = n - 1;
+    for (i = 0; i < self->nentries; ++i) {
+        for (j = self->entries[i].key[0] & mask; table[j]; j = (j + 1) & mask)
+            ;
+        table[j] = (uint32_t) (i + 1);
+    }
+
+    free(self->table);
+    self->table = table;
+    self->table_size = n;
+
+    return 0;
+}
+
+/* Write out buffered records, then the index entries that refer to them */
+static int
+kern_store_flush (kern_StoreObj *self)
+{
+    size_t n;
+
+    if (self->npending > 0) {
+        if (kern_store_pwrite(self->pages_fd, self->pending, self->npending,
+                              self->pages_size - self->npending) < 0)
+            return -1;
+        self->npending = 0;
+    }
+
+    n = self->nentries - self->nsaved;
+    if (n > 0) {
+        if (kern_store_pwrite(self->index_fd, self->entries + self->nsaved,
+                              n * sizeof(kern_store_entry),
+                              sizeof(kern_store_header) +
+                              self->nsaved * sizeof(kern_store_entry)) < 0)
+            return -1;
+        self->nsaved = self->nentries;
+    }
+
+    return 0;
+}
+
+static int
+kern_store_zero (const uint8_t *page, size_t size)
+{
+    return page[0] == 0 && memcmp(page, page + 1, size - 1) == 0;
+}
+
+/*
+ * Find a page by its contents, adding it if it's new. Called with the lock
+ * held
+ *
+ * Arguments: page - page_size bytes
+ *            id - set to the page's id
+ *            counts - updated with the bytes of a new record
+ * Returns:   0, or -1 with errno set
+ */
+static int
+kern_store_put (kern_StoreObj *self, const uint8_t *page, uint64_t *id,
+                kern_store_counts *counts)
+{
+    kern_store_entry *e;
+    uint64_t key[2];
+    size_t i, mask, length;
+    uint8_t *record;
+
+    if (kern_store_reserve(self) < 0)
+        return -1;
+
+    key[0] = kern_xxh64(page, self->page_size, 0);
+    key[1] = kern_xxh64(page, self->page_size, STORE_SEED);
+
+    mask = self->table_size - 1;
+    for (i = key[0] & mask; self->table[i]; i = (i + 1) & mask) {
+        e = &self->entries[self->table[i] - 1];
+        if (e->key[0] == key[0] && e->key[1] == key[1]) {
+            *id = self->table[i];
+            return 0;
+        }
+    }
+
+    if (self->npending + KERN_LZ_BOUND(self->page_size) > STORE_PENDING &&
+        kern_store_flush(self) < 0)
+        return -1;
+
+    e = &self->entries[self->nentries];
+    e->key[0] = key[0];
+    e->key[1] = key[1];
+    e->offset = self->pages_size;
+    e->flags = KERN_STORE_LZ;
+
+    /* Pages that don't compress are kept as they are */
+    record = self->pending + self->npending;
+    length = kern_lz_compress(page, self->page_size, record,
+                              self->page_size - 1);
+    if (length == 0) {
+        memcpy(record, page, self->page_size);
+        length = self->page_size;
+        e->flags = 0;
+    }
+    e->length = (uint32_t) length;
+
+    self->npending += length;
+    self->pages_size += length;
+    self->table[i] = (uint32_t) ++self->nentries;
+
+    *id = self->nentries;
+    counts->added++;
+    counts->bytes += length;
+
+    return 0;
+}
+
+/* Decompress a page into buf. Called with the lock held */
+static int
+kern_store_load (kern_StoreObj *self, uint64_t id, uint8_t *buf)
+{
+    kern_store_entry *e = &self->entries[id - 1];
+    uint64_t flushed = self->pages_size - self->npending;
+    const uint8_t *record;
+
+    if (e->offset >= flushed) {
+        record = self->pending + (e->offset - flushed);
+    } else {
+        if (kern_store_pread(self->pages_fd, self->scratch, e->length,
+                             e->offset) < 0)
+            return -1;
+        record = self->scratch;
+    }
+
+    if (! (e->flags & KERN_STORE_LZ)) {
+        memcpy(buf, record, self->page_size);
+        return 0;
+    }
+
+    if (kern_lz_decompress(record, e->length, buf, self->page_size) !=
+        (int) self->page_size) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy part of a stored page, going through the cache. Doesn't need the GIL
+ *
+ * Returns: 0, or -1 with errno set
+ */
+static int
+kern_store_page (kern_StoreObj *self, uint64_t id, size_t offset, size_t size,
+                 uint8_t *out)
+{
+    size_t slot = (size_t) (id & (STORE_CACHE_PAGES - 1));
+    uint8_t *page = self->cache + slot * self->page_size;
+    int r = 0;
+
+    pthread_mutex_lock(&self->lock);
+
+    if (self->cache_ids[slot] == id) {
+        self->hits++;
+    } else {
+        self->misses++;
+        r = kern_store_load(self, id, page);
+        self->cache_ids[slot] = r == 0 ? id : 0;
+    }
+
+    if (r == 0)
+        memcpy(out, page + offset, size);
+
+    pthread_mutex_unlock(&self->lock);
+
+    return r;
+}
+
+static int
+kern_store_file (kern_StoreObj *self, char *buf, const char *fmt,
+                 const char *name)
+{
+    char file[MAXPATHLEN];
+
+    if (snprintf(file, sizeof(file), fmt, name) >= (int) sizeof(file) ||
+        snprintf(buf, MAXPATHLEN, "%s/%s", PyString_AS_STRING(self->path),
+                 file) >= MAXPATHLEN) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Read the index, keeping entries up to the first one the pages don't hold */
+static int
+kern_store_read_index (kern_StoreObj *self)
+{
+    kern_store_header header;
+    kern_store_entry *e;
+    struct stat st, pages;
+    size_t n, i;
+
+    if (fstat(self->index_fd, &st) < 0 || fstat(self->pages_fd, &pages) < 0)
+        return -1;
+
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "MDBPIDX1", 8);
+        header.page_size = (uint32_t) self->page_size;
+        return kern_store_pwrite(self->index_fd, &header, sizeof(header), 0);
+    }
+
+    if ((size_t) st.st_size < sizeof(header) ||
+        kern_store_pread(self->index_fd, &header, sizeof(header), 0) < 0 ||
+        memcmp(header.magic, "MDBPIDX1", 8) != 0) {
+        PyErr_Format(kern_Error, "%s is not a page store",
+                     PyString_AS_STRING(self->path));
+        return -2;
+    }
+
+    if (header.page_size != self->page_size) {
+        PyErr_Format(kern_Error, "Store has %u-byte pages, not %zu",
+                     header.page_size, self->page_size);
+        return -2;
+    }
+
+    n = ((size_t) st.st_size - sizeof(header)) / sizeof(kern_store_entry);
+    if (n == 0)
+        return 0;
+
+    self->entries = malloc(n * sizeof(kern_store_entry));
+    if (self->entries == NULL)
+        return -1;
+    self->capacity = n;
+
+    if (kern_store_pread(self->index_fd, self->entries,
+                         n * sizeof(kern_store_entry), sizeof(header)) < 0)
+        return -1;
+
+    for (i = 0; i < n; ++i) {
+        e = &self->entries[i];
+        if (e->length == 0 || e->length > self->page_size ||
+            e->offset + e->length > (uint64_t) pages.st_size)
+            break;
+    }
+
+    self->nentries = self->nsaved = i;
+    self->pages_size = (uint64_t) pages.st_size;
+
+    return 0;
+}
+
+/*
+ * Pick up index entries other writers appended since we last looked.
+ * Called with the lock held, and with the index's flock if locked
+ *
+ * Returns: 0, or -1 with errno set
+ */
+static int
+kern_store_refresh (kern_StoreObj *self, int locked)
+{
+    kern_store_entry e;
+    struct stat st, pages;
+    size_t n = 0, i, j, mask;
+    int r = 0;
+
+    /*
+     * While our own add() has or waits for the flock, it catches up for
+     * us; another flock on its descriptor would only downgrade its own
+     */
+    if ((! locked && self->writing) || self->nentries != self->nsaved)
+        return 0;
+
+    if (! locked && flock(self->index_fd, LOCK_SH) < 0)
+        return -1;
+
+    if (fstat(self->index_fd, &st) < 0 || fstat(self->pages_fd, &pages) < 0) {
+        r = -1;
+        goto out;
+    }
+
+    if ((size_t) st.st_size > sizeof(kern_store_header))
+        n = ((size_t) st.st_size - sizeof(kern_store_header)) /
+            sizeof(kern_store_entry);
+
+    for (i = self->nsaved; i < n; ++i) {
+        if (kern_store_pread(self->index_fd, &e, sizeof(e),
+                             sizeof(kern_store_header) +
+                             i * sizeof(kern_store_entry)) < 0 ||
+            kern_store_reserve(self) < 0) {
+            r = -1;
+            goto out;
+        }
+        if (e.length == 0 || e.length > self->page_size ||
+            e.offset + e.length > (uint64_t) pages.st_size)
+            break;
+
+        mask = self->table_size - 1;
+        for (j = e.key[0] & mask; self->table[j]; j = (j + 1) & mask)
+            ;
+        self->entries[self->nentries] = e;
+        self->table[j] = (uint32_t) ++self->nentries;
+    }
+
+    self->nsaved = self->nentries;
+    self->pages_size = (uint64_t) pages.st_size;
+
+ out:
+    if (! locked)
+        flock(self->index_fd, LOCK_UN);
+    return r;
+}
+
+/*
+ * Create or open the store at self->path
+ *
+ * Returns: 0, or -1 with errno set, or -2 with an exception set
+ */
+static int
+kern_store_open (kern_StoreObj *self)
+{
+    char file[MAXPATHLEN];
+    int r;
+
+    if (mkdir(PyString_AS_STRING(self->path), 0777) < 0 && errno != EEXIST)
+        return -1;
+
+    if (kern_store_file(self, file, "%s", "snapshots") < 0 ||
+        (mkdir(file, 0777) < 0 && errno != EEXIST))
+        return -1;
+
+    if (kern_store_file(self, file, "%s", "index") < 0 ||
+        (self->index_fd = open(file, O_RDWR | O_CREAT, 0666)) < 0)
+        return -1;
+
+    if (kern_store_file(self, file, "%s", "pages") < 0 ||
+        (self->pages_fd = open(file, O_RDWR | O_CREAT, 0666)) < 0)
+        return -1;
+
+    if ((r = kern_store_read_index(self)) < 0)
+        return r;
+
+    self->pending = malloc(STORE_PENDING);
+    self->cache = malloc(STORE_CACHE_PAGES * self->page_size);
+    self->cache_ids = calloc(STORE_CACHE_PAGES, sizeof(uint64_t));
+    self->scratch = malloc(self->page_size);
+    if (self->pending == NULL || self->cache == NULL ||
+        self->cache_ids == NULL || self->scratch == NULL)
+        return -1;
+
+    return kern_store_reserve(self);
+}
+
+/* Dedup, compress and add every readable page of a snapshot */
+static int
+kern_store_pages (kern_StoreObj *self, kern_snap *snap, uint64_t *ids,
+                  kern_store_counts *counts)
+{
+    kern_snap_segment *seg;
+    mach_vm_address_t address, end;
+    const uint8_t *data;
+    uint8_t *buf, *valid;
+    size_t i, size, off;
+    int r = 0;
+
+    buf = malloc(STORE_CHUNK);
+    valid = malloc(KERN_MEMORY_VALID_SIZE(0, STORE_CHUNK));
+    if (buf == NULL || valid == NULL) {
+        free(buf);
+        free(valid);
+        return -1;
+    }
+
+    for (i = 0; i < snap->nsegments && r == 0; ++i) {
+        seg = &snap->segments[i];
+        if (! (seg->protection & VM_PROT_READ))
+            continue;
+
+        end = seg->address + seg->size;
+        for (address = seg->address; address < end && r == 0;
+             address += size) {
+            size = (size_t) MIN(end - address, STORE_CHUNK);
+            data = kern_snap_data(snap, seg, address, size, buf, valid);
+
+            pthread_mutex_lock(&self->lock);
+            for (off = 0; off < size && r == 0; off += self->page_size) {
+                if (kern_store_zero(data + off, self->page_size)) {
+                    ids[counts->pages] = 0;
+                    counts->zero++;
+                } else {
+                    r = kern_store_put(self, data + off, &ids[counts->pages],
+                                       counts);
+                }
+                counts->pages++;
+            }
+            pthread_mutex_unlock(&self->lock);
+        }
+
+        kern_snap_release(seg);
+    }
+
+    free(buf);
+    free(valid);
+
+    if (r == 0) {
+        pthread_mutex_lock(&self->lock);
+        r = kern_store_flush(self);
+        pthread_mutex_unlock(&self->lock);
+    }
+
+    return r;
+}
+
+/* Write a snapshot's manifest, replacing any of the same name */
+static int
+kern_store_save (kern_StoreObj *self, kern_snap *snap, const char *name,
+                 const uint64_t *ids, uint64_t npages)
+{
+    char file[MAXPATHLEN], tmp[MAXPATHLEN];
+    kern_store_manifest m;
+    kern_store_segment s;
+    size_t i;
+    FILE *f;
+    int r = 0, err;
+
+    if (kern_store_file(self, file, "snapshots/%s", name) < 0 ||
+        kern_store_file(self, tmp, "snapshots/.%s.tmp", name) < 0)
+        return -1;
+
+    f = fopen(tmp, "wb");
+    if (f == NULL)
+        return -1;
+
+    memset(&m, 0, sizeof(m));
+    memcpy(m.magic, "MDBSNAP1", 8);
+    m.page_size = (uint32_t) self->page_size;
+    m.pid = snap->task->pid;
+    m.nsegments = snap->nsegments;
+    m.nthreads = snap->nthreads;
+    m.nfiles = snap->nfiles;
+    m.paths_size = snap->paths_size;
+    m.npages = npages;
+
+    if (fwrite(&m, sizeof(m), 1, f) != 1)
+        r = -1;
+
+    for (i = 0; i < snap->nsegments && r == 0; ++i) {
+        memset(&s, 0, sizeof(s));
+        s.address = snap->segments[i].address;
+        s.size = snap->segments[i].size;
+        s.protection = snap->segments[i].protection;
+        if (fwrite(&s, sizeof(s), 1, f) != 1)
+            r = -1;
+    }
+
+    if (r == 0 &&
+        ((snap->nthreads && fwrite(snap->threads, sizeof(*snap->threads),
+                                   snap->nthreads, f) != snap->nthreads) ||
+         (snap->nfiles && fwrite(snap->files, 3 * sizeof(uint64_t),
+                                 snap->nfiles, f) != snap->nfiles) ||
+         (snap->paths_size && fwrite(snap->paths, snap->paths_size, 1,
+                                     f) != 1) ||
+         (npages && fwrite(ids, sizeof(*ids), (size_t) npages, f) !=
+          (size_t) npages)))
+        r = -1;
+
+    if (fclose(f) != 0)
+        r = -1;
+
+    if (r == 0 && rename(tmp, file) < 0)
+        r = -1;
+
+    if (r < 0) {
+        err = errno;
+        remove(tmp);
+        errno = err;
+    }
+
+    return r;
+}
+
+static int
+kern_store_check_name (const char *name)
+{
+    if (name[0] == '\0' || name[0] == '.' || strchr(name, '/') != NULL) {
+        PyErr_SetString(PyExc_ValueError, "snapshot names must be non-empty "
+                        "and can't contain '/' or start with '.'");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Snapshot a task into the store
+ *
+ * Arguments: task - attached task (live or saved)
+ *            name - snapshot name, replacing any existing one
+ *            live - capture memory while frozen and thaw before storing
+ *                   (default True), rather than staying frozen throughout
+ * Returns:   {pages, zero, new, bytes, pause, window, segments, threads}
+ */
+static PyObject *
+kern_Store_add (kern_StoreObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_TaskObj *task;
+    PyObject *live = NULL, *ret = NULL;
+    kern_store_counts counts;
+    kern_snap snap;
+    const char *name;
+    uint64_t *ids = NULL, npages = 0;
+    size_t i;
+    int r = -1, err = ENOMEM;
+
+    static char *kwlist[] = {"task", "name", "live", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O!s|O", kwlist,
+                                      &kern_TaskType, &task, &name, &live))
+        return NULL;
+
+    if (kern_store_check_name(name) < 0)
+        return NULL;
+
+    if (self->index_fd < 0) {
+        PyErr_SetString(kern_Error, "store isn't open");
+        return NULL;
+    }
+
+    if (! task->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (kern_snap_take(&snap, task,
+                       live == NULL || PyObject_IsTrue(live) == 1) < 0) {
+        kern_snap_free(&snap);
+        return NULL;
+    }
+
+    for (i = 0; i < snap.nsegments; ++i)
+        if (snap.segments[i].protection & VM_PROT_READ)
+            npages += snap.segments[i].size / self->page_size;
+
+    memset(&counts, 0, sizeof(counts));
+    ids = malloc((size_t) npages * sizeof(*ids) + 1);
+
+    /*
+     * Other Store objects and processes append to the same files, so take
+     * the index's flock and catch up with them first
+     */
+    Py_BEGIN_ALLOW_THREADS
+    if (ids != NULL) {
+        pthread_mutex_lock(&self->add_lock);
+        pthread_mutex_lock(&self->lock);
+        self->writing = 1;
+        pthread_mutex_unlock(&self->lock);
+
+        r = flock(self->index_fd, LOCK_EX);
+        if (r == 0) {
+            pthread_mutex_lock(&self->lock);
+            r = kern_store_refresh(self, 1);
+            pthread_mutex_unlock(&self->lock);
+
+            if (r == 0)
+                r = kern_store_pages(self, &snap, ids, &counts);
+            if (r == 0)
+                r = kern_store_save(self, &snap, name, ids, npages);
+            err = errno;
+
+            flock(self->index_fd, LOCK_UN);
+        } else {
+            err = errno;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        self->writing = 0;
+        pthread_mutex_unlock(&self->lock);
+        pthread_mutex_unlock(&self->add_lock);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (kern_snap_done(&snap) < 0)
+        goto out;
+
+    if (r < 0) {
+        errno = err;
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, self->path);
+        goto out;
+    }
+
+    ret = Py_BuildValue("{s:K,s:K,s:K,s:K,s:O,s:O,s:n,s:n}",
+                        "pages", counts.pages,
+                        "zero", counts.zero,
+                        "new", counts.added,
+                        "bytes", counts.bytes,
+                        "pause", snap.pause,
+                        "window", snap.window,
+                        "segments", (Py_ssize_t) snap.nsegments,
+                        "threads", (Py_ssize_t) snap.nthreads);
+
+ out:
+    free(ids);
+    kern_snap_free(&snap);
+
+    return ret;
+}
+
+/*
+ * List the snapshots in the store
+ *
+ * Arguments: None
+ * Returns:   Sorted list of names
+ */
+static PyObject *
+kern_Store_snapshots (kern_StoreObj *self)
+{
+    char dir[MAXPATHLEN];
+    struct dirent *entry;
+    PyObject *names, *name;
+    DIR *d;
+
+    if (self->index_fd < 0) {
+        PyErr_SetString(kern_Error, "store isn't open");
+        return NULL;
+    }
+
+    if (kern_store_file(self, dir, "%s", "snapshots") < 0 ||
+        (d = opendir(dir)) == NULL)
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError,
+                                                    self->path);
+
+    names = PyList_New(0);
+    while (names != NULL && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        name = PyString_FromString(entry->d_name);
+        if (name == NULL || PyList_Append(names, name) < 0)
+            Py_CLEAR(names);
+        Py_XDECREF(name);
+    }
+    closedir(d);
+
+    if (names != NULL && PyList_Sort(names) < 0)
+        Py_CLEAR(names);
+
+    return names;
+}
+
+/*
+ * Get the store's size and cache counters
+ *
+ * Arguments: None
+ * Returns:   {pages, bytes, hits, misses}
+ */
+static PyObject *
+kern_Store_stats (kern_StoreObj *self)
+{
+    PyObject *ret;
+
+    pthread_mutex_lock(&self->lock);
+    ret = Py_BuildValue("{s:n,s:K,s:K,s:K}",
+                        "pages", (Py_ssize_t) self->nentries,
+                        "bytes", self->pages_size,
+                        "hits", self->hits,
+                        "misses", self->misses);
+    pthread_mutex_unlock(&self->lock);
+
+    return ret;
+}
+
+static void
+kern_Store_dealloc (kern_StoreObj *self)
+{
+    if (self->index_fd >= 0)
+        close(self->index_fd);
+    if (self->pages_fd >= 0)
+        close(self->pages_fd);
+
+    free(self->entries);
+    free(self->table);
+    free(self->pending);
+    free(self->cache_ids);
+    free(self->cache);
+    free(self->scratch);
+    pthread_mutex_destroy(&self->lock);
+    pthread_mutex_destroy(&self->add_lock);
+
+    Py_XDECREF(self->path);
+    self->ob_type->tp_free((PyObject *) self);
+}
+
+static PyObject *
+kern_Store_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    kern_StoreObj *self = NULL;
+
+    self = (kern_StoreObj *) type->tp_alloc(type, 0);
+
+    if (self != NULL) {
+        pthread_mutex_init(&self->lock, NULL);
+        pthread_mutex_init(&self->add_lock, NULL);
+        self->index_fd = -1;
+        self->pages_fd = -1;
+        self->page_size = vm_page_size;
+
+        Py_INCREF(Py_None);
+        self->path = Py_None;
+    }
+
+    return (PyObject *) self;
+}
+
+static int
+kern_Store_init (kern_StoreObj *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *path = NULL, *tmp;
+    int r;
+
+    static char *kwlist[] = {"path", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "S", kwlist, &path))
+        return -1;
+
+    if (self->index_fd >= 0) {
+        PyErr_SetString(kern_Error, "store already open");
+        return -1;
+    }
+
+    tmp = self->path;
+    Py_INCREF(path);
+    self->path = path;
+    Py_XDECREF(tmp);
+
+    r = kern_store_open(self);
+    if (r == -1)
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, path);
+
+    return r < 0 ? -1 : 0;
+}
+
+static PyMemberDef kern_StoreMembers[] = {
+    {"path", T_OBJECT_EX, offsetof(kern_StoreObj, path), READONLY,
+     "Store directory"},
+    {NULL} /* Sentinel */
+};
+
+static PyMethodDef kern_StoreMethods[] = {
+    {"add", (PyCFunction)kern_Store_add, METH_KEYWORDS,
+     "Snapshot a task into the store"},
+    {"snapshots", (PyCFunction)kern_Store_snapshots, METH_NOARGS,
+     "Return the names of the stored snapshots"},
+    {"stats", (PyCFunction)kern_Store_stats, METH_NOARGS,
+     "Return the store's size and cache counters"},
+    {NULL} /* Sentinel */
+};
+
+PyTypeObject kern_StoreType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /* ob_size */
+    "mdb.kern.Store",          /* tp_name */
+    sizeof(kern_StoreObj),     /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    (destructor)kern_Store_dealloc, /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_compare */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    "Deduplicated, compressed store of task snapshots", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    kern_StoreMethods,         /* tp_methods */
+    kern_StoreMembers,         /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)kern_Store_init, /* tp_init */
+    0,                         /* tp_alloc */
+    kern_Store_new,            /* tp_new */
+};
+
+/* StoreTask */
+
+static kern_return_t
+kern_store_read (kern_TaskObj *task, mach_vm_address_t address,
+                 mach_vm_size_t size, void *buf, mach_vm_size_t *out_size)
+{
+    kern_StoreTaskObj *self = (kern_StoreTaskObj *) task;
+    kern_CoreTaskObj *core = &self->core;
+    kern_StoreObj *store = self->store;
+    kern_core_segment *seg;
+    uint8_t *out = buf;
+    uint64_t remaining = size, off, n, id;
+    size_t i, within;
+
+    i = kern_core_find(core, address);
+
+    while (remaining > 0) {
+        if (i >= core->nsegments || core->segments[i].vaddr > address)
+            return KERN_INVALID_ADDRESS;
+
+        seg = &core->segments[i];
+        off = address - seg->vaddr;
+        if (off >= seg->memsz) {
+            i++;
+            continue;
+        }
+
+        /* One page at a time; unreadable regions have no pages and read
+           as zero, as in a core file */
+        within = (size_t) (off & (store->page_size - 1));
+        n = MIN(store->page_size - within, remaining);
+        n = MIN(n, seg->memsz - off);
+
+        id = off < seg->filesz ?
+             self->ids[seg->offset + off / store->page_size] : 0;
+        if (id == 0)
+            memset(out, 0, (size_t) n);
+        else if (kern_store_page(store, id, within, (size_t) n, out) < 0)
+            return KERN_FAILURE;
+
+        out += n;
+        address += n;
+        remaining -= n;
+    }
+
+    *out_size = size;
+
+    return KERN_SUCCESS;
+}
+
+static const kern_task_ops kern_store_ops = {
+    kern_store_read,
+    kern_core_write,
+    kern_core_region,
+    kern_core_path,
+    NULL,
+    kern_core_residency,
+};
+
+/* Check a manifest and build the task's regions, files and threads from it */
+static int
+kern_store_parse (kern_StoreTaskObj *self, const uint8_t *data, size_t size)
+{
+    kern_CoreTaskObj *core = &self->core;
+    kern_StoreObj *store = self->store;
+    const kern_store_manifest *m = (const kern_store_manifest *) data;
+    const kern_store_segment *s;
+    const uint64_t *files;
+    kern_elf_prstatus64 prs;
+    kern_core_segment *seg;
+    const uint8_t *p;
+    uint64_t page = 0, nentries, top;
+    char *path, *end;
+    size_t i;
+    int r;
+
+    if (size < sizeof(*m) || memcmp(m->magic, "MDBSNAP1", 8) != 0 ||
+        m->page_size != store->page_size || m->nsegments > size ||
+        m->nthreads > size || m->nfiles > size || m->paths_size > size ||
+        m->npages > size ||
+        sizeof(*m) + m->nsegments * sizeof(*s) +
+        m->nthreads * sizeof(prs) + m->nfiles * 3 * sizeof(uint64_t) +
+        m->paths_size + m->npages * sizeof(uint64_t) != size)
+        goto corrupt;
+
+    p = data + sizeof(*m);
+
+    core->segments = calloc((size_t) m->nsegments + 1, sizeof(*seg));
+    if (core->segments == NULL)
+        goto nomem;
+
+    for (i = 0; i < m->nsegments; ++i, p += sizeof(*s)) {
+        s = (const kern_store_segment *) p;
+        if ((s->address | s->size) & (store->page_size - 1) ||
+            (i > 0 && s->address < core->segments[i - 1].vaddr +
+             core->segments[i - 1].memsz))
+            goto corrupt;
+
+        seg = &core->segments[core->nsegments++];
+        seg->vaddr = s->address;
+        seg->memsz = s->size;
+        seg->protection = s->protection;
+        if (s->protection & VM_PROT_READ) {
+            seg->offset = page;
+            seg->filesz = s->size;
+            page += s->size / store->page_size;
+        }
+    }
+
+    if (page != m->npages)
+        goto corrupt;
+
+    for (i = 0; i < m->nthreads; ++i, p += sizeof(prs)) {
+        memcpy(&prs, p, sizeof(prs));
+        if (kern_core_add_thread(core, &prs) < 0)
+            return -1;
+    }
+    core->task.pid = m->pid;
+
+    files = (const uint64_t *) p;
+    p += m->nfiles * 3 * sizeof(uint64_t);
+
+    self->paths = malloc((size_t) m->paths_size + 1);
+    core->files = calloc((size_t) m->nfiles + 1, sizeof(kern_core_file));
+    if (self->paths == NULL || core->files == NULL)
+        goto nomem;
+    memcpy(self->paths, p, (size_t) m->paths_size);
+    self->paths[m->paths_size] = '\0';
+    p += m->paths_size;
+
+    path = self->paths;
+    end = self->paths + m->paths_size;
+    for (i = 0; i < m->nfiles; ++i) {
+        if (path >= end)
+            goto corrupt;
+        core->files[i].start = files[i * 3];
+        core->files[i].end = files[i * 3 + 1];
+        core->files[i].offset = files[i * 3 + 2] * store->page_size;
+        core->files[i].path = path;
+        core->nfiles++;
+        path += strlen(path) + 1;
+    }
+
+    self->ids = malloc((size_t) m->npages * sizeof(uint64_t) + 1);
+    if (self->ids == NULL)
+        goto nomem;
+    memcpy(self->ids, p, (size_t) m->npages * sizeof(uint64_t));
+
+    for (i = 0, top = 0; i < m->npages; ++i)
+        top = MAX(top, self->ids[i]);
+
+    /* Pages another writer added since the store was opened */
+    pthread_mutex_lock(&store->lock);
+    r = top > store->nentries ? kern_store_refresh(store, 0) : 0;
+    nentries = store->nentries;
+    pthread_mutex_unlock(&store->lock);
+
+    if (r < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, store->path);
+        return -1;
+    }
+
+    if (top > nentries)
+        goto corrupt;
+
+    return 0;
+
+ corrupt:
+    PyErr_Format(kern_Error, "Corrupt snapshot %s",
+                 PyString_AS_STRING(self->name));
+    return -1;
+
+ nomem:
+    PyErr_NoMemory();
+    return -1;
+}
+
+/* Drop a partly parsed manifest, so a failed attach can be retried */
+static void
+kern_store_task_reset (kern_StoreTaskObj *self)
+{
+    kern_core_reset(&self->core);
+    free(self->ids);
+    self->ids = NULL;
+    free(self->paths);
+    self->paths = NULL;
+}
+
+/*
+ * Read the snapshot's manifest
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_StoreTask_attach (kern_StoreTaskObj *self)
+{
+    const char *path;
+    struct stat st;
+    uint8_t *data;
+    PyObject *vm;
+    FILE *f;
+    int r;
+
+    if (self->core.task.attached) {
+        PyErr_SetNone(kern_AlreadyAttachedError);
+        return NULL;
+    }
+
+    path = PyString_AsString(self->core.path);
+    if (path == NULL)
+        return NULL;
+
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError,
+                                                    self->core.path);
+
+    if (fstat(fileno(f), &st) < 0) {
+        fclose(f);
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError,
+                                                    self->core.path);
+    }
+
+    data = malloc((size_t) st.st_size + 1);
+    if (data == NULL) {
+        fclose(f);
+        return PyErr_NoMemory();
+    }
+
+    if (fread(data, 1, (size_t) st.st_size, f) != (size_t) st.st_size) {
+        free(data);
+        fclose(f);
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError,
+                                                    self->core.path);
+    }
+    fclose(f);
+
+    r = kern_store_parse(self, data, (size_t) st.st_size);
+    free(data);
+    if (r < 0) {
+        kern_store_task_reset(self);
+        return NULL;
+    }
+
+    vm = kern_memory_new((PyObject *) self, 0, UINT64_MAX);
+    if (vm == NULL) {
+        kern_store_task_reset(self);
+        return NULL;
+    }
+
+    Py_DECREF(self->core.task.vm);
+    self->core.task.vm = vm;
+
+    self->core.task.attached = 1;
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Drop the manifest and the task's vm and threads
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_StoreTask_close (kern_StoreTaskObj *self)
+{
+    kern_store_task_reset(self);
+    kern_core_close(&self->core);
+
+    Py_RETURN_NONE;
+}
+
+static void
+kern_StoreTask_dealloc (kern_StoreTaskObj *self)
+{
+    free(self->ids);
+    free(self->paths);
+    Py_XDECREF(self->store);
+    Py_XDECREF(self->name);
+    kern_CoreTaskType.tp_dealloc((PyObject *) self);
+}
+
+static PyObject *
+kern_StoreTask_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    kern_StoreTaskObj *self = NULL;
+
+    self = (kern_StoreTaskObj *) kern_CoreTaskType.tp_new(type, args, kwds);
+
+    if (self != NULL) {
+        self->core.task.ops = &kern_store_ops;
+        self->store = NULL;
+        self->ids = NULL;
+        self->paths = NULL;
+
+        Py_INCREF(Py_None);
+        self->name = Py_None;
+    }
+
+    return (PyObject *) self;
+}
+
+static int
+kern_StoreTask_init (kern_StoreTaskObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_StoreObj *store = NULL;
+    PyObject *name = NULL, *path, *tmp;
+
+    static char *kwlist[] = {"store", "name", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O!S", kwlist,
+                                      &kern_StoreType, &store, &name))
+        return -1;
+
+    if (kern_store_check_name(PyString_AS_STRING(name)) < 0)
+        return -1;
+
+    if (store->index_fd < 0) {
+        PyErr_SetString(kern_Error, "store isn't open");
+        return -1;
+    }
+
+    path = PyString_FromFormat("%s/snapshots/%s",
+                               PyString_AS_STRING(store->path),
+                               PyString_AS_STRING(name));
+    if (path == NULL)
+        return -1;
+
+    tmp = self->core.path;
+    self->core.path = path;
+    Py_XDECREF(tmp);
+
+    tmp = (PyObject *) self->store;
+    Py_INCREF(store);
+    self->store = store;
+    Py_XDECREF(tmp);
+
+    tmp = self->name;
+    Py_INCREF(name);
+    self->name = name;
+    Py_XDECREF(tmp);
+
+    return 0;
+}
+
+static PyMemberDef kern_StoreTaskMembers[] = {
+    {"store", T_OBJECT_EX, offsetof(kern_StoreTaskObj, store), READONLY,
+     "Store holding the snapshot"},
+    {"name", T_OBJECT_EX, offsetof(kern_StoreTaskObj, name), READONLY,
+     "Snapshot name"},
+    {NULL} /* Sentinel */
+};
+
+static PyMethodDef kern_StoreTaskMethods[] = {
+    {"attach", (PyCFunction)kern_StoreTask_attach, METH_NOARGS,
+     "Read the snapshot's manifest"},
+    {"close", (PyCFunction)kern_StoreTask_close, METH_NOARGS,
+     "Drop the snapshot's manifest"},
+    {NULL} /* Sentinel */
+};
+
+PyTypeObject kern_StoreTaskType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /* ob_size */
+    "mdb.kern.StoreTask",      /* tp_name */
+    sizeof(kern_StoreTaskObj), /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    (destructor)kern_StoreTask_dealloc, /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_compare */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    "Task objects backed by a stored snapshot", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    kern_StoreTaskMethods,     /* tp_methods */
+    kern_StoreTaskMembers,     /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)kern_StoreTask_init, /* tp_init */
+    0,                         /* tp_alloc */
+    kern_StoreTask_new,        /* tp_new */
+};
@@ -0,0 +1,84 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_STORE_H
+#define _KERN_STORE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "structmember.h"
+
+#include "task.h"
+#include "core.h"
+
+extern PyTypeObject kern_StoreType;
+extern PyTypeObject kern_StoreTaskType;
+
+/* Records in the pages file are compressed unless this is clear */
+#define KERN_STORE_LZ  1
+
+/* A unique page: its 128-bit content hash and where its record is */
+typedef struct {
+    uint64_t key[2];
+    uint64_t offset;
+    uint32_t length;
+    uint32_t flags;
+} kern_store_entry;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *path;
+    int index_fd;
+    int pages_fd;
+    size_t page_size;
+    kern_store_entry *entries;  /* page id n is entries[n - 1] */
+    size_t nentries, capacity;
+    size_t nsaved;              /* entries already in the index file */
+    uint32_t *table;            /* open addressing, entry index + 1 */
+    size_t table_size;
+    uint64_t pages_size;        /* including records not yet written */
+    uint8_t *pending;
+    size_t npending;
+    uint64_t *cache_ids;
+    uint8_t *cache;
+    uint8_t *scratch;
+    uint64_t hits, misses;
+    char writing;               /* add() has or waits for the flock */
+    pthread_mutex_t lock;
+    pthread_mutex_t add_lock;   /* one add() at a time */
+} kern_StoreObj;
+
+/* A snapshot read back from a store, paged in as it's read */
+typedef struct {
+    kern_CoreTaskObj core;
+    kern_StoreObj *store;
+    PyObject *name;
+    uint64_t *ids;              /* page ids, 0 for zero pages */
+    char *paths;
+} kern_StoreTaskObj;
+
+#endif
@@ -0,0 +1,1253 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <libkern/OSByteOrder.h>
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+#include <mach-o/fat.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+
+#include "util.h"
+#include "kern.h"
+#include "elf.h"
+#include "task.h"
+#include "symbols.h"
+
+/*
+ * Address to symbol resolution for 64-bit ELF and Mach-O objects mapped in a
+ * task, plus perf-PID.map files written by JITs.
+ *
+ * Each object's build-id (LC_UUID for Mach-O) and load address are read
+ * from the task itself, so a previously cached object is symbolized without
+ * touching its file. Symbols come from the file on disk: .symtab and .dynsym
+ * for ELF, LC_SYMTAB (either slice of a universal file) for Mach-O. Libraries
+ * that only exist in the dyld shared cache have no file, and resolve nothing.
+ * Parsed tables are cached as flat arrays that are mapped back in as-is:
+ *
+ *   kern_sym_header | value[n] | size[n] | name[n] | strtab
+ */
+
+#define SYM_MAGIC       "MDBSYM01"
+#define SYM_MAX_CMDS    (1 << 20)       /* Mach-O load commands read */
+#define SYM_ENTRY_SIZE  (8 + 8 + 4)
+
+typedef struct {
+    char magic[8];
+    uint64_t nsyms;
+    uint64_t strtab_size;
+} kern_sym_header;
+
+typedef struct {
+    uint64_t value;
+    uint64_t size;
+    const char *name;
+} kern_sym_entry;
+
+
+static size_t
+kern_sym_block_size (size_t nsyms, size_t strtab_size)
+{
+    return nsyms * SYM_ENTRY_SIZE + strtab_size;
+}
+
+static void
+kern_sym_set_tables (kern_sym_module *m, unsigned char *block, size_t nsyms)
+{
+    m->nsyms = nsyms;
+    m->value = (const uint64_t *) block;
+    m->size = (const uint64_t *) (block + nsyms * 8);
+    m->name = (const uint32_t *) (block + nsyms * 16);
+    m->strtab = (const char *) (block + nsyms * 20);
+}
+
+static void
+kern_sym_module_free (kern_sym_module *m)
+{
+    if (m->map != NULL)
+        munmap(m->map, m->map_size);
+    free(m->owned);
+    free(m->path);
+}
+
+static int
+kern_sym_entry_cmp (const void *a, const void *b)
+{
+    const kern_sym_entry *x = a, *y = b;
+
+    if (x->value != y->value)
+        return x->value < y->value ? -1 : 1;
+
+    /* Sized symbols first, so they survive de-duplication */
+    return x->size > y->size ? -1 : x->size < y->size;
+}
+
+/*
+ * Sort and de-duplicate entries into the module's flat tables
+ */
+static int
+kern_sym_build (kern_sym_module *m, kern_sym_entry *entries, size_t n)
+{
+    size_t i, k, strtab_size = 0, len;
+    unsigned char *block;
+    uint64_t *value, *size;
+    uint32_t *name;
+    char *strtab;
+
+    qsort(entries, n, sizeof(kern_sym_entry), kern_sym_entry_cmp);
+
+    for (i = 0, k = 0; i < n; ++i) {
+        if (k > 0 && entries[k - 1].value == entries[i].value)
+            continue;
+        entries[k++] = entries[i];
+        strtab_size += strlen(entries[i].name) + 1;
+    }
+    n = k;
+
+    block = malloc(kern_sym_block_size(n, strtab_size) + 1);
+    if (block == NULL)
+        return -1;
+
+    value = (uint64_t *) block;
+    size = (uint64_t *) (block + n * 8);
+    name = (uint32_t *) (block + n * 16);
+    strtab = (char *) (block + n * 20);
+
+    for (i = 0, strtab_size = 0; i < n; ++i) {
+        value[i] = entries[i].value;
+        size[i] = entries[i].size;
+        name[i] = (uint32_t) strtab_size;
+        len = strlen(entries[i].name) + 1;
+        memcpy(strtab + strtab_size, entries[i].name, len);
+        strtab_size += len;
+    }
+
+    free(m->owned);
+    m->owned = block;
+    kern_sym_set_tables(m, block, n);
+
+    return 0;
+}
+
+static void
+kern_sym_cache_path (kern_sym_module *m, const char *dir, char *buf,
+                     size_t size)
+{
+    size_t i, len;
+
+    len = (size_t) snprintf(buf, size, "%s/", dir);
+    for (i = 0; i < m->build_id_size && len + 3 < size; ++i)
+        len += (size_t) snprintf(buf + len, size - len, "%02x",
+                                 m->build_id[i]);
+    snprintf(buf + len, size - len, ".sym");
+}
+
+static int
+kern_sym_cache_load (kern_sym_module *m, const char *dir)
+{
+    char path[MAXPATHLEN];
+    kern_sym_header *header;
+    struct stat st;
+    size_t size, i;
+    void *map;
+    int fd;
+
+    kern_sym_cache_path(m, dir, path, sizeof(path));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(kern_sym_header)) {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    /* The cache directory may be shared, so check before trusting it */
+    header = map;
+    size = (size_t) st.st_size - sizeof(kern_sym_header);
+    if (memcmp(header->magic, SYM_MAGIC, 8) ||
+        header->nsyms > size / SYM_ENTRY_SIZE ||
+        header->strtab_size != size - header->nsyms * SYM_ENTRY_SIZE)
+        goto corrupt;
+
+    kern_sym_set_tables(m, (unsigned char *) (header + 1),
+                        (size_t) header->nsyms);
+
+    if (m->nsyms > 0 && (header->strtab_size == 0 ||
+                         m->strtab[header->strtab_size - 1] != '\0'))
+        goto corrupt;
+    for (i = 0; i < m->nsyms; ++i)
+        if (m->name[i] >= header->strtab_size)
+            goto corrupt;
+
+    m->map = map;
+    m->map_size = (size_t) st.st_size;
+    m->cached = 1;
+
+    return 1;
+
+ corrupt:
+    munmap(map, (size_t) st.st_size);
+    m->nsyms = 0;
+
+    return 0;
+}
+
+static void
+kern_sym_cache_store (kern_sym_module *m, const char *dir)
+{
+    char path[MAXPATHLEN], tmp[MAXPATHLEN];
+    kern_sym_header header;
+    size_t strtab_size = 0;
+    FILE *f;
+
+    if (m->nsyms > 0)
+        strtab_size = m->name[m->nsyms - 1] +
+                      strlen(m->strtab + m->name[m->nsyms - 1]) + 1;
+
+    memcpy(header.magic, SYM_MAGIC, 8);
+    header.nsyms = m->nsyms;
+    header.strtab_size = strtab_size;
+
+    kern_sym_cache_path(m, dir, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+
+    /* Write then rename, so readers never see a partial table */
+    f = fopen(tmp, "wb");
+    if (f == NULL)
+        return;
+
+    if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+        fwrite(m->value, 1, kern_sym_block_size(m->nsyms, strtab_size), f)
+            != kern_sym_block_size(m->nsyms, strtab_size)) {
+        fclose(f);
+        unlink(tmp);
+        return;
+    }
+
+    if (fclose(f) != 0 || rename(tmp, path) != 0)
+        unlink(tmp);
+}
+
+/* Find the GNU build-id note in [notes, notes + size) */
+static size_t
+kern_sym_find_build_id (const unsigned char *notes, uint64_t size,
+                        unsigned char *out)
+{
+    const Elf64_Nhdr *note;
+    uint64_t off = 0, desc;
+
+    while (off + sizeof(Elf64_Nhdr) <= size) {
+        note = (const Elf64_Nhdr *) (notes + off);
+        desc = off + sizeof(Elf64_Nhdr) + ((note->n_namesz + 3) & ~3);
+        if (desc + note->n_descsz > size)
+            break;
+
+        if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+            ! memcmp(notes + off + sizeof(Elf64_Nhdr), "GNU", 4) &&
+            note->n_descsz <= _KERN_BUILD_ID_MAX) {
+            memcpy(out, notes + desc, note->n_descsz);
+            return note->n_descsz;
+        }
+
+        off = desc + ((note->n_descsz + 3) & ~3);
+    }
+
+    return 0;
+}
+
+/* The load command at *off, which is moved past it; NULL if malformed */
+static const struct load_command *
+kern_sym_macho_command (const unsigned char *cmds, uint32_t size,
+                        uint32_t *off)
+{
+    const struct load_command *lc;
+
+    if (*off > size || size - *off < sizeof(struct load_command))
+        return NULL;
+
+    lc = (const struct load_command *) (cmds + *off);
+    if (lc->cmdsize < sizeof(struct load_command) ||
+        lc->cmdsize > size - *off)
+        return NULL;
+
+    *off += lc->cmdsize;
+    return lc;
+}
+
+/*
+ * Read the Mach-O load commands mapped at base in the task for the object's
+ * link-time base (that of the segment mapping the header) and LC_UUID
+ */
+static int
+kern_sym_probe_macho (kern_TaskObj *task, uint64_t base, kern_sym_module *m)
+{
+    struct mach_header_64 header;
+    const struct load_command *lc;
+    const struct segment_command_64 *seg;
+    const struct uuid_command *uuid;
+    mach_vm_size_t out_size;
+    uint64_t link_base = UINT64_MAX;
+    unsigned char *cmds;
+    uint32_t i, off = 0;
+
+    if (kern_task_read(task, base, sizeof(header), &header, &out_size)
+        != KERN_SUCCESS || out_size != sizeof(header) ||
+        header.magic != MH_MAGIC_64 || header.sizeofcmds > SYM_MAX_CMDS)
+        return -1;
+
+    if ((cmds = malloc(header.sizeofcmds + 1)) == NULL)
+        return -1;
+
+    if (kern_task_read(task, base + sizeof(header), header.sizeofcmds, cmds,
+                       &out_size) != KERN_SUCCESS ||
+        out_size != header.sizeofcmds) {
+        free(cmds);
+        return -1;
+    }
+
+    for (i = 0; i < header.ncmds; ++i) {
+        lc = kern_sym_macho_command(cmds, header.sizeofcmds, &off);
+        if (lc == NULL)
+            break;
+
+        if (lc->cmd == LC_SEGMENT_64 && lc->cmdsize >= sizeof(*seg)) {
+            /* Not __PAGEZERO, which maps nothing from the file */
+            seg = (const struct segment_command_64 *) lc;
+            if (seg->fileoff == 0 && seg->filesize != 0)
+                link_base = seg->vmaddr;
+        } else if (lc->cmd == LC_UUID && lc->cmdsize >= sizeof(*uuid)) {
+            uuid = (const struct uuid_command *) lc;
+            memcpy(m->build_id, uuid->uuid, sizeof(uuid->uuid));
+            m->build_id_size = sizeof(uuid->uuid);
+        }
+    }
+
+    free(cmds);
+
+    if (link_base == UINT64_MAX)
+        return -1;
+
+    m->bias = base - link_base;
+
+    return 0;
+}
+
+/*
+ * Read the ELF or Mach-O header mapped at base in the task for the object's
+ * link-time base and build-id. Returns -1 if base doesn't hold an object
+ */
+static int
+kern_sym_probe (kern_TaskObj *task, uint64_t base, kern_sym_module *m)
+{
+    unsigned char page[4096], notes[4096];
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *) page;
+    Elf64_Phdr *phdr;
+    mach_vm_size_t out_size;
+    uint64_t link_base = UINT64_MAX, size;
+    uint32_t magic;
+    int i;
+
+    if (kern_task_read(task, base, sizeof(page), page, &out_size)
+        != KERN_SUCCESS || out_size != sizeof(page))
+        return -1;
+
+    memcpy(&magic, page, sizeof(magic));
+    if (magic == MH_MAGIC_64)
+        return kern_sym_probe_macho(task, base, m);
+
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_phentsize != sizeof(Elf64_Phdr) ||
+        ehdr->e_phoff + (uint64_t) ehdr->e_phnum * sizeof(Elf64_Phdr)
+            > sizeof(page))
+        return -1;
+
+    phdr = (Elf64_Phdr *) (page + ehdr->e_phoff);
+    for (i = 0; i < ehdr->e_phnum; ++i)
+        if (phdr[i].p_type == PT_LOAD && phdr[i].p_offset == 0)
+            link_base = phdr[i].p_vaddr & ~(uint64_t) 4095;
+
+    if (link_base == UINT64_MAX)
+        return -1;
+
+    m->bias = base - link_base;
+
+    for (i = 0; i < ehdr->e_phnum && m->build_id_size == 0; ++i) {
+        if (phdr[i].p_type != PT_NOTE)
+            continue;
+
+        size = phdr[i].p_filesz < sizeof(notes) ? phdr[i].p_filesz :
+               sizeof(notes);
+        if (kern_task_read(task, phdr[i].p_vaddr + m->bias, size, notes,
+                           &out_size) == KERN_SUCCESS)
+            m->build_id_size = kern_sym_find_build_id(notes, out_size,
+                                                      m->build_id);
+    }
+
+    return 0;
+}
+
+/* Append an entry, growing entries as needed */
+static int
+kern_sym_append (kern_sym_entry **entries, size_t *n, size_t *capacity,
+                 uint64_t value, uint64_t size, const char *name)
+{
+    void *tmp;
+
+    if (*n == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 4096;
+        tmp = realloc(*entries, *capacity * sizeof(kern_sym_entry));
+        if (tmp == NULL)
+            return -1;
+        *entries = tmp;
+    }
+
+    (*entries)[*n].value = value;
+    (*entries)[*n].size = size;
+    (*entries)[*n].name = name;
+    (*n)++;
+
+    return 0;
+}
+
+/* .symtab and .dynsym of the ELF object mapped at map */
+static int
+kern_sym_parse_elf (kern_sym_module *m, const unsigned char *map,
+                    uint64_t map_size)
+{
+    unsigned char build_id[_KERN_BUILD_ID_MAX];
+    kern_sym_entry *entries = NULL;
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *) map;
+    const Elf64_Shdr *shdr, *strs;
+    const Elf64_Sym *sym;
+    size_t n = 0, capacity = 0, nsym, j, id_size = 0;
+    int i, ret = 0;
+
+    if (map_size < sizeof(Elf64_Ehdr) ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+        ehdr->e_shoff + (uint64_t) ehdr->e_shnum * sizeof(Elf64_Shdr)
+            > map_size)
+        return 0;
+
+    shdr = (const Elf64_Shdr *) (map + ehdr->e_shoff);
+
+    for (i = 0; i < ehdr->e_shnum && id_size == 0; ++i)
+        if (shdr[i].sh_type == SHT_NOTE &&
+            shdr[i].sh_offset + shdr[i].sh_size <= map_size)
+            id_size = kern_sym_find_build_id(map + shdr[i].sh_offset,
+                                             shdr[i].sh_size, build_id);
+
+    /* A stale file on disk would give wrong answers */
+    if (m->build_id_size && (id_size != m->build_id_size ||
+                             memcmp(build_id, m->build_id, id_size)))
+        return 0;
+
+    for (i = 0; i < ehdr->e_shnum; ++i) {
+        if ((shdr[i].sh_type != SHT_SYMTAB && shdr[i].sh_type != SHT_DYNSYM)
+            || shdr[i].sh_link >= ehdr->e_shnum ||
+            shdr[i].sh_offset + shdr[i].sh_size > map_size)
+            continue;
+
+        strs = &shdr[shdr[i].sh_link];
+        if (strs->sh_offset + strs->sh_size > map_size ||
+            strs->sh_size == 0 || map[strs->sh_offset + strs->sh_size - 1])
+            continue;
+
+        sym = (const Elf64_Sym *) (map + shdr[i].sh_offset);
+        nsym = shdr[i].sh_size / sizeof(Elf64_Sym);
+
+        for (j = 0; j < nsym; ++j) {
+            if (sym[j].st_shndx == SHN_UNDEF || sym[j].st_value == 0 ||
+                sym[j].st_name == 0 || sym[j].st_name >= strs->sh_size)
+                continue;
+
+            switch (ELF64_ST_TYPE(sym[j].st_info)) {
+            case STT_FUNC:
+            case STT_OBJECT:
+            case STT_NOTYPE:
+                break;
+            default:
+                continue;
+            }
+
+            if (kern_sym_append(&entries, &n, &capacity, sym[j].st_value,
+                                sym[j].st_size, (const char *) map +
+                                strs->sh_offset + sym[j].st_name) < 0) {
+                ret = -1;
+                goto done;
+            }
+        }
+    }
+
+    ret = kern_sym_build(m, entries, n) < 0 ? -1 : 1;
+
+ done:
+    free(entries);
+
+    return ret;
+}
+
+/*
+ * LC_SYMTAB of the 64-bit Mach-O object at map, the whole file or a slice
+ * of a universal one. Symbols have no sizes, so each runs to the next; C
+ * names lose their leading underscore
+ */
+static int
+kern_sym_parse_macho (kern_sym_module *m, const unsigned char *map,
+                      uint64_t map_size)
+{
+    const struct mach_header_64 *header;
+    const struct load_command *lc;
+    const struct symtab_command *symtab = NULL;
+    const struct uuid_command *uuid = NULL;
+    const struct nlist_64 *sym;
+    const char *strtab, *name;
+    kern_sym_entry *entries = NULL;
+    size_t n = 0, capacity = 0;
+    uint32_t i, off = 0;
+    int ret = 0;
+
+    header = (const struct mach_header_64 *) map;
+    if (map_size < sizeof(*header) || header->magic != MH_MAGIC_64 ||
+        header->sizeofcmds > map_size - sizeof(*header))
+        return 0;
+
+    for (i = 0; i < header->ncmds; ++i) {
+        lc = kern_sym_macho_command(map + sizeof(*header),
+                                    header->sizeofcmds, &off);
+        if (lc == NULL)
+            return 0;
+
+        if (lc->cmd == LC_SYMTAB && lc->cmdsize >= sizeof(*symtab))
+            symtab = (const struct symtab_command *) lc;
+        else if (lc->cmd == LC_UUID && lc->cmdsize >= sizeof(*uuid))
+            uuid = (const struct uuid_command *) lc;
+    }
+
+    /* A stale file on disk, or the other slice, would give wrong answers */
+    if (m->build_id_size && (uuid == NULL ||
+                             m->build_id_size != sizeof(uuid->uuid) ||
+                             memcmp(uuid->uuid, m->build_id,
+                                    sizeof(uuid->uuid))))
+        return 0;
+
+    if (symtab == NULL || symtab->symoff > map_size ||
+        symtab->nsyms > (map_size - symtab->symoff) / sizeof(*sym) ||
+        symtab->stroff > map_size ||
+        symtab->strsize > map_size - symtab->stroff)
+        return 0;
+
+    sym = (const struct nlist_64 *) (map + symtab->symoff);
+    strtab = (const char *) map + symtab->stroff;
+
+    for (i = 0; i < symtab->nsyms; ++i) {
+        if ((sym[i].n_type & N_STAB) || (sym[i].n_type & N_TYPE) != N_SECT ||
+            sym[i].n_un.n_strx == 0 || sym[i].n_un.n_strx >= symtab->strsize)
+            continue;
+
+        name = strtab + sym[i].n_un.n_strx;
+        if (memchr(name, '\0', symtab->strsize - sym[i].n_un.n_strx) == NULL)
+            continue;
+        if (name[0] == '_')
+            name++;
+        if (name[0] == '\0')
+            continue;
+
+        if (kern_sym_append(&entries, &n, &capacity, sym[i].n_value, 0,
+                            name) < 0) {
+            ret = -1;
+            goto done;
+        }
+    }
+
+    ret = kern_sym_build(m, entries, n) < 0 ? -1 : 1;
+
+ done:
+    free(entries);
+
+    return ret;
+}
+
+/* Try each 64-bit slice of a universal file; the UUID picks the right one */
+static int
+kern_sym_parse_fat (kern_sym_module *m, const unsigned char *map,
+                    uint64_t map_size)
+{
+    const struct fat_header *fat = (const struct fat_header *) map;
+    const struct fat_arch *arch;
+    uint64_t offset, size;
+    uint32_t i, narch;
+    int ret;
+
+    narch = OSSwapBigToHostInt32(fat->nfat_arch);
+    if (narch > (map_size - sizeof(*fat)) / sizeof(*arch))
+        return 0;
+
+    arch = (const struct fat_arch *) (fat + 1);
+    for (i = 0; i < narch; ++i) {
+        offset = OSSwapBigToHostInt32(arch[i].offset);
+        size = OSSwapBigToHostInt32(arch[i].size);
+        if (offset > map_size || size > map_size - offset)
+            continue;
+
+        if ((ret = kern_sym_parse_macho(m, map + offset, size)) != 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Parse the object's file. Returns 0 if the file is unusable, e.g. missing
+ * or a different build
+ */
+static int
+kern_sym_parse_file (kern_sym_module *m)
+{
+    unsigned char *map;
+    struct stat st;
+    uint32_t magic;
+    int fd, ret = 0;
+
+    fd = open(m->path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(Elf64_Ehdr)) {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    memcpy(&magic, map, sizeof(magic));
+    if (! memcmp(map, ELFMAG, SELFMAG))
+        ret = kern_sym_parse_elf(m, map, (uint64_t) st.st_size);
+    else if (magic == MH_MAGIC_64)
+        ret = kern_sym_parse_macho(m, map, (uint64_t) st.st_size);
+    else if (OSSwapBigToHostInt32(magic) == FAT_MAGIC)
+        ret = kern_sym_parse_fat(m, map, (uint64_t) st.st_size);
+
+    munmap(map, (size_t) st.st_size);
+
+    return ret;
+}
+
+/*
+ * perf-PID.map lines are "START SIZE name", in hex
+ */
+static int
+kern_sym_load_perf_map (kern_SymbolsObj *self, kern_sym_module *m, int pid)
+{
+    char path[MAXPATHLEN], line[4096], *name, *nl;
+    kern_sym_entry *entries = NULL;
+    size_t n = 0, capacity = 0, i;
+    unsigned long long start, size;
+    char **names = NULL;
+    void *tmp;
+    FILE *f;
+    int ret = -1;
+
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", pid);
+
+    f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+
+    m->start = UINT64_MAX;
+    m->end = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%llx %llx", &start, &size) != 2)
+            continue;
+
+        name = strchr(line, ' ');
+        name = name ? strchr(name + 1, ' ') : NULL;
+        if (name == NULL)
+            continue;
+        name++;
+        if ((nl = strchr(name, '\n')) != NULL)
+            *nl = '\0';
+
+        if (n == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            tmp = realloc(entries, capacity * sizeof(kern_sym_entry));
+            if (tmp == NULL)
+                goto done;
+            entries = tmp;
+            tmp = realloc(names, capacity * sizeof(char *));
+            if (tmp == NULL)
+                goto done;
+            names = tmp;
+        }
+
+        names[n] = strdup(name);
+        if (names[n] == NULL)
+            goto done;
+
+        entries[n].value = start;
+        entries[n].size = size;
+        entries[n].name = names[n];
+        n++;
+
+        if (start < m->start)
+            m->start = start;
+        if (start + size > m->end)
+            m->end = start + size;
+    }
+
+    m->path = strdup(path);
+    if (n == 0 || m->path == NULL || kern_sym_build(m, entries, n) < 0)
+        goto done;
+
+    ret = 1;
+
+ done:
+    fclose(f);
+    for (i = 0; i < n; ++i)
+        free(names[i]);
+    free(names);
+    free(entries);
+
+    return ret;
+}
+
+static void
+kern_sym_clear (kern_SymbolsObj *self)
+{
+    size_t i;
+
+    for (i = 0; i < self->nmodules; ++i)
+        kern_sym_module_free(&self->modules[i]);
+    free(self->modules);
+
+    self->modules = NULL;
+    self->nmodules = 0;
+    self->nsyms = 0;
+}
+
+static kern_sym_module *
+kern_sym_add_module (kern_SymbolsObj *self, size_t *capacity)
+{
+    void *tmp;
+
+    if (self->nmodules == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        tmp = realloc(self->modules, *capacity * sizeof(kern_sym_module));
+        if (tmp == NULL)
+            return NULL;
+        self->modules = tmp;
+    }
+
+    memset(&self->modules[self->nmodules], 0, sizeof(kern_sym_module));
+    return &self->modules[self->nmodules++];
+}
+
+static int
+kern_sym_module_cmp (const void *a, const void *b)
+{
+    const kern_sym_module *x = a, *y = b;
+
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/*
+ * Load symbol tables for every ELF object mapped in the task, and the task's
+ * perf-PID.map if there is one
+ *
+ * Arguments: None
+ * Returns:   Number of symbols loaded
+ */
+static PyObject *
+kern_Symbols_load (kern_SymbolsObj *self)
+{
+    kern_TaskObj *task = (kern_TaskObj *) self->task;
+    const char *cache = NULL;
+    char path[MAXPATHLEN];
+    kern_sym_module *m;
+    kern_region region;
+    size_t capacity = 0, i;
+    int ret;
+
+    if (! task->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (self->cache != Py_None)
+        cache = PyString_AsString(self->cache);
+
+    kern_sym_clear(self);
+
+    /* Group file-backed regions by path, probing at the first mapping */
+    region.address = 0;
+    while (kern_task_region(task, &region) == KERN_SUCCESS) {
+        if (kern_task_path(task, region.address, path, sizeof(path))) {
+            for (i = 0; i < self->nmodules; ++i)
+                if (! strcmp(self->modules[i].path, path))
+                    break;
+
+            if (i < self->nmodules) {
+                /* A module whose probe failed stays empty */
+                m = &self->modules[i];
+                if (m->end != m->start &&
+                    region.address + region.size > m->end)
+                    m->end = region.address + region.size;
+            } else {
+                m = kern_sym_add_module(self, &capacity);
+                if (m == NULL || (m->path = strdup(path)) == NULL)
+                    return PyErr_NoMemory();
+                m->start = region.address;
+                m->end = region.address + region.size;
+
+                /* Not necessarily at offset 0: a universal file's slice
+                   is mapped from where it starts in the file */
+                if (kern_sym_probe(task, region.address, m) < 0)
+                    m->nsyms = 0, m->end = m->start;
+            }
+        }
+
+        if (region.address + region.size < region.address)
+            break;
+        region.address += region.size;
+    }
+
+    for (i = 0; i < self->nmodules; ++i) {
+        m = &self->modules[i];
+        if (m->end == m->start)
+            continue;
+
+        if (cache && m->build_id_size && kern_sym_cache_load(m, cache))
+            continue;
+
+        ret = kern_sym_parse_file(m);
+        if (ret < 0)
+            return PyErr_NoMemory();
+
+        if (ret > 0 && cache && m->build_id_size)
+            kern_sym_cache_store(m, cache);
+    }
+
+    m = kern_sym_add_module(self, &capacity);
+    if (m == NULL)
+        return PyErr_NoMemory();
+    if (kern_sym_load_perf_map(self, m, task->pid) <= 0) {
+        kern_sym_module_free(m);
+        self->nmodules--;
+    }
+
+    /* Drop objects without symbols and index what's left */
+    for (i = 0, capacity = 0; i < self->nmodules; ++i) {
+        if (self->modules[i].nsyms == 0) {
+            kern_sym_module_free(&self->modules[i]);
+            continue;
+        }
+        self->modules[capacity++] = self->modules[i];
+    }
+    self->nmodules = capacity;
+
+    qsort(self->modules, self->nmodules, sizeof(kern_sym_module),
+          kern_sym_module_cmp);
+
+    for (i = 0; i < self->nmodules; ++i) {
+        self->modules[i].first = self->nsyms;
+        self->nsyms += self->modules[i].nsyms;
+    }
+
+    return PyInt_FromSize_t(self->nsyms);
+}
+
+/* Global symbol index for address, or -1 */
+static int64_t
+kern_sym_lookup (kern_SymbolsObj *self, uint64_t address, uint64_t *offset)
+{
+    kern_sym_module *m;
+    size_t lo = 0, hi = self->nmodules, mid;
+    uint64_t rel;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (self->modules[mid].start <= address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return -1;
+
+    m = &self->modules[lo - 1];
+    if (address >= m->end)
+        return -1;
+
+    rel = address - m->bias;
+    lo = 0;
+    hi = m->nsyms;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (m->value[mid] <= rel)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return -1;
+
+    lo--;
+    if (m->size[lo] != 0 && rel >= m->value[lo] + m->size[lo])
+        return -1;
+
+    *offset = rel - m->value[lo];
+    return (int64_t) (m->first + lo);
+}
+
+static kern_sym_module *
+kern_sym_module_of (kern_SymbolsObj *self, size_t index)
+{
+    size_t lo = 0, hi = self->nmodules, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (self->modules[mid].first <= index)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return &self->modules[lo - 1];
+}
+
+/*
+ * Symbolize an address
+ *
+ * Arguments: address - address in the task
+ * Returns:   (name, offset, path), or None if no symbol covers address
+ */
+static PyObject *
+kern_Symbols_lookup (kern_SymbolsObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_sym_module *m;
+    uint64_t address, offset;
+    int64_t index;
+
+    static char *kwlist[] = {"address", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "K", kwlist, &address))
+        return NULL;
+
+    index = kern_sym_lookup(self, address, &offset);
+    if (index < 0)
+        Py_RETURN_NONE;
+
+    m = kern_sym_module_of(self, (size_t) index);
+    return Py_BuildValue("(sKs)",
+                         m->strtab + m->name[index - m->first], offset,
+                         m->path);
+}
+
+/*
+ * Symbolize many addresses at once
+ *
+ * Arguments: addresses - sequence of addresses, or a buffer of native
+ *                        64-bit addresses such as array('L')
+ * Returns:   (symbols, offsets) arrays, where symbols holds indexes for
+ *            name(), or -1 for unknown addresses
+ */
+static PyObject *
+kern_Symbols_lookupMany (kern_SymbolsObj *self, PyObject *args,
+                         PyObject *kwds)
+{
+    PyObject *addresses, *fast = NULL, *symbols, *offsets;
+    const void *buf;
+    Py_ssize_t buf_len, n, i;
+    uint64_t *in = NULL, *off = NULL;
+    int64_t *sym = NULL;
+
+    static char *kwlist[] = {"addresses", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &addresses))
+        return NULL;
+
+    if (! PyList_Check(addresses) && ! PyTuple_Check(addresses) &&
+        PyObject_CheckReadBuffer(addresses)) {
+        if (PyObject_AsReadBuffer(addresses, &buf, &buf_len) < 0)
+            return NULL;
+        n = buf_len / 8;
+        in = malloc((size_t) n * 8 + 8);
+        if (in != NULL)
+            memcpy(in, buf, (size_t) n * 8);
+    } else {
+        fast = PySequence_Fast(addresses, "addresses must be a sequence");
+        if (fast == NULL)
+            return NULL;
+        n = PySequence_Fast_GET_SIZE(fast);
+        in = malloc((size_t) n * 8 + 8);
+        for (i = 0; in != NULL && i < n; ++i)
+            in[i] = PyInt_AsUnsignedLongLongMask(
+                PySequence_Fast_GET_ITEM(fast, i));
+        Py_DECREF(fast);
+        if (PyErr_Occurred()) {
+            free(in);
+            return NULL;
+        }
+    }
+
+    sym = malloc((size_t) n * 8 + 8);
+    off = malloc((size_t) n * 8 + 8);
+    if (in == NULL || sym == NULL || off == NULL) {
+        free(in);
+        free(sym);
+        free(off);
+        return PyErr_NoMemory();
+    }
+
+    /* With the GIL held, as load() frees and replaces the tables */
+    for (i = 0; i < n; ++i) {
+        off[i] = 0;
+        sym[i] = kern_sym_lookup(self, in[i], &off[i]);
+    }
+
+    symbols = kern_array_new("l", sym, (size_t) n * 8);
+    offsets = kern_array_new("L", off, (size_t) n * 8);
+
+    free(in);
+    free(sym);
+    free(off);
+
+    return Py_BuildValue("(NN)", symbols, offsets);
+}
+
+/*
+ * Get a symbol's name
+ *
+ * Arguments: index - symbol index from lookupMany()
+ * Returns:   (name, path)
+ */
+static PyObject *
+kern_Symbols_name (kern_SymbolsObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_sym_module *m;
+    Py_ssize_t index;
+
+    static char *kwlist[] = {"index", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "n", kwlist, &index))
+        return NULL;
+
+    if (index < 0 || (size_t) index >= self->nsyms) {
+        PyErr_SetString(PyExc_IndexError, "symbol index out of range");
+        return NULL;
+    }
+
+    m = kern_sym_module_of(self, (size_t) index);
+    return Py_BuildValue("(ss)", m->strtab + m->name[index - m->first],
+                         m->path);
+}
+
+/*
+ * Describe the loaded objects
+ *
+ * Arguments: None
+ * Returns:   List of {path, start, end, bias, build_id, symbols, cached}
+ */
+static PyObject *
+kern_Symbols_modules (kern_SymbolsObj *self)
+{
+    PyObject *modules, *item;
+    char build_id[_KERN_BUILD_ID_MAX * 2 + 1];
+    kern_sym_module *m;
+    size_t i, k;
+
+    modules = PyList_New(0);
+    if (modules == NULL)
+        return NULL;
+
+    for (i = 0; i < self->nmodules; ++i) {
+        m = &self->modules[i];
+        for (k = 0; k < m->build_id_size; ++k)
+            sprintf(build_id + k * 2, "%02x", m->build_id[k]);
+        build_id[k * 2] = '\0';
+
+        item = Py_BuildValue("{s:s,s:K,s:K,s:K,s:s,s:n,s:O}",
+                             "path", m->path, "start", m->start,
+                             "end", m->end, "bias", m->bias,
+                             "build_id", build_id,
+                             "symbols", (Py_ssize_t) m->nsyms,
+                             "cached", m->cached ? Py_True : Py_False);
+        if (item == NULL || PyList_Append(modules, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(modules);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+
+    return modules;
+}
+
+static void
+kern_Symbols_dealloc (kern_SymbolsObj *self)
+{
+    kern_sym_clear(self);
+    Py_XDECREF(self->task);
+    Py_XDECREF(self->cache);
+    self->ob_type->tp_free( (PyObject*) self);
+}
+
+static PyObject *
+kern_Symbols_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    kern_SymbolsObj *self = NULL;
+
+    self = (kern_SymbolsObj *) type->tp_alloc(type, 0);
+
+    if (self != NULL) {
+        self->modules = NULL;
+        self->nmodules = 0;
+        self->nsyms = 0;
+
+        Py_INCREF(Py_None);
+        self->task = Py_None;
+        Py_INCREF(Py_None);
+        self->cache = Py_None;
+    }
+
+    return (PyObject *) self;
+}
+
+static int
+kern_Symbols_init (kern_SymbolsObj *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *task = NULL, *cache = Py_None, *tmp;
+
+    static char *kwlist[] = {"task", "cache", NULL};
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O!|O", kwlist,
+                                      &kern_TaskType, &task, &cache))
+        return -1;
+
+    if (cache != Py_None && ! PyString_Check(cache)) {
+        PyErr_SetString(PyExc_TypeError, "cache must be a directory path");
+        return -1;
+    }
+
+    tmp = self->task;
+    Py_INCREF(task);
+    self->task = task;
+    Py_XDECREF(tmp);
+
+    tmp = self->cache;
+    Py_INCREF(cache);
+    self->cache = cache;
+    Py_XDECREF(tmp);
+
+    return 0;
+}
+
+static PyMemberDef kern_SymbolsMembers[] = {
+    {"task", T_OBJECT_EX, offsetof(kern_SymbolsObj, task), READONLY,
+     "Task being symbolized"},
+    {"cache", T_OBJECT_EX, offsetof(kern_SymbolsObj, cache), READONLY,
+     "Symbol cache directory, or None"},
+    {NULL} /* Sentinel */
+};
+
+static PyMethodDef kern_SymbolsMethods[] = {
+    {"load", (PyCFunction)kern_Symbols_load, METH_NOARGS,
+     "Load symbols for the objects mapped in the task"},
+    {"lookup", (PyCFunction)kern_Symbols_lookup, METH_KEYWORDS,
+     "Symbolize an address"},
+    {"lookupMany", (PyCFunction)kern_Symbols_lookupMany, METH_KEYWORDS,
+     "Symbolize many addresses"},
+    {"name", (PyCFunction)kern_Symbols_name, METH_KEYWORDS,
+     "Return a symbol's name and object path"},
+    {"modules", (PyCFunction)kern_Symbols_modules, METH_NOARGS,
+     "Describe the loaded objects"},
+    {NULL} /* Sentinel */
+};
+
+PyTypeObject kern_SymbolsType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /* ob_size */
+    "mdb.kern.Symbols",        /* tp_name */
+    sizeof(kern_SymbolsObj),   /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    (destructor)kern_Symbols_dealloc, /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_compare */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+    "Symbols objects",         /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    kern_SymbolsMethods,       /* tp_methods */
+    kern_SymbolsMembers,       /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)kern_Symbols_init, /* tp_init */
+    0,                         /* tp_alloc */
+    kern_Symbols_new,          /* tp_new */
+};
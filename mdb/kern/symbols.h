@@ -0,0 +1,68 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_SYMBOLS_H
+#define _KERN_SYMBOLS_H
+
+#include "structmember.h"
+
+extern PyTypeObject kern_SymbolsType;
+
+#define _KERN_BUILD_ID_MAX 64
+
+/*
+ * Symbol table for one mapped object. value, size and name are parallel
+ * arrays sorted by value; names are offsets into strtab
+ */
+typedef struct {
+    char *path;
+    uint64_t start;
+    uint64_t end;
+    uint64_t bias;
+    unsigned char build_id[_KERN_BUILD_ID_MAX];
+    size_t build_id_size;
+    int cached;
+    size_t first;
+    size_t nsyms;
+    const uint64_t *value;
+    const uint64_t *size;
+    const uint32_t *name;
+    const char *strtab;
+    void *map;
+    size_t map_size;
+    void *owned;
+} kern_sym_module;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *task;
+    PyObject *cache;
+    kern_sym_module *modules;
+    size_t nmodules;
+    size_t nsyms;
+} kern_SymbolsObj;
+
+#endif
@@ -0,0 +1,644 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+#include <mach/mach_vm.h>
+
+#include "util.h"
+#include "kern.h"
+#include "task.h"
+#include "scratch.h"
+#include "breakpoint.h"
+#include "hook.h"
+#include "syscalls.h"
+
+/*
+ * Syscall tracing without stopping the task. Stopping on every syscall
+ * (EXC_MASK_SYSCALL, or PTRACE_SYSCALL elsewhere) slows I/O-heavy tasks
+ * down tenfold, so only the libsystem_kernel stubs of the syscalls of
+ * interest are patched; every other syscall runs untouched. A stub is
+ *
+ *   mov eax, NUMBER; mov r10, rcx; syscall; jae 1f; ...
+ *
+ * whose first 10 bytes become a jmp to a copy of them in scratch memory
+ * that checks the argument filters, makes the syscall, logs it to a ring
+ * shared with the debugger, and jumps back to the jae with rax, rdx and
+ * the flags as the kernel left them.
+ *
+ * stub:
+ *   mov r10, rcx
+ *   (for each filter: mov rax, ARG; and rax, MASK; cmp rax, VALUE;
+ *    jne plain)
+ *   push rdi; push rsi; push rdx; push r10; push r8; push r9
+ *   rdtsc; push rax
+ *   mov rdx, [rsp + 32]
+ *   mov eax, NUMBER
+ *   syscall
+ *   pushfq; push rax; push rdx
+ *   rdtsc; push rax
+ *   (reserve a record in RING as the hooks' stub does, then copy the
+ *    saved arguments, times, result and flags, the return address,
+ *    gs:[0], NUMBER and ADDRESS into it, and set its seq)
+ *   pop r11; pop rdx; pop rax; popfq
+ *   lea rsp, [rsp + 56]
+ *   jmp ADDRESS + 10
+ * plain:
+ *   mov eax, NUMBER
+ *   syscall
+ *   jmp ADDRESS + 10
+ *
+ * Records are reserved after the syscall returns, so a thread blocked in
+ * one doesn't hold up the others' records, but syscalls that don't return
+ * (exit, a successful execve) aren't logged.
+ */
+
+static const uint8_t kern_syscall_code[] = {
+    0x57, 0x56, 0x52, 0x41, 0x52, 0x41, 0x50, 0x41, 0x51, 0x0f, 0x31, 0x48,
+    0xc1, 0xe2, 0x20, 0x48, 0x09, 0xd0, 0x50, 0x48, 0x8b, 0x54, 0x24, 0x20,
+    0xb8, 0x00, 0x00, 0x00, 0x00, 0x0f, 0x05, 0x9c, 0x50, 0x52, 0x0f, 0x31,
+    0x48, 0xc1, 0xe2, 0x20, 0x48, 0x09, 0xd0, 0x50, 0x48, 0xb9, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x48, 0x8b, 0x41, 0x40, 0x48, 0x89,
+    0xc2, 0x48, 0x2b, 0x91, 0x80, 0x00, 0x00, 0x00, 0x48, 0x81, 0xfa, 0x00,
+    0x00, 0x00, 0x00, 0x0f, 0x83, 0xab, 0x00, 0x00, 0x00, 0x48, 0x8d, 0x50,
+    0x01, 0xf0, 0x48, 0x0f, 0xb1, 0x51, 0x40, 0x75, 0xd9, 0x49, 0x89, 0xd3,
+    0x25, 0x00, 0x00, 0x00, 0x00, 0x48, 0xc1, 0xe0, 0x07, 0x48, 0x8d, 0x8c,
+    0x01, 0xc0, 0x00, 0x00, 0x00, 0x48, 0x8b, 0x04, 0x24, 0x48, 0x89, 0x41,
+    0x20, 0x48, 0x8b, 0x44, 0x24, 0x10, 0x48, 0x89, 0x41, 0x30, 0x48, 0x8b,
+    0x44, 0x24, 0x18, 0x48, 0x89, 0x41, 0x38, 0x48, 0x8b, 0x44, 0x24, 0x20,
+    0x48, 0x89, 0x41, 0x18, 0x48, 0x8b, 0x44, 0x24, 0x28, 0x48, 0x89, 0x41,
+    0x70, 0x48, 0x8b, 0x44, 0x24, 0x30, 0x48, 0x89, 0x41, 0x68, 0x48, 0x8b,
+    0x44, 0x24, 0x38, 0x48, 0x89, 0x41, 0x60, 0x48, 0x8b, 0x44, 0x24, 0x40,
+    0x48, 0x89, 0x41, 0x58, 0x48, 0x8b, 0x44, 0x24, 0x48, 0x48, 0x89, 0x41,
+    0x50, 0x48, 0x8b, 0x44, 0x24, 0x50, 0x48, 0x89, 0x41, 0x48, 0x48, 0x8b,
+    0x44, 0x24, 0x58, 0x48, 0x89, 0x41, 0x28, 0x65, 0x48, 0x8b, 0x04, 0x25,
+    0x00, 0x00, 0x00, 0x00, 0x48, 0x89, 0x41, 0x10, 0xb8, 0x00, 0x00, 0x00,
+    0x00, 0x48, 0x89, 0x41, 0x08, 0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x48, 0x89, 0x41, 0x40, 0x4c, 0x89, 0x19, 0xeb, 0x08,
+    0xf0, 0x48, 0xff, 0x81, 0x88, 0x00, 0x00, 0x00, 0x41, 0x5b, 0x5a, 0x58,
+    0x9d, 0x48, 0x8d, 0x64, 0x24, 0x38, 0xe9, 0x00, 0x00, 0x00, 0x00, 0xb8,
+    0x00, 0x00, 0x00, 0x00, 0x0f, 0x05, 0xe9, 0x00, 0x00, 0x00, 0x00,
+};
+
+/* Immediates patched into each copy of the stub */
+#define SYSCALL_NUMBER          25
+#define SYSCALL_RING            46
+#define SYSCALL_CAPACITY        71
+#define SYSCALL_MASK            97
+#define SYSCALL_RECORD_NUMBER   225
+#define SYSCALL_ADDRESS         235
+#define SYSCALL_BACK            271
+#define SYSCALL_PLAIN           275
+#define SYSCALL_PLAIN_NUMBER    276
+#define SYSCALL_PLAIN_BACK      283
+
+/* mov rax, ARG; movabs r11, MASK; and rax, r11; movabs r11, VALUE;
+   cmp rax, r11; jne plain */
+static const uint8_t kern_syscall_filter[] = {
+    0x00, 0x00, 0x00, 0x49, 0xbb, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x4c, 0x21, 0xd8, 0x49, 0xbb, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x4c, 0x39, 0xd8, 0x0f, 0x85, 0x00, 0x00, 0x00, 0x00,
+};
+
+#define FILTER_MASK     5
+#define FILTER_VALUE    18
+#define FILTER_PLAIN    31
+
+/* mov rax, rdi / rsi / rdx / r10 / r8 / r9 */
+static const uint8_t kern_syscall_arg[_KERN_SYSCALL_ARGS][3] = {
+    {0x48, 0x89, 0xf8}, {0x48, 0x89, 0xf0}, {0x48, 0x89, 0xd0},
+    {0x4c, 0x89, 0xd0}, {0x4c, 0x89, 0xc0}, {0x4c, 0x89, 0xc8},
+};
+
+#define SYSCALL_RECORDS (64 * 1024)
+#define SYSCALL_PREFIX  3               /* mov r10, rcx */
+#define SYSCALL_MAX     (SYSCALL_PREFIX + \
+                         _KERN_SYSCALL_ARGS * sizeof(kern_syscall_filter) + \
+                         sizeof(kern_syscall_code))
+
+#define VOLATILE(x) (*(volatile __typeof__(x) *) &(x))
+
+static size_t
+kern_syscall_find (struct kern_syscalls *syscalls, mach_vm_address_t address)
+{
+    size_t lo = 0, hi = syscalls->count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (syscalls->items[mid].address < address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Whether [address, address + size) meets the bytes a traced stub lost */
+int
+kern_syscall_overlaps (kern_TaskObj *task, mach_vm_address_t address,
+                       mach_vm_size_t size)
+{
+    struct kern_syscalls *syscalls = task->syscalls;
+    size_t i;
+
+    if (syscalls == NULL || syscalls->count == 0)
+        return 0;
+
+    i = kern_syscall_find(syscalls, address + size);
+    if (i == 0)
+        return 0;
+
+    return address < syscalls->items[i - 1].address + _KERN_SYSCALL_PATCH;
+}
+
+/* As with hooks, the ring stays allocated in the task for running stubs */
+void
+kern_syscalls_free (kern_TaskObj *task)
+{
+    struct kern_syscalls *syscalls = task->syscalls;
+
+    if (syscalls == NULL)
+        return;
+
+    mach_vm_deallocate(mach_task_self(),
+                       (mach_vm_address_t) syscalls->ring,
+                       KERN_SYSCALL_RING_SIZE(SYSCALL_RECORDS));
+    free(syscalls->items);
+    free(syscalls);
+    task->syscalls = NULL;
+}
+
+static struct kern_syscalls *
+kern_syscalls_new (kern_TaskObj *task)
+{
+    kern_return_t kr;
+    struct kern_syscalls *syscalls;
+    mach_vm_address_t local;
+
+    syscalls = calloc(1, sizeof(struct kern_syscalls));
+    if (syscalls == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    kr = kern_shared_alloc(task, KERN_SYSCALL_RING_SIZE(SYSCALL_RECORDS),
+                           &local, &syscalls->remote);
+    if (kr != KERN_SUCCESS) {
+        free(syscalls);
+        kern_handle_kr(kr);
+        return NULL;
+    }
+
+    syscalls->ring = (kern_syscall_ring *) (uintptr_t) local;
+    syscalls->ring->magic = KERN_SYSCALL_MAGIC;
+    syscalls->ring->capacity = SYSCALL_RECORDS;
+
+    return syscalls;
+}
+
+/*
+ * Find a syscall stub: an address, or the name of a libsystem_kernel
+ * function, which being in the shared cache is where it is here. *local is
+ * set to the stub in our own address space when it was looked up by name
+ *
+ * Returns: 0, or -1 with an exception set
+ */
+static int
+kern_syscall_address (PyObject *syscall, mach_vm_address_t *address,
+                      const uint8_t **local)
+{
+    void *function;
+
+    *local = NULL;
+
+    if (PyString_Check(syscall)) {
+        function = dlsym(RTLD_DEFAULT, PyString_AS_STRING(syscall));
+        if (function == NULL) {
+            PyErr_Format(PyExc_ValueError, "no function named %s",
+                         PyString_AS_STRING(syscall));
+            return -1;
+        }
+        *address = (mach_vm_address_t) (uintptr_t) function;
+        *local = function;
+        return 0;
+    }
+
+    *address = PyInt_AsUnsignedLongLongMask(syscall);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+/*
+ * Compile the argument filters: {index: value or (value, mask)}, the
+ * argument ANDed with mask (default all ones) having to equal value
+ *
+ * Returns: Number of filters written to code, their jnes yet to be aimed,
+ *          or -1 with an exception set
+ */
+static int
+kern_syscall_filters (PyObject *filters, uint8_t *code)
+{
+    PyObject *key, *item, *value, *mask;
+    Py_ssize_t pos = 0;
+    uint64_t v, m;
+    long index;
+    int count = 0;
+    uint8_t *filter;
+
+    if (filters == NULL || filters == Py_None)
+        return 0;
+
+    if (! PyDict_Check(filters)) {
+        PyErr_SetString(PyExc_TypeError, "args must be a dict");
+        return -1;
+    }
+
+    while (PyDict_Next(filters, &pos, &key, &item)) {
+        index = PyInt_AsLong(key);
+        if (index == -1 && PyErr_Occurred())
+            return -1;
+        if (index < 0 || index >= _KERN_SYSCALL_ARGS) {
+            PyErr_Format(PyExc_ValueError, "no argument %ld", index);
+            return -1;
+        }
+
+        if (PyTuple_Check(item)) {
+            if (! PyArg_ParseTuple(item, "OO", &value, &mask))
+                return -1;
+        } else {
+            value = item;
+            mask = NULL;
+        }
+
+        v = PyInt_AsUnsignedLongLongMask(value);
+        m = mask != NULL ? PyInt_AsUnsignedLongLongMask(mask) : ~0ULL;
+        if (PyErr_Occurred())
+            return -1;
+
+        filter = code + count * sizeof(kern_syscall_filter);
+        memcpy(filter, kern_syscall_filter, sizeof(kern_syscall_filter));
+        memcpy(filter, kern_syscall_arg[index], 3);
+        memcpy(filter + FILTER_MASK, &m, 8);
+        v &= m;
+        memcpy(filter + FILTER_VALUE, &v, 8);
+        ++count;
+    }
+
+    return count;
+}
+
+/*
+ * Trace a syscall, optionally only when its arguments match. Each call
+ * that returns is then logged to a ring the debugger drains with
+ * drainSyscalls(), while the task runs on; other syscalls aren't slowed
+ * at all. 64-bit tasks only
+ *
+ * Arguments: syscall - address of its libsystem_kernel stub, or the
+ *                      stub's name (e.g. "read", "__open")
+ *            args - {index: value or (value, mask)}, the calls to log,
+ *                   default = None (all)
+ * Returns:   Address of the stub
+ */
+PyObject *
+kern_Task_traceSyscall (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    kern_return_t kr;
+    struct kern_syscalls *syscalls;
+    kern_syscall_trace *items, *trace;
+    PyObject *syscall, *filters = NULL;
+    mach_vm_address_t address, stub, back;
+    mach_vm_address_t to[2];
+    mach_vm_size_t out_size;
+    const uint8_t *local;
+    uint8_t code[_KERN_SYSCALL_PATCH], patch[_KERN_SYSCALL_PATCH];
+    uint8_t out[SYSCALL_MAX], *body;
+    static const uint8_t from[2] = {5, 8};
+    uint32_t number, imm;
+    size_t i, n, capacity;
+    int count;
+
+    static char *kwlist[] = {"syscall", "args", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &syscall,
+                                      &filters))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (self->ops != &kern_task_mach_ops) {
+        PyErr_SetString(kern_Error, "syscalls are traced in live tasks only");
+        return NULL;
+    }
+
+    if (! kern_task_is64(self)) {
+        PyErr_SetString(kern_Error, "syscalls are traced in 64-bit tasks "
+                        "only");
+        return NULL;
+    }
+
+    if (kern_syscall_address(syscall, &address, &local) < 0)
+        return NULL;
+
+    if (kern_hook_overlaps(self, address, _KERN_SYSCALL_PATCH)) {
+        PyErr_Format(kern_Error, "already hooked or traced near 0x%llx",
+                     (unsigned long long) address);
+        return NULL;
+    }
+
+    kr = kern_task_read(self, address, sizeof(code), code, &out_size);
+    CHECK_KR(kr);
+
+    if (out_size != sizeof(code) || code[0] != 0xb8 ||
+        memcmp(code + 5, "\x49\x89\xca\x0f\x05", 5) != 0) {
+        PyErr_Format(PyExc_ValueError, "no syscall stub at 0x%llx",
+                     (unsigned long long) address);
+        return NULL;
+    }
+
+    if (local != NULL && memcmp(code, local, sizeof(code)) != 0) {
+        PyErr_SetString(kern_Error, "the task doesn't share our system "
+                        "libraries");
+        return NULL;
+    }
+
+    for (i = 0; i < _KERN_SYSCALL_PATCH; ++i)
+        if (kern_breakpoint_slot(self, address + i)) {
+            PyErr_Format(kern_Error, "breakpoint at 0x%llx",
+                         (unsigned long long) (address + i));
+            return NULL;
+        }
+
+    memcpy(&number, code + 1, 4);
+
+    /* mov r10, rcx; the filters; the stub proper */
+    out[0] = 0x49;
+    out[1] = 0x89;
+    out[2] = 0xca;
+    count = kern_syscall_filters(filters, out + SYSCALL_PREFIX);
+    if (count < 0)
+        return NULL;
+
+    /* A failed filter skips the rest, and the logging, for plain */
+    for (i = 0; i < (size_t) count; ++i) {
+        imm = (uint32_t) ((count - i - 1) * sizeof(kern_syscall_filter) +
+                          SYSCALL_PLAIN);
+        memcpy(out + SYSCALL_PREFIX + i * sizeof(kern_syscall_filter) +
+               FILTER_PLAIN, &imm, 4);
+    }
+
+    body = out + SYSCALL_PREFIX + count * sizeof(kern_syscall_filter);
+    n = (size_t) (body - out) + sizeof(kern_syscall_code);
+
+    kr = kern_scratch_alloc(self, address, n, &stub);
+    CHECK_KR(kr);
+
+    if (self->syscalls == NULL &&
+        (self->syscalls = kern_syscalls_new(self)) == NULL)
+        return NULL;
+    syscalls = self->syscalls;
+
+    memcpy(body, kern_syscall_code, sizeof(kern_syscall_code));
+    memcpy(body + SYSCALL_NUMBER, &number, 4);
+    memcpy(body + SYSCALL_RECORD_NUMBER, &number, 4);
+    memcpy(body + SYSCALL_PLAIN_NUMBER, &number, 4);
+    memcpy(body + SYSCALL_RING, &syscalls->remote, 8);
+    imm = SYSCALL_RECORDS;
+    memcpy(body + SYSCALL_CAPACITY, &imm, 4);
+    imm = SYSCALL_RECORDS - 1;
+    memcpy(body + SYSCALL_MASK, &imm, 4);
+    memcpy(body + SYSCALL_ADDRESS, &address, 8);
+
+    /* Both paths rejoin the stub at its jae */
+    back = address + _KERN_SYSCALL_PATCH;
+    imm = (uint32_t) (back - (stub + (body - out) + SYSCALL_PLAIN));
+    memcpy(body + SYSCALL_BACK, &imm, 4);
+    imm = (uint32_t) (back - (stub + n));
+    memcpy(body + SYSCALL_PLAIN_BACK, &imm, 4);
+
+    /*
+     * jmp stub, then int3s. A thread stopped after the mov eax or the
+     * mov r10 starts the stub over: rcx still holds the fourth argument
+     */
+    patch[0] = 0xe9;
+    imm = (uint32_t) (stub - (address + 5));
+    memcpy(patch + 1, &imm, 4);
+    memset(patch + 5, 0xcc, _KERN_SYSCALL_PATCH - 5);
+    to[0] = to[1] = stub;
+
+    if (syscalls->count == syscalls->capacity) {
+        capacity = syscalls->capacity ? syscalls->capacity * 2 : 16;
+        items = realloc(syscalls->items,
+                        capacity * sizeof(kern_syscall_trace));
+        if (items == NULL)
+            return PyErr_NoMemory();
+        syscalls->items = items;
+        syscalls->capacity = capacity;
+    }
+
+    kr = kern_scratch_write(self, stub, out, (mach_vm_size_t) n);
+    CHECK_KR(kr);
+
+    if (kern_hook_patch(self, address, patch, sizeof(patch), from, to, 2) < 0)
+        return NULL;
+
+    i = kern_syscall_find(syscalls, address);
+    memmove(&syscalls->items[i + 1], &syscalls->items[i],
+            (syscalls->count - i) * sizeof(kern_syscall_trace));
+    trace = &syscalls->items[i];
+    trace->address = address;
+    trace->stub = stub;
+    trace->number = number;
+    memcpy(trace->original, code, sizeof(code));
+    syscalls->count++;
+
+    return PyLong_FromUnsignedLongLong(address);
+}
+
+/*
+ * Stop tracing a syscall. Calls already in its stub are still logged
+ *
+ * Arguments: syscall - address or name of the stub
+ * Returns:   None
+ */
+PyObject *
+kern_Task_untraceSyscall (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    struct kern_syscalls *syscalls = self->syscalls;
+    PyObject *syscall;
+    mach_vm_address_t address;
+    const uint8_t *local;
+    size_t i;
+
+    static char *kwlist[] = {"syscall", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &syscall))
+        return NULL;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (kern_syscall_address(syscall, &address, &local) < 0)
+        return NULL;
+
+    i = syscalls != NULL ? kern_syscall_find(syscalls, address) : 0;
+    if (syscalls == NULL || i == syscalls->count ||
+        syscalls->items[i].address != address) {
+        PyErr_Format(PyExc_KeyError, "no syscall traced at 0x%llx",
+                     (unsigned long long) address);
+        return NULL;
+    }
+
+    if (kern_hook_patch(self, address, syscalls->items[i].original,
+                        _KERN_SYSCALL_PATCH, NULL, NULL, 0) < 0)
+        return NULL;
+
+    memmove(&syscalls->items[i], &syscalls->items[i + 1],
+            (syscalls->count - i - 1) * sizeof(kern_syscall_trace));
+    syscalls->count--;
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Get the task's traced syscalls
+ *
+ * Arguments: None
+ * Returns:   Dictionary of stub address to syscall number
+ */
+PyObject *
+kern_Task_getSyscalls (kern_TaskObj *self)
+{
+    PyObject *result, *key, *value;
+    size_t i;
+
+    result = PyDict_New();
+    if (result == NULL || self->syscalls == NULL)
+        return result;
+
+    for (i = 0; i < self->syscalls->count; ++i) {
+        key = PyLong_FromUnsignedLongLong(self->syscalls->items[i].address);
+        value = PyInt_FromLong((long) self->syscalls->items[i].number);
+        if (key == NULL || value == NULL ||
+            PyDict_SetItem(result, key, value) < 0) {
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(key);
+        Py_DECREF(value);
+    }
+
+    return result;
+}
+
+/*
+ * Take the syscalls logged since the last drain, in the order they
+ * returned. The task isn't stopped; records still being written are left
+ * for next time
+ *
+ * Arguments: limit - most records to take, default = 0 (all)
+ * Returns:   ([(address, number, thread, start, end, caller, args, result,
+ *            error)], dropped), address being the stub, number the
+ *            syscall's with its class (0x2000000 for BSD), thread the
+ *            caller's pthread_t, start and end TSCs, args the six
+ *            argument registers; result is -1 when error is an errno, and
+ *            error 0 otherwise. dropped counts syscalls lost to a full
+ *            ring since the last drain
+ */
+PyObject *
+kern_Task_drainSyscalls (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    struct kern_syscalls *syscalls = self->syscalls;
+    kern_syscall_ring *ring;
+    kern_syscall_record record;
+    PyObject *records, *item;
+    uint64_t tail, dropped;
+    long long result;
+    unsigned long long limit = 0, count, error;
+
+    static char *kwlist[] = {"limit", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|K", kwlist, &limit))
+        return NULL;
+
+    records = PyList_New(0);
+    if (records == NULL || syscalls == NULL)
+        return records != NULL ? Py_BuildValue("(Ni)", records, 0) : NULL;
+
+    ring = syscalls->ring;
+    tail = ring->tail;
+
+    for (count = 0; limit == 0 || count < limit; ++count) {
+        if (VOLATILE(ring->records[tail & (SYSCALL_RECORDS - 1)].seq) !=
+            tail + 1)
+            break;
+
+        __sync_synchronize();
+        record = ring->records[tail & (SYSCALL_RECORDS - 1)];
+        __sync_synchronize();
+        ring->tail = ++tail;
+
+        /* The carry flag marks a failed syscall, rax then its errno */
+        if (record.flags & 1) {
+            result = -1;
+            error = record.ret;
+        } else {
+            result = (long long) record.ret;
+            error = 0;
+        }
+
+        item = Py_BuildValue("(KkKKKK(KKKKKK)LK)",
+                             record.address, (unsigned long) record.number,
+                             record.thread, record.start, record.end,
+                             record.caller, record.arg[0], record.arg[1],
+                             record.arg[2], record.arg[3], record.arg[4],
+                             record.arg[5], result, error);
+        if (item == NULL || PyList_Append(records, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(records);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+
+    dropped = ring->dropped;
+    count = dropped - syscalls->dropped;
+    syscalls->dropped = dropped;
+
+    return Py_BuildValue("(NK)", records, count);
+}
@@ -0,0 +1,71 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_SYSCALLS_H
+#define _KERN_SYSCALLS_H
+
+#include <mach/mach_types.h>
+
+#include "task.h"
+#include "shared.h"
+
+/* mov eax, imm32; mov r10, rcx; syscall */
+#define _KERN_SYSCALL_PATCH 10
+#define _KERN_SYSCALL_ARGS  6
+
+typedef struct {
+    mach_vm_address_t address;      /* the libsystem_kernel stub */
+    mach_vm_address_t stub;         /* filters, then the syscall, logged */
+    uint32_t number;
+    uint8_t original[_KERN_SYSCALL_PATCH];
+} kern_syscall_trace;
+
+struct kern_syscalls {
+    kern_syscall_ring *ring;        /* mapped here */
+    mach_vm_address_t remote;       /* and in the task */
+    uint64_t dropped;               /* ring->dropped at the last drain */
+    kern_syscall_trace *items;      /* sorted by address */
+    size_t count;
+    size_t capacity;
+};
+
+int kern_syscall_overlaps (kern_TaskObj *task, mach_vm_address_t address,
+                           mach_vm_size_t size);
+
+void kern_syscalls_free (kern_TaskObj *task);
+
+PyObject *kern_Task_traceSyscall (kern_TaskObj *self, PyObject *args,
+                                  PyObject *kwds);
+
+PyObject *kern_Task_untraceSyscall (kern_TaskObj *self, PyObject *args,
+                                    PyObject *kwds);
+
+PyObject *kern_Task_getSyscalls (kern_TaskObj *self);
+
+PyObject *kern_Task_drainSyscalls (kern_TaskObj *self, PyObject *args,
+                                   PyObject *kwds);
+
+#endif
@@ -26,18 +26,143 @@
 
 #include <Python.h>
 
+#include <libproc.h>
+#include <sys/param.h>
+#include <sys/sysctl.h>
+
 #include <mach/mach.h>
 #include <mach/mach_traps.h>
 #include <mach/mach_types.h>
+#include <mach/mach_vm.h>
 
 #include "util.h"
 #include "kern.h"
 #include "memory.h"
 #include "thread.h"
 #include "exception.h"
+#include "heap.h"
+#include "regex.h"
+#include "hash.h"
+#include "snapshot.h"
+#include "index.h"
+#include "scratch.h"
+#include "breakpoint.h"
+#include "hook.h"
+#include "syscalls.h"
+#include "call.h"
+#include "trace.h"
+#include "agent.h"
+#include "record.h"
 #include "task.h"
 
 
+static kern_return_t
+kern_task_mach_read (kern_TaskObj *task, mach_vm_address_t address,
+                     mach_vm_size_t size, void *buf, mach_vm_size_t *out_size)
+{
+    /* An agent in the task serves reads from shared memory. It's checked
+       again under agent_lock */
+    if (task->agent != NULL &&
+        kern_agent_read(task, address, size, buf, out_size) == KERN_SUCCESS)
+        return KERN_SUCCESS;
+
+    return mach_vm_read_overwrite(task->port, address, size,
+                                  (mach_vm_address_t) buf, out_size);
+}
+
+static kern_return_t
+kern_task_mach_write (kern_TaskObj *task, mach_vm_address_t address,
+                      const void *data, mach_vm_size_t size)
+{
+    return mach_vm_write(task->port, address, (vm_offset_t) data,
+                         (mach_msg_type_number_t) size);
+}
+
+static kern_return_t
+kern_task_mach_region (kern_TaskObj *task, kern_region *region)
+{
+    mach_port_t object;
+    mach_msg_type_number_t info_count = VM_REGION_BASIC_INFO_COUNT_64;
+
+    return mach_vm_region(task->port, &region->address, &region->size,
+                          VM_REGION_BASIC_INFO_64,
+                          (vm_region_info_t) &region->info, &info_count,
+                          &object);
+}
+
+static size_t
+kern_task_mach_path (kern_TaskObj *task, mach_vm_address_t address,
+                     char *buf, size_t size)
+{
+    int len;
+
+    len = proc_regionfilename(task->pid, address, buf, (uint32_t) size);
+    if (len <= 0 || (size_t) len >= size)
+        return 0;
+
+    buf[len] = '\0';
+    return (size_t) len;
+}
+
+/* Pages per residency query */
+#define KERN_RESIDENCY_BATCH 1024
+
+static kern_return_t
+kern_task_mach_residency (kern_TaskObj *task, mach_vm_address_t address,
+                          mach_vm_size_t size, uint8_t *present, size_t first)
+{
+    kern_return_t kr;
+    int dispositions[KERN_RESIDENCY_BATCH];
+    mach_vm_size_t n, count, i;
+
+    while (size > 0) {
+        n = size / vm_page_size;
+        if (n > KERN_RESIDENCY_BATCH)
+            n = KERN_RESIDENCY_BATCH;
+
+        /* Reports the pmap state only, so nothing is faulted in */
+        count = n;
+        kr = mach_vm_page_range_query(task->port, address, n * vm_page_size,
+                                      (mach_vm_address_t) dispositions,
+                                      &count);
+        if (kr != KERN_SUCCESS)
+            return kr;
+
+        for (i = 0; i < count; ++i, ++first)
+            if (dispositions[i] & VM_PAGE_QUERY_PAGE_PRESENT)
+                present[first >> 3] |= (uint8_t) (1 << (first & 7));
+        first += n - count;
+
+        address += n * vm_page_size;
+        size -= n * vm_page_size;
+    }
+
+    return KERN_SUCCESS;
+}
+
+const kern_task_ops kern_task_mach_ops = {
+    kern_task_mach_read,
+    kern_task_mach_write,
+    kern_task_mach_region,
+    kern_task_mach_path,
+    NULL,
+    kern_task_mach_residency,
+};
+
+/* Whether the task runs 64-bit code */
+int
+kern_task_is64 (kern_TaskObj *task)
+{
+    struct kinfo_proc info;
+    size_t size = sizeof(info);
+    int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, task->pid };
+
+    if (sysctl(mib, 4, &info, &size, NULL, 0) < 0 || size == 0)
+        return sizeof(void *) == 8;
+
+    return (info.kp_proc.p_flag & P_LP64) != 0;
+}
+
 /*
  * Attach to the task
  *
@@ -48,7 +173,8 @@ static PyObject *
 kern_Task_attach (kern_TaskObj* self, PyObject *args, PyObject *kwds)
 {
     kern_return_t kr;
-    kern_MemoryObj *vm = NULL;
+    PyObject *vm = NULL;
+    uint64_t start = kern_stats_now();
 
     if (self->attached) {
         PyErr_SetNone(kern_AlreadyAttachedError);
@@ -64,19 +190,18 @@ kern_Task_attach (kern_TaskObj* self, PyObject *args, PyObject *kwds)
     CHECK_KR(kr);
 
     /* Initialize VM attr */
-    vm = PyObject_New(kern_MemoryObj, &kern_MemoryType);
+    vm = kern_memory_new((PyObject *) self, 0, UINT64_MAX);
     if (vm == NULL)
         return NULL;
 
-    Py_INCREF(self);
-    vm->task = (PyObject *) self;
-    vm->address = 0;
-    vm->size = UINT64_MAX;
-
-    self->vm = (PyObject *) vm;
+    Py_DECREF(self->vm);
+    self->vm = vm;
 
     self->attached = 1;
 
+    kern_trace_emit(&self->stats, _KERN_TRACE_ATTACH, (uint64_t) self->pid,
+                    0, start, kern_stats_now(), KERN_SUCCESS);
+
     Py_RETURN_NONE;
 }
 
@@ -84,23 +209,20 @@ kern_Task_attach (kern_TaskObj* self, PyObject *args, PyObject *kwds)
  * Find a memory region in the task's address space
  *
  * Arguments: address - the address at which to start looking for a region
- * Returns:   Dictionary, or None if no region is found
+ * Returns:   Dictionary, or None if no region is found. path is the mapped
+ *            file, or None for anonymous memory
  */
 static PyObject *
 kern_Task_findRegion (kern_TaskObj *self, PyObject *args, PyObject *kwds)
 {
-    vm_address_t address;
-    vm_size_t size;
-
     kern_return_t kr;
-    mach_port_t object;
-    vm_region_basic_info_data_64_t info;
-    mach_msg_type_number_t info_count = VM_REGION_BASIC_INFO_COUNT_64;
+    kern_region region;
+    char path[MAXPATHLEN];
 
     static char *kwlist[] = {"address", NULL};
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "K", kwlist,
-                                      &address))
+                                      &region.address))
         return NULL;
 
     if (! self->attached) {
@@ -108,80 +230,208 @@ kern_Task_findRegion (kern_TaskObj *self, PyObject *args, PyObject *kwds)
         return NULL;
     }
 
-    kr = vm_region_64(self->port, &address, &size, VM_REGION_BASIC_INFO,
-                      (vm_region_info_t) &info, &info_count, &object);
+    kr = kern_task_region(self, &region);
 
     if (kr == KERN_INVALID_ADDRESS)
         Py_RETURN_NONE;
+    CHECK_KR(kr);
 
-#define KV(kv) #kv, info.kv
-    return Py_BuildValue("{s:K,s:K,s:i,s:i,s:i,s:i,s:i,s:i}",
-                         "address", address, "size", size,
+    if (! kern_task_path(self, region.address, path, sizeof(path)))
+        path[0] = '\0';
+
+#define KV(kv) #kv, region.info.kv
+    return Py_BuildValue("{s:K,s:K,s:i,s:i,s:i,s:i,s:i,s:i,s:K,s:z}",
+                         "address", region.address, "size", region.size,
                          KV(protection), KV(max_protection),
                          KV(inheritance), KV(shared), KV(reserved),
-                         KV(behavior));
+                         KV(behavior), KV(offset),
+                         "path", path[0] ? path : NULL);
 #undef KV
 }
 
 /*
- * Get the task's list of threads.
+ * Look up the Thread for a thread port in the task's thread table, creating
+ * it if the thread is new. The send right is handed over: a Thread already
+ * holds one for its port, so the extra user reference is dropped
  *
- * Arguments: None
- * Returns:   List of Thread objects
+ * Returns: new reference, or NULL
  */
-static PyObject *
-kern_Task_getThreads (kern_TaskObj *self)
+static kern_ThreadObj *
+kern_task_thread (kern_TaskObj *self, mach_port_t port)
 {
-    kern_return_t kr;
-    thread_act_port_array_t thread_list;
-    mach_msg_type_number_t thread_count;
+    kern_ThreadObj *thread;
+    PyObject *key;
 
-    PyObject *threads = NULL;
-    Py_ssize_t threads_size = 0;
-    kern_ThreadObj *thread = NULL;
+    if (self->threads == NULL && (self->threads = PyDict_New()) == NULL)
+        goto error;
 
-    int i;
+    if ((key = PyInt_FromLong((long) port)) == NULL)
+        goto error;
 
-    if (! self->attached) {
-        PyErr_SetNone(kern_NotAttachedError);
+    thread = (kern_ThreadObj *) PyDict_GetItem(self->threads, key);
+    if (thread != NULL) {
+        Py_DECREF(key);
+        Py_INCREF(thread);
+        mach_port_deallocate(mach_task_self(), port);
+        return thread;
+    }
+
+    thread = kern_thread_new((PyObject *) self, port);
+    if (thread == NULL) {
+        Py_DECREF(key);
+        goto error;
+    }
+
+    if (PyDict_SetItem(self->threads, key, (PyObject *) thread) < 0) {
+        Py_DECREF(key);
+        Py_DECREF(thread);
         return NULL;
     }
+    Py_DECREF(key);
+
+    return thread;
+
+ error:
+    mach_port_deallocate(mach_task_self(), port);
+    return NULL;
+}
+
+/*
+ * Bring the thread table up to date: threads seen before keep their Thread
+ * objects (and cached state such as the arch), new threads are added and
+ * exited ones dropped
+ *
+ * Returns: new list of Threads in the kernel's order, or NULL
+ */
+static PyObject *
+kern_task_threads (kern_TaskObj *self)
+{
+    kern_return_t kr;
+    thread_act_port_array_t thread_list;
+    mach_msg_type_number_t thread_count, i;
+    kern_ThreadObj *thread;
+    PyObject *threads, *table = NULL, *key;
 
     kr = task_threads(self->port, &thread_list, &thread_count);
     CHECK_KR(kr);
 
-    threads = PyList_New((Py_ssize_t) 0);
-    if (threads == NULL)
-        return PyErr_NoMemory();
+    threads = PyList_New((Py_ssize_t) thread_count);
+    if (threads != NULL)
+        table = PyDict_New();
 
     for (i = 0; i < thread_count; ++i) {
-        thread = PyObject_New(kern_ThreadObj, &kern_ThreadType);
-        if (thread == NULL)
-            goto error;
+        /* After a failure the remaining rights are just released */
+        if (table == NULL) {
+            mach_port_deallocate(mach_task_self(), thread_list[i]);
+            continue;
+        }
+
+        key = NULL;
+        thread = kern_task_thread(self, thread_list[i]);
+        if (thread != NULL) {
+            PyList_SET_ITEM(threads, i, (PyObject *) thread);
+            key = PyInt_FromLong((long) thread->port);
+        }
+
+        if (key == NULL || PyDict_SetItem(table, key, (PyObject *) thread) < 0)
+            Py_CLEAR(table);
+        Py_XDECREF(key);
+    }
 
-        thread->port = thread_list[i];
-        thread->arch = _KERN_THREAD_ARCH_UNKNOWN;
-        thread->paused = 0;
+    vm_deallocate(mach_task_self(), (vm_address_t) thread_list,
+                  thread_count * sizeof(*thread_list));
 
-        Py_INCREF(self);
-        thread->task = (PyObject *) self;
-        if (PyList_Append(threads, (PyObject *) thread))
-            return NULL;
-
-        thread = NULL;
+    if (table == NULL) {
+        Py_XDECREF(threads);
+        return PyErr_Occurred() ? NULL : PyErr_NoMemory();
     }
 
+    Py_XDECREF(self->threads);
+    self->threads = table;
+
     return threads;
+}
 
- error:
-    /* Decrement the reference count for previously allocated PyObjects */
-    threads_size = PyList_Size(threads);
-    for (i = 0; i < threads_size; ++i)
-        Py_DECREF(PyList_GetItem(threads, (Py_ssize_t) i));
+/*
+ * Get the task's list of threads. A thread is represented by the same
+ * Thread object for as long as it lives
+ *
+ * Arguments: None
+ * Returns:   List of Thread objects
+ */
+static PyObject *
+kern_Task_getThreads (kern_TaskObj *self)
+{
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    return kern_task_threads(self);
+}
+
+/*
+ * Get every thread's name, run state, CPU usage and times. The thread list
+ * is refreshed, then each thread is queried once with the GIL released;
+ * threads that exit in between are left out
+ *
+ * Arguments: None
+ * Returns:   List of {thread, tid, name, state, cpu_usage, priority,
+ *            user_time, system_time}, as for Thread.info
+ */
+static PyObject *
+kern_Task_threadInfo (kern_TaskObj *self)
+{
+    PyObject *threads, *list = NULL, *dict;
+    kern_thread_info *info;
+    kern_return_t *krs;
+    Py_ssize_t i, n;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if ((threads = kern_task_threads(self)) == NULL)
+        return NULL;
+
+    n = PyList_GET_SIZE(threads);
+    info = malloc((n + 1) * sizeof(*info));
+    krs = malloc((n + 1) * sizeof(*krs));
+    if (info == NULL || krs == NULL) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < n; ++i)
+        krs[i] = kern_thread_get_info((kern_ThreadObj *)
+                                      PyList_GET_ITEM(threads, i), &info[i]);
+    Py_END_ALLOW_THREADS
+
+    if ((list = PyList_New(0)) == NULL)
+        goto out;
+
+    for (i = 0; i < n; ++i) {
+        if (krs[i] != KERN_SUCCESS)
+            continue;
+
+        dict = kern_thread_info_dict((kern_ThreadObj *)
+                                     PyList_GET_ITEM(threads, i), &info[i]);
+        if (dict == NULL || PyList_Append(list, dict) < 0) {
+            Py_XDECREF(dict);
+            Py_CLEAR(list);
+            goto out;
+        }
+        Py_DECREF(dict);
+    }
 
+ out:
+    free(info);
+    free(krs);
     Py_DECREF(threads);
 
-    return PyErr_NoMemory();
+    return list;
 }
 
 /*
@@ -218,39 +468,306 @@ kern_Task_basicInfo (kern_TaskObj *self)
                          info.system_time.microseconds);
 }
 
+/*
+ * Wait up to milliseconds for an exception in the task
+ *
+ * Returns: 1 on event, 0 on timeout, -1 on fail
+ */
+int
+kern_task_wait (kern_TaskObj *self, int milliseconds, kern_exc_event *event)
+{
+    uint64_t start;
+    int ret;
+
+    start = kern_stats_now();
+    ret = kern_excserv_poll(self->exc_port, milliseconds, event);
+    kern_stats_record(&self->stats, _KERN_STAT_EXC_WAIT,
+                      ret > 0 ? event->thread : 0, 0, start,
+                      ret < 0 ? KERN_FAILURE : KERN_SUCCESS);
+
+    /* The exception handler left the thread suspended */
+    if (ret > 0)
+        kern_trace_mark(&self->stats, _KERN_TRACE_STOP, event->thread);
+
+    return ret;
+}
+
+/*
+ * Make poll()'s dictionary for an event from kern_task_wait, taking over
+ * its thread right
+ *
+ * Returns: new reference, or NULL
+ */
+PyObject *
+kern_task_event (kern_TaskObj *self, kern_exc_event *event)
+{
+    kern_return_t kr;
+    kern_ThreadObj *thread = NULL;
+    mach_vm_address_t pc, hit = 0;
+    PyObject *breakpoint = Py_None, *codes;
+
+    thread = kern_task_thread(self, event->thread);
+    if (thread == NULL)
+        return NULL;
+
+    thread->paused = 1;
+
+    /* Rewind past our int3, resume() then steps over it out of line */
+    if (event->type == EXC_BREAKPOINT && self->breakpoints != NULL &&
+        kern_thread_get_pc(thread, &pc) == KERN_SUCCESS &&
+        kern_breakpoint_slot(self, pc - 1)) {
+        kr = kern_thread_set_pc(thread, pc - 1);
+        if (kr != KERN_SUCCESS) {
+            Py_DECREF(thread);
+            KERN_ERROR(kr);
+        }
+
+        kern_trace_mark(&self->stats, _KERN_TRACE_BREAKPOINT, pc - 1);
+
+        hit = pc - 1;
+        breakpoint = PyLong_FromUnsignedLongLong(pc - 1);
+        if (breakpoint == NULL) {
+            Py_DECREF(thread);
+            return NULL;
+        }
+    } else {
+        Py_INCREF(breakpoint);
+    }
+
+    kern_record_event(self, event, thread, hit);
+
+    if (event->ncodes > 1)
+        codes = Py_BuildValue("(LL)", (long long) event->code[0],
+                              (long long) event->code[1]);
+    else if (event->ncodes == 1)
+        codes = Py_BuildValue("(L)", (long long) event->code[0]);
+    else
+        codes = PyTuple_New(0);
+    if (codes == NULL) {
+        Py_DECREF(thread);
+        Py_DECREF(breakpoint);
+        return NULL;
+    }
+
+    return Py_BuildValue("{s:N,s:s,s:N,s:N}", "thread", (PyObject *) thread,
+                         "type", kern_exc_string(event->type),
+                         "breakpoint", breakpoint, "codes", codes);
+}
+
 /*
  * Poll the task for events (e.g. thread exception)
  *
  * Arguments: None
- * Returns:   {type, thread}
+ * Returns:   {type, thread, breakpoint, codes}, breakpoint being the address
+ *            of the breakpoint hit or None, codes the exception's codes
  */
 static PyObject *
 kern_Task_poll (kern_TaskObj *self)
 {
     kern_exc_event event;
-    kern_ThreadObj *thread = NULL;
+    PyObject *result;
+
+    /* Events that arrived while call() waited for its own come first */
+    if (self->pending != NULL && PyList_GET_SIZE(self->pending) > 0) {
+        result = PyList_GET_ITEM(self->pending, 0);
+        Py_INCREF(result);
+        if (PySequence_DelItem(self->pending, 0) < 0) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        return result;
+    }
 
-    if (kern_excserv_poll(self->exc_port, 100, &event) <= 0)
+    if (kern_task_wait(self, 100, &event) <= 0)
         Py_RETURN_NONE;
 
-    thread = PyObject_New(kern_ThreadObj, &kern_ThreadType);
-    if (thread == NULL)
+    return kern_task_event(self, &event);
+}
+
+/*
+ * Stop the whole task in one call, for consistent reads. task_suspend holds
+ * every thread and waits for them to leave user space; threads created while
+ * the task is frozen start out held, so nothing runs until thaw()
+ *
+ * Arguments: None
+ * Returns:   the stop window, from the call until the last thread stopped,
+ *            in ns
+ */
+static PyObject *
+kern_Task_freeze (kern_TaskObj *self)
+{
+    kern_return_t kr;
+    uint64_t start, end;
+
+    if (! self->attached) {
+        PyErr_SetNone(kern_NotAttachedError);
+        return NULL;
+    }
+
+    if (self->frozen) {
+        PyErr_SetNone(kern_AlreadyPausedError);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    start = kern_stats_now();
+    kr = task_suspend(self->port);
+    end = kern_stats_now();
+    Py_END_ALLOW_THREADS
+
+    kern_stats_record(&self->stats, _KERN_STAT_SUSPEND, self->port, 0, start,
+                      kr);
+    CHECK_KR(kr);
+
+    kern_trace_mark(&self->stats, _KERN_TRACE_STOP, self->port);
+
+    self->frozen = 1;
+    self->frozen_at = end;
+
+    return PyLong_FromUnsignedLongLong(end - start);
+}
+
+/*
+ * Let a frozen task run again. Threads paused individually stay paused
+ *
+ * Arguments: None
+ * Returns:   how long the task was frozen, in ns
+ */
+static PyObject *
+kern_Task_thaw (kern_TaskObj *self)
+{
+    kern_return_t kr;
+    uint64_t start;
+
+    if (! self->frozen) {
+        PyErr_SetNone(kern_NotPausedError);
+        return NULL;
+    }
+
+    start = kern_stats_now();
+    kr = task_resume(self->port);
+    kern_stats_record(&self->stats, _KERN_STAT_RESUME, self->port, 0, start,
+                      kr);
+    CHECK_KR(kr);
+
+    kern_trace_mark(&self->stats, _KERN_TRACE_CONTINUE, self->port);
+
+    self->frozen = 0;
+
+    return PyLong_FromUnsignedLongLong(kern_stats_now() - self->frozen_at);
+}
+
+/*
+ * Get the task's operation counters since the last resetStats(). Each
+ * operation (read, write, region, get_state, set_state, suspend, resume,
+ * exc_wait) has call, error and byte counts, total time and a latency
+ * histogram
+ *
+ * Arguments: None
+ * Returns:   {operation: {calls, errors, bytes, ns, histogram}}, histogram
+ *            being a list of (upper bound ns, calls) pairs
+ */
+static PyObject *
+kern_Task_stats (kern_TaskObj *self)
+{
+    return kern_stats_dict(&self->stats);
+}
+
+/*
+ * Zero the task's operation counters
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_Task_resetStats (kern_TaskObj *self)
+{
+    kern_stats_reset(&self->stats);
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Start recording a timeline of the task's debugger operations, discarding
+ * any earlier recording
+ *
+ * Arguments: capacity - events kept; older events are overwritten
+ * Returns:   None
+ */
+static PyObject *
+kern_Task_startTrace (kern_TaskObj *self, PyObject *args, PyObject *kwds)
+{
+    struct kern_trace *trace;
+    unsigned long long capacity = 1 << 16;
+
+    static char *kwlist[] = {"capacity", NULL};
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|K", kwlist, &capacity))
+        return NULL;
+
+    if (capacity == 0) {
+        PyErr_SetString(PyExc_ValueError, "capacity must be positive");
+        return NULL;
+    }
+
+    trace = kern_trace_new(capacity);
+    if (trace == NULL)
         return PyErr_NoMemory();
 
-    thread->port = event.thread;
-    thread->arch = _KERN_THREAD_ARCH_UNKNOWN;
-    thread->paused = 1;
+    /* Threads running without the GIL may be writing the old one */
+    kern_trace_swap(&self->stats, trace);
+    kern_trace_free(self->trace);
+    self->trace = trace;
 
-    Py_INCREF(self);
-    thread->task = (PyObject *) self;
+    Py_RETURN_NONE;
+}
+
+/*
+ * Stop recording. The recording is kept for exportTrace()
+ *
+ * Arguments: None
+ * Returns:   None
+ */
+static PyObject *
+kern_Task_stopTrace (kern_TaskObj *self)
+{
+    kern_trace_swap(&self->stats, NULL);
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Export the recorded timeline in Chrome trace event format, for
+ * chrome://tracing or Perfetto. Times are relative to startTrace()
+ *
+ * Arguments: None
+ * Returns:   JSON string
+ */
+static PyObject *
+kern_Task_exportTrace (kern_TaskObj *self)
+{
+    if (self->trace == NULL) {
+        PyErr_SetString(kern_Error, "no trace recorded");
+        return NULL;
+    }
 
-    return Py_BuildValue("{s:O,s:s}", "thread", (PyObject *) thread,
-                         "type", kern_exc_string(event.type));
+    return kern_trace_export(self->trace, self->pid);
 }
 
 static void
 kern_Task_dealloc (kern_TaskObj* self)
 {
+    kern_recorder_free(self);
+    kern_agent_free(self);
+    kern_syscalls_free(self);
+    kern_hooks_free(self);
+    kern_breakpoints_free(self);
+    kern_scratch_free(self);
+    kern_stats_destroy(&self->stats);
+    kern_trace_free(self->trace);
+    pthread_rwlock_destroy(&self->agent_lock);
+    Py_XDECREF(self->threads);
+    Py_XDECREF(self->pending);
     Py_XDECREF(self->vm);
     self->ob_type->tp_free( (PyObject*) self);
 }
@@ -265,6 +782,20 @@ kern_Task_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
     if (self != NULL) {
         self->pid = 0;
         self->attached = 0;
+        self->frozen = 0;
+        self->ops = &kern_task_mach_ops;
+        self->scratch = NULL;
+        self->trampoline = 0;
+        self->breakpoints = NULL;
+        self->hooks = NULL;
+        self->syscalls = NULL;
+        self->threads = NULL;
+        self->pending = NULL;
+        kern_stats_init(&self->stats);
+        self->trace = NULL;
+        self->agent = NULL;
+        pthread_rwlock_init(&self->agent_lock, NULL);
+        self->recorder = NULL;
 
         Py_INCREF(Py_None);
         self->vm = Py_None;
@@ -290,6 +821,8 @@ static PyMemberDef kern_TaskMembers[] = {
      "Task pid"},
     {"attached", T_BOOL, offsetof(kern_TaskObj, attached), 0,
      "Attachment status"},
+    {"frozen", T_BOOL, offsetof(kern_TaskObj, frozen), READONLY,
+     "Whether the task is frozen"},
     {"vm", T_OBJECT_EX, offsetof(kern_TaskObj, vm), 0,
      "Task virtual memory"},
     {NULL} /* Sentinel */
@@ -304,8 +837,70 @@ static PyMethodDef kern_TaskMethods[] = {
      "Return memory region in the tasks address space"},
     {"getThreads", (PyCFunction)kern_Task_getThreads, METH_NOARGS,
      "Return the task's list of threads" },
+    {"threadInfo", (PyCFunction)kern_Task_threadInfo, METH_NOARGS,
+     "Return the name, run state and CPU usage of every thread"},
     {"basicInfo", (PyCFunction)kern_Task_basicInfo, METH_NOARGS,
      "Return basic information about the task"},
+    {"walkHeap", (PyCFunction)kern_Task_walkHeap, METH_KEYWORDS,
+     "Walk the task's glibc malloc heap"},
+    {"pageHashes", (PyCFunction)kern_Task_pageHashes, METH_KEYWORDS,
+     "Hash each page of the task's memory"},
+    {"regexSearch", (PyCFunction)kern_Task_regexSearch, METH_KEYWORDS,
+     "Search the task's memory for a regular expression"},
+    {"buildIndex", (PyCFunction)kern_Task_buildIndex, METH_KEYWORDS,
+     "Build a trigram index of the task's memory for repeated searches"},
+    {"setBreakpoint", (PyCFunction)kern_Task_setBreakpoint, METH_KEYWORDS,
+     "Set a breakpoint"},
+    {"clearBreakpoint", (PyCFunction)kern_Task_clearBreakpoint,
+     METH_KEYWORDS, "Remove a breakpoint"},
+    {"getBreakpoints", (PyCFunction)kern_Task_getBreakpoints, METH_NOARGS,
+     "Return the task's breakpoints"},
+    {"call", (PyCFunction)kern_Task_call, METH_KEYWORDS,
+     "Call a function in the task"},
+    {"hook", (PyCFunction)kern_Task_hook, METH_KEYWORDS,
+     "Log calls to a function without stopping the task"},
+    {"unhook", (PyCFunction)kern_Task_unhook, METH_KEYWORDS,
+     "Remove a hook"},
+    {"getHooks", (PyCFunction)kern_Task_getHooks, METH_NOARGS,
+     "Return the task's hooks"},
+    {"drainHooks", (PyCFunction)kern_Task_drainHooks, METH_KEYWORDS,
+     "Take the calls logged by hooks"},
+    {"traceSyscall", (PyCFunction)kern_Task_traceSyscall, METH_KEYWORDS,
+     "Log a syscall's calls without stopping the task"},
+    {"untraceSyscall", (PyCFunction)kern_Task_untraceSyscall, METH_KEYWORDS,
+     "Stop tracing a syscall"},
+    {"getSyscalls", (PyCFunction)kern_Task_getSyscalls, METH_NOARGS,
+     "Return the task's traced syscalls"},
+    {"drainSyscalls", (PyCFunction)kern_Task_drainSyscalls, METH_KEYWORDS,
+     "Take the syscalls logged by traceSyscall"},
+    {"snapshot", (PyCFunction)kern_Task_snapshot, METH_KEYWORDS,
+     "Save the task as an ELF core file"},
+    {"loadAgent", (PyCFunction)kern_Task_loadAgent, METH_KEYWORDS,
+     "Load an agent into the task to serve memory requests"},
+    {"unloadAgent", (PyCFunction)kern_Task_unloadAgent, METH_NOARGS,
+     "Stop the task's agent"},
+    {"walkList", (PyCFunction)kern_Task_walkList, METH_KEYWORDS,
+     "Follow a linked list in the task's memory"},
+    {"gather", (PyCFunction)kern_Task_gather, METH_KEYWORDS,
+     "Read the same number of bytes at many addresses"},
+    {"freeze", (PyCFunction)kern_Task_freeze, METH_NOARGS,
+     "Stop every thread of the task"},
+    {"thaw", (PyCFunction)kern_Task_thaw, METH_NOARGS,
+     "Let a frozen task run again"},
+    {"stats", (PyCFunction)kern_Task_stats, METH_NOARGS,
+     "Return the task's operation counters"},
+    {"resetStats", (PyCFunction)kern_Task_resetStats, METH_NOARGS,
+     "Zero the task's operation counters"},
+    {"startTrace", (PyCFunction)kern_Task_startTrace, METH_KEYWORDS,
+     "Start recording a timeline of debugger operations"},
+    {"stopTrace", (PyCFunction)kern_Task_stopTrace, METH_NOARGS,
+     "Stop recording the timeline"},
+    {"exportTrace", (PyCFunction)kern_Task_exportTrace, METH_NOARGS,
+     "Return the timeline as Chrome trace event JSON"},
+    {"record", (PyCFunction)kern_Task_record, METH_KEYWORDS,
+     "Start recording the events poll() delivers"},
+    {"stopRecording", (PyCFunction)kern_Task_stopRecording, METH_NOARGS,
+     "Stop recording events"},
     {NULL} /* Sentinel */
 };
 
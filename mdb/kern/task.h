@@ -27,19 +27,143 @@
 #ifndef _KERN_TASK_H
 #define _KERN_TASK_H
 
+#include <pthread.h>
+
 #include <mach/mach_types.h>
 
 #include "structmember.h"
 
+#include "stats.h"
+#include "exception.h"
+
 extern PyTypeObject kern_TaskType;
 
+typedef struct kern_task_ops kern_task_ops;
+
+struct kern_scratch;
+struct kern_breakpoints;
+struct kern_hooks;
+struct kern_syscalls;
+struct kern_agent;
+struct kern_recorder;
+
 typedef struct {
     PyObject_HEAD
     int pid;
     char attached;
+    char frozen;
+    uint64_t frozen_at;         /* kern_stats_now() at freeze */
     mach_port_t port;
     mach_port_t exc_port;
     PyObject *vm;
+    const kern_task_ops *ops;
+    struct kern_scratch *scratch;
+    mach_vm_address_t trampoline;   /* call()'s, in scratch memory, or 0 */
+    struct kern_breakpoints *breakpoints;
+    struct kern_hooks *hooks;
+    struct kern_syscalls *syscalls; /* traced, or NULL */
+    PyObject *threads;          /* port name -> Thread, as last seen */
+    PyObject *pending;          /* events for poll(), caught by call() */
+    kern_stats stats;
+    struct kern_trace *trace;
+    struct kern_agent *agent;   /* loaded into the task, or NULL */
+    pthread_rwlock_t agent_lock;    /* held to use agent, written to change
+                                       it */
+    struct kern_recorder *recorder; /* of poll()'s events, or NULL */
 } kern_TaskObj;
 
+typedef struct {
+    mach_vm_address_t address;
+    mach_vm_size_t size;
+    vm_region_basic_info_data_64_t info;
+} kern_region;
+
+/*
+ * Backend primitives used by Memory and the native scanners. Live tasks go
+ * through the Mach VM calls; offline backends (e.g. CoreTask) supply their own.
+ * region() finds the first region ending above region->address.
+ */
+struct kern_task_ops {
+    kern_return_t (*read) (kern_TaskObj *task, mach_vm_address_t address,
+                           mach_vm_size_t size, void *buf,
+                           mach_vm_size_t *out_size);
+    kern_return_t (*write) (kern_TaskObj *task, mach_vm_address_t address,
+                            const void *data, mach_vm_size_t size);
+    kern_return_t (*region) (kern_TaskObj *task, kern_region *region);
+    /* Path of the file mapped at address, returns its length or 0 */
+    size_t (*path) (kern_TaskObj *task, mach_vm_address_t address,
+                    char *buf, size_t size);
+    /* Optional: byte offset of [address, address+size) within the task's
+       buffer interface, or -1 if the range isn't directly mapped */
+    Py_ssize_t (*direct) (kern_TaskObj *task, mach_vm_address_t address,
+                          mach_vm_size_t size);
+    /* Optional: set bits from first in present for the resident pages of
+       the page aligned [address, address+size), which lies in one region */
+    kern_return_t (*residency) (kern_TaskObj *task, mach_vm_address_t address,
+                                mach_vm_size_t size, uint8_t *present,
+                                size_t first);
+};
+
+extern const kern_task_ops kern_task_mach_ops;
+
+int kern_task_is64 (kern_TaskObj *task);
+
+int kern_task_wait (kern_TaskObj *self, int milliseconds,
+                    kern_exc_event *event);
+
+PyObject *kern_task_event (kern_TaskObj *self, kern_exc_event *event);
+
+#define kern_task_path(t, a, b, s) ((t)->ops->path((t), (a), (b), (s)))
+
+/* Backend calls, counted in the task's stats */
+
+static inline kern_return_t
+kern_task_read (kern_TaskObj *task, mach_vm_address_t address,
+                mach_vm_size_t size, void *buf, mach_vm_size_t *out_size)
+{
+    uint64_t start = kern_stats_now();
+    kern_return_t kr = task->ops->read(task, address, size, buf, out_size);
+
+    kern_stats_record(&task->stats, _KERN_STAT_READ, address,
+                      kr == KERN_SUCCESS ? *out_size : 0, start, kr);
+    return kr;
+}
+
+static inline kern_return_t
+kern_task_write (kern_TaskObj *task, mach_vm_address_t address,
+                 const void *data, mach_vm_size_t size)
+{
+    uint64_t start = kern_stats_now();
+    kern_return_t kr = task->ops->write(task, address, data, size);
+
+    kern_stats_record(&task->stats, _KERN_STAT_WRITE, address,
+                      kr == KERN_SUCCESS ? size : 0, start, kr);
+    return kr;
+}
+
+static inline kern_return_t
+kern_task_region (kern_TaskObj *task, kern_region *region)
+{
+    uint64_t start = kern_stats_now();
+    kern_return_t kr = task->ops->region(task, region);
+
+    /* Running off the end of the address space isn't an error */
+    kern_stats_record(&task->stats, _KERN_STAT_REGION, region->address, 0,
+                      start, kr == KERN_INVALID_ADDRESS ? KERN_SUCCESS : kr);
+    return kr;
+}
+
+static inline kern_return_t
+kern_task_residency (kern_TaskObj *task, mach_vm_address_t address,
+                     mach_vm_size_t size, uint8_t *present, size_t first)
+{
+    uint64_t start = kern_stats_now();
+    kern_return_t kr = task->ops->residency(task, address, size, present,
+                                            first);
+
+    kern_stats_record(&task->stats, _KERN_STAT_RESIDENCY, address, size,
+                      start, kr);
+    return kr;
+}
+
 #endif
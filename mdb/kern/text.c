@@ -0,0 +1,451 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "util.h"
+#include "kern.h"
+#include "task.h"
+#include "memory.h"
+#include "text.h"
+
+/*
+ * Printable string extraction.
+ *
+ * Bytes are classified sixteen at a time into bitmasks, with SSE2 where
+ * available, and runs of set bits are found with count-trailing-zeros, so
+ * long printable or binary stretches cost one compare per block. UTF-16LE
+ * strings are runs of printable ASCII each followed by a zero byte, at
+ * either byte alignment.
+ */
+
+#define TEXT_BLOCK        16
+
+/* As strings(1): printable ASCII and tab */
+#define TEXT_PRINTABLE(c) (((c) >= 0x20 && (c) < 0x7f) || (c) == '\t')
+
+static inline unsigned
+kern_text_printable (const uint8_t *p)
+{
+#ifdef __SSE2__
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    /* Unsigned range check as signed compares on the biased bytes */
+    __m128i x = _mm_xor_si128(v, _mm_set1_epi8((char) 0x80));
+    __m128i in = _mm_and_si128(
+        _mm_cmpgt_epi8(x, _mm_set1_epi8((char) (0x1f ^ 0x80))),
+        _mm_cmplt_epi8(x, _mm_set1_epi8((char) (0x7f ^ 0x80))));
+
+    in = _mm_or_si128(in, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    return (unsigned) _mm_movemask_epi8(in);
+#else
+    unsigned mask = 0;
+    int i;
+
+    for (i = 0; i < TEXT_BLOCK; ++i)
+        if (TEXT_PRINTABLE(p[i]))
+            mask |= 1U << i;
+    return mask;
+#endif
+}
+
+static inline unsigned
+kern_text_zero (const uint8_t *p)
+{
+#ifdef __SSE2__
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+
+    return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v,
+                                                       _mm_setzero_si128()));
+#else
+    unsigned mask = 0;
+    int i;
+
+    for (i = 0; i < TEXT_BLOCK; ++i)
+        if (p[i] == 0)
+            mask |= 1U << i;
+    return mask;
+#endif
+}
+
+static void
+kern_strings_add (kern_strings *out, size_t offset, size_t length, int wide)
+{
+    kern_string *items;
+
+    if (out->count == out->capacity) {
+        out->capacity = out->capacity ? out->capacity * 2 : 1024;
+        items = realloc(out->items, out->capacity * sizeof(kern_string));
+        if (items == NULL) {
+            out->nomem = 1;
+            return;
+        }
+        out->items = items;
+    }
+
+    out->items[out->count].offset = offset;
+    out->items[out->count].length = length;
+    out->items[out->count].wide = (uint8_t) wide;
+    out->count++;
+}
+
+typedef struct {
+    int in;
+    size_t start;
+    size_t unit;                /* bytes per character */
+    size_t min_length;          /* in characters */
+} kern_text_run;
+
+static void
+kern_text_close (kern_text_run *r, size_t end, kern_strings *out)
+{
+    r->in = 0;
+    if ((end - r->start) / r->unit >= r->min_length)
+        kern_strings_add(out, r->start, (end - r->start) / r->unit * r->unit,
+                         r->unit > 1);
+}
+
+/*
+ * Advance a run over a block at base. bits marks the positions holding a
+ * character, valid the positions considered (one alignment of UTF-16)
+ */
+static inline void
+kern_text_runs (kern_text_run *r, unsigned bits, unsigned valid, size_t base,
+                kern_strings *out)
+{
+    unsigned x;
+    int k;
+
+    for (;;) {
+        x = (r->in ? ~bits : bits) & valid;
+        if (x == 0)
+            return;
+
+        k = __builtin_ctz(x);
+        if (r->in) {
+            kern_text_close(r, base + (size_t) k, out);
+        } else {
+            r->in = 1;
+            r->start = base + (size_t) k;
+        }
+        valid &= ~((2U << k) - 1);
+    }
+}
+
+static int
+kern_string_cmp (const void *a, const void *b)
+{
+    const kern_string *x = a, *y = b;
+
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return (int) x->wide - (int) y->wide;
+}
+
+/*
+ * Find printable strings
+ *
+ * Arguments: data, size - bytes to search
+ *            min_length - shortest string, in characters
+ *            kinds - _KERN_STRINGS_ASCII and/or _KERN_STRINGS_UTF16
+ *            out - receives the strings, sorted by offset
+ */
+void
+kern_strings_find (const uint8_t *data, size_t size, size_t min_length,
+                   int kinds, kern_strings *out)
+{
+    kern_text_run ascii = { 0, 0, 1, min_length };
+    kern_text_run wide[2] = { { 0, 0, 2, min_length },
+                              { 0, 0, 2, min_length } };
+    unsigned p, z, bits, valid;
+    size_t i, j, n;
+    int a;
+
+    if (min_length == 0)
+        ascii.min_length = wide[0].min_length = wide[1].min_length = 1;
+
+    /* The UTF-16 test at i looks at byte i + 1, hence the extra byte */
+    for (i = 0; i + TEXT_BLOCK + 1 <= size; i += TEXT_BLOCK) {
+        p = kern_text_printable(data + i);
+
+        if (kinds & _KERN_STRINGS_ASCII)
+            kern_text_runs(&ascii, p, 0xffff, i, out);
+
+        if (kinds & _KERN_STRINGS_UTF16) {
+            z = kern_text_zero(data + i + 1);
+            bits = p & z;
+            kern_text_runs(&wide[0], bits, 0x5555, i, out);
+            kern_text_runs(&wide[1], bits, 0xaaaa, i, out);
+        }
+    }
+
+    /* Tail, one position at a time */
+    for (; i < size; i += n) {
+        n = size - i < TEXT_BLOCK ? size - i : TEXT_BLOCK;
+        p = z = 0;
+        for (j = 0; j < n; ++j) {
+            if (TEXT_PRINTABLE(data[i + j]))
+                p |= 1U << j;
+            if (i + j + 1 < size && data[i + j + 1] == 0)
+                z |= 1U << j;
+        }
+
+        valid = (1U << n) - 1;
+        if (kinds & _KERN_STRINGS_ASCII)
+            kern_text_runs(&ascii, p, valid, i, out);
+        if (kinds & _KERN_STRINGS_UTF16) {
+            kern_text_runs(&wide[0], p & z, 0x5555 & valid, i, out);
+            kern_text_runs(&wide[1], p & z, 0xaaaa & valid, i, out);
+        }
+    }
+
+    if (ascii.in)
+        kern_text_close(&ascii, size, out);
+    for (a = 0; a < 2; ++a)
+        if (wide[a].in)
+            kern_text_close(&wide[a], size, out);
+
+    if (kinds == (_KERN_STRINGS_ASCII | _KERN_STRINGS_UTF16) && ! out->nomem)
+        qsort(out->items, out->count, sizeof(kern_string), kern_string_cmp);
+}
+
+/*
+ * Find printable strings in the memory. The memory is read once, or not at
+ * all for backends that keep it mapped, and strings are returned as
+ * positions in that buffer
+ *
+ * Arguments: minLength - shortest string in characters, default = 4
+ *            encoding - "ascii", "utf-16" or None for both, default = None
+ *            offset - byte offset from memory start, default = 0
+ *            size - number of bytes, default = self->size
+ *            views - also return a buffer object per string, default = False
+ * Returns:   {data, offset, length, wide[, views]}: data is the buffer read,
+ *            offset, length (in bytes) and wide (1 for UTF-16LE) parallel
+ *            arrays, and views a list of buffers into data
+ */
+PyObject *
+kern_Memory_strings (kern_MemoryObj *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *data, *result = NULL, *views = NULL, *view, *want_views = NULL;
+    kern_strings out;
+    const char *encoding = NULL;
+    const void *buf;
+    Py_ssize_t len;
+    uint64_t offset = 0, size = self->size, *a = NULL, *l = NULL;
+    unsigned int min_length = 4;
+    uint8_t *w = NULL;
+    size_t i;
+    int kinds = _KERN_STRINGS_ASCII | _KERN_STRINGS_UTF16;
+
+    static char *kwlist[] = {"minLength", "encoding", "offset", "size",
+                             "views", NULL};
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|IzKKO", kwlist,
+                                      &min_length, &encoding, &offset, &size,
+                                      &want_views))
+        return NULL;
+
+    if (encoding != NULL) {
+        if (strcmp(encoding, "ascii") == 0) {
+            kinds = _KERN_STRINGS_ASCII;
+        } else if (strcmp(encoding, "utf-16") == 0 ||
+                   strcmp(encoding, "utf-16le") == 0) {
+            kinds = _KERN_STRINGS_UTF16;
+        } else {
+            PyErr_Format(PyExc_ValueError, "unknown encoding '%s'",
+                         encoding);
+            return NULL;
+        }
+    }
+
+    if (offset > self->size)
+        offset = self->size;
+    if (offset + size > self->size)
+        size = self->size - offset;
+
+    data = kern_memory_view(self, offset, size);
+    if (data == NULL)
+        return NULL;
+
+    if (PyObject_AsReadBuffer(data, &buf, &len) < 0) {
+        Py_DECREF(data);
+        return NULL;
+    }
+
+    memset(&out, 0, sizeof(out));
+
+    /* data is immutable and referenced for the duration */
+    Py_BEGIN_ALLOW_THREADS
+    kern_strings_find(buf, (size_t) len, min_length, kinds, &out);
+    Py_END_ALLOW_THREADS
+
+    if (out.nomem) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    a = malloc(out.count * sizeof(uint64_t) + 1);
+    l = malloc(out.count * sizeof(uint64_t) + 1);
+    w = malloc(out.count + 1);
+    if (a == NULL || l == NULL || w == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    for (i = 0; i < out.count; ++i) {
+        a[i] = out.items[i].offset;
+        l[i] = out.items[i].length;
+        w[i] = out.items[i].wide;
+    }
+
+    if (want_views != NULL && PyObject_IsTrue(want_views)) {
+        views = PyList_New((Py_ssize_t) out.count);
+        if (views == NULL)
+            goto done;
+
+        for (i = 0; i < out.count; ++i) {
+            view = PyBuffer_FromObject(data, (Py_ssize_t) a[i],
+                                       (Py_ssize_t) l[i]);
+            if (view == NULL)
+                goto done;
+            PyList_SET_ITEM(views, i, view);
+        }
+    }
+
+    result = Py_BuildValue("{s:O,s:N,s:N,s:N}", "data", data,
+                           "offset", kern_array_new("L", a, out.count * 8),
+                           "length", kern_array_new("L", l, out.count * 8),
+                           "wide", kern_array_new("B", w, out.count));
+    if (result != NULL && views != NULL &&
+        PyDict_SetItemString(result, "views", views) < 0)
+        Py_CLEAR(result);
+
+ done:
+    Py_DECREF(data);
+    Py_XDECREF(views);
+    free(out.items);
+    free(a);
+    free(l);
+    free(w);
+
+    return result;
+}
+
+/* Copy n bytes, replacing anything but printable ASCII with '.' */
+static void
+kern_text_copy (char *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i bias = _mm_set1_epi8((char) 0x80);
+    const __m128i lo = _mm_set1_epi8((char) (0x1f ^ 0x80));
+    const __m128i hi = _mm_set1_epi8((char) (0x7f ^ 0x80));
+    const __m128i dot = _mm_set1_epi8('.');
+    __m128i v, x, in;
+
+    for (; i + TEXT_BLOCK <= n; i += TEXT_BLOCK) {
+        v = _mm_loadu_si128((const __m128i *) (src + i));
+        x = _mm_xor_si128(v, bias);
+        in = _mm_and_si128(_mm_cmpgt_epi8(x, lo), _mm_cmplt_epi8(x, hi));
+        _mm_storeu_si128((__m128i *) (dst + i),
+                         _mm_or_si128(_mm_and_si128(in, v),
+                                      _mm_andnot_si128(in, dot)));
+    }
+#endif
+
+    for (; i < n; ++i)
+        dst[i] = src[i] >= 0x20 && src[i] < 0x7f ? (char) src[i] : '.';
+}
+
+/*
+ * Render the bytes around each offset for display, with anything but
+ * printable ASCII shown as '.'
+ *
+ * Arguments: data - string or buffer
+ *            offsets - sequence of offsets into data
+ *            before - bytes shown before each offset, default = 50
+ *            after - bytes shown from each offset on, default = 50
+ * Returns:   List of strings, one per offset
+ */
+PyObject *
+kern_printable (PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *offsets, *fast, *result, *item;
+    const char *data;
+    int size;
+    unsigned long long off;
+    unsigned int before = 50, after = 50;
+    Py_ssize_t n, i, start, end;
+
+    static char *kwlist[] = {"data", "offsets", "before", "after", NULL};
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "s#O|II", kwlist,
+                                      &data, &size, &offsets, &before,
+                                      &after))
+        return NULL;
+
+    fast = PySequence_Fast(offsets, "offsets must be a sequence");
+    if (fast == NULL)
+        return NULL;
+
+    n = PySequence_Fast_GET_SIZE(fast);
+    result = PyList_New(n);
+    if (result == NULL)
+        goto error;
+
+    for (i = 0; i < n; ++i) {
+        off = PyInt_AsUnsignedLongLongMask(PySequence_Fast_GET_ITEM(fast,
+                                                                     i));
+        if (PyErr_Occurred())
+            goto error;
+
+        start = off > (unsigned long long) size ? size : (Py_ssize_t) off;
+        end = start + (Py_ssize_t) after;
+        start = start > (Py_ssize_t) before ? start - before : 0;
+        if (end > size)
+            end = size;
+
+        item = PyString_FromStringAndSize(NULL, end - start);
+        if (item == NULL)
+            goto error;
+        kern_text_copy(PyString_AS_STRING(item),
+                       (const uint8_t *) data + start, (size_t) (end - start));
+        PyList_SET_ITEM(result, i, item);
+    }
+
+    Py_DECREF(fast);
+    return result;
+
+ error:
+    Py_DECREF(fast);
+    Py_XDECREF(result);
+    return NULL;
+}
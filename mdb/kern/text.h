@@ -0,0 +1,57 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_TEXT_H
+#define _KERN_TEXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "memory.h"
+
+#define _KERN_STRINGS_ASCII  0x1
+#define _KERN_STRINGS_UTF16  0x2
+
+typedef struct {
+    uint64_t offset;
+    uint64_t length;            /* in bytes */
+    uint8_t wide;               /* UTF-16LE */
+} kern_string;
+
+typedef struct {
+    kern_string *items;
+    size_t count, capacity;
+    int nomem;
+} kern_strings;
+
+void kern_strings_find (const uint8_t *data, size_t size, size_t min_length,
+                        int kinds, kern_strings *out);
+
+PyObject *kern_Memory_strings (kern_MemoryObj *self, PyObject *args,
+                               PyObject *kwds);
+PyObject *kern_printable (PyObject *self, PyObject *args, PyObject *kwds);
+
+#endif
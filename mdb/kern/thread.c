@@ -26,6 +26,8 @@
 
 #include <Python.h>
 
+#include <string.h>
+
 #include <mach/mach.h>
 #include <mach/mach_traps.h>
 #include <mach/mach_types.h>
@@ -33,13 +35,20 @@
 #include "util.h"
 #include "kern.h"
 #include "task.h"
+#include "breakpoint.h"
+#include "trace.h"
 #include "thread.h"
 
 
-static int
+#define THREAD_TASK(t) (PyObject_TypeCheck((t)->task, &kern_TaskType) ? \
+                        (kern_TaskObj *) (t)->task : NULL)
+#define THREAD_STATS(t) (THREAD_TASK(t) ? &THREAD_TASK(t)->stats : NULL)
+
+kern_return_t
 kern_thread_state (kern_ThreadObj *self, kern_multi_arch_tstate *multi_state)
 {
     kern_return_t kr;
+    uint64_t start = kern_stats_now();
 
     thread_state_flavor_t flavor;
     mach_msg_type_number_t count;
@@ -75,29 +84,181 @@ kern_thread_state (kern_ThreadObj *self, kern_multi_arch_tstate *multi_state)
         }
     }
 
+    kern_stats_record(THREAD_STATS(self), _KERN_STAT_GET_STATE,
+                      self->port, 0, start, kr);
+
+    return kr;
+}
+
+kern_return_t
+kern_thread_set_state (kern_ThreadObj *self,
+                       kern_multi_arch_tstate *multi_state)
+{
+    kern_return_t kr;
+    uint64_t start = kern_stats_now();
+
+    if (self->arch == _KERN_THREAD_ARCH_X86_64)
+        kr = thread_set_state(self->port, x86_THREAD_STATE64,
+                              (thread_state_t) &(multi_state->state64),
+                              x86_THREAD_STATE64_COUNT);
+    else
+        kr = thread_set_state(self->port, x86_THREAD_STATE32,
+                              (thread_state_t) &(multi_state->state32),
+                              x86_THREAD_STATE32_COUNT);
+
+    kern_stats_record(THREAD_STATS(self), _KERN_STAT_SET_STATE,
+                      self->port, 0, start, kr);
+
     return kr;
 }
 
+kern_return_t
+kern_thread_get_pc (kern_ThreadObj *self, uint64_t *pc)
+{
+    kern_return_t kr;
+    kern_multi_arch_tstate multi_state;
+
+    kr = kern_thread_state(self, &multi_state);
+    if (kr != KERN_SUCCESS)
+        return kr;
+
+    if (self->arch == _KERN_THREAD_ARCH_X86_64)
+        *pc = multi_state.state64.__rip;
+    else
+        *pc = multi_state.state32.__eip;
+
+    return KERN_SUCCESS;
+}
+
+kern_return_t
+kern_thread_set_pc (kern_ThreadObj *self, uint64_t pc)
+{
+    kern_return_t kr;
+    kern_multi_arch_tstate multi_state;
+
+    kr = kern_thread_state(self, &multi_state);
+    if (kr != KERN_SUCCESS)
+        return kr;
+
+    if (self->arch == _KERN_THREAD_ARCH_X86_64)
+        multi_state.state64.__rip = pc;
+    else
+        multi_state.state32.__eip = (unsigned int) pc;
+
+    return kern_thread_set_state(self, &multi_state);
+}
+
 /*
- * Get execution state (e.g. machine registers) for the thread
+ * Create a Thread for a thread port of task
  *
- * Arguments: None
- * Returns:   Dictionary of registers
+ * Arguments: task - the Task the thread belongs to
+ *            port - send right the Thread takes over
+ * Returns:   new reference, or NULL
  */
-static PyObject *
-kern_Thread_getState (kern_ThreadObj *self)
+kern_ThreadObj *
+kern_thread_new (PyObject *task, mach_port_t port)
+{
+    kern_ThreadObj *thread;
+    thread_identifier_info_data_t ident;
+    mach_msg_type_number_t count = THREAD_IDENTIFIER_INFO_COUNT;
+
+    thread = PyObject_New(kern_ThreadObj, &kern_ThreadType);
+    if (thread == NULL)
+        return NULL;
+
+    thread->port = port;
+    thread->arch = _KERN_THREAD_ARCH_UNKNOWN;
+    thread->paused = 0;
+
+    /* The system-wide id outlives our port name for the thread */
+    if (thread_info(port, THREAD_IDENTIFIER_INFO, (thread_info_t) &ident,
+                    &count) == KERN_SUCCESS)
+        thread->tid = ident.thread_id;
+    else
+        thread->tid = 0;
+
+    Py_INCREF(task);
+    thread->task = task;
+
+    return thread;
+}
+
+/*
+ * Get the thread's name, run state, CPU usage and times in one call. Doesn't
+ * need the GIL
+ */
+kern_return_t
+kern_thread_get_info (kern_ThreadObj *self, kern_thread_info *info)
 {
     kern_return_t kr;
-    kern_multi_arch_tstate multi_state;
+    thread_extended_info_data_t ext;
+    mach_msg_type_number_t count = THREAD_EXTENDED_INFO_COUNT;
 
-    kr = kern_thread_state(self, &multi_state);
-    CHECK_KR(kr);
+    kr = thread_info(self->port, THREAD_EXTENDED_INFO, (thread_info_t) &ext,
+                     &count);
+    if (kr != KERN_SUCCESS)
+        return kr;
 
-    /* self->arch is always set by this point */
+    info->state = ext.pth_run_state;
+    info->cpu_usage = ext.pth_cpu_usage;
+    info->priority = ext.pth_curpri;
+    info->user_time = ext.pth_user_time / 1000;
+    info->system_time = ext.pth_system_time / 1000;
+
+    memcpy(info->name, ext.pth_name, sizeof(info->name));
+    info->name[sizeof(info->name) - 1] = '\0';
+
+    return KERN_SUCCESS;
+}
+
+static const char *
+kern_thread_state_name (int state)
+{
+    switch (state) {
+    case TH_STATE_RUNNING:
+        return "running";
+    case TH_STATE_STOPPED:
+        return "stopped";
+    case TH_STATE_WAITING:
+        return "waiting";
+    case TH_STATE_UNINTERRUPTIBLE:
+        return "uninterruptible";
+    case TH_STATE_HALTED:
+        return "halted";
+    default:
+        return "unknown";
+    }
+}
+
+/*
+ * Build the dictionary returned by info and Task.threadInfo
+ */
+PyObject *
+kern_thread_info_dict (kern_ThreadObj *self, kern_thread_info *info)
+{
+    return Py_BuildValue("{s:O,s:K,s:z,s:s,s:d,s:i,s:(K,K),s:(K,K)}",
+                         "thread", (PyObject *) self,
+                         "tid", self->tid,
+                         "name", info->name[0] ? info->name : NULL,
+                         "state", kern_thread_state_name(info->state),
+                         "cpu_usage",
+                         (double) info->cpu_usage / TH_USAGE_SCALE,
+                         "priority", info->priority,
+                         "user_time", info->user_time / 1000000,
+                         info->user_time % 1000000,
+                         "system_time", info->system_time / 1000000,
+                         info->system_time % 1000000);
+}
 
-    if (self->arch == _KERN_THREAD_ARCH_X86_64) {
+/*
+ * Build the register dictionary returned by getState
+ */
+PyObject *
+kern_thread_state_dict (int arch, kern_multi_arch_tstate *multi_state)
+{
+    if (arch == _KERN_THREAD_ARCH_X86_64) {
 
-#define KV(kv) #kv, multi_state.state64.__##kv
+#define KV(kv) #kv, multi_state->state64.__##kv
         return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,"
                              "s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
                              KV(rax), KV(rbx), KV(rcx), KV(rdx), KV(rdi),
@@ -108,7 +269,7 @@ kern_Thread_getState (kern_ThreadObj *self)
 
     } else {
 
-#define KV(kv) #kv, multi_state.state32.__##kv
+#define KV(kv) #kv, multi_state->state32.__##kv
         return Py_BuildValue("{s:I,s:I,s:I,s:I,s:I,s:I,s:I,s:I,s:I,s:I,s:I,s:I,"
                              "s:I,s:I,s:I,s:I}", KV(eax), KV(ebx), KV(ecx),
                              KV(edx), KV(edi), KV(esi), KV(ebp), KV(esp),
@@ -119,6 +280,26 @@ kern_Thread_getState (kern_ThreadObj *self)
     }
 }
 
+/*
+ * Get execution state (e.g. machine registers) for the thread
+ *
+ * Arguments: None
+ * Returns:   Dictionary of registers
+ */
+static PyObject *
+kern_Thread_getState (kern_ThreadObj *self)
+{
+    kern_return_t kr;
+    kern_multi_arch_tstate multi_state;
+
+    kr = kern_thread_state(self, &multi_state);
+    CHECK_KR(kr);
+
+    /* self->arch is always set by this point */
+
+    return kern_thread_state_dict(self->arch, &multi_state);
+}
+
 /*
  * Set execution state (e.g. machine registers) for the thread. Should only be
  * called while the thread is paused
@@ -138,9 +319,6 @@ kern_Thread_setState (kern_ThreadObj *self, PyObject *args, PyObject *kwds)
     unsigned int val32;
     Py_ssize_t pos = 0;
 
-    thread_state_flavor_t flavor;
-    mach_msg_type_number_t count;
-
     static char *kwlist[] = {"state", NULL};
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "O!", kwlist,
@@ -203,18 +381,7 @@ kern_Thread_setState (kern_ThreadObj *self, PyObject *args, PyObject *kwds)
         }
     }
 
-    if (self->arch == _KERN_THREAD_ARCH_X86_64) {
-        flavor = x86_THREAD_STATE64;
-        count = x86_THREAD_STATE64_COUNT;
-        kr = thread_set_state(self->port, flavor,
-                              (thread_state_t) &(multi_state.state64), count);
-    } else {
-        flavor = x86_THREAD_STATE32;
-        count = x86_THREAD_STATE32_COUNT;
-        kr = thread_set_state(self->port, flavor,
-                              (thread_state_t) &(multi_state.state32), count);
-    }
-
+    kr = kern_thread_set_state(self, &multi_state);
     CHECK_KR(kr);
 
     Py_RETURN_NONE;
@@ -232,15 +399,22 @@ static PyObject *
 kern_Thread_pause (kern_ThreadObj *self)
 {
     kern_return_t kr;
+    uint64_t start;
 
     if (self->paused) {
         PyErr_SetNone(kern_AlreadyPausedError);
         return NULL;
     }
 
+    start = kern_stats_now();
     kr = thread_suspend(self->port);
+    kern_stats_record(THREAD_STATS(self), _KERN_STAT_SUSPEND,
+                      self->port, 0, start, kr);
     CHECK_KR(kr);
 
+    if (THREAD_STATS(self))
+        kern_trace_mark(THREAD_STATS(self), _KERN_TRACE_STOP, self->port);
+
     kr = thread_abort_safely(self->port);
     CHECK_KR(kr);
 
@@ -250,7 +424,8 @@ kern_Thread_pause (kern_ThreadObj *self)
 }
 
 /*
- * Resume the thread. May only be called while paused
+ * Resume the thread. May only be called while paused. A thread stopped at a
+ * breakpoint continues through the breakpoint's displaced instruction
  *
  * Arguments: None
  * Returns:   None
@@ -259,23 +434,63 @@ static PyObject *
 kern_Thread_resume (kern_ThreadObj *self)
 {
     kern_return_t kr;
+    mach_vm_address_t pc, slot;
+    uint64_t start;
 
     if (! self->paused) {
         PyErr_SetNone(kern_NotPausedError);
         return NULL;
     }
 
+    if (THREAD_TASK(self) && THREAD_TASK(self)->breakpoints != NULL) {
+        kr = kern_thread_get_pc(self, &pc);
+        CHECK_KR(kr);
+
+        slot = kern_breakpoint_slot((kern_TaskObj *) self->task, pc);
+        if (slot) {
+            kr = kern_thread_set_pc(self, slot);
+            CHECK_KR(kr);
+        }
+    }
+
+    start = kern_stats_now();
     kr = thread_resume(self->port);
+    kern_stats_record(THREAD_STATS(self), _KERN_STAT_RESUME,
+                      self->port, 0, start, kr);
     CHECK_KR(kr);
 
+    if (THREAD_STATS(self))
+        kern_trace_mark(THREAD_STATS(self), _KERN_TRACE_CONTINUE, self->port);
+
     self->paused = 0;
 
     Py_RETURN_NONE;
 }
 
+/*
+ * Get the thread's name, run state, CPU usage and times
+ *
+ * Arguments: None
+ * Returns:   {thread, tid, name, state, cpu_usage, priority, user_time,
+ *             system_time}, name being None if the thread has none
+ */
+static PyObject *
+kern_Thread_info (kern_ThreadObj *self)
+{
+    kern_return_t kr;
+    kern_thread_info info;
+
+    kr = kern_thread_get_info(self, &info);
+    CHECK_KR(kr);
+
+    return kern_thread_info_dict(self, &info);
+}
+
 static void
 kern_Thread_dealloc(kern_ThreadObj *self)
 {
+    if (self->port != MACH_PORT_NULL)
+        mach_port_deallocate(mach_task_self(), self->port);
     Py_XDECREF(self->task);
     self->ob_type->tp_free( (PyObject*) self);
 }
@@ -306,7 +521,7 @@ kern_Thread_init (kern_ThreadObj *self, PyObject *args, PyObject *kwds)
     PyObject *task = NULL, *tmp;
 
     static char *kwlist[] = {"task", NULL};
-    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &kern_TaskType,
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O!", kwlist, &kern_TaskType,
                                       &task))
         return -1;
 
@@ -325,6 +540,8 @@ static PyMemberDef kern_ThreadMembers[] = {
      "Task containing this thread"},
     {"paused", T_BOOL, offsetof(kern_ThreadObj, paused), 0,
      "Pause status"},
+    {"tid", T_ULONGLONG, offsetof(kern_ThreadObj, tid), READONLY,
+     "Thread id"},
     {NULL} /* Sentinel */
 };
 
@@ -337,6 +554,8 @@ static PyMethodDef kern_ThreadMethods[] = {
      "Pause the thread"},
     {"resume", (PyCFunction)kern_Thread_resume, METH_NOARGS,
      "Resume the thread"},
+    {"info", (PyCFunction)kern_Thread_info, METH_NOARGS,
+     "Return the thread's name, run state and CPU usage"},
     {NULL} /* Sentinel */
 };
 
@@ -43,13 +43,43 @@ typedef struct {
     PyObject_HEAD
     PyObject *task;
     mach_port_t port;
+    uint64_t tid;
     int arch;
     char paused;
 } kern_ThreadObj;
 
+/* Scheduler view of a thread, from kern_thread_get_info */
+typedef struct {
+    int state;                  /* TH_STATE_* */
+    int cpu_usage;              /* scaled by TH_USAGE_SCALE */
+    int priority;
+    uint64_t user_time;         /* microseconds */
+    uint64_t system_time;
+    char name[64];
+} kern_thread_info;
+
 typedef struct {
     x86_thread_state64_t state64;
     x86_thread_state32_t state32;
 } kern_multi_arch_tstate;
 
+kern_ThreadObj *kern_thread_new (PyObject *task, mach_port_t port);
+
+kern_return_t kern_thread_get_info (kern_ThreadObj *self,
+                                    kern_thread_info *info);
+
+PyObject *kern_thread_info_dict (kern_ThreadObj *self, kern_thread_info *info);
+
+PyObject *kern_thread_state_dict (int arch, kern_multi_arch_tstate *multi_state);
+
+kern_return_t kern_thread_state (kern_ThreadObj *self,
+                                 kern_multi_arch_tstate *multi_state);
+
+kern_return_t kern_thread_set_state (kern_ThreadObj *self,
+                                     kern_multi_arch_tstate *multi_state);
+
+kern_return_t kern_thread_get_pc (kern_ThreadObj *self, uint64_t *pc);
+
+kern_return_t kern_thread_set_pc (kern_ThreadObj *self, uint64_t pc);
+
 #endif
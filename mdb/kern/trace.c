@@ -0,0 +1,304 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mach/mach.h>
+#include <mach/mach_types.h>
+
+#include "stats.h"
+#include "trace.h"
+
+/*
+ * Timeline of debugger operations, exported as Chrome trace event JSON
+ * (chrome://tracing, Perfetto).
+ *
+ * Events go into a preallocated ring. Writers claim a slot with an atomic
+ * increment, clear seq and publish the event by writing seq last, so
+ * recording never locks or allocates. Export checks seq before and after
+ * copying an event, and skips it if a writer had the slot meanwhile.
+ */
+
+static const char *kern_trace_names[_KERN_TRACE_TYPES] = {
+    "read", "write", "region", "get_state", "set_state", "suspend", "resume",
+    "exc_wait", "residency", "attach", "breakpoint", "stopped", "stopped",
+};
+
+static uint32_t kern_trace_next_tid = 1;
+static __thread uint32_t kern_trace_tid;
+
+struct kern_trace *
+kern_trace_new (uint64_t capacity)
+{
+    struct kern_trace *trace;
+
+    trace = malloc(sizeof(struct kern_trace));
+    if (trace == NULL)
+        return NULL;
+
+    trace->events = calloc((size_t) capacity, sizeof(kern_trace_event));
+    if (trace->events == NULL) {
+        free(trace);
+        return NULL;
+    }
+
+    trace->capacity = capacity;
+    trace->next = 0;
+    trace->origin = kern_stats_now();
+
+    return trace;
+}
+
+void
+kern_trace_free (struct kern_trace *trace)
+{
+    if (trace == NULL)
+        return;
+
+    free(trace->events);
+    free(trace);
+}
+
+void
+kern_trace_record (struct kern_trace *trace, int type, uint64_t arg,
+                   uint64_t bytes, uint64_t start, uint64_t end,
+                   kern_return_t kr)
+{
+    kern_trace_event *event;
+    uint64_t index;
+
+    if (kern_trace_tid == 0)
+        kern_trace_tid = __sync_fetch_and_add(&kern_trace_next_tid, 1);
+
+    index = __sync_fetch_and_add(&trace->next, 1);
+    event = &trace->events[index % trace->capacity];
+
+    event->seq = 0;
+    __sync_synchronize();
+
+    event->ts = start;
+    event->dur = end - start;
+    event->arg = arg;
+    event->bytes = bytes;
+    event->tid = kern_trace_tid;
+    event->type = (uint16_t) type;
+    event->error = kr != KERN_SUCCESS;
+
+    __sync_synchronize();
+    event->seq = index + 1;
+}
+
+/*
+ * Record an event in stats' trace, if it has one. Sampler and worker
+ * threads record without the GIL, so the trace can be swapped under them:
+ * a writer announces itself in the counter of the current epoch's parity
+ * before it loads the trace, and backs off if the epoch moved meanwhile
+ */
+void
+kern_trace_emit (kern_stats *stats, int type, uint64_t arg, uint64_t bytes,
+                 uint64_t start, uint64_t end, kern_return_t kr)
+{
+    struct kern_trace *trace;
+    uint64_t parity;
+
+    if (stats->trace == NULL)
+        return;
+
+    for (;;) {
+        parity = stats->trace_epoch & 1;
+        __sync_fetch_and_add(&stats->trace_writers[parity], 1);
+        if ((stats->trace_epoch & 1) == parity)
+            break;
+        __sync_fetch_and_sub(&stats->trace_writers[parity], 1);
+    }
+
+    trace = *(struct kern_trace * volatile *) &stats->trace;
+    if (trace != NULL)
+        kern_trace_record(trace, type, arg, bytes, start, end, kr);
+
+    __sync_fetch_and_sub(&stats->trace_writers[parity], 1);
+}
+
+/*
+ * Make trace (or NULL) stats' trace. On return no thread is writing the
+ * old one, which the caller may free. Writers arriving meanwhile count
+ * against the new epoch, so a busy sampler can't hold this up
+ */
+void
+kern_trace_swap (kern_stats *stats, struct kern_trace *trace)
+{
+    uint64_t parity;
+
+    (void) __sync_lock_test_and_set(&stats->trace, trace);
+    __sync_synchronize();
+
+    parity = stats->trace_epoch & 1;
+    __sync_fetch_and_add(&stats->trace_epoch, 1);
+
+    while (stats->trace_writers[parity] != 0)
+        sched_yield();
+}
+
+/* Record an instant event, if the task is tracing */
+void
+kern_trace_mark (kern_stats *stats, int type, uint64_t arg)
+{
+    uint64_t now;
+
+    if (stats->trace == NULL)
+        return;
+
+    now = kern_stats_now();
+    kern_trace_emit(stats, type, arg, 0, now, now, KERN_SUCCESS);
+}
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} kern_trace_buf;
+
+static int
+kern_trace_printf (kern_trace_buf *buf, const char *format, ...)
+{
+    va_list ap;
+    char *data;
+    int len;
+
+    for (;;) {
+        va_start(ap, format);
+        len = vsnprintf(buf->data + buf->size, buf->capacity - buf->size,
+                        format, ap);
+        va_end(ap);
+
+        if (len < 0)
+            return -1;
+        if (buf->size + (size_t) len < buf->capacity)
+            break;
+
+        data = realloc(buf->data, buf->capacity * 2 + (size_t) len);
+        if (data == NULL)
+            return -1;
+        buf->data = data;
+        buf->capacity = buf->capacity * 2 + (size_t) len;
+    }
+
+    buf->size += (size_t) len;
+    return 0;
+}
+
+/*
+ * Chrome trace events for whatever is in the ring. Operations are complete
+ * ("X") events on the debugger thread that made them; target threads'
+ * stopped windows are async ("b"/"e") spans keyed by thread port
+ */
+PyObject *
+kern_trace_export (struct kern_trace *trace, int pid)
+{
+    kern_trace_buf buf;
+    kern_trace_event event, *slot;
+    PyObject *result;
+    uint64_t first, last, i;
+    const char *sep = "";
+    int ret = 0;
+
+    buf.capacity = 1 << 16;
+    buf.size = 0;
+    buf.data = malloc(buf.capacity);
+    if (buf.data == NULL)
+        return PyErr_NoMemory();
+
+    last = trace->next;
+    first = last > trace->capacity ? last - trace->capacity : 0;
+
+    ret |= kern_trace_printf(&buf, "{\"displayTimeUnit\": \"ns\", "
+                             "\"traceEvents\": [\n");
+
+    for (i = first; i < last && ret == 0; ++i) {
+        slot = &trace->events[i % trace->capacity];
+
+        /* A writer that claimed the slot during the copy changed seq */
+        if (slot->seq != i + 1)
+            continue;
+        __sync_synchronize();
+        event = *slot;
+        __sync_synchronize();
+        if (*(volatile uint64_t *) &slot->seq != i + 1 ||
+            event.ts < trace->origin)
+            continue;
+
+        ret |= kern_trace_printf(&buf, "%s{\"name\": \"%s\", \"pid\": %d, "
+                                 "\"tid\": %u, \"ts\": %.3f", sep,
+                                 kern_trace_names[event.type], pid,
+                                 event.tid,
+                                 (event.ts - trace->origin) / 1000.0);
+        sep = ",\n";
+
+        switch (event.type) {
+        case _KERN_TRACE_BREAKPOINT:
+            ret |= kern_trace_printf(&buf, ", \"ph\": \"i\", \"s\": \"p\", "
+                                     "\"args\": {\"address\": \"0x%llx\"}}",
+                                     (unsigned long long) event.arg);
+            break;
+        case _KERN_TRACE_STOP:
+        case _KERN_TRACE_CONTINUE:
+            ret |= kern_trace_printf(&buf, ", \"ph\": \"%s\", "
+                                     "\"cat\": \"target\", \"id\": %llu}",
+                                     event.type == _KERN_TRACE_STOP ?
+                                     "b" : "e",
+                                     (unsigned long long) event.arg);
+            break;
+        default:
+            ret |= kern_trace_printf(&buf, ", \"ph\": \"X\", "
+                                     "\"dur\": %.3f, \"args\": {\"arg\": "
+                                     "\"0x%llx\", \"bytes\": %llu, "
+                                     "\"error\": %d}}",
+                                     event.dur / 1000.0,
+                                     (unsigned long long) event.arg,
+                                     (unsigned long long) event.bytes,
+                                     event.error);
+            break;
+        }
+    }
+
+    ret |= kern_trace_printf(&buf, "\n]}\n");
+
+    if (ret != 0) {
+        free(buf.data);
+        return PyErr_NoMemory();
+    }
+
+    result = PyString_FromStringAndSize(buf.data, (Py_ssize_t) buf.size);
+    free(buf.data);
+
+    return result;
+}
@@ -0,0 +1,79 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_TRACE_H
+#define _KERN_TRACE_H
+
+#include <stdint.h>
+
+#include <mach/mach_types.h>
+
+#include "stats.h"
+
+/* Trace-only event types, following the _KERN_STAT_* operations */
+#define _KERN_TRACE_ATTACH       (_KERN_STAT_OPS + 0)
+#define _KERN_TRACE_BREAKPOINT   (_KERN_STAT_OPS + 1)
+#define _KERN_TRACE_STOP         (_KERN_STAT_OPS + 2)
+#define _KERN_TRACE_CONTINUE     (_KERN_STAT_OPS + 3)
+#define _KERN_TRACE_TYPES        (_KERN_STAT_OPS + 4)
+
+typedef struct {
+    uint64_t seq;       /* index + 1 once the event is complete */
+    uint64_t ts;
+    uint64_t dur;
+    uint64_t arg;       /* address, or target thread port */
+    uint64_t bytes;
+    uint32_t tid;       /* debugger thread */
+    uint16_t type;
+    uint16_t error;
+} kern_trace_event;
+
+/* Fixed size ring; the oldest events are overwritten */
+struct kern_trace {
+    kern_trace_event *events;
+    uint64_t capacity;
+    uint64_t next;
+    uint64_t origin;
+};
+
+struct kern_trace *kern_trace_new (uint64_t capacity);
+void kern_trace_free (struct kern_trace *trace);
+
+void kern_trace_record (struct kern_trace *trace, int type, uint64_t arg,
+                        uint64_t bytes, uint64_t start, uint64_t end,
+                        kern_return_t kr);
+
+void kern_trace_emit (kern_stats *stats, int type, uint64_t arg,
+                      uint64_t bytes, uint64_t start, uint64_t end,
+                      kern_return_t kr);
+
+void kern_trace_swap (kern_stats *stats, struct kern_trace *trace);
+
+void kern_trace_mark (kern_stats *stats, int type, uint64_t arg);
+
+PyObject *kern_trace_export (struct kern_trace *trace, int pid);
+
+#endif
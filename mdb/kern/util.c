@@ -196,3 +196,34 @@ kern_handle_kr(kern_return_t kr)
 
     PyErr_SetString(kern_KernelError, msg);
 }
+
+/*
+ * Build an array.array of the given typecode from raw native-endian data
+ */
+PyObject *
+kern_array_new(const char *typecode, const void *data, size_t size)
+{
+    static PyObject *array_type = NULL;
+    PyObject *module, *bytes, *array;
+
+    if (array_type == NULL) {
+        module = PyImport_ImportModule("array");
+        if (module == NULL)
+            return NULL;
+
+        array_type = PyObject_GetAttrString(module, "array");
+        Py_DECREF(module);
+        if (array_type == NULL)
+            return NULL;
+    }
+
+    bytes = PyString_FromStringAndSize((const char *) data,
+                                       (Py_ssize_t) size);
+    if (bytes == NULL)
+        return NULL;
+
+    array = PyObject_CallFunction(array_type, "sO", typecode, bytes);
+    Py_DECREF(bytes);
+
+    return array;
+}
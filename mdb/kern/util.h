@@ -31,6 +31,8 @@
 
 void kern_handle_kr(kern_return_t kr);
 
+PyObject *kern_array_new(const char *typecode, const void *data, size_t size);
+
 #define KERN_ERROR(kr) do { kern_handle_kr(kr); \
         return NULL; } while (0)
 
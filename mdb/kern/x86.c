@@ -0,0 +1,518 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "x86.h"
+
+/*
+ * x86 and x86-64 instruction length decoding, and relocation of single
+ * instructions so they can run from somewhere else in the address space.
+ *
+ * Only as much of the encoding is decoded as is needed to find the length,
+ * the ModRM displacement and immediates, and whether the instruction's
+ * behaviour depends on where it runs (relative branches, rip-relative
+ * operands, calls).
+ */
+
+#define M  0x01     /* ModRM */
+#define B  0x02     /* imm8 */
+#define Z  0x04     /* imm16/32 by operand size */
+#define W  0x08     /* imm16 */
+#define r  0x10     /* rel8 */
+#define R  0x20     /* rel16/32 */
+#define S  0x40     /* special cased in kern_x86_decode */
+
+static const uint8_t kern_x86_one[256] = {
+    /* 0_ */ M, M, M, M, B, Z, 0, 0, M, M, M, M, B, Z, 0, 0,
+    /* 1_ */ M, M, M, M, B, Z, 0, 0, M, M, M, M, B, Z, 0, 0,
+    /* 2_ */ M, M, M, M, B, Z, 0, 0, M, M, M, M, B, Z, 0, 0,
+    /* 3_ */ M, M, M, M, B, Z, 0, 0, M, M, M, M, B, Z, 0, 0,
+    /* 4_ */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 5_ */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 6_ */ 0, 0, M, M, 0, 0, 0, 0, Z, M|Z, B, M|B, 0, 0, 0, 0,
+    /* 7_ */ r, r, r, r, r, r, r, r, r, r, r, r, r, r, r, r,
+    /* 8_ */ M|B, M|Z, M|B, M|B, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 9_ */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, S, 0, 0, 0, 0, 0,
+    /* A_ */ S, S, S, S, 0, 0, 0, 0, B, Z, 0, 0, 0, 0, 0, 0,
+    /* B_ */ B, B, B, B, B, B, B, B, S, S, S, S, S, S, S, S,
+    /* C_ */ M|B, M|B, W, 0, M, M, M|B, M|Z, S, 0, W, 0, 0, B, 0, 0,
+    /* D_ */ M, M, M, M, B, B, 0, 0, M, M, M, M, M, M, M, M,
+    /* E_ */ r, r, r, r, B, B, B, B, R, R, S, r, 0, 0, 0, 0,
+    /* F_ */ 0, 0, 0, 0, 0, 0, M|S, M|S, 0, 0, 0, 0, 0, 0, M, M,
+};
+
+static const uint8_t kern_x86_two[256] = {
+    /* 0_ */ M, M, M, M, 0, 0, 0, 0, 0, 0, 0, 0, 0, M, 0, M|B,
+    /* 1_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 2_ */ M, M, M, M, 0, 0, 0, 0, M, M, M, M, M, M, M, M,
+    /* 3_ */ 0, 0, 0, 0, 0, 0, 0, 0, S, 0, S, 0, 0, 0, 0, 0,
+    /* 4_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 5_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 6_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 7_ */ M|B, M|B, M|B, M|B, M, M, M, 0, M, M, M, M, M, M, M, M,
+    /* 8_ */ R, R, R, R, R, R, R, R, R, R, R, R, R, R, R, R,
+    /* 9_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* A_ */ 0, 0, 0, M, M|B, M, 0, 0, 0, 0, 0, M, M|B, M, M, M,
+    /* B_ */ M, M, M, M, M, M, M, M, M, M, M|B, M, M, M, M, M,
+    /* C_ */ M, M, M|B, M, M|B, M|B, M|B, M, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* D_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* E_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* F_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+};
+
+#undef M
+#undef B
+#undef Z
+#undef W
+#undef r
+#undef R
+#undef S
+
+static int64_t
+kern_x86_signed (const uint8_t *p, int size)
+{
+    int8_t v8;
+    int16_t v16;
+    int32_t v32;
+
+    switch (size) {
+    case 1:
+        memcpy(&v8, p, 1);
+        return v8;
+    case 2:
+        memcpy(&v16, p, 2);
+        return v16;
+    default:
+        memcpy(&v32, p, 4);
+        return v32;
+    }
+}
+
+/*
+ * Decode the instruction at code. Returns its length, or -1 if it's
+ * truncated or can't be decoded
+ */
+int
+kern_x86_decode (const uint8_t *code, size_t size, int mode64,
+                 kern_x86_insn *insn)
+{
+    size_t i = 0;
+    int opsize16 = 0, addrsize = mode64 ? 64 : 32, rexw = 0, vex = 0;
+    int imm = 0, rel = 0, reg;
+    uint8_t op, flags = 0, modrm, mod, rm, sib;
+
+    memset(insn, 0, sizeof(kern_x86_insn));
+
+    if (size > _KERN_X86_MAX_LENGTH)
+        size = _KERN_X86_MAX_LENGTH;
+
+#define NEED(n) do { if (i + (n) > size) return -1; } while (0)
+
+    /* Legacy prefixes, any order */
+    for (;; ++i) {
+        NEED(1);
+        switch (code[i]) {
+        case 0x66:
+            opsize16 = 1;
+            continue;
+        case 0x67:
+            addrsize = mode64 ? 32 : 16;
+            continue;
+        case 0x26: case 0x2e: case 0x36: case 0x3e: case 0x64: case 0x65:
+        case 0xf0: case 0xf2: case 0xf3:
+            continue;
+        }
+        break;
+    }
+
+    if (mode64 && (code[i] & 0xf0) == 0x40) {
+        insn->rex = code[i];
+        rexw = code[i] & 0x08;
+        ++i;
+        NEED(1);
+    }
+
+    op = code[i];
+
+    /*
+     * VEX (c4, c5), EVEX (62) and XOP (8f). Outside 64-bit mode c4, c5 and
+     * 62 are only prefixes when the next byte has mod == 3
+     */
+    if (op == 0xc4 || op == 0xc5 || op == 0x62 || op == 0x8f) {
+        NEED(2);
+        if (op == 0x8f)
+            vex = (code[i + 1] & 0x1f) >= 8;
+        else
+            vex = mode64 || (code[i + 1] & 0xc0) == 0xc0;
+    }
+
+    if (vex) {
+        switch (op) {
+        case 0xc5:
+            insn->map = 1;
+            i += 2;
+            break;
+        case 0xc4:
+            NEED(3);
+            insn->map = code[i + 1] & 0x1f;
+            rexw = code[i + 2] & 0x80;
+            i += 3;
+            break;
+        case 0x62:
+            NEED(4);
+            insn->map = code[i + 1] & 0x07;
+            rexw = code[i + 2] & 0x80;
+            i += 4;
+            break;
+        default:
+            NEED(3);
+            insn->map = code[i + 1] & 0x1f;
+            rexw = code[i + 2] & 0x80;
+            i += 3;
+            break;
+        }
+
+        NEED(1);
+        insn->opcode = (uint8_t) i;
+        op = code[i++];
+
+        /* vzeroupper and vzeroall are the only ones without ModRM */
+        flags = (insn->map == 1 && op == 0x77) ? 0 : 0x01;
+        if (insn->map == 3 || insn->map == 8 ||
+            (insn->map == 1 && (kern_x86_two[op] & 0x02)))
+            imm = 1;
+        else if (insn->map == 10)
+            imm = 4;
+    } else if (op == 0x0f) {
+        NEED(2);
+        switch (code[i + 1]) {
+        case 0x38:
+            NEED(3);
+            insn->map = 2;
+            insn->opcode = (uint8_t) (i + 2);
+            op = code[i + 2];
+            flags = 0x01;
+            i += 3;
+            break;
+        case 0x3a:
+            NEED(3);
+            insn->map = 3;
+            insn->opcode = (uint8_t) (i + 2);
+            op = code[i + 2];
+            flags = 0x01;
+            imm = 1;
+            i += 3;
+            break;
+        default:
+            insn->map = 1;
+            insn->opcode = (uint8_t) (i + 1);
+            op = code[i + 1];
+            flags = kern_x86_two[op];
+            i += 2;
+            break;
+        }
+    } else {
+        insn->opcode = (uint8_t) i;
+        flags = kern_x86_one[op];
+        ++i;
+    }
+
+    if (flags & 0x02)
+        imm = 1;
+    if (flags & 0x04)
+        imm = opsize16 ? 2 : 4;
+    if (flags & 0x08)
+        imm = 2;
+    if (flags & 0x10)
+        rel = 1;
+    if (flags & 0x20)
+        rel = (! mode64 && opsize16) ? 2 : 4;
+
+    if (flags & 0x01) {
+        NEED(1);
+        insn->modrm = (uint8_t) i;
+        modrm = code[i++];
+        mod = modrm >> 6;
+        rm = modrm & 7;
+
+        if (mod != 3 && addrsize == 16) {
+            if (mod == 1)
+                insn->disp_size = 1;
+            else if (mod == 2 || (mod == 0 && rm == 6))
+                insn->disp_size = 2;
+        } else if (mod != 3) {
+            if (rm == 4) {
+                NEED(1);
+                sib = code[i++];
+                if (mod == 0 && (sib & 7) == 5)
+                    insn->disp_size = 4;
+            } else if (mod == 0 && rm == 5) {
+                insn->disp_size = 4;
+                insn->rip_relative = (uint8_t) mode64;
+            }
+
+            if (mod == 1)
+                insn->disp_size = 1;
+            else if (mod == 2)
+                insn->disp_size = 4;
+        }
+
+        if (insn->disp_size) {
+            insn->disp = (uint8_t) i;
+            i += insn->disp_size;
+        }
+    }
+
+    if (! vex && insn->map == 0 && (flags & 0x40)) {
+        reg = (code[insn->modrm] >> 3) & 7;
+
+        switch (op) {
+        case 0xf6:
+            imm = reg < 2 ? 1 : 0;
+            break;
+        case 0xf7:
+            imm = reg < 2 ? (opsize16 ? 2 : 4) : 0;
+            break;
+        case 0xa0: case 0xa1: case 0xa2: case 0xa3:
+            /* mov moffs, an absolute address */
+            imm = addrsize / 8;
+            break;
+        case 0xc8:
+            imm = 3;
+            break;
+        case 0x9a: case 0xea:
+            if (mode64)
+                return -1;
+            imm = (opsize16 ? 2 : 4) + 2;
+            insn->branch = _KERN_X86_BRANCH_FIXED;
+            break;
+        default:
+            /* b8-bf, mov r, imm */
+            imm = rexw ? 8 : (opsize16 ? 2 : 4);
+            break;
+        }
+    }
+
+    if (imm || rel) {
+        insn->imm = (uint8_t) i;
+        insn->imm_size = (uint8_t) (imm + rel);
+        i += insn->imm_size;
+    }
+
+    NEED(0);
+    if (i > _KERN_X86_MAX_LENGTH)
+        return -1;
+#undef NEED
+
+    insn->length = (uint8_t) i;
+
+    if (vex)
+        return (int) i;
+
+    if (rel) {
+        insn->rel = kern_x86_signed(code + insn->imm, rel);
+
+        if (insn->map == 1 || (op >= 0x70 && op <= 0x7f) ||
+            (op >= 0xe0 && op <= 0xe3))
+            insn->branch = _KERN_X86_BRANCH_JCC;
+        else if (op == 0xe8)
+            insn->branch = _KERN_X86_BRANCH_CALL;
+        else
+            insn->branch = _KERN_X86_BRANCH_JMP;
+    } else if (insn->map == 0) {
+        reg = insn->modrm ? (code[insn->modrm] >> 3) & 7 : 0;
+
+        if (op == 0xcc || op == 0xf1 || op == 0xce)
+            insn->branch = _KERN_X86_BRANCH_FIXED;
+        else if (op == 0xff && reg == 2)
+            insn->branch = _KERN_X86_BRANCH_CALL_RM;
+        else if (op == 0xff && reg == 3)
+            insn->branch = _KERN_X86_BRANCH_FIXED;
+        else if (op == 0xc7 && code[insn->modrm] == 0xf8)
+            /* xbegin, the abort handler is relative */
+            insn->branch = _KERN_X86_BRANCH_FIXED;
+    }
+
+    return (int) i;
+}
+
+static int
+kern_x86_emit_jmp (uint8_t *out, int mode64, uint64_t at, uint64_t target)
+{
+    uint32_t rel;
+
+    /* jmp [rip+0] followed by the target, reaches anywhere */
+    if (mode64) {
+        out[0] = 0xff;
+        out[1] = 0x25;
+        memset(out + 2, 0, 4);
+        memcpy(out + 6, &target, 8);
+        return 14;
+    }
+
+    rel = (uint32_t) (target - (at + 5));
+    out[0] = 0xe9;
+    memcpy(out + 1, &rel, 4);
+    return 5;
+}
+
+/* Push a return address without touching any register */
+static int
+kern_x86_emit_push (uint8_t *out, int mode64, uint64_t value)
+{
+    uint32_t lo = (uint32_t) value, hi = (uint32_t) (value >> 32);
+
+    out[0] = 0x68;
+    memcpy(out + 1, &lo, 4);
+
+    if (! mode64)
+        return 5;
+
+    /* push sign-extends, so set the high half: mov dword [rsp+4], hi */
+    out[5] = 0xc7;
+    out[6] = 0x44;
+    out[7] = 0x24;
+    out[8] = 0x04;
+    memcpy(out + 9, &hi, 4);
+    return 13;
+}
+
+/* Copy the instruction to out, now running at to */
+static int
+kern_x86_emit_copy (uint8_t *out, const uint8_t *code,
+                    const kern_x86_insn *insn, uint64_t from, uint64_t to)
+{
+    int64_t disp;
+    int32_t disp32;
+
+    memcpy(out, code, insn->length);
+
+    if (insn->rip_relative) {
+        disp = kern_x86_signed(code + insn->disp, 4) +
+               (int64_t) (from - to);
+        if (disp < INT32_MIN || disp > INT32_MAX)
+            return -1;
+
+        disp32 = (int32_t) disp;
+        memcpy(out + insn->disp, &disp32, 4);
+    }
+
+    return insn->length;
+}
+
+/*
+ * Rewrite the instruction at from to run at to and then continue at the
+ * instruction after from, as if it had run in place. rip-relative operands
+ * must stay within 2GB of to.
+ *
+ * Returns the number of bytes written to out (at most
+ * _KERN_X86_RELOCATED_MAX), or -1 if the instruction can't be relocated
+ */
+int
+kern_x86_relocate (const uint8_t *code, const kern_x86_insn *insn,
+                   int mode64, uint64_t from, uint64_t to, uint8_t *out)
+{
+    uint64_t next = from + insn->length, target = next + insn->rel;
+    uint8_t modrm, sib;
+    int n = 0, k, skip;
+
+    if (! mode64) {
+        next = (uint32_t) next;
+        target = (uint32_t) target;
+    }
+
+    switch (insn->branch) {
+    case _KERN_X86_BRANCH_NONE:
+        n = kern_x86_emit_copy(out, code, insn, next, to + insn->length);
+        if (n < 0)
+            return -1;
+        n += kern_x86_emit_jmp(out + n, mode64, to + n, next);
+        break;
+
+    case _KERN_X86_BRANCH_JMP:
+        n = kern_x86_emit_jmp(out, mode64, to, target);
+        break;
+
+    case _KERN_X86_BRANCH_JCC:
+        /*
+         * jcc taken
+         * jmp short not_taken
+         * taken: jmp target
+         * not_taken: jmp next
+         */
+        if (insn->map == 1) {
+            out[n++] = (uint8_t) (0x70 | (code[insn->opcode] & 0x0f));
+        } else {
+            /* Keep 67, it picks cx/ecx/rcx for loop and jcxz */
+            for (k = 0; k <= insn->opcode; ++k)
+                out[n++] = code[k];
+        }
+        skip = mode64 ? 14 : 5;
+        out[n++] = 0x02;
+        out[n++] = 0xeb;
+        out[n++] = (uint8_t) skip;
+        n += kern_x86_emit_jmp(out + n, mode64, to + n, target);
+        n += kern_x86_emit_jmp(out + n, mode64, to + n, next);
+        break;
+
+    case _KERN_X86_BRANCH_CALL:
+        n = kern_x86_emit_push(out, mode64, next);
+        n += kern_x86_emit_jmp(out + n, mode64, to + n, target);
+        break;
+
+    case _KERN_X86_BRANCH_CALL_RM:
+        /*
+         * Push the real return address then jmp through the same operand.
+         * Operands based on the stack pointer would see the push
+         */
+        modrm = code[insn->modrm];
+        if ((modrm & 7) == 4 && ! (insn->rex & 0x01)) {
+            if ((modrm >> 6) == 3)
+                return -1;
+            sib = code[insn->modrm + 1];
+            if ((sib & 7) == 4)
+                return -1;
+        }
+        for (k = 0; k < insn->opcode; ++k)
+            if (code[k] == 0x66)
+                return -1;
+
+        n = kern_x86_emit_push(out, mode64, next);
+        k = kern_x86_emit_copy(out + n, code, insn, next,
+                               to + n + insn->length);
+        if (k < 0)
+            return -1;
+        out[n + insn->modrm] = (uint8_t) ((modrm & ~0x38) | 0x20);
+        n += k;
+        break;
+
+    default:
+        return -1;
+    }
+
+    return n;
+}
@@ -0,0 +1,66 @@
+/*-
+ * Copyright (c) 2011 Peter Le Bek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_X86_H
+#define _KERN_X86_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define _KERN_X86_MAX_LENGTH      15
+#define _KERN_X86_RELOCATED_MAX   64
+
+/* Control flow classes the relocator has to rewrite */
+#define _KERN_X86_BRANCH_NONE      0
+#define _KERN_X86_BRANCH_JMP       1   /* jmp rel */
+#define _KERN_X86_BRANCH_JCC       2   /* jcc, loop, jcxz rel */
+#define _KERN_X86_BRANCH_CALL      3   /* call rel */
+#define _KERN_X86_BRANCH_CALL_RM   4   /* call r/m */
+#define _KERN_X86_BRANCH_FIXED     5   /* can't run elsewhere, e.g. int3 */
+
+/* Offsets are from the start of the instruction, 0 meaning absent */
+typedef struct {
+    uint8_t length;
+    uint8_t opcode;
+    uint8_t map;        /* 0: one byte, 1: 0f, 2: 0f38, 3: 0f3a */
+    uint8_t modrm;
+    uint8_t disp;
+    uint8_t disp_size;
+    uint8_t imm;
+    uint8_t imm_size;
+    uint8_t rex;
+    uint8_t rip_relative;
+    uint8_t branch;
+    int64_t rel;        /* branch displacement from the next instruction */
+} kern_x86_insn;
+
+int kern_x86_decode (const uint8_t *code, size_t size, int mode64,
+                     kern_x86_insn *insn);
+
+int kern_x86_relocate (const uint8_t *code, const kern_x86_insn *insn,
+                       int mode64, uint64_t from, uint64_t to, uint8_t *out);
+
+#endif
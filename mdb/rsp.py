@@ -0,0 +1,749 @@
+# Copyright (c) 2011 Peter Le Bek
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+"""GDB remote serial protocol server for an attached Task, so gdb or lldb
+can share a task with mdb scripts instead of attaching themselves.
+
+    from mdb.rsp import RSPServer
+    RSPServer(task, ("127.0.0.1", 1234)).serve()
+
+then "target extended-remote :1234" in gdb or "gdb-remote 1234" in lldb.
+64-bit tasks only.
+"""
+
+import os
+import select
+import socket
+import struct
+
+from mdb.kern import Error
+
+
+PACKET_SIZE = 0x20000
+
+# amd64 as gdb numbers it; registers Thread.getState() lacks are
+# reported unavailable
+_GENERAL = ["rax", "rbx", "rcx", "rdx", "rsi", "rdi", "rbp", "rsp",
+            "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "rip"]
+_SEGMENT = ["eflags", "cs", "ss", "ds", "es", "fs", "gs"]
+_X87 = ["st%d" % i for i in range(8)]
+_X87_CONTROL = ["fctrl", "fstat", "ftag", "fiseg", "fioff", "foseg",
+                "fooff", "fop"]
+_SSE = ["xmm%d" % i for i in range(16)]
+
+REGISTERS = ([(name, 8) for name in _GENERAL] +
+             [(name, 4) for name in _SEGMENT] +
+             [(name, 10) for name in _X87] +
+             [(name, 4) for name in _X87_CONTROL] +
+             [(name, 16) for name in _SSE] + [("mxcsr", 4)])
+
+# getState() names eflags rflags
+_STATE_NAMES = {"eflags": "rflags"}
+
+_TRAP_FLAG = 0x100
+
+SIGINT = 2
+SIGTRAP = 5
+_SIGNALS = {"EXC_BAD_ACCESS": 11, "EXC_BAD_INSTRUCTION": 4,
+            "EXC_ARITHMETIC": 8, "EXC_BREAKPOINT": SIGTRAP}
+
+
+def _targetXML():
+    types = {"rip": "code_ptr", "rsp": "data_ptr", "rbp": "data_ptr",
+             "eflags": "i386_eflags", "mxcsr": "i386_mxcsr"}
+    lines = ['<?xml version="1.0"?>',
+             '<!DOCTYPE target SYSTEM "gdb-target.dtd">',
+             '<target version="1.0">',
+             '<architecture>i386:x86-64</architecture>',
+             '<feature name="org.gnu.gdb.i386.core">']
+    for number, (name, size) in enumerate(REGISTERS):
+        if name == "xmm0":
+            lines.append('</feature>')
+            lines.append('<feature name="org.gnu.gdb.i386.sse">')
+            lines.append('<vector id="v4f" type="ieee_single" count="4"/>')
+            lines.append('<vector id="v2d" type="ieee_double" count="2"/>')
+            lines.append('<vector id="v16i8" type="int8" count="16"/>')
+            lines.append('<vector id="v8i16" type="int16" count="8"/>')
+            lines.append('<vector id="v4i32" type="int32" count="4"/>')
+            lines.append('<vector id="v2i64" type="int64" count="2"/>')
+            lines.append('<union id="vec128"><field name="v4_float" '
+                         'type="v4f"/><field name="v2_double" type="v2d"/>'
+                         '<field name="v16_int8" type="v16i8"/>'
+                         '<field name="v8_int16" type="v8i16"/>'
+                         '<field name="v4_int32" type="v4i32"/>'
+                         '<field name="v2_int64" type="v2i64"/>'
+                         '<field name="uint128" type="uint128"/></union>')
+            lines.append('<flags id="i386_mxcsr" size="4">'
+                         '<field name="IE" start="0" end="0"/></flags>')
+        if name == "rax":
+            lines.append('<flags id="i386_eflags" size="4">'
+                         '<field name="CF" start="0" end="0"/>'
+                         '<field name="ZF" start="6" end="6"/>'
+                         '<field name="TF" start="8" end="8"/></flags>')
+        kind = {10: "i387_ext", 16: "vec128"}.get(size, types.get(name))
+        if kind is None:
+            kind = "int%d" % (size * 8)
+        lines.append('<reg name="%s" bitsize="%d" type="%s" regnum="%d"/>'
+                     % (name, size * 8, kind, number))
+    lines.append('</feature>')
+    lines.append('</target>')
+    return "\n".join(lines)
+
+
+def _checksum(data):
+    return sum(bytearray(data)) & 0xff
+
+
+def escape(data):
+    """Escape binary data for a packet"""
+    for c in "}$#*":
+        data = data.replace(c, "}" + chr(ord(c) ^ 0x20))
+    return data
+
+
+def unescape(data):
+    if "}" not in data:
+        return data
+    out = []
+    i = 0
+    while i < len(data):
+        if data[i] == "}":
+            out.append(chr(ord(data[i + 1]) ^ 0x20))
+            i += 2
+        else:
+            out.append(data[i])
+            i += 1
+    return "".join(out)
+
+
+def splitPackets(buf):
+    """Split complete packets off the front of buf.
+
+    Returns ([payload or '\\x03' for an interrupt, ...], acks, remainder),
+    acks being a string of the '+' and '-' seen. Packets with a bad
+    checksum are returned as None
+    """
+    packets = []
+    acks = []
+    i = 0
+
+    while i < len(buf):
+        c = buf[i]
+        if c in "+-":
+            acks.append(c)
+            i += 1
+        elif c == "\x03":
+            packets.append(c)
+            i += 1
+        elif c == "$":
+            end = buf.find("#", i + 1)
+            if end < 0 or end + 3 > len(buf):
+                break
+            payload = buf[i + 1:end]
+            try:
+                ok = int(buf[end + 1:end + 3], 16) == _checksum(payload)
+            except ValueError:
+                ok = False
+            packets.append(payload if ok else None)
+            i = end + 3
+        else:
+            i += 1
+
+    return packets, "".join(acks), buf[i:]
+
+
+def frame(payload, prefix="$"):
+    return "%s%s#%02x" % (prefix, payload, _checksum(payload))
+
+
+class RSPServer(object):
+    """Serve one gdb or lldb connection at a time.
+
+    In all-stop mode (the default) the task is frozen while the debugger
+    has it stopped; continuing thaws it and the first exception in any
+    thread stops it again. In non-stop mode (QNonStop:1) threads are
+    stopped and continued one by one with vCont and stops are sent as
+    notifications. Breakpoints are the task's own, which any mdb script
+    sharing the task sees too; threads such a script paused stay paused
+    until it resumes them.
+    """
+
+    def __init__(self, task, address):
+        """address: (host, port) for TCP or a path for a Unix socket"""
+        self.task = task
+        self.address = address
+        self.listener = None
+        self.conn = None
+
+    def listen(self):
+        if isinstance(self.address, tuple):
+            self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR,
+                                     1)
+        else:
+            if os.path.exists(self.address):
+                os.unlink(self.address)
+            self.listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.listener.bind(self.address)
+        self.listener.listen(1)
+        return self.listener.getsockname()
+
+    def serve(self, once=False):
+        """Accept connections and serve them until once is set and the
+        first ends"""
+        if self.listener is None:
+            self.listen()
+
+        while True:
+            conn, _ = self.listener.accept()
+            try:
+                self.session(conn)
+            finally:
+                conn.close()
+            if once:
+                break
+
+    def close(self):
+        if self.listener is not None:
+            self.listener.close()
+            self.listener = None
+            if not isinstance(self.address, tuple):
+                os.unlink(self.address)
+
+    # Session
+
+    def session(self, conn):
+        self.conn = conn
+        if isinstance(self.address, tuple):
+            conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+        self.acks = True
+        self.nonStop = False
+        self.binaryUpload = False
+        self.running = False
+        self.current = {}            # 'g' and 'c': the thread ops go to
+        self.breakpoints = set()     # set through us, cleared at detach
+        self.notifications = []      # non-stop stops not yet acked
+        self.stepping = None
+        self.done = False
+        self.threads = {}
+        self.suspended = set()       # tids paused by us or at our events
+
+        # An attaching debugger expects the task stopped
+        if not self.task.frozen:
+            self.task.freeze()
+        self.lastStop = (SIGTRAP, self._firstThread())
+
+        buf = ""
+        try:
+            while not self.done:
+                # Wait for packets, or for events while anything runs
+                timeout = 0 if self.running or self.nonStop else None
+                readable, _, _ = select.select([conn], [], [], timeout)
+
+                if readable:
+                    data = conn.recv(PACKET_SIZE)
+                    if not data:
+                        break
+                    buf += data
+                    packets, _, buf = splitPackets(buf)
+                    # Everything that arrived together, answered together
+                    out = []
+                    for packet in packets:
+                        out.append(self.dispatch(packet))
+                    out = "".join(out)
+                    if out:
+                        conn.sendall(out)
+
+                if self.running or self.nonStop:
+                    self.pollTask()
+        finally:
+            self.detach()
+            self.conn = None
+
+    def reply(self, payload):
+        if payload is None:
+            return ""
+        return frame(payload)
+
+    def notify(self, stop):
+        # One notification in flight; the rest follow vStopped
+        self.notifications.append(stop)
+        if len(self.notifications) == 1:
+            self.conn.sendall(frame("Stop:" + stop, "%"))
+
+    def dispatch(self, packet):
+        if packet is None:
+            return "-" if self.acks else ""
+        if packet == "\x03":
+            return self.interrupt()
+
+        # Acknowledged on receipt, whether or not there's a reply yet
+        ack = "+" if self.acks else ""
+        kind = packet[0]
+        handler = getattr(self, "packet_" + {
+            "?": "stop", "g": "g", "G": "G", "p": "p", "P": "P",
+            "m": "m", "M": "M", "x": "x", "X": "X", "H": "H", "T": "T",
+            "c": "c", "s": "s", "D": "D", "k": "k", "Z": "Z", "z": "z",
+            "q": "q", "Q": "Q", "v": "v"}.get(kind, "unknown"))
+
+        try:
+            return ack + self.reply(handler(packet))
+        except (Error, ValueError, KeyError, IndexError, struct.error):
+            return ack + self.reply("E01")
+
+    def packet_unknown(self, packet):
+        return ""
+
+    # Threads
+
+    def _threads(self):
+        threads = self.task.getThreads()
+        self.threads = dict((thread.tid, thread) for thread in threads)
+        return threads
+
+    def _firstThread(self):
+        threads = self._threads()
+        return threads[0] if threads else None
+
+    def _thread(self, op):
+        tid = self.current.get(op, 0)
+        if tid in (0, -1) or tid not in self.threads:
+            self._threads()
+        if tid in self.threads:
+            return self.threads[tid]
+        thread = self.lastStop[1]
+        if thread is None or thread.tid not in self.threads:
+            thread = self._firstThread()
+        return thread
+
+    def _tid(self, text):
+        # Thread ids may be p<pid>.<tid>, -1 for all or 0 for any
+        if text.startswith("p"):
+            text = text.split(".")[-1]
+        return -1 if text == "-1" else int(text, 16)
+
+    def packet_H(self, packet):
+        self.current[packet[1]] = self._tid(packet[2:])
+        return "OK"
+
+    def packet_T(self, packet):
+        self._threads()
+        return "OK" if self._tid(packet[1:]) in self.threads else "E01"
+
+    # Registers
+
+    def _registers(self, thread):
+        state = thread.getState()
+        out = []
+        for name, size in REGISTERS:
+            value = state.get(_STATE_NAMES.get(name, name))
+            if value is None:
+                out.append("xx" * size)
+            else:
+                out.append(struct.pack("<Q", value)[:size].encode("hex"))
+        return out
+
+    def packet_g(self, packet):
+        return "".join(self._registers(self._thread("g")))
+
+    def packet_p(self, packet):
+        number = int(packet[1:], 16)
+        if number >= len(REGISTERS):
+            return "E01"
+        thread = self._thread("g")
+        return self._registers(thread)[number]
+
+    def _setRegisters(self, thread, values):
+        state = {}
+        for name, value in values:
+            name = _STATE_NAMES.get(name, name)
+            if value is not None and name in thread.getState():
+                state[name] = value
+        thread.setState(state)
+
+    def packet_G(self, packet):
+        data = packet[1:]
+        values = []
+        pos = 0
+        for name, size in REGISTERS:
+            field = data[pos:pos + size * 2]
+            pos += size * 2
+            if size <= 8 and len(field) == size * 2 and "x" not in field:
+                values.append((name, struct.unpack(
+                    "<Q", field.decode("hex").ljust(8, "\0"))[0]))
+        self._setRegisters(self._thread("g"), values)
+        return "OK"
+
+    def packet_P(self, packet):
+        number, value = packet[1:].split("=")
+        name, size = REGISTERS[int(number, 16)]
+        if size > 8:
+            return "E01"
+        value = struct.unpack("<Q", value.decode("hex").ljust(8, "\0"))[0]
+        self._setRegisters(self._thread("g"), [(name, value)])
+        return "OK"
+
+    # Memory
+
+    def read(self, address, size):
+        """As much of [address, address+size) as can be read"""
+        try:
+            return self.task.vm.read(address, size)
+        except Error:
+            pass
+
+        # Up to the first unreadable page
+        out = []
+        page = 4096
+        end = address + size
+        while address < end:
+            n = min(end, (address & ~(page - 1)) + page) - address
+            try:
+                out.append(self.task.vm.read(address, n))
+            except Error:
+                break
+            address += n
+        return "".join(out)
+
+    def _range(self, text):
+        address, size = text.split(",")
+        return int(address, 16), min(int(size, 16), PACKET_SIZE / 2)
+
+    def packet_m(self, packet):
+        address, size = self._range(packet[1:])
+        data = self.read(address, size)
+        return data.encode("hex") if data or not size else "E01"
+
+    def packet_x(self, packet):
+        address, size = self._range(packet[1:])
+        data = self.read(address, size)
+        if size and not data:
+            return "E01"
+        if not size and not self.binaryUpload:
+            return "OK"                 # lldb probing for support
+        return ("b" if self.binaryUpload else "") + escape(data)
+
+    def packet_M(self, packet):
+        where, data = packet[1:].split(":", 1)
+        address, size = self._range(where)
+        self.task.vm.write(data.decode("hex")[:size], address)
+        return "OK"
+
+    def packet_X(self, packet):
+        where, data = packet[1:].split(":", 1)
+        address, size = self._range(where)
+        if size:
+            self.task.vm.write(unescape(data)[:size], address)
+        return "OK"
+
+    def _memoryMap(self):
+        # Breakpoints go in through copy-on-write, so code is "ram" too
+        lines = ['<?xml version="1.0"?>',
+                 '<!DOCTYPE memory-map PUBLIC "+//IDN gnu.org//DTD GDB '
+                 'Memory Map V1.0//EN" "http://sourceware.org/gdb/gdb-'
+                 'memory-map.dtd">', '<memory-map>']
+        for region in self.task.iterRegions():
+            lines.append('<memory type="ram" start="0x%x" length="0x%x"/>'
+                         % (region['address'], region['size']))
+        lines.append('</memory-map>')
+        return "\n".join(lines)
+
+    # Breakpoints
+
+    def packet_Z(self, packet):
+        kind, address, _ = packet[1:].split(",", 2)
+        if kind != "0":
+            return ""
+        address = int(address, 16)
+        self.task.setBreakpoint(address)
+        self.breakpoints.add(address)
+        return "OK"
+
+    def packet_z(self, packet):
+        kind, address, _ = packet[1:].split(",", 2)
+        if kind != "0":
+            return ""
+        address = int(address, 16)
+        if address in self.breakpoints:
+            self.task.clearBreakpoint(address)
+            self.breakpoints.discard(address)
+        return "OK"
+
+    # Execution
+
+    def stopReply(self, signal, thread):
+        if thread is None:
+            return "S%02x" % signal
+        return "T%02xthread:%x;" % (signal, thread.tid)
+
+    def packet_stop(self, packet):
+        if not self.nonStop:
+            return self.stopReply(*self.lastStop)
+
+        # Non-stop: every stopped thread, through vStopped
+        self.notifications = []
+        for thread in self._threads():
+            if thread.paused:
+                self.notifications.append(self.stopReply(0, thread))
+        return self.notifications[0] if self.notifications else "OK"
+
+    def _pause(self, thread):
+        thread.pause()
+        self.suspended.add(thread.tid)
+
+    def _resume(self, thread):
+        # Only threads we hold: an mdb script may have paused others
+        if thread.tid in self.suspended:
+            self.suspended.discard(thread.tid)
+            if thread.paused:
+                thread.resume()
+
+    def _resumeAll(self, step=None):
+        # Threads stopped at exceptions are held on their own
+        for thread in self._threads():
+            if thread is not step:
+                self._resume(thread)
+
+        if step is not None:
+            # Only the stepping thread may run
+            others = [thread for thread in self.threads.values()
+                      if thread is not step and not thread.paused]
+            for thread in others:
+                self._pause(thread)
+            self.stepOthers = others
+            self._setTrap(step, True)
+            if not step.paused:
+                step.pause()
+            self.task.thaw()
+            step.resume()
+            self.suspended.discard(step.tid)
+            self.stepping = step
+        elif self.task.frozen:
+            self.task.thaw()
+
+        self.running = True
+
+    def _setTrap(self, thread, on):
+        flags = thread.getState()["rflags"]
+        flags = flags | _TRAP_FLAG if on else flags & ~_TRAP_FLAG
+        thread.setState({"rflags": flags})
+
+    def _resumeAt(self, packet):
+        # c[addr] and s[addr] may give where to continue from
+        if len(packet) > 1:
+            self._thread("c").setState({"rip": int(packet[1:], 16)})
+
+    def packet_c(self, packet):
+        self._resumeAt(packet)
+        self._resumeAll()
+        return None
+
+    def packet_s(self, packet):
+        self._resumeAt(packet)
+        self._resumeAll(step=self._thread("c"))
+        return None
+
+    def interrupt(self):
+        if self.nonStop or not self.running:
+            return ""
+        self.stopAll(SIGINT, self._firstThread())
+        return self.reply(self.stopReply(*self.lastStop))
+
+    def stopAll(self, signal, thread):
+        self.task.freeze()
+        self.running = False
+        if self.stepping is not None:
+            self._setTrap(self.stepping, False)
+            for other in self.stepOthers:
+                self._resume(other)
+            self.stepping = None
+        self.lastStop = (signal, thread)
+
+    def pollTask(self):
+        event = self.task.poll()
+        if event is None:
+            return
+
+        thread = event['thread']
+        self.threads[thread.tid] = thread
+        self.suspended.add(thread.tid)
+        signal = _SIGNALS.get(event['type'], SIGTRAP)
+
+        if self.nonStop:
+            self._setTrap(thread, False)
+            self.notify(self.stopReply(signal, thread))
+        else:
+            self.stopAll(signal, thread)
+            self.conn.sendall(self.reply(self.stopReply(signal, thread)))
+
+    def packet_v(self, packet):
+        if packet.startswith("vCont?"):
+            return "vCont;c;C;s;S;t"
+        if packet.startswith("vCont;"):
+            return self.vCont(packet[6:])
+        if packet == "vStopped":
+            if self.notifications:
+                self.notifications.pop(0)
+            return self.notifications[0] if self.notifications else "OK"
+        if packet.startswith("vKill"):
+            self.done = True
+            return "OK"
+        return ""
+
+    def vCont(self, actions):
+        actions = [action.split(":") for action in actions.split(";")]
+
+        if not self.nonStop:
+            # All-stop: one thread may step, everything else continues
+            for action in actions:
+                if action[0][0] in "sS":
+                    tid = self._tid(action[1]) if len(action) > 1 else -1
+                    self._threads()
+                    step = self.threads.get(tid, self._thread("c"))
+                    self._resumeAll(step=step)
+                    return None
+            self._resumeAll()
+            return None
+
+        # Non-stop: each thread as it says, the first action matching
+        self._threads()
+        done = set()
+        for action in actions:
+            tids = ([self._tid(action[1])] if len(action) > 1 else
+                    [tid for tid in self.threads if tid not in done])
+            for tid in tids:
+                thread = self.threads.get(tid)
+                if thread is None or tid in done:
+                    continue
+                done.add(tid)
+                op = action[0][0]
+                if op == "t" and not thread.paused:
+                    self._pause(thread)
+                    self.notify(self.stopReply(0, thread))
+                # A bare c leaves threads an mdb script paused alone
+                elif op in "cC" and thread.paused and (
+                        len(action) > 1 or tid in self.suspended):
+                    thread.resume()
+                    self.suspended.discard(tid)
+                elif op in "sS":
+                    self._setTrap(thread, True)
+                    if thread.paused:
+                        thread.resume()
+                    self.suspended.discard(tid)
+        if self.task.frozen:
+            self.task.thaw()
+        return "OK"
+
+    def packet_D(self, packet):
+        self.done = True
+        return "OK"
+
+    def packet_k(self, packet):
+        self.done = True
+        return None
+
+    def detach(self):
+        # Leave the task as an mdb script would expect it: running
+        for address in self.breakpoints:
+            try:
+                self.task.clearBreakpoint(address)
+            except (Error, KeyError):
+                pass
+        self.breakpoints = set()
+        if self.stepping is not None:
+            self._setTrap(self.stepping, False)
+            self.stepping = None
+        for thread in self._threads():
+            self._resume(thread)
+        self.suspended = set()
+        if self.task.frozen:
+            self.task.thaw()
+        self.running = False
+
+    # Queries
+
+    def packet_q(self, packet):
+        name, _, args = packet[1:].partition(":")
+
+        if name == "Supported":
+            features = args.split(";")
+            self.binaryUpload = "binary-upload+" in features
+            return ("PacketSize=%x;QStartNoAckMode+;QNonStop+;"
+                    "qXfer:features:read+;qXfer:memory-map:read+;"
+                    "vContSupported+;binary-upload+" % PACKET_SIZE)
+        if name == "Attached":
+            return "1"
+        if name == "C":
+            thread = self._thread("g")
+            return "QC%x" % thread.tid if thread is not None else ""
+        if name == "fThreadInfo":
+            tids = ["%x" % thread.tid for thread in self._threads()]
+            return "m" + ",".join(tids) if tids else "l"
+        if name == "sThreadInfo":
+            return "l"
+        if name == "Xfer":
+            return self.xfer(args)
+        if name == "HostInfo":
+            return ("cputype:16777223;cpusubtype:3;ostype:macosx;"
+                    "vendor:apple;endian:little;ptrsize:8;")
+        if name == "ProcessInfo":
+            return ("pid:%x;cputype:1000007;cpusubtype:3;ostype:macosx;"
+                    "vendor:apple;endian:little;ptrsize:8;" % self.task.pid)
+        if name == "Symbol":
+            return "OK"
+        return ""
+
+    def xfer(self, args):
+        obj, op, annex, where = args.split(":", 3)
+        if op != "read":
+            return ""
+        if obj == "features" and annex == "target.xml":
+            data = _targetXML()
+        elif obj == "memory-map":
+            data = self._memoryMap()
+        else:
+            return "E00"
+
+        offset, length = [int(n, 16) for n in where.split(",")]
+        chunk = data[offset:offset + min(length, PACKET_SIZE / 2)]
+        more = offset + len(chunk) < len(data)
+        return ("m" if more else "l") + escape(chunk)
+
+    def packet_Q(self, packet):
+        if packet == "QStartNoAckMode":
+            # dispatch() has already acked this one, the last
+            self.acks = False
+            return "OK"
+        if packet.startswith("QNonStop:"):
+            self.nonStop = packet.endswith("1")
+            if self.nonStop and self.task.frozen:
+                # Threads stop individually from now on
+                for thread in self._threads():
+                    if not thread.paused:
+                        self._pause(thread)
+                self.task.thaw()
+            return "OK"
+        return ""
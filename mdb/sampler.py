@@ -0,0 +1,98 @@
+
+# Copyright (c) 2011 Peter Le Bek
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+import struct
+from array import array
+
+
+_SIZES = {'b': 1, 'B': 1, 'h': 2, 'H': 2, 'i': 4, 'I': 4, 'f': 4,
+          'q': 8, 'Q': 8, 'd': 8}
+_TYPECODES = {'q': 'l', 'Q': 'L'}
+
+
+def _varint(data, pos):
+    value = shift = 0
+    while True:
+        b = ord(data[pos])
+        pos += 1
+        value |= (b & 0x7f) << shift
+        if b < 0x80:
+            return value, pos
+        shift += 7
+
+
+def loadSamples(path):
+    """Decode a file written by Sampler(path=...). Values that didn't
+    change between records are carried forward, so every column has one
+    entry per record.
+
+    Returns {'wall': ns since the epoch at the first sample,
+             'addresses': [...], 'types': [...],
+             'time': array of ns since the first sample,
+             'values': [array per watch]}
+    """
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if data[:8] != "MDBSAMP1":
+        raise ValueError("not a sample file: %s" % path)
+
+    n, _, wall, origin = struct.unpack_from("<IIQQ", data, 8)
+    pos = 32
+    addresses, types = [], []
+    for i in xrange(n):
+        address, code = struct.unpack_from("<QB", data, pos)
+        addresses.append(address)
+        types.append(chr(code))
+        pos += 16
+
+    nbytes = (n + 7) / 8
+    times = array('L')
+    columns = [array(_TYPECODES.get(t, t)) for t in types]
+    current = [0] * n
+    now = 0
+
+    while pos < len(data):
+        delta, pos = _varint(data, pos)
+        bitmap = data[pos:pos + nbytes]
+        pos += nbytes
+        now += delta
+
+        if not bitmap.strip("\0"):
+            # Sampling stopped here
+            continue
+
+        for i in xrange(n):
+            if ord(bitmap[i / 8]) & (1 << (i % 8)):
+                current[i] = struct.unpack_from("<" + types[i], data, pos)[0]
+                pos += _SIZES[types[i]]
+
+        times.append(now)
+        for i in xrange(n):
+            columns[i].append(current[i])
+
+    return {'wall': wall, 'addresses': addresses, 'types': types,
+            'time': times, 'values': columns}
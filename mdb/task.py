@@ -24,10 +24,19 @@
 # SUCH DAMAGE.
 
 
-from mdb.kern import Task
+import os
+from contextlib import contextmanager
 
+from mdb.kern import (Task, CoreTask, StoreTask, RemoteTask,
+                      ReplayTask)
 
-class BasicTask(Task):
+
+# The agent library for Task.loadAgent(), built alongside mdb.kern
+AGENT_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                          "agent.so")
+
+
+class RegionMixin(object):
 
     def iterRegions(self):
         i = 0
@@ -39,3 +48,35 @@ class BasicTask(Task):
 
             yield region
             i = region['address'] + region['size']
+
+
+class FreezeMixin(object):
+
+    @contextmanager
+    def freezing(self):
+        """Stop the whole task for the duration of a with block"""
+        self.freeze()
+        try:
+            yield self
+        finally:
+            self.thaw()
+
+
+class BasicTask(RegionMixin, FreezeMixin, Task):
+    pass
+
+
+class BasicCoreTask(RegionMixin, FreezeMixin, CoreTask):
+    pass
+
+
+class BasicStoreTask(RegionMixin, FreezeMixin, StoreTask):
+    pass
+
+
+class BasicRemoteTask(RegionMixin, FreezeMixin, RemoteTask):
+    pass
+
+
+class BasicReplayTask(RegionMixin, FreezeMixin, ReplayTask):
+    pass
@@ -15,4 +15,7 @@ setup(name="mdb",
       description="Mach Debugger",
       author="Peter Le Bek",
       packages=["mdb"],
-      ext_modules=[Extension("mdb.kern", glob("mdb/kern/*.c"))])
+      ext_modules=[Extension("mdb.kern", glob("mdb/kern/*.c")),
+                   # Not a module: the library Task.loadAgent() injects
+                   Extension("mdb.agent", ["mdb/agent/agent.c"],
+                             include_dirs=["mdb/kern"])])